@@ -21,10 +21,12 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <zlib.h>
+#include <ctype.h>
+#include <time.h>
 #include "kerncompat.h"
 #include "crc32c.h"
 #include "ctree.h"
@@ -34,35 +36,8 @@
 #include "version.h"
 #include "volumes.h"
 #include "extent_io.h"
-
-#define HEADER_MAGIC		0xbd5c25e27295668bULL
-#define MAX_PENDING_SIZE	(256 * 1024)
-#define BLOCK_SIZE		1024
-#define BLOCK_MASK		(BLOCK_SIZE - 1)
-
-#define COMPRESS_NONE		0
-#define COMPRESS_ZLIB		1
-
-struct meta_cluster_item {
-	__le64 bytenr;
-	__le32 size;
-} __attribute__ ((__packed__));
-
-struct meta_cluster_header {
-	__le64 magic;
-	__le64 bytenr;
-	__le32 nritems;
-	u8 compress;
-} __attribute__ ((__packed__));
-
-/* cluster header + index items + buffers */
-struct meta_cluster {
-	struct meta_cluster_header header;
-	struct meta_cluster_item items[];
-} __attribute__ ((__packed__));
-
-#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
-			   sizeof(struct meta_cluster_item))
+#include "metadump.h"
+#include "list_sort.h"
 
 struct fs_chunk {
 	u64 logical;
@@ -71,6 +46,13 @@ struct fs_chunk {
 	struct rb_node n;
 };
 
+/* throughput is reported against the uncompressed size */
+struct compress_stats {
+	u64 raw_bytes;
+	u64 compressed_bytes;
+	u64 nsecs;
+};
+
 struct async_work {
 	struct list_head list;
 	struct list_head ordered;
@@ -78,6 +60,7 @@ struct async_work {
 	u64 size;
 	u8 *buffer;
 	size_t bufsize;
+	int ready;
 	int error;
 };
 
@@ -91,21 +74,35 @@ struct metadump_struct {
 	size_t num_threads;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	/* signalled by the workers when a buffer is ready */
+	pthread_cond_t ready_cond;
 	struct rb_root name_tree;
 
 	struct list_head list;
 	struct list_head ordered;
 	size_t num_items;
-	size_t num_ready;
+	/*
+	 * The previous full cluster, written out when the next one is full so
+	 * the workers compress it while the next one is read.
+	 */
+	struct list_head queued;
 
 	u64 pending_start;
 	u64 pending_size;
 
+	int compress_method;
 	int compress_level;
+	struct compress_stats stats;
 	int done;
 	int data;
 	int sanitize_names;
 
+	/* block index written at the end of the image, if asked for */
+	int write_index;
+	struct meta_index_item *index;
+	u64 nr_index;
+	u64 max_index;
+
 	int error;
 };
 
@@ -116,6 +113,12 @@ struct name {
 	u32 len;
 };
 
+/* per device limits of the restore writers */
+#define RESTORE_MAX_IOV		256
+#define RESTORE_MAX_QUEUED	(64 * 1024 * 1024)
+
+struct restore_writer;
+
 struct mdrestore_struct {
 	FILE *in;
 	FILE *out;
@@ -124,25 +127,69 @@ struct mdrestore_struct {
 	size_t num_threads;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
+	/* signalled when items are done or written */
+	pthread_cond_t wait_cond;
+
+	/* one per target device */
+	struct restore_writer *writers;
+	int nr_writers;
 
 	struct rb_root chunk_tree;
 	struct list_head list;
 	size_t num_items;
 	u32 leafsize;
 	u64 devid;
+	/* size of the device the image was taken from */
+	u64 dev_bytes;
 	u8 uuid[BTRFS_UUID_SIZE];
 	u8 fsid[BTRFS_FSID_SIZE];
 
 	int compress_method;
+	struct compress_stats stats;
 	int done;
 	int error;
 	int old_restore;
 	int fixup_offset;
 	int multi_devices;
 	struct btrfs_fs_info *info;
+	/* set if the image has a block index */
+	struct metadump_image *image;
 };
 
 static void print_usage(void) __attribute__((noreturn));
+
+/* -v, print the compression statistics */
+static int verbose;
+
+static u64 now_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void print_compress_stats(int method, struct compress_stats *stats,
+				 int restore)
+{
+	const struct compress_codec *codec = find_codec(method);
+	u64 rate = 0;
+
+	if (!codec || !stats->raw_bytes)
+		return;
+	if (stats->nsecs)
+		rate = stats->raw_bytes * 1000000000ULL / stats->nsecs;
+	if (restore)
+		fprintf(stderr, "decompressed %s to %s with %s",
+			pretty_size(stats->compressed_bytes),
+			pretty_size(stats->raw_bytes), codec->name);
+	else
+		fprintf(stderr, "compressed %s to %s with %s",
+			pretty_size(stats->raw_bytes),
+			pretty_size(stats->compressed_bytes), codec->name);
+	fprintf(stderr, ", %s/s per thread\n", pretty_size(rate));
+}
+
 static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				   u64 search, u64 cluster_bytenr);
 static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size);
@@ -581,9 +628,13 @@ static void copy_buffer(struct metadump_struct *md, u8 *dst,
 static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
+	struct compress_ctx ctx;
 	struct async_work *async;
+	u64 start_ns;
+	u64 nsecs = 0;
 	int ret;
 
+	memset(&ctx, 0, sizeof(ctx));
 	while (1) {
 		pthread_mutex_lock(&md->mutex);
 		while (list_empty(&md->list)) {
@@ -597,35 +648,47 @@ static void *dump_worker(void *data)
 		list_del_init(&async->list);
 		pthread_mutex_unlock(&md->mutex);
 
-		if (md->compress_level > 0) {
+		if (md->compress_method != COMPRESS_NONE) {
 			u8 *orig = async->buffer;
 
-			async->bufsize = compressBound(async->size);
+			async->bufsize = compress_bound(md->compress_method,
+							async->size);
 			async->buffer = malloc(async->bufsize);
 			if (!async->buffer) {
 				fprintf(stderr, "Error allocing buffer\n");
 				pthread_mutex_lock(&md->mutex);
 				if (!md->error)
 					md->error = -ENOMEM;
+				pthread_cond_signal(&md->ready_cond);
 				pthread_mutex_unlock(&md->mutex);
+				compress_ctx_free(&ctx);
 				pthread_exit(NULL);
 			}
 
-			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
+			start_ns = now_nsecs();
+			ret = compress_item(&ctx, md->compress_method,
+					    md->compress_level, async->buffer,
+					    &async->bufsize, orig, async->size);
+			nsecs = now_nsecs() - start_ns;
 
-			if (ret != Z_OK)
+			if (ret)
 				async->error = 1;
 
 			free(orig);
 		}
 
 		pthread_mutex_lock(&md->mutex);
-		md->num_ready++;
+		async->ready = 1;
+		if (md->compress_method != COMPRESS_NONE) {
+			md->stats.raw_bytes += async->size;
+			md->stats.compressed_bytes += async->bufsize;
+			md->stats.nsecs += nsecs;
+		}
+		pthread_cond_signal(&md->ready_cond);
 		pthread_mutex_unlock(&md->mutex);
 	}
 out:
+	compress_ctx_free(&ctx);
 	pthread_exit(NULL);
 }
 
@@ -633,14 +696,23 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 {
 	struct meta_cluster_header *header;
 
-	md->num_items = 0;
-	md->num_ready = 0;
 	header = &md->cluster->header;
 	header->magic = cpu_to_le64(HEADER_MAGIC);
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
-	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+	header->compress = md->compress_method;
+}
+
+static void free_async_list(struct list_head *list)
+{
+	struct async_work *async;
+
+	while (!list_empty(list)) {
+		async = list_entry(list->next, struct async_work, ordered);
+		list_del_init(&async->ordered);
+		free(async->buffer);
+		free(async);
+	}
 }
 
 static void metadump_destroy(struct metadump_struct *md, int num_threads)
@@ -656,6 +728,11 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 	for (i = 0; i < num_threads; i++)
 		pthread_join(md->threads[i], NULL);
 
+	/* left behind by errors */
+	free_async_list(&md->queued);
+	free_async_list(&md->ordered);
+
+	pthread_cond_destroy(&md->ready_cond);
 	pthread_cond_destroy(&md->cond);
 	pthread_mutex_destroy(&md->mutex);
 
@@ -670,29 +747,36 @@ static void metadump_destroy(struct metadump_struct *md, int num_threads)
 	}
 	free(md->threads);
 	free(md->cluster);
+	free(md->index);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 int sanitize_names)
+			 FILE *out, int num_threads, int compress_method,
+			 int compress_level, int sanitize_names,
+			 int write_index)
 {
 	int i, ret = 0;
 
 	memset(md, 0, sizeof(*md));
 	pthread_cond_init(&md->cond, NULL);
+	pthread_cond_init(&md->ready_cond, NULL);
 	pthread_mutex_init(&md->mutex, NULL);
 	INIT_LIST_HEAD(&md->list);
 	INIT_LIST_HEAD(&md->ordered);
+	INIT_LIST_HEAD(&md->queued);
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->compress_method = compress_method;
 	md->compress_level = compress_level;
 	md->cluster = calloc(1, BLOCK_SIZE);
 	md->sanitize_names = sanitize_names;
+	md->write_index = write_index;
 	if (sanitize_names > 1)
 		crc32c_optimization_init();
 
 	if (!md->cluster) {
+		pthread_cond_destroy(&md->ready_cond);
 		pthread_cond_destroy(&md->cond);
 		pthread_mutex_destroy(&md->mutex);
 		return -ENOMEM;
@@ -707,6 +791,7 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	md->threads = calloc(num_threads, sizeof(pthread_t));
 	if (!md->threads) {
 		free(md->cluster);
+		pthread_cond_destroy(&md->ready_cond);
 		pthread_cond_destroy(&md->cond);
 		pthread_mutex_destroy(&md->mutex);
 		return -ENOMEM;
@@ -730,30 +815,94 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
-static int write_buffers(struct metadump_struct *md, u64 *next)
+static int add_index_item(struct metadump_struct *md,
+			  struct async_work *async, u64 offset)
+{
+	struct meta_index_item *item;
+
+	if (md->nr_index == md->max_index) {
+		u64 max = max_t(u64, md->max_index * 2,
+				INDEX_ITEMS_PER_CLUSTER);
+
+		item = realloc(md->index, max * sizeof(*item));
+		if (!item) {
+			fprintf(stderr, "Error allocating index\n");
+			return -ENOMEM;
+		}
+		md->index = item;
+		md->max_index = max;
+	}
+
+	item = md->index + md->nr_index++;
+	item->bytenr = cpu_to_le64(async->start);
+	item->offset = cpu_to_le64(offset);
+	item->size = cpu_to_le32(async->bufsize);
+	item->raw_size = cpu_to_le32(async->size);
+	return 0;
+}
+
+/*
+ * Write the block index as clusters without items after the last real
+ * cluster, see metadump.h.
+ */
+static int write_block_index(struct metadump_struct *md)
+{
+	struct meta_cluster_header *header = &md->cluster->header;
+	struct meta_index_header *ih;
+	u64 start = le64_to_cpu(header->bytenr);
+	u64 bytenr = start;
+	u64 done = 0;
+	u32 nritems;
+	int ret;
+
+	ih = (struct meta_index_header *)md->cluster->items;
+	do {
+		nritems = min_t(u64, md->nr_index - done,
+				INDEX_ITEMS_PER_CLUSTER);
+		memset(md->cluster, 0, BLOCK_SIZE);
+		header->magic = cpu_to_le64(HEADER_MAGIC);
+		header->bytenr = cpu_to_le64(bytenr);
+		header->nritems = cpu_to_le32(0);
+		header->compress = md->compress_method;
+		ih->magic = cpu_to_le64(INDEX_MAGIC);
+		ih->start = cpu_to_le64(start);
+		ih->total = cpu_to_le64(md->nr_index);
+		ih->nritems = cpu_to_le32(nritems);
+		memcpy(ih + 1, md->index + done, nritems * sizeof(*md->index));
+
+		ret = fwrite(md->cluster, BLOCK_SIZE, 1, md->out);
+		if (ret != 1) {
+			fprintf(stderr, "Error writing out index: %d\n", errno);
+			return -EIO;
+		}
+		done += nritems;
+		bytenr += BLOCK_SIZE;
+	} while (done < md->nr_index);
+
+	return 0;
+}
+
+/* write out the cluster of the buffers on @list, called with md->mutex held */
+static int write_buffers(struct metadump_struct *md, struct list_head *list,
+			 u64 *next)
 {
 	struct meta_cluster_header *header = &md->cluster->header;
 	struct meta_cluster_item *item;
 	struct async_work *async;
-	u64 bytenr = 0;
+	u64 bytenr = le64_to_cpu(header->bytenr);
 	u32 nritems = 0;
 	int ret;
 	int err = 0;
 
-	if (list_empty(&md->ordered))
+	if (list_empty(list))
 		goto out;
 
 	/* wait until all buffers are compressed */
-	while (!err && md->num_items > md->num_ready) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&md->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&md->mutex);
-		err = md->error;
+	list_for_each_entry(async, list, ordered) {
+		while (!async->ready && !md->error)
+			pthread_cond_wait(&md->ready_cond, &md->mutex);
 	}
+	err = md->error;
 
 	if (err) {
 		fprintf(stderr, "One of the threads errored out %s\n",
@@ -762,7 +911,7 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 
 	/* setup and write index block */
-	list_for_each_entry(async, &md->ordered, ordered) {
+	list_for_each_entry(async, list, ordered) {
 		item = md->cluster->items + nritems;
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
@@ -777,12 +926,13 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 
 	/* write buffers */
-	bytenr += le64_to_cpu(header->bytenr) + BLOCK_SIZE;
-	while (!list_empty(&md->ordered)) {
-		async = list_entry(md->ordered.next, struct async_work,
-				   ordered);
+	bytenr += BLOCK_SIZE;
+	while (!list_empty(list)) {
+		async = list_entry(list->next, struct async_work, ordered);
 		list_del_init(&async->ordered);
 
+		if (!err && md->write_index)
+			err = add_index_item(md, async, bytenr);
 		bytenr += async->bufsize;
 		if (!err)
 			ret = fwrite(async->buffer, async->bufsize, 1,
@@ -869,6 +1019,46 @@ static int read_data_extent(struct metadump_struct *md,
 	return 0;
 }
 
+/*
+ * Read the tree blocks of the pending range in one batch on the readahead
+ * threads, flush_pending() then finds them in the extent buffer cache.
+ */
+static void readahead_pending(struct metadump_struct *md)
+{
+	struct btrfs_reada_block *blocks;
+	u64 blocksize = md->root->nodesize;
+	u64 nr = (md->pending_size + blocksize - 1) / blocksize;
+	u64 i;
+
+	if (nr < 2)
+		return;
+	blocks = malloc(nr * sizeof(*blocks));
+	if (!blocks)
+		return;
+	for (i = 0; i < nr; i++) {
+		blocks[i].bytenr = md->pending_start + i * blocksize;
+		blocks[i].blocksize = min(blocksize,
+					  md->pending_size - i * blocksize);
+		blocks[i].parent_transid = 0;
+	}
+	readahead_tree_blocks(md->root, blocks, nr);
+	free(blocks);
+}
+
+/* write out the queued cluster and set up the header for the next one */
+static int write_queued(struct metadump_struct *md)
+{
+	u64 start;
+	int ret;
+
+	ret = write_buffers(md, &md->queued, &start);
+	if (ret)
+		fprintf(stderr, "Error writing buffers %d\n", errno);
+	else
+		meta_cluster_init(md, start);
+	return ret;
+}
+
 static int flush_pending(struct metadump_struct *md, int done)
 {
 	struct async_work *async = NULL;
@@ -905,6 +1095,9 @@ static int flush_pending(struct metadump_struct *md, int done)
 			}
 		}
 
+		if (!md->data)
+			readahead_pending(md);
+
 		while (!md->data && size > 0) {
 			u64 this_read = min(blocksize, size);
 			eb = read_tree_block(md->root, start, this_read, 0);
@@ -932,20 +1125,21 @@ static int flush_pending(struct metadump_struct *md, int done)
 	if (async) {
 		list_add_tail(&async->ordered, &md->ordered);
 		md->num_items++;
-		if (md->compress_level > 0) {
+		if (md->compress_method != COMPRESS_NONE) {
 			list_add_tail(&async->list, &md->list);
 			pthread_cond_signal(&md->cond);
 		} else {
-			md->num_ready++;
+			async->ready = 1;
 		}
 	}
 	if (md->num_items >= ITEMS_PER_CLUSTER || done) {
-		ret = write_buffers(md, &start);
-		if (ret)
-			fprintf(stderr, "Error writing buffers %d\n",
-				errno);
-		else
-			meta_cluster_init(md, start);
+		ret = write_queued(md);
+		if (!ret) {
+			list_splice_tail_init(&md->ordered, &md->queued);
+			md->num_items = 0;
+		}
+		if (!ret && done)
+			ret = write_queued(md);
 	}
 	pthread_mutex_unlock(&md->mutex);
 	return ret;
@@ -963,7 +1157,9 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root, start, size, 0);
+	/* tree blocks are read in batches by flush_pending() */
+	if (data)
+		readahead_tree_block(md->root, start, size, 0);
 	md->pending_size += size;
 	md->data = data;
 	return 0;
@@ -1006,6 +1202,40 @@ static int is_tree_block(struct btrfs_root *extent_root,
 }
 #endif
 
+/* read all blocks @eb points to in one batch before walking them */
+static void readahead_children(struct btrfs_root *root,
+			       struct extent_buffer *eb)
+{
+	struct btrfs_reada_block *blocks;
+	struct btrfs_root_item *ri;
+	struct btrfs_key key;
+	int level = btrfs_header_level(eb);
+	int nritems = btrfs_header_nritems(eb);
+	int nr = 0;
+	int i;
+
+	blocks = malloc(nritems * sizeof(*blocks));
+	if (!blocks)
+		return;
+	for (i = 0; i < nritems; i++) {
+		if (level == 0) {
+			btrfs_item_key_to_cpu(eb, &key, i);
+			if (key.type != BTRFS_ROOT_ITEM_KEY)
+				continue;
+			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
+			blocks[nr].bytenr = btrfs_disk_root_bytenr(eb, ri);
+		} else {
+			blocks[nr].bytenr = btrfs_node_blockptr(eb, i);
+		}
+		blocks[nr].blocksize = root->leafsize;
+		blocks[nr].parent_transid = 0;
+		nr++;
+	}
+	if (nr > 1)
+		readahead_tree_blocks(root, blocks, nr);
+	free(blocks);
+}
+
 static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 			    struct metadump_struct *metadump, int root_tree)
 {
@@ -1029,6 +1259,7 @@ static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
 
 	level = btrfs_header_level(eb);
 	nritems = btrfs_header_nritems(eb);
+	readahead_children(root, eb);
 	for (i = 0; i < nritems; i++) {
 		if (level == 0) {
 			btrfs_item_key_to_cpu(eb, &key, i);
@@ -1166,6 +1397,8 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
 
+	/* the whole extent tree is walked, read its leaves a node at a time */
+	path->reada = 2;
 	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching extent root %d\n", ret);
@@ -1252,7 +1485,8 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 }
 
 static int create_metadump(const char *input, FILE *out, int num_threads,
-			   int compress_level, int sanitize, int walk_trees)
+			   int compress_method, int compress_level,
+			   int sanitize, int walk_trees, int write_index)
 {
 	struct btrfs_root *root;
 	struct btrfs_path *path = NULL;
@@ -1260,6 +1494,9 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 	int ret;
 	int err = 0;
 
+	/* the tree blocks are read by as many threads as compress them */
+	if (num_threads)
+		btrfs_set_reada_threads(num_threads);
 	root = open_ctree(input, 0, 0);
 	if (!root) {
 		fprintf(stderr, "Open ctree failed\n");
@@ -1269,7 +1506,8 @@ static int create_metadump(const char *input, FILE *out, int num_threads,
 	BUG_ON(root->nodesize != root->leafsize);
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level, sanitize);
+			    compress_method, compress_level, sanitize,
+			    write_index);
 	if (ret) {
 		fprintf(stderr, "Error initing metadump %d\n", ret);
 		close_ctree(root);
@@ -1327,8 +1565,15 @@ out:
 			err = ret;
 		fprintf(stderr, "Error flushing pending %d\n", ret);
 	}
+	if (!err && write_index) {
+		ret = write_block_index(&metadump);
+		if (ret)
+			err = ret;
+	}
 
 	metadump_destroy(&metadump, num_threads);
+	if (!err && verbose)
+		print_compress_stats(compress_method, &metadump.stats, 0);
 
 	btrfs_free_path(path);
 	ret = close_ctree(root);
@@ -1549,6 +1794,22 @@ next:
 	return 0;
 }
 
+/*
+ * Restored regular files are grown to the size of the device they stand
+ * for, so everything that isn't restored is a hole and the backup supers
+ * have their place.
+ */
+static void grow_restore_file(int fd, u64 size)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size >= size)
+		return;
+	if (ftruncate(fd, size))
+		fprintf(stderr, "Couldn't grow the restore target: %d\n",
+			errno);
+}
+
 static void write_backup_supers(int fd, u8 *buf)
 {
 	struct btrfs_super_block *super = (struct btrfs_super_block *)buf;
@@ -1611,31 +1872,302 @@ static u64 logical_to_physical(struct mdrestore_struct *mdres, u64 logical, u64
 	return fs_chunk->physical + offset;
 }
 
+/*
+ * Restored blocks are written by one thread per target device.  A writer
+ * sorts everything that was queued since its last pass and merges runs of
+ * adjacent blocks into a single pwritev(), so the decompression workers
+ * never wait for the disk and each device gets its own stream of large
+ * writes.
+ */
+struct restore_buf {
+	u8 *data;
+	int refs;
+};
+
+struct restore_write {
+	struct list_head list;
+	u64 offset;
+	u8 *data;
+	size_t len;
+	struct restore_buf *buf;
+};
+
+struct restore_writer {
+	struct mdrestore_struct *mdres;
+	int fd;
+	pthread_t thread;
+	pthread_cond_t cond;
+	struct list_head writes;
+	/* bytes queued and not written yet */
+	u64 queued;
+	int done;
+};
+
+static int restore_write_cmp(void *priv, struct list_head *a,
+			     struct list_head *b)
+{
+	struct restore_write *wa = list_entry(a, struct restore_write, list);
+	struct restore_write *wb = list_entry(b, struct restore_write, list);
+
+	if (wa->offset < wb->offset)
+		return -1;
+	return wa->offset > wb->offset;
+}
+
+static int write_iov(int fd, struct iovec *iov, int nr, u64 offset)
+{
+	ssize_t ret;
+
+	while (nr) {
+		ret = pwritev(fd, iov, nr, offset);
+		if (ret <= 0) {
+			if (ret < 0)
+				fprintf(stderr, "Error writing to device %d\n",
+					errno);
+			else
+				fprintf(stderr, "Short write\n");
+			return ret < 0 ? -errno : -EIO;
+		}
+		offset += ret;
+		while (nr && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/* write out @batch sorted by offset, returns the first error */
+static int write_batch(struct restore_writer *w, struct list_head *batch)
+{
+	struct iovec iov[RESTORE_MAX_IOV];
+	struct restore_write *write;
+	u64 start = 0;
+	u64 end = 0;
+	int nr = 0;
+	int err = 0;
+	int ret;
+
+	list_sort(NULL, batch, restore_write_cmp);
+	list_for_each_entry(write, batch, list) {
+		if (nr && (write->offset != end || nr == RESTORE_MAX_IOV)) {
+			ret = write_iov(w->fd, iov, nr, start);
+			if (ret && !err)
+				err = ret;
+			nr = 0;
+		}
+		if (!nr)
+			start = end = write->offset;
+		iov[nr].iov_base = write->data;
+		iov[nr].iov_len = write->len;
+		end += write->len;
+		nr++;
+	}
+	if (nr) {
+		ret = write_iov(w->fd, iov, nr, start);
+		if (ret && !err)
+			err = ret;
+	}
+	return err;
+}
+
+static void put_restore_buf(struct restore_buf *buf)
+{
+	if (--buf->refs)
+		return;
+	free(buf->data);
+	free(buf);
+}
+
+static void *restore_writer_thread(void *data)
+{
+	struct restore_writer *w = data;
+	struct mdrestore_struct *mdres = w->mdres;
+	struct restore_write *write;
+	LIST_HEAD(batch);
+	u64 bytes;
+	int ret;
+
+	pthread_mutex_lock(&mdres->mutex);
+	while (1) {
+		while (list_empty(&w->writes) && !w->done)
+			pthread_cond_wait(&w->cond, &mdres->mutex);
+		if (list_empty(&w->writes))
+			break;
+		list_splice_init(&w->writes, &batch);
+		pthread_mutex_unlock(&mdres->mutex);
+
+		ret = write_batch(w, &batch);
+
+		pthread_mutex_lock(&mdres->mutex);
+		if (ret && !mdres->error)
+			mdres->error = ret;
+		bytes = 0;
+		while (!list_empty(&batch)) {
+			write = list_entry(batch.next, struct restore_write,
+					   list);
+			list_del(&write->list);
+			bytes += write->len;
+			put_restore_buf(write->buf);
+			free(write);
+		}
+		w->queued -= bytes;
+		pthread_cond_broadcast(&mdres->wait_cond);
+	}
+	pthread_mutex_unlock(&mdres->mutex);
+	return NULL;
+}
+
+/* queue @len bytes at @data of @buf to be written at @offset by @w */
+static int queue_write(struct restore_writer *w, u64 offset, u8 *data,
+		       size_t len, struct restore_buf *buf)
+{
+	struct mdrestore_struct *mdres = w->mdres;
+	struct restore_write *write;
+
+	write = malloc(sizeof(*write));
+	if (!write) {
+		fprintf(stderr, "Error allocating write\n");
+		return -ENOMEM;
+	}
+	write->offset = offset;
+	write->data = data;
+	write->len = len;
+	write->buf = buf;
+
+	pthread_mutex_lock(&mdres->mutex);
+	while (w->queued >= RESTORE_MAX_QUEUED && !mdres->error)
+		pthread_cond_wait(&mdres->wait_cond, &mdres->mutex);
+	buf->refs++;
+	list_add_tail(&write->list, &w->writes);
+	w->queued += len;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&mdres->mutex);
+	return 0;
+}
+
+static struct restore_writer *find_writer(struct mdrestore_struct *mdres,
+					  int fd)
+{
+	int i;
+
+	for (i = 0; i < mdres->nr_writers; i++)
+		if (mdres->writers[i].fd == fd)
+			return &mdres->writers[i];
+	return NULL;
+}
+
+/* queue a restored item for the output, mapped through the chunk tree */
+static int queue_restore_item(struct mdrestore_struct *mdres,
+			      struct async_work *async,
+			      struct restore_buf *buf, size_t size)
+{
+	u64 offset = 0;
+	u64 bytenr;
+	int ret;
+
+	while (size) {
+		u64 chunk_size = size;
+
+		if (!mdres->multi_devices && !mdres->old_restore)
+			bytenr = logical_to_physical(mdres,
+						     async->start + offset,
+						     &chunk_size);
+		else
+			bytenr = async->start + offset;
+
+		ret = queue_write(&mdres->writers[0], bytenr,
+				  buf->data + offset, chunk_size, buf);
+		if (ret)
+			return ret;
+		size -= chunk_size;
+		offset += chunk_size;
+	}
+	return 0;
+}
+
+/*
+ * Queue a restored item for the devices of the filesystem in the fixup
+ * stage of a multi device restore, each stripe goes to its own device.
+ */
+static int queue_fixup_item(struct mdrestore_struct *mdres,
+			    struct async_work *async,
+			    struct restore_buf *buf, size_t size)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	struct restore_writer *w;
+	u64 *raid_map = NULL;
+	u64 logical = async->start;
+	u64 offset = 0;
+	u64 len;
+	int ret;
+	int i;
+
+	while (offset < size) {
+		len = size - offset;
+		ret = btrfs_map_block(&mdres->info->mapping_tree, WRITE,
+				      logical + offset, &len, &multi, 0,
+				      &raid_map);
+		if (ret) {
+			fprintf(stderr, "Couldn't map the block %llu\n",
+				(unsigned long long)(logical + offset));
+			return -EIO;
+		}
+		/* parity has to be computed, leave it to the generic code */
+		if (raid_map) {
+			kfree(raid_map);
+			kfree(multi);
+			return write_data_to_disk(mdres->info,
+						  buf->data + offset,
+						  logical + offset,
+						  size - offset, 0);
+		}
+
+		len = min_t(u64, len, size - offset);
+		for (i = 0; i < multi->num_stripes; i++) {
+			w = find_writer(mdres, multi->stripes[i].dev->fd);
+			if (!w) {
+				kfree(multi);
+				return -EIO;
+			}
+			ret = queue_write(w, multi->stripes[i].physical,
+					  buf->data + offset, len, buf);
+			if (ret) {
+				kfree(multi);
+				return ret;
+			}
+		}
+		kfree(multi);
+		multi = NULL;
+		offset += len;
+	}
+	return 0;
+}
+
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
+	struct compress_ctx ctx;
 	struct async_work *async;
+	struct restore_buf *buf;
+	u8 super[BTRFS_SUPER_INFO_SIZE];
 	size_t size;
-	u8 *buffer;
-	u8 *outbuf;
 	int outfd;
 	int ret;
 	int compress_size = MAX_PENDING_SIZE * 4;
 
+	memset(&ctx, 0, sizeof(ctx));
 	outfd = fileno(mdres->out);
-	buffer = malloc(compress_size);
-	if (!buffer) {
-		fprintf(stderr, "Error allocing buffer\n");
-		pthread_mutex_lock(&mdres->mutex);
-		if (!mdres->error)
-			mdres->error = -ENOMEM;
-		pthread_mutex_unlock(&mdres->mutex);
-		pthread_exit(NULL);
-	}
 
 	while (1) {
-		u64 bytenr;
-		off_t offset = 0;
+		u64 start_ns;
+		u64 nsecs = 0;
+		u64 raw_size = 0;
 		int err = 0;
 
 		pthread_mutex_lock(&mdres->mutex);
@@ -1650,91 +2182,167 @@ static void *restore_worker(void *data)
 		list_del_init(&async->list);
 		pthread_mutex_unlock(&mdres->mutex);
 
-		if (mdres->compress_method == COMPRESS_ZLIB) {
-			size = compress_size; 
-			ret = uncompress(buffer, (unsigned long *)&size,
-					 async->buffer, async->bufsize);
-			if (ret != Z_OK) {
-				fprintf(stderr, "Error decompressing %d\n",
-					ret);
-				err = -EIO;
+		/* the buffer is handed to the writers, which free it */
+		buf = malloc(sizeof(*buf));
+		if (!buf) {
+			err = -ENOMEM;
+			goto done;
+		}
+		buf->refs = 1;
+		if (mdres->compress_method != COMPRESS_NONE) {
+			buf->data = malloc(compress_size);
+			if (!buf->data) {
+				free(buf);
+				err = -ENOMEM;
+				goto done;
+			}
+			size = compress_size;
+			start_ns = now_nsecs();
+			ret = decompress_item(&ctx, mdres->compress_method,
+					      buf->data, &size, async->buffer,
+					      async->bufsize);
+			nsecs = now_nsecs() - start_ns;
+			if (ret) {
+				err = ret;
+				size = 0;
 			}
-			outbuf = buffer;
+			raw_size = size;
 		} else {
-			outbuf = async->buffer;
+			buf->data = async->buffer;
 			size = async->bufsize;
+			async->buffer = NULL;
 		}
 
 		if (!mdres->multi_devices) {
 			if (async->start == BTRFS_SUPER_INFO_OFFSET) {
 				if (mdres->old_restore) {
-					update_super_old(outbuf);
+					update_super_old(buf->data);
 				} else {
-					ret = update_super(outbuf);
+					ret = update_super(buf->data);
 					if (ret)
 						err = ret;
 				}
 			} else if (!mdres->old_restore) {
-				ret = fixup_chunk_tree_block(mdres, async, outbuf, size);
+				ret = fixup_chunk_tree_block(mdres, async,
+							     buf->data, size);
 				if (ret)
 					err = ret;
 			}
 		}
 
 		if (!mdres->fixup_offset) {
-			while (size) {
-				u64 chunk_size = size;
-				if (!mdres->multi_devices && !mdres->old_restore)
-					bytenr = logical_to_physical(mdres,
-								     async->start + offset,
-								     &chunk_size);
-				else
-					bytenr = async->start + offset;
-
-				ret = pwrite64(outfd, outbuf+offset, chunk_size,
-					       bytenr);
-				if (ret != chunk_size) {
-					if (ret < 0) {
-						fprintf(stderr, "Error writing to "
-							"device %d\n", errno);
-						err = errno;
-						break;
-					} else {
-						fprintf(stderr, "Short write\n");
-						err = -EIO;
-						break;
-					}
-				}
-				size -= chunk_size;
-				offset += chunk_size;
-			}
+			ret = queue_restore_item(mdres, async, buf, size);
+			if (ret)
+				err = ret;
 		} else if (async->start != BTRFS_SUPER_INFO_OFFSET) {
-			ret = write_data_to_disk(mdres->info, outbuf, async->start, size, 0);
+			ret = queue_fixup_item(mdres, async, buf, size);
 			if (ret) {
 				printk("Error write data\n");
 				exit(1);
 			}
 		}
 
-
-		/* backup super blocks are already there at fixup_offset stage */
-		if (!mdres->multi_devices && async->start == BTRFS_SUPER_INFO_OFFSET)
-			write_backup_supers(outfd, outbuf);
+		/*
+		 * backup super blocks are already there at fixup_offset stage,
+		 * they're written from a copy as the writer still needs the
+		 * primary one
+		 */
+		if (!mdres->multi_devices &&
+		    async->start == BTRFS_SUPER_INFO_OFFSET) {
+			memcpy(super, buf->data, BTRFS_SUPER_INFO_SIZE);
+			write_backup_supers(outfd, super);
+		}
 
+		pthread_mutex_lock(&mdres->mutex);
+		put_restore_buf(buf);
+		pthread_mutex_unlock(&mdres->mutex);
+done:
 		pthread_mutex_lock(&mdres->mutex);
 		if (err && !mdres->error)
 			mdres->error = err;
+		if (mdres->compress_method != COMPRESS_NONE) {
+			mdres->stats.raw_bytes += raw_size;
+			mdres->stats.compressed_bytes += async->bufsize;
+			mdres->stats.nsecs += nsecs;
+		}
 		mdres->num_items--;
+		pthread_cond_broadcast(&mdres->wait_cond);
 		pthread_mutex_unlock(&mdres->mutex);
 
 		free(async->buffer);
 		free(async);
 	}
 out:
-	free(buffer);
+	compress_ctx_free(&ctx);
 	pthread_exit(NULL);
 }
 
+static int start_writers(struct mdrestore_struct *mdres)
+{
+	struct btrfs_device *device;
+	struct restore_writer *w;
+	int nr = 1;
+	int ret = 0;
+	int i;
+
+	if (mdres->fixup_offset) {
+		nr = 0;
+		list_for_each_entry(device, &mdres->info->fs_devices->devices,
+				    dev_list)
+			nr++;
+	}
+	mdres->writers = calloc(nr, sizeof(*mdres->writers));
+	if (!mdres->writers)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		w = &mdres->writers[i];
+		w->mdres = mdres;
+		w->fd = -1;
+		INIT_LIST_HEAD(&w->writes);
+		pthread_cond_init(&w->cond, NULL);
+	}
+	if (mdres->fixup_offset) {
+		i = 0;
+		list_for_each_entry(device, &mdres->info->fs_devices->devices,
+				    dev_list) {
+			if (device->fd <= 0)
+				continue;
+			grow_restore_file(device->fd, device->total_bytes);
+			mdres->writers[i++].fd = device->fd;
+		}
+	} else {
+		mdres->writers[0].fd = fileno(mdres->out);
+	}
+
+	for (i = 0; i < nr; i++) {
+		w = &mdres->writers[i];
+		ret = pthread_create(&w->thread, NULL, restore_writer_thread,
+				     w);
+		if (ret)
+			break;
+		mdres->nr_writers++;
+	}
+	return ret;
+}
+
+static void stop_writers(struct mdrestore_struct *mdres)
+{
+	struct restore_writer *w;
+	int i;
+
+	for (i = 0; i < mdres->nr_writers; i++) {
+		w = &mdres->writers[i];
+		pthread_mutex_lock(&mdres->mutex);
+		w->done = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&mdres->mutex);
+		pthread_join(w->thread, NULL);
+		pthread_cond_destroy(&w->cond);
+	}
+	free(mdres->writers);
+}
+
 static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 {
 	struct rb_node *n;
@@ -1754,10 +2362,13 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 
 	for (i = 0; i < num_threads; i++)
 		pthread_join(mdres->threads[i], NULL);
+	stop_writers(mdres);
 
+	pthread_cond_destroy(&mdres->wait_cond);
 	pthread_cond_destroy(&mdres->cond);
 	pthread_mutex_destroy(&mdres->mutex);
 	free(mdres->threads);
+	metadump_image_close(mdres->image);
 }
 
 static int mdrestore_init(struct mdrestore_struct *mdres,
@@ -1769,6 +2380,7 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 
 	memset(mdres, 0, sizeof(*mdres));
 	pthread_cond_init(&mdres->cond, NULL);
+	pthread_cond_init(&mdres->wait_cond, NULL);
 	pthread_mutex_init(&mdres->mutex, NULL);
 	INIT_LIST_HEAD(&mdres->list);
 	mdres->in = in;
@@ -1782,10 +2394,18 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	if (!num_threads)
 		return 0;
 
+	ret = start_writers(mdres);
+	if (ret) {
+		mdrestore_destroy(mdres, 0);
+		return ret;
+	}
+
 	mdres->num_threads = num_threads;
 	mdres->threads = calloc(num_threads, sizeof(pthread_t));
-	if (!mdres->threads)
+	if (!mdres->threads) {
+		mdrestore_destroy(mdres, 0);
 		return -ENOMEM;
+	}
 	for (i = 0; i < num_threads; i++) {
 		ret = pthread_create(mdres->threads + i, NULL, restore_worker,
 				     mdres);
@@ -1809,18 +2429,17 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	if (mdres->leafsize)
 		return 0;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 
 		buffer = malloc(MAX_PENDING_SIZE * 2);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_item(NULL, mdres->compress_method, buffer,
+				      &size, async->buffer, async->bufsize);
+		if (ret) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1833,6 +2452,7 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	memcpy(mdres->uuid, super->dev_item.uuid,
 		       BTRFS_UUID_SIZE);
 	mdres->devid = le64_to_cpu(super->dev_item.devid);
+	mdres->dev_bytes = le64_to_cpu(super->dev_item.total_bytes);
 	free(buffer);
 	return 0;
 }
@@ -1847,7 +2467,9 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
-	BUG_ON(mdres->num_items);
+	ret = check_compress_method(header->compress);
+	if (ret)
+		return ret;
 	mdres->compress_method = header->compress;
 
 	bytenr = le64_to_cpu(header->bytenr) + BLOCK_SIZE;
@@ -1907,22 +2529,29 @@ static int add_cluster(struct meta_cluster *cluster,
 	return 0;
 }
 
-static int wait_for_worker(struct mdrestore_struct *mdres)
+static int writers_busy(struct mdrestore_struct *mdres)
 {
-	int ret = 0;
+	int i;
+
+	for (i = 0; i < mdres->nr_writers; i++)
+		if (mdres->writers[i].queued)
+			return 1;
+	return 0;
+}
+
+/*
+ * Wait until at most @max_items are left to the workers, and if @max_items
+ * is 0 until everything has been written.
+ */
+static int wait_for_worker(struct mdrestore_struct *mdres, size_t max_items)
+{
+	int ret;
 
 	pthread_mutex_lock(&mdres->mutex);
+	while (!mdres->error && (mdres->num_items > max_items ||
+				 (!max_items && writers_busy(mdres))))
+		pthread_cond_wait(&mdres->wait_cond, &mdres->mutex);
 	ret = mdres->error;
-	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
-		ret = mdres->error;
-	}
 	pthread_mutex_unlock(&mdres->mutex);
 	return ret;
 }
@@ -2006,6 +2635,30 @@ out:
 	return ret;
 }
 
+static int read_indexed_chunk_block(struct mdrestore_struct *mdres,
+				    u64 search)
+{
+	u8 *buffer;
+	int ret;
+
+	buffer = malloc(mdres->leafsize);
+	if (!buffer) {
+		fprintf(stderr, "Error allocing buffer\n");
+		return -ENOMEM;
+	}
+
+	ret = metadump_image_read(mdres->image, search, buffer,
+				  mdres->leafsize);
+	if (ret == -ENOENT)
+		fprintf(stderr, "Chunk tree block %llu not in the image\n",
+			(unsigned long long)search);
+	if (!ret)
+		ret = read_chunk_block(mdres, buffer, search, search,
+				       mdres->leafsize, 0);
+	free(buffer);
+	return ret;
+}
+
 /* If you have to ask you aren't worthy */
 static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				   u64 search, u64 cluster_bytenr)
@@ -2020,6 +2673,9 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 	u8 *buffer, *tmp = NULL;
 	int ret = 0;
 
+	if (mdres->image)
+		return read_indexed_chunk_block(mdres, search);
+
 	cluster = malloc(BLOCK_SIZE);
 	if (!cluster) {
 		fprintf(stderr, "Error allocating cluster\n");
@@ -2033,7 +2689,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 		return -ENOMEM;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		tmp = malloc(max_size);
 		if (!tmp) {
 			fprintf(stderr, "Error allocing tmp buffer\n");
@@ -2092,7 +2748,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				break;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
+			if (mdres->compress_method != COMPRESS_NONE) {
 				ret = fread(tmp, bufsize, 1, mdres->in);
 				if (ret != 1) {
 					fprintf(stderr, "Error reading: %d\n",
@@ -2102,15 +2758,12 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres,
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					fprintf(stderr, "Error decompressing "
-						"%d\n", ret);
-					ret = -EIO;
+				ret = decompress_item(NULL,
+						      mdres->compress_method,
+						      buffer, &size, tmp,
+						      bufsize);
+				if (ret)
 					break;
-				}
 			} else {
 				ret = fread(buffer, bufsize, 1, mdres->in);
 				if (ret != 1) {
@@ -2181,6 +2834,9 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	}
 
 	bytenr += BLOCK_SIZE;
+	ret = check_compress_method(header->compress);
+	if (ret)
+		return ret;
 	mdres->compress_method = header->compress;
 	nritems = le32_to_cpu(header->nritems);
 	for (i = 0; i < nritems; i++) {
@@ -2213,7 +2869,7 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -EIO;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = MAX_PENDING_SIZE * 2;
 		u8 *tmp;
 
@@ -2222,13 +2878,12 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 			free(buffer);
 			return -ENOMEM;
 		}
-		ret = uncompress(tmp, (unsigned long *)&size,
-				 buffer, le32_to_cpu(item->size));
-		if (ret != Z_OK) {
-			fprintf(stderr, "Error decompressing %d\n", ret);
+		ret = decompress_item(NULL, mdres->compress_method, tmp, &size,
+				      buffer, le32_to_cpu(item->size));
+		if (ret) {
 			free(buffer);
 			free(tmp);
-			return -EIO;
+			return ret;
 		}
 		free(buffer);
 		buffer = tmp;
@@ -2242,12 +2897,27 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	memcpy(mdres->uuid, super->dev_item.uuid,
 		       BTRFS_UUID_SIZE);
 	mdres->devid = le64_to_cpu(super->dev_item.devid);
+	mdres->dev_bytes = le64_to_cpu(super->dev_item.total_bytes);
 	free(buffer);
 	pthread_mutex_unlock(&mdres->mutex);
 
 	return search_for_chunk_blocks(mdres, chunk_root_bytenr, 0);
 }
 
+/* the remapped chunks may reach beyond the end of the original device */
+static void size_restore_target(struct mdrestore_struct *mdres)
+{
+	struct fs_chunk *fs_chunk;
+	struct rb_node *n;
+	u64 size = mdres->dev_bytes;
+
+	for (n = rb_first(&mdres->chunk_tree); n; n = rb_next(n)) {
+		fs_chunk = rb_entry(n, struct fs_chunk, n);
+		size = max(size, fs_chunk->physical + fs_chunk->bytes);
+	}
+	grow_restore_file(fileno(mdres->out), size);
+}
+
 static int __restore_metadump(const char *input, FILE *out, int old_restore,
 			      int num_threads, int fixup_offset,
 			      const char *target, int multi_devices)
@@ -2299,9 +2969,16 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 	}
 
 	if (!multi_devices && !old_restore) {
+		/* with a block index the chunk tree can be read directly */
+		if (in != stdin) {
+			mdrestore.image = metadump_image_open(fileno(in), 0);
+			if (IS_ERR(mdrestore.image))
+				mdrestore.image = NULL;
+		}
 		ret = build_chunk_tree(&mdrestore, cluster);
 		if (ret)
 			goto out;
+		size_restore_target(&mdrestore);
 	}
 
 	if (in != stdin && fseek(in, 0, SEEK_SET)) {
@@ -2327,15 +3004,25 @@ static int __restore_metadump(const char *input, FILE *out, int old_restore,
 			break;
 		}
 
-		ret = wait_for_worker(&mdrestore);
+		/* the next cluster is read while this one is restored */
+		ret = wait_for_worker(&mdrestore, ITEMS_PER_CLUSTER);
 		if (ret) {
 			fprintf(stderr, "One of the threads errored out %d\n",
 				ret);
 			break;
 		}
 	}
+	if (!ret) {
+		ret = wait_for_worker(&mdrestore, 0);
+		if (ret)
+			fprintf(stderr, "One of the threads errored out %d\n",
+				ret);
+	}
 out:
 	mdrestore_destroy(&mdrestore, num_threads);
+	if (!ret && verbose)
+		print_compress_stats(mdrestore.compress_method,
+				     &mdrestore.stats, 1);
 failed_cluster:
 	free(cluster);
 failed_info:
@@ -2417,6 +3104,8 @@ static int update_disk_super_on_device(struct btrfs_fs_info *info,
 		exit(1);
 	}
 
+	grow_restore_file(fp, total_bytes);
+
 	buf = malloc(BTRFS_SUPER_INFO_SIZE);
 	if (!buf) {
 		ret = -ENOMEM;
@@ -2454,16 +3143,70 @@ out:
 	return 0;
 }
 
+/*
+ * Parse the -c argument: a plain number is a zlib level (0 turns
+ * compression off), otherwise it is "algo" or "algo:level".
+ */
+static int parse_compress_arg(const char *arg, int *method, int *level)
+{
+	const struct compress_codec *codec = NULL;
+	const char *sep;
+	char *end;
+	long val;
+	int i;
+
+	if (isdigit(arg[0])) {
+		val = strtol(arg, &end, 10);
+		if (*end || val > 9)
+			return -EINVAL;
+		*method = val ? COMPRESS_ZLIB : COMPRESS_NONE;
+		*level = val;
+		return 0;
+	}
+
+	sep = strchr(arg, ':');
+	for (i = 0; i < metadump_nr_codecs; i++) {
+		size_t len = sep ? sep - arg : strlen(arg);
+
+		if (strlen(metadump_codecs[i].name) == len &&
+		    !strncmp(metadump_codecs[i].name, arg, len)) {
+			codec = &metadump_codecs[i];
+			break;
+		}
+	}
+	if (!codec)
+		return -EINVAL;
+
+	*method = codec->method;
+	*level = codec->default_level;
+	if (!sep)
+		return 0;
+
+	val = strtol(sep + 1, &end, 10);
+	if (!sep[1] || *end || val < 1 || val > codec->max_level)
+		return -EINVAL;
+	*level = val;
+	return 0;
+}
+
 static void print_usage(void)
 {
+	int i;
+
 	fprintf(stderr, "usage: btrfs-image [options] source target\n");
 	fprintf(stderr, "\t-r      \trestore metadump image\n");
-	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9)\n");
+	fprintf(stderr, "\t-c value\tcompression level (0 ~ 9) or algo[:level]\n");
+	for (i = 0; i < metadump_nr_codecs; i++)
+		fprintf(stderr, "\t        \t  %s, level 1 ~ %d (default %d)\n",
+			metadump_codecs[i].name, metadump_codecs[i].max_level,
+			metadump_codecs[i].default_level);
 	fprintf(stderr, "\t-t value\tnumber of threads (1 ~ 32)\n");
 	fprintf(stderr, "\t-o      \tdon't mess with the chunk tree when restoring\n");
 	fprintf(stderr, "\t-s      \tsanitize file names, use once to just use garbage, use twice if you want crc collisions\n");
 	fprintf(stderr, "\t-w      \twalk all trees instead of using extent tree, do this if your extent tree is broken\n");
 	fprintf(stderr, "\t-m	   \trestore for multiple devices\n");
+	fprintf(stderr, "\t-i      \twrite a block index at the end of the image\n");
+	fprintf(stderr, "\t-v      \tprint compression statistics\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "\tIn the dump mode, source is the btrfs device and target is the output file (use '-' for stdout).\n");
 	fprintf(stderr, "\tIn the restore mode, source is the dumped image and target is the btrfs device/file.\n");
@@ -2475,10 +3218,12 @@ int main(int argc, char *argv[])
 	char *source;
 	char *target;
 	u64 num_threads = 0;
-	u64 compress_level = 0;
+	int compress_method = COMPRESS_NONE;
+	int compress_level = 0;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
+	int write_index = 0;
 	int multi_devices = 0;
 	int ret;
 	int sanitize = 0;
@@ -2487,7 +3232,7 @@ int main(int argc, char *argv[])
 	FILE *out;
 
 	while (1) {
-		int c = getopt(argc, argv, "rc:t:oswm");
+		int c = getopt(argc, argv, "rc:t:oswmiv");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -2500,9 +3245,12 @@ int main(int argc, char *argv[])
 				print_usage();
 			break;
 		case 'c':
-			compress_level = arg_strtou64(optarg);
-			if (compress_level > 9)
+			if (parse_compress_arg(optarg, &compress_method,
+					       &compress_level)) {
+				fprintf(stderr, "Invalid compression: %s\n",
+					optarg);
 				print_usage();
+			}
 			break;
 		case 'o':
 			old_restore = 1;
@@ -2517,6 +3265,12 @@ int main(int argc, char *argv[])
 			create = 0;
 			multi_devices = 1;
 			break;
+		case 'i':
+			write_index = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
 		default:
 			print_usage();
 		}
@@ -2535,8 +3289,9 @@ int main(int argc, char *argv[])
 			usage_error++;
 		}
 	} else {
-		if (walk_trees || sanitize || compress_level) {
-			fprintf(stderr, "Usage error: use -w, -s, -c options for restore makes no sense\n");
+		if (walk_trees || sanitize || write_index ||
+		    compress_method != COMPRESS_NONE) {
+			fprintf(stderr, "Usage error: use -w, -s, -c, -i options for restore makes no sense\n");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -2565,7 +3320,7 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if (num_threads == 0 && compress_level > 0) {
+	if (num_threads == 0 && (compress_method != COMPRESS_NONE || !create)) {
 		num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 		if (num_threads <= 0)
 			num_threads = 1;
@@ -2582,9 +3337,10 @@ int main(int argc, char *argv[])
 		"WARNING: The device is mounted. Make sure the filesystem is quiescent.\n");
 
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees);
+				      compress_method, compress_level,
+				      sanitize, walk_trees, write_index);
 	} else {
-		ret = restore_metadump(source, out, old_restore, 1,
+		ret = restore_metadump(source, out, old_restore, num_threads,
 				       multi_devices);
 	}
 	if (ret) {
@@ -2632,7 +3388,7 @@ int main(int argc, char *argv[])
 		close_ctree(info->chunk_root);
 
 		/* fix metadata block to map correct chunk */
-		ret = fixup_metadump(source, out, 1, target);
+		ret = fixup_metadump(source, out, num_threads, target);
 		if (ret) {
 			fprintf(stderr, "fix metadump failed (error=%d)\n",
 				ret);
@@ -0,0 +1,722 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "kerncompat.h"
+#include "ctree.h"
+#include "disk-io.h"
+#include "hash.h"
+#include "transaction.h"
+#include "bulk-load.h"
+
+#define BULK_CHUNK_SIZE		(1024 * 1024)
+
+struct bulk_chunk {
+	struct list_head list;
+	char data[0];
+};
+
+/* a finished block, to be pointed to by the level above */
+struct bulk_ptr {
+	struct btrfs_disk_key key;
+	u64 bytenr;
+};
+
+void btrfs_bulk_init(struct btrfs_bulk_loader *bl, int fill)
+{
+	memset(bl, 0, sizeof(*bl));
+	bl->fill = max(min(fill, 100), 1);
+	INIT_LIST_HEAD(&bl->trees);
+	INIT_LIST_HEAD(&bl->chunks);
+}
+
+void btrfs_bulk_release(struct btrfs_bulk_loader *bl)
+{
+	struct btrfs_bulk_tree *tree;
+	struct bulk_chunk *chunk;
+
+	while (!list_empty(&bl->trees)) {
+		tree = list_entry(bl->trees.next, struct btrfs_bulk_tree,
+				  list);
+		list_del(&tree->list);
+		free(tree->items);
+		free(tree);
+	}
+	while (!list_empty(&bl->chunks)) {
+		chunk = list_entry(bl->chunks.next, struct bulk_chunk, list);
+		list_del(&chunk->list);
+		free(chunk);
+	}
+	bl->chunk_ptr = NULL;
+	bl->chunk_left = 0;
+}
+
+static void *bulk_alloc(struct btrfs_bulk_loader *bl, u32 size)
+{
+	struct bulk_chunk *chunk;
+	void *ret;
+
+	size = round_up(size, (u32)sizeof(u64));
+	if (size > bl->chunk_left) {
+		BUG_ON(size > BULK_CHUNK_SIZE);
+		chunk = malloc(sizeof(*chunk) + BULK_CHUNK_SIZE);
+		if (!chunk)
+			return NULL;
+		list_add_tail(&chunk->list, &bl->chunks);
+		bl->chunk_ptr = chunk->data;
+		bl->chunk_left = BULK_CHUNK_SIZE;
+	}
+	ret = bl->chunk_ptr;
+	bl->chunk_ptr += size;
+	bl->chunk_left -= size;
+	return ret;
+}
+
+static void *bulk_add(struct btrfs_bulk_loader *bl,
+		      struct btrfs_bulk_tree *tree,
+		      struct btrfs_key *key, u32 size)
+{
+	struct btrfs_bulk_item *item;
+
+	if (tree->nr_items == tree->max_items) {
+		u64 max_items = max_t(u64, tree->max_items * 2, 1024);
+
+		item = realloc(tree->items, max_items * sizeof(*item));
+		if (!item)
+			return NULL;
+		tree->items = item;
+		tree->max_items = max_items;
+	}
+	item = &tree->items[tree->nr_items];
+	item->data = bulk_alloc(bl, size);
+	if (!item->data)
+		return NULL;
+	memset(item->data, 0, size);
+	item->key = *key;
+	item->size = size;
+	item->seq = bl->seq++;
+	tree->nr_items++;
+	return item->data;
+}
+
+/* copy the items @tree->root already has into the loader */
+static int bulk_read_tree(struct btrfs_bulk_loader *bl,
+			  struct btrfs_bulk_tree *tree)
+{
+	struct btrfs_root *root = tree->root;
+	struct extent_buffer *leaf;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	void *ptr;
+	u32 size;
+	int ret;
+
+	btrfs_init_path(&path);
+	key.objectid = 0;
+	key.type = 0;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		size = btrfs_item_size_nr(leaf, path.slots[0]);
+		ptr = bulk_add(bl, tree, &key, size);
+		if (!ptr) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		read_extent_buffer(leaf, ptr,
+				   btrfs_item_ptr_offset(leaf, path.slots[0]),
+				   size);
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static struct btrfs_bulk_tree *bulk_get_tree(struct btrfs_bulk_loader *bl,
+					     struct btrfs_root *root)
+{
+	struct btrfs_bulk_tree *tree;
+	int ret;
+
+	list_for_each_entry(tree, &bl->trees, list) {
+		if (tree->root == root)
+			return tree;
+	}
+
+	tree = calloc(1, sizeof(*tree));
+	if (!tree)
+		return ERR_PTR(-ENOMEM);
+	tree->root = root;
+	list_add_tail(&tree->list, &bl->trees);
+
+	ret = bulk_read_tree(bl, tree);
+	if (ret)
+		return ERR_PTR(ret);
+	return tree;
+}
+
+/*
+ * Add an item of @size bytes to @root, returns a pointer to its zeroed
+ * contents to be filled in by the caller.
+ */
+void *btrfs_bulk_insert_empty_item(struct btrfs_bulk_loader *bl,
+				   struct btrfs_root *root,
+				   struct btrfs_key *key, u32 size)
+{
+	struct btrfs_bulk_tree *tree;
+	void *ptr;
+
+	if (size > BTRFS_LEAF_DATA_SIZE(root) - sizeof(struct btrfs_item))
+		return ERR_PTR(-EOVERFLOW);
+
+	tree = bulk_get_tree(bl, root);
+	if (IS_ERR(tree))
+		return tree;
+	ptr = bulk_add(bl, tree, key, size);
+	if (!ptr)
+		return ERR_PTR(-ENOMEM);
+	return ptr;
+}
+
+int btrfs_bulk_insert_item(struct btrfs_bulk_loader *bl,
+			   struct btrfs_root *root, struct btrfs_key *key,
+			   const void *data, u32 size)
+{
+	void *ptr;
+
+	ptr = btrfs_bulk_insert_empty_item(bl, root, key, size);
+	if (IS_ERR(ptr))
+		return PTR_ERR(ptr);
+	memcpy(ptr, data, size);
+	return 0;
+}
+
+static int bulk_item_cmp(const void *a, const void *b)
+{
+	const struct btrfs_bulk_item *item1 = a;
+	const struct btrfs_bulk_item *item2 = b;
+	int ret;
+
+	ret = btrfs_comp_cpu_keys((struct btrfs_key *)&item1->key,
+				  (struct btrfs_key *)&item2->key);
+	if (ret)
+		return ret;
+	if (item1->seq < item2->seq)
+		return -1;
+	return item1->seq > item2->seq;
+}
+
+/* the item types several entries with the same key are packed into */
+static int bulk_key_mergeable(struct btrfs_key *key)
+{
+	switch (key->type) {
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_XATTR_ITEM_KEY:
+	case BTRFS_INODE_REF_KEY:
+	case BTRFS_INODE_EXTREF_KEY:
+		return 1;
+	}
+	return 0;
+}
+
+static struct extent_buffer *bulk_alloc_block(struct btrfs_trans_handle *trans,
+					      struct btrfs_root *root,
+					      struct btrfs_disk_key *key,
+					      int level, u64 hint)
+{
+	struct extent_buffer *eb;
+	u32 blocksize = btrfs_level_size(root, level);
+
+	eb = btrfs_alloc_free_block(trans, root, blocksize,
+				    root->root_key.objectid, key, level,
+				    hint, 0);
+	if (IS_ERR(eb))
+		return eb;
+
+	memset_extent_buffer(eb, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_level(eb, level);
+	btrfs_set_header_bytenr(eb, eb->start);
+	btrfs_set_header_generation(eb, trans->transid);
+	btrfs_set_header_backref_rev(eb, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(eb, root->root_key.objectid);
+	write_extent_buffer(eb, root->fs_info->fsid,
+			    btrfs_header_fsid(), BTRFS_FSID_SIZE);
+	write_extent_buffer(eb, root->fs_info->chunk_tree_uuid,
+			    btrfs_header_chunk_tree_uuid(eb),
+			    BTRFS_UUID_SIZE);
+	return eb;
+}
+
+/*
+ * Record the finished block @eb in @ptrs, it is kept as @last as it is
+ * the root if it turns out to be the only block of its level.
+ */
+static void bulk_finish_block(struct extent_buffer *eb,
+			      struct bulk_ptr *ptr,
+			      struct extent_buffer **last)
+{
+	if (btrfs_header_level(eb))
+		btrfs_node_key(eb, &ptr->key, 0);
+	else if (btrfs_header_nritems(eb))
+		btrfs_item_key(eb, &ptr->key, 0);
+	else
+		memset(&ptr->key, 0, sizeof(ptr->key));
+	ptr->bytenr = eb->start;
+	btrfs_mark_buffer_dirty(eb);
+
+	if (*last)
+		free_extent_buffer(*last);
+	*last = eb;
+}
+
+static int bulk_build_leaves(struct btrfs_trans_handle *trans,
+			     struct btrfs_bulk_loader *bl,
+			     struct btrfs_bulk_tree *tree,
+			     struct bulk_ptr *ptrs, u64 *nr_ptrs,
+			     struct extent_buffer **last)
+{
+	struct btrfs_root *root = tree->root;
+	struct btrfs_bulk_item *items = tree->items;
+	struct extent_buffer *leaf = NULL;
+	struct btrfs_disk_key disk_key;
+	struct btrfs_item *item;
+	u32 limit = BTRFS_LEAF_DATA_SIZE(root) * bl->fill / 100;
+	u32 data_end = 0;
+	u32 used = 0;
+	u32 size;
+	u64 hint = 0;
+	u64 i = 0;
+	u64 j;
+	int slot = 0;
+
+	*nr_ptrs = 0;
+	while (i < tree->nr_items) {
+		size = 0;
+		for (j = i; j < tree->nr_items; j++) {
+			if (btrfs_comp_cpu_keys(&items[j].key, &items[i].key))
+				break;
+			size += items[j].size;
+		}
+		if (j - i > 1 && !bulk_key_mergeable(&items[i].key)) {
+			fprintf(stderr, "duplicate key %llu %u %llu\n",
+				(unsigned long long)items[i].key.objectid,
+				items[i].key.type,
+				(unsigned long long)items[i].key.offset);
+			goto eexist;
+		}
+		if (size + sizeof(*item) > BTRFS_LEAF_DATA_SIZE(root))
+			goto eoverflow;
+
+		if (leaf && used + size + sizeof(*item) > limit) {
+			bulk_finish_block(leaf, &ptrs[(*nr_ptrs)++], last);
+			hint = leaf->start + leaf->len;
+			leaf = NULL;
+		}
+		if (!leaf) {
+			btrfs_cpu_key_to_disk(&disk_key, &items[i].key);
+			leaf = bulk_alloc_block(trans, root, &disk_key, 0, hint);
+			if (IS_ERR(leaf))
+				return PTR_ERR(leaf);
+			data_end = BTRFS_LEAF_DATA_SIZE(root);
+			used = 0;
+			slot = 0;
+		}
+
+		data_end -= size;
+		btrfs_cpu_key_to_disk(&disk_key, &items[i].key);
+		btrfs_set_item_key(leaf, &disk_key, slot);
+		item = btrfs_item_nr(slot);
+		btrfs_set_item_offset(leaf, item, data_end);
+		btrfs_set_item_size(leaf, item, size);
+		size = 0;
+		for (; i < j; i++) {
+			write_extent_buffer(leaf, items[i].data,
+				btrfs_leaf_data(leaf) + data_end + size,
+				items[i].size);
+			size += items[i].size;
+		}
+		used += size + sizeof(*item);
+		btrfs_set_header_nritems(leaf, ++slot);
+	}
+	if (!leaf) {
+		/* an empty tree still has a root leaf */
+		memset(&disk_key, 0, sizeof(disk_key));
+		leaf = bulk_alloc_block(trans, root, &disk_key, 0, hint);
+		if (IS_ERR(leaf))
+			return PTR_ERR(leaf);
+	}
+	bulk_finish_block(leaf, &ptrs[(*nr_ptrs)++], last);
+	return 0;
+
+eexist:
+	free_extent_buffer(leaf);
+	return -EEXIST;
+eoverflow:
+	free_extent_buffer(leaf);
+	return -EOVERFLOW;
+}
+
+/*
+ * Build the nodes of @level over the @nr_ptrs blocks below, spreading the
+ * pointers evenly.  @ptrs is replaced with the new nodes.
+ */
+static int bulk_build_nodes(struct btrfs_trans_handle *trans,
+			    struct btrfs_bulk_loader *bl,
+			    struct btrfs_root *root, int level,
+			    struct bulk_ptr *ptrs, u64 *nr_ptrs,
+			    struct extent_buffer **last)
+{
+	struct extent_buffer *node;
+	u64 per_node = BTRFS_NODEPTRS_PER_BLOCK(root) * bl->fill / 100;
+	u64 nr_nodes;
+	u64 nr;
+	u64 hint = (*last)->start + (*last)->len;
+	u64 i = 0;
+	u64 n;
+	u64 k;
+
+	per_node = max_t(u64, per_node, 2);
+	nr_nodes = (*nr_ptrs + per_node - 1) / per_node;
+	for (n = 0; n < nr_nodes; n++) {
+		nr = *nr_ptrs / nr_nodes + (n < *nr_ptrs % nr_nodes);
+		node = bulk_alloc_block(trans, root, &ptrs[i].key, level, hint);
+		if (IS_ERR(node))
+			return PTR_ERR(node);
+		for (k = 0; k < nr; k++) {
+			btrfs_set_node_key(node, &ptrs[i + k].key, k);
+			btrfs_set_node_blockptr(node, k, ptrs[i + k].bytenr);
+			btrfs_set_node_ptr_generation(node, k, trans->transid);
+		}
+		btrfs_set_header_nritems(node, nr);
+		i += nr;
+		/* n <= i, the pointers read are not overwritten */
+		bulk_finish_block(node, &ptrs[n], last);
+		hint = node->start + node->len;
+	}
+	*nr_ptrs = nr_nodes;
+	return 0;
+}
+
+static int bulk_free_tree_blocks(struct btrfs_trans_handle *trans,
+				 struct btrfs_root *root,
+				 struct extent_buffer *eb)
+{
+	struct extent_buffer *child;
+	int level = btrfs_header_level(eb);
+	u32 i;
+	int ret;
+
+	for (i = 0; level && i < btrfs_header_nritems(eb); i++) {
+		child = read_tree_block(root, btrfs_node_blockptr(eb, i),
+					btrfs_level_size(root, level - 1),
+					btrfs_node_ptr_generation(eb, i));
+		if (!extent_buffer_uptodate(child)) {
+			free_extent_buffer(child);
+			return -EIO;
+		}
+		ret = bulk_free_tree_blocks(trans, root, child);
+		free_extent_buffer(child);
+		if (ret)
+			return ret;
+	}
+	return btrfs_free_extent(trans, root, eb->start, eb->len, 0,
+				 root->root_key.objectid, level, 0);
+}
+
+static int bulk_build_tree(struct btrfs_trans_handle *trans,
+			   struct btrfs_bulk_loader *bl,
+			   struct btrfs_bulk_tree *tree)
+{
+	struct btrfs_root *root = tree->root;
+	struct extent_buffer *last = NULL;
+	struct extent_buffer *old;
+	struct bulk_ptr *ptrs;
+	u64 nr_ptrs;
+	int level = 0;
+	int ret;
+
+	qsort(tree->items, tree->nr_items, sizeof(*tree->items),
+	      bulk_item_cmp);
+
+	ptrs = malloc((tree->nr_items + 1) * sizeof(*ptrs));
+	if (!ptrs)
+		return -ENOMEM;
+
+	ret = bulk_build_leaves(trans, bl, tree, ptrs, &nr_ptrs, &last);
+	while (!ret && nr_ptrs > 1) {
+		if (++level >= BTRFS_MAX_LEVEL) {
+			ret = -EOVERFLOW;
+			break;
+		}
+		ret = bulk_build_nodes(trans, bl, root, level, ptrs,
+				       &nr_ptrs, &last);
+	}
+	free(ptrs);
+	if (ret) {
+		if (last)
+			free_extent_buffer(last);
+		return ret;
+	}
+
+	old = root->node;
+	ret = bulk_free_tree_blocks(trans, root, old);
+	if (ret) {
+		free_extent_buffer(last);
+		return ret;
+	}
+	root->node = last;
+	free_extent_buffer(old);
+	add_root_to_dirty_list(root);
+	return 0;
+}
+
+/*
+ * Build all trees items were added to and replace the old trees with
+ * them.  The loader is empty afterwards.
+ */
+int btrfs_bulk_commit(struct btrfs_trans_handle *trans,
+		      struct btrfs_bulk_loader *bl)
+{
+	struct btrfs_bulk_tree *tree;
+	int ret = 0;
+
+	list_for_each_entry(tree, &bl->trees, list) {
+		ret = bulk_build_tree(trans, bl, tree);
+		if (ret)
+			break;
+	}
+	btrfs_bulk_release(bl);
+	return ret;
+}
+
+int btrfs_bulk_insert_inode(struct btrfs_bulk_loader *bl,
+			    struct btrfs_root *root, u64 objectid,
+			    struct btrfs_inode_item *inode_item)
+{
+	struct btrfs_key key;
+
+	key.objectid = objectid;
+	key.type = BTRFS_INODE_ITEM_KEY;
+	key.offset = 0;
+	return btrfs_bulk_insert_item(bl, root, &key, inode_item,
+				      sizeof(*inode_item));
+}
+
+int btrfs_bulk_insert_inode_ref(struct btrfs_bulk_loader *bl,
+				struct btrfs_root *root,
+				const char *name, int name_len,
+				u64 inode_objectid, u64 ref_objectid,
+				u64 index)
+{
+	struct btrfs_inode_ref *ref;
+	struct btrfs_key key;
+
+	key.objectid = inode_objectid;
+	key.type = BTRFS_INODE_REF_KEY;
+	key.offset = ref_objectid;
+	ref = btrfs_bulk_insert_empty_item(bl, root, &key,
+					   sizeof(*ref) + name_len);
+	if (IS_ERR(ref))
+		return PTR_ERR(ref);
+	btrfs_set_stack_inode_ref_name_len(ref, name_len);
+	btrfs_set_stack_inode_ref_index(ref, index);
+	memcpy(ref + 1, name, name_len);
+	return 0;
+}
+
+static int bulk_insert_dir_item(struct btrfs_trans_handle *trans,
+				struct btrfs_bulk_loader *bl,
+				struct btrfs_root *root, struct btrfs_key *key,
+				const char *name, u16 name_len,
+				const void *data, u16 data_len,
+				struct btrfs_key *location, u8 type)
+{
+	struct btrfs_dir_item *dir_item;
+	struct btrfs_disk_key disk_key;
+
+	dir_item = btrfs_bulk_insert_empty_item(bl, root, key,
+				sizeof(*dir_item) + name_len + data_len);
+	if (IS_ERR(dir_item))
+		return PTR_ERR(dir_item);
+	btrfs_cpu_key_to_disk(&disk_key, location);
+	memcpy(&dir_item->location, &disk_key, sizeof(disk_key));
+	btrfs_set_stack_dir_transid(dir_item, trans->transid);
+	btrfs_set_stack_dir_type(dir_item, type);
+	btrfs_set_stack_dir_name_len(dir_item, name_len);
+	btrfs_set_stack_dir_data_len(dir_item, data_len);
+	memcpy(dir_item + 1, name, name_len);
+	memcpy((char *)(dir_item + 1) + name_len, data, data_len);
+	return 0;
+}
+
+int btrfs_bulk_insert_dir_item(struct btrfs_trans_handle *trans,
+			       struct btrfs_bulk_loader *bl,
+			       struct btrfs_root *root, const char *name,
+			       int name_len, u64 dir,
+			       struct btrfs_key *location, u8 type, u64 index)
+{
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = dir;
+	key.type = BTRFS_DIR_ITEM_KEY;
+	key.offset = btrfs_name_hash(name, name_len);
+	ret = bulk_insert_dir_item(trans, bl, root, &key, name, name_len,
+				   NULL, 0, location, type);
+	if (ret || root == root->fs_info->tree_root)
+		return ret;
+
+	key.type = BTRFS_DIR_INDEX_KEY;
+	key.offset = index;
+	return bulk_insert_dir_item(trans, bl, root, &key, name, name_len,
+				    NULL, 0, location, type);
+}
+
+int btrfs_bulk_insert_xattr_item(struct btrfs_trans_handle *trans,
+				 struct btrfs_bulk_loader *bl,
+				 struct btrfs_root *root, const char *name,
+				 u16 name_len, const void *data, u16 data_len,
+				 u64 objectid)
+{
+	struct btrfs_key location;
+	struct btrfs_key key;
+
+	memset(&location, 0, sizeof(location));
+	key.objectid = objectid;
+	key.type = BTRFS_XATTR_ITEM_KEY;
+	key.offset = btrfs_name_hash(name, name_len);
+	return bulk_insert_dir_item(trans, bl, root, &key, name, name_len,
+				    data, data_len, &location,
+				    BTRFS_FT_XATTR);
+}
+
+int btrfs_bulk_insert_inline_extent(struct btrfs_trans_handle *trans,
+				    struct btrfs_bulk_loader *bl,
+				    struct btrfs_root *root, u64 objectid,
+				    u64 offset, char *buffer, size_t size)
+{
+	struct btrfs_file_extent_item *ei;
+	struct btrfs_key key;
+
+	key.objectid = objectid;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = offset;
+	ei = btrfs_bulk_insert_empty_item(bl, root, &key,
+				btrfs_file_extent_calc_inline_size(size));
+	if (IS_ERR(ei))
+		return PTR_ERR(ei);
+	btrfs_set_stack_file_extent_generation(ei, trans->transid);
+	btrfs_set_stack_file_extent_type(ei, BTRFS_FILE_EXTENT_INLINE);
+	btrfs_set_stack_file_extent_ram_bytes(ei, size);
+	memcpy((void *)btrfs_file_extent_inline_start(ei), buffer, size);
+	return 0;
+}
+
+/*
+ * The bulk counterpart of btrfs_record_file_extent(), only the file
+ * extent item is loaded, the extent tree is updated right away.
+ */
+int btrfs_bulk_record_file_extent(struct btrfs_trans_handle *trans,
+				  struct btrfs_bulk_loader *bl,
+				  struct btrfs_root *root, u64 objectid,
+				  struct btrfs_inode_item *inode,
+				  u64 file_pos, u64 disk_bytenr,
+				  u64 num_bytes)
+{
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+	u64 nbytes;
+
+	key.objectid = objectid;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = file_pos;
+	fi = btrfs_bulk_insert_empty_item(bl, root, &key, sizeof(*fi));
+	if (IS_ERR(fi))
+		return PTR_ERR(fi);
+	btrfs_set_stack_file_extent_generation(fi, trans->transid);
+	btrfs_set_stack_file_extent_type(fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_disk_bytenr(fi, disk_bytenr);
+	btrfs_set_stack_file_extent_disk_num_bytes(fi, num_bytes);
+	btrfs_set_stack_file_extent_num_bytes(fi, num_bytes);
+	btrfs_set_stack_file_extent_ram_bytes(fi, num_bytes);
+	if (disk_bytenr == 0)
+		return 0;
+
+	nbytes = btrfs_stack_inode_nbytes(inode) + num_bytes;
+	btrfs_set_stack_inode_nbytes(inode, nbytes);
+
+	return btrfs_record_data_extent(trans, root, objectid, file_pos,
+					disk_bytenr, num_bytes);
+}
+
+/*
+ * Add the csums of the @len bytes of @data written to @bytenr to the csum
+ * root @root, in items sized to fit the fill factor of the leaves.  The
+ * range must not have csums yet.
+ */
+int btrfs_bulk_csum_file_blocks(struct btrfs_bulk_loader *bl,
+				struct btrfs_root *root, u64 bytenr,
+				char *data, u64 len)
+{
+	struct btrfs_key key;
+	u32 sectorsize = root->sectorsize;
+	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	u64 nr_sectors = len / sectorsize;
+	u32 max_csums;
+	u32 *csums;
+	u64 done = 0;
+	u32 nr;
+	int ret = 0;
+
+	max_csums = (BTRFS_LEAF_DATA_SIZE(root) * bl->fill / 100 -
+		     sizeof(struct btrfs_item)) / csum_size;
+	max_csums = max_t(u32, max_csums, 1);
+
+	csums = malloc(nr_sectors * sizeof(*csums));
+	if (!csums)
+		return -ENOMEM;
+	btrfs_csum_sectors(root, data, sectorsize, nr_sectors, csums);
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	while (done < nr_sectors) {
+		nr = min_t(u64, nr_sectors - done, max_csums);
+		key.offset = bytenr + done * sectorsize;
+		ret = btrfs_bulk_insert_item(bl, root, &key, csums + done,
+					     nr * csum_size);
+		if (ret)
+			break;
+		done += nr;
+	}
+	free(csums);
+	return ret;
+}
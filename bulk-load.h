@@ -0,0 +1,106 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_BULK_LOAD_H__
+#define __BTRFS_BULK_LOAD_H__
+
+#include "kerncompat.h"
+#include "list.h"
+#include "ctree.h"
+
+/*
+ * The bulk loader collects the items of whole trees in memory and builds
+ * the trees bottom up when it is committed, instead of searching and
+ * splitting for every item.  Items with the same key are concatenated in
+ * the order they were added, which is what inserting them one by one does
+ * for dir items, xattrs and inode refs.
+ *
+ * The first item added for a root pulls in the items the tree already
+ * has, and the old tree blocks are freed by btrfs_bulk_commit().  Until
+ * then the tree must not be changed by other means, and it must not be
+ * shared with snapshots.
+ */
+struct btrfs_bulk_item {
+	struct btrfs_key key;
+	u64 seq;
+	u32 size;
+	char *data;
+};
+
+struct btrfs_bulk_tree {
+	struct btrfs_root *root;
+	struct btrfs_bulk_item *items;
+	u64 nr_items;
+	u64 max_items;
+	struct list_head list;
+};
+
+struct btrfs_bulk_loader {
+	/* percentage of leaves and nodes to fill */
+	int fill;
+	u64 seq;
+	struct list_head trees;
+	/* item data is carved out of these chunks */
+	struct list_head chunks;
+	char *chunk_ptr;
+	u32 chunk_left;
+};
+
+void btrfs_bulk_init(struct btrfs_bulk_loader *bl, int fill);
+void btrfs_bulk_release(struct btrfs_bulk_loader *bl);
+int btrfs_bulk_commit(struct btrfs_trans_handle *trans,
+		      struct btrfs_bulk_loader *bl);
+
+void *btrfs_bulk_insert_empty_item(struct btrfs_bulk_loader *bl,
+				   struct btrfs_root *root,
+				   struct btrfs_key *key, u32 size);
+int btrfs_bulk_insert_item(struct btrfs_bulk_loader *bl,
+			   struct btrfs_root *root, struct btrfs_key *key,
+			   const void *data, u32 size);
+
+int btrfs_bulk_insert_inode(struct btrfs_bulk_loader *bl,
+			    struct btrfs_root *root, u64 objectid,
+			    struct btrfs_inode_item *inode_item);
+int btrfs_bulk_insert_inode_ref(struct btrfs_bulk_loader *bl,
+				struct btrfs_root *root,
+				const char *name, int name_len,
+				u64 inode_objectid, u64 ref_objectid,
+				u64 index);
+int btrfs_bulk_insert_dir_item(struct btrfs_trans_handle *trans,
+			       struct btrfs_bulk_loader *bl,
+			       struct btrfs_root *root, const char *name,
+			       int name_len, u64 dir,
+			       struct btrfs_key *location, u8 type, u64 index);
+int btrfs_bulk_insert_xattr_item(struct btrfs_trans_handle *trans,
+				 struct btrfs_bulk_loader *bl,
+				 struct btrfs_root *root, const char *name,
+				 u16 name_len, const void *data, u16 data_len,
+				 u64 objectid);
+int btrfs_bulk_insert_inline_extent(struct btrfs_trans_handle *trans,
+				    struct btrfs_bulk_loader *bl,
+				    struct btrfs_root *root, u64 objectid,
+				    u64 offset, char *buffer, size_t size);
+int btrfs_bulk_record_file_extent(struct btrfs_trans_handle *trans,
+				  struct btrfs_bulk_loader *bl,
+				  struct btrfs_root *root, u64 objectid,
+				  struct btrfs_inode_item *inode,
+				  u64 file_pos, u64 disk_bytenr,
+				  u64 num_bytes);
+int btrfs_bulk_csum_file_blocks(struct btrfs_bulk_loader *bl,
+				struct btrfs_root *root, u64 bytenr,
+				char *data, u64 len);
+
+#endif
@@ -18,12 +18,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include "ctree.h"
 #include "volumes.h"
@@ -56,9 +60,15 @@ static int repair = 0;
 static int no_holes = 0;
 static int init_extent_tree = 0;
 static int check_data_csum = 0;
+static int verbose = 0;
+static int nr_check_threads = BTRFS_READA_THREADS;
 
+/*
+ * The backrefs of an extent.  The first one is kept in the extent record
+ * if it is of the kind of the extent, a tree backref for metadata and a
+ * data backref for data, all others are in rec->extra->backrefs.
+ */
 struct extent_backref {
-	struct list_head list;
 	unsigned int is_data:1;
 	unsigned int found_extent_tree:1;
 	unsigned int full_backref:1;
@@ -68,6 +78,7 @@ struct extent_backref {
 
 struct data_backref {
 	struct extent_backref node;
+	u32 num_refs;
 	union {
 		u64 parent;
 		u64 root;
@@ -76,8 +87,6 @@ struct data_backref {
 	u64 offset;
 	u64 disk_bytenr;
 	u64 bytes;
-	u64 ram_bytes;
-	u32 num_refs;
 	u32 found_ref;
 };
 
@@ -89,30 +98,75 @@ struct tree_backref {
 	};
 };
 
-struct extent_record {
-	struct list_head backrefs;
-	struct list_head dups;
+/*
+ * Where a tree block is.  Until the block is read that is the generation
+ * and key of the pointer to it, which the block is checked against, after
+ * that the generation and first key of the block itself.
+ */
+struct tree_block_info_rec {
+	union {
+		struct {
+			u64 parent_generation;
+			struct btrfs_disk_key parent_key;
+		};
+		struct {
+			u64 generation;
+			u64 info_objectid;
+		};
+	};
+};
+
+/* the rarely needed parts of an extent record */
+struct extent_record_extra {
+	struct extent_record *rec;
+	/* on duplicate_extents or the dups of another record */
 	struct list_head list;
+	struct list_head dups;
+	u32 num_duplicates;
+	u32 nr_backrefs;
+	u32 max_backrefs;
+	struct extent_backref **backrefs;
+	/* of a data extent a tree block pointer leads to */
+	struct tree_block_info_rec block;
+};
+
+/*
+ * There is one of these for every extent in the filesystem.  The start of
+ * the extent is cache.start and a record only takes the memory up to the
+ * end of the member for its kind, tree or data, see alloc_extent_record().
+ */
+struct extent_record {
 	struct cache_extent cache;
-	struct btrfs_disk_key parent_key;
-	u64 start;
+	struct extent_record_extra *extra;
 	u64 max_size;
 	u64 nr;
-	u64 refs;
 	u64 extent_item_refs;
-	u64 generation;
-	u64 parent_generation;
-	u64 info_objectid;
-	u32 num_duplicates;
-	u8 info_level;
+	u32 refs;
 	unsigned int found_rec:1;
 	unsigned int content_checked:1;
 	unsigned int owner_ref_checked:1;
 	unsigned int is_root:1;
 	unsigned int metadata:1;
 	unsigned int flag_block_full_backref:1;
+	/* the backref in the record is used */
+	unsigned int inline_ref:1;
+	/* the tree block was read, see struct tree_block_info_rec */
+	unsigned int block_read:1;
+	unsigned int info_level:8;
+	union {
+		struct {
+			struct tree_backref ref;
+			struct tree_block_info_rec block;
+		} tree;
+		struct data_backref data;
+	};
 };
 
+#define TREE_EXTENT_RECORD_SIZE						\
+	(offsetof(struct extent_record, tree) +				\
+	 sizeof(((struct extent_record *)0)->tree))
+#define DATA_EXTENT_RECORD_SIZE	sizeof(struct extent_record)
+
 struct inode_backref {
 	struct list_head list;
 	unsigned int found_dir_item:1;
@@ -221,12 +275,22 @@ struct ptr_node {
 	void *data;
 };
 
+struct walk_control;
+
 struct shared_node {
 	struct cache_extent cache;
 	struct cache_tree root_cache;
 	struct cache_tree inode_cache;
 	struct inode_record *current;
 	u32 refs;
+	/*
+	 * Only used when fs roots are checked on several threads: the walk
+	 * that is filling the node, whether it is done and how many threads
+	 * are copying records out of it.
+	 */
+	struct walk_control *walker;
+	unsigned int done:1;
+	u32 readers;
 };
 
 struct block_info {
@@ -235,10 +299,14 @@ struct block_info {
 };
 
 struct walk_control {
-	struct cache_tree shared;
+	struct cache_tree *shared;
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
+	/* the node this walk is waiting for another thread to finish */
+	struct shared_node *waiting;
+	/* a shared node was skipped as the walks waited for each other */
+	int looped;
 };
 
 struct bad_item {
@@ -249,6 +317,694 @@ struct bad_item {
 
 static void reset_cached_block_groups(struct btrfs_fs_info *fs_info);
 
+/*
+ * Without --repair check_fs_roots() checks several fs roots at the same
+ * time, see check_fs_roots_threaded().  The tree code is not thread safe,
+ * so every search and tree block read of the workers is done holding
+ * fs_tree_mutex.  The shared node cache has a lock of its own, taken
+ * after fs_tree_mutex if both are needed.  What a worker prints about a
+ * root goes to cur_root_log and is printed in root order.
+ */
+static int fs_root_threads;
+static pthread_mutex_t fs_tree_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shared_node_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shared_node_cond = PTHREAD_COND_INITIALIZER;
+static __thread FILE *cur_root_log;
+static __thread struct cache_tree *cur_corrupt_blocks;
+
+static FILE *root_err(void)
+{
+	return cur_root_log ? cur_root_log : stderr;
+}
+
+static void lock_fs_trees(struct btrfs_fs_info *info)
+{
+	if (!fs_root_threads)
+		return;
+	pthread_mutex_lock(&fs_tree_mutex);
+	info->corrupt_blocks = cur_corrupt_blocks;
+}
+
+static void unlock_fs_trees(void)
+{
+	if (fs_root_threads)
+		pthread_mutex_unlock(&fs_tree_mutex);
+}
+
+static void lock_shared_nodes(void)
+{
+	if (fs_root_threads)
+		pthread_mutex_lock(&shared_node_mutex);
+}
+
+static void unlock_shared_nodes(void)
+{
+	if (fs_root_threads)
+		pthread_mutex_unlock(&shared_node_mutex);
+}
+
+/*
+ * Extent and backref records are allocated and freed by the million on big
+ * filesystems.  They are carved out of large chunks instead of going through
+ * malloc one by one, which saves the per allocation overhead and keeps them
+ * close together.  Freed records are reused via a free list, the chunks are
+ * only given back by record_slab_release() once no record is in use.
+ *
+ * With --spill-dir the chunks are shared mappings of an unlinked file in
+ * that directory instead, so the kernel can write records out and drop them
+ * from memory when the host runs short instead of OOM killing the check.
+ */
+#define RECORD_SLAB_CHUNK_SIZE	(1024 * 1024)
+
+static int record_spill_fd = -1;
+static u64 record_spill_size;
+
+struct record_slab {
+	size_t size;
+	void *free_list;
+	void *chunks;
+	char *next;
+	size_t left;
+	u64 in_use;
+};
+
+#define RECORD_SLAB_INIT(bytes)						\
+	{ .size = ((bytes) + sizeof(void *) - 1) &			\
+		  ~(sizeof(void *) - 1) }
+
+static struct record_slab tree_rec_slab =
+	RECORD_SLAB_INIT(TREE_EXTENT_RECORD_SIZE);
+static struct record_slab data_rec_slab =
+	RECORD_SLAB_INIT(DATA_EXTENT_RECORD_SIZE);
+static struct record_slab tree_backref_slab =
+	RECORD_SLAB_INIT(sizeof(struct tree_backref));
+static struct record_slab data_backref_slab =
+	RECORD_SLAB_INIT(sizeof(struct data_backref));
+static struct record_slab extra_slab =
+	RECORD_SLAB_INIT(sizeof(struct extent_record_extra));
+
+/*
+ * The arrays of the backrefs past the inline one come from slabs of power
+ * of two sizes, see backref_array_slab().  Only the arrays of extents with
+ * more than BACKREF_ARRAY_MAX backrefs are too big for a slab chunk and
+ * are allocated with malloc.
+ */
+#define BACKREF_ARRAY_MIN	4
+#define BACKREF_ARRAY_CLASSES	15
+#define BACKREF_ARRAY_MAX	(BACKREF_ARRAY_MIN << (BACKREF_ARRAY_CLASSES - 1))
+
+static struct record_slab backref_array_slabs[BACKREF_ARRAY_CLASSES];
+static pthread_mutex_t record_spill_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The records of the read only extent scan are built by shards, see
+ * extent_shards_start().  A shard owns the records of the chunks given to
+ * it and allocates them from its own slabs, the update queue is the only
+ * thing its worker shares with the main thread.
+ */
+#define EXTENT_SHARD_BATCH	256
+#define EXTENT_SHARD_BATCHES	64
+
+enum rec_op_type {
+	REC_OP_EXTENT_REC,
+	REC_OP_TREE_BACKREF,
+	REC_OP_DATA_BACKREF,
+	REC_OP_MAYBE_FREE,
+};
+
+/* a queued call of add_extent_rec() and friends */
+struct rec_op {
+	u64 seq;
+	int type;
+	union {
+		struct {
+			struct btrfs_key parent_key;
+			u64 parent_gen;
+			u64 start;
+			u64 nr;
+			u64 extent_item_refs;
+			u64 max_size;
+			unsigned int has_parent_key:1;
+			unsigned int is_root:1;
+			unsigned int inc_ref:1;
+			unsigned int set_checked:1;
+			unsigned int metadata:1;
+			unsigned int extent_rec:1;
+		} extent;
+		struct {
+			u64 bytenr;
+			u64 parent;
+			u64 root;
+			int found_ref;
+		} tree;
+		struct {
+			u64 bytenr;
+			u64 parent;
+			u64 root;
+			u64 owner;
+			u64 offset;
+			u64 max_size;
+			u32 num_refs;
+			int found_ref;
+		} data;
+		struct extent_record *rec;
+	};
+};
+
+struct rec_batch {
+	struct list_head list;
+	int nr;
+	struct rec_op ops[EXTENT_SHARD_BATCH];
+};
+
+struct rec_msg {
+	struct list_head list;
+	u64 seq;
+	char text[0];
+};
+
+struct extent_shard {
+	struct cache_tree cache;
+	struct record_slab tree_rec_slab;
+	struct record_slab data_rec_slab;
+	struct record_slab tree_backref_slab;
+	struct record_slab data_backref_slab;
+	struct record_slab extra_slab;
+	struct record_slab backref_array_slabs[BACKREF_ARRAY_CLASSES];
+	struct list_head duplicates;
+	u64 bytes_used;
+	/* messages of the applied updates and the seq of the current one */
+	struct list_head msgs;
+	u64 seq;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct list_head queue;
+	struct list_head free;
+	/* batches queued or being applied */
+	int queued;
+	int stop;
+	/* batch the main thread is filling */
+	struct rec_batch *fill;
+};
+
+struct extent_shard_chunk {
+	u64 start;
+	u64 end;
+};
+
+struct extent_shards {
+	struct cache_tree *extent_cache;
+	struct extent_shard *shards;
+	int nr_shards;
+	/* 0 if the updates are applied inline */
+	int nr_threads;
+	u64 seq;
+	struct extent_shard_chunk *chunks;
+	int nr_chunks;
+};
+
+static struct extent_shards *extent_shards;
+/* the shard whose records the current thread changes */
+static __thread struct extent_shard *cur_shard;
+
+static int extent_shards_queue(struct rec_op *op, u64 start, u64 len);
+static void extent_shards_flush(void);
+static struct cache_tree *extent_cache_of(struct cache_tree *extent_cache,
+					  u64 start, u64 len);
+
+static int record_spill_init(const char *dir)
+{
+	char *name;
+	int fd;
+
+	name = malloc(strlen(dir) + sizeof("/btrfs-check-XXXXXX"));
+	if (!name)
+		return -ENOMEM;
+	sprintf(name, "%s/btrfs-check-XXXXXX", dir);
+	fd = mkstemp(name);
+	if (fd < 0) {
+		fd = -errno;
+		fprintf(stderr, "ERROR: cannot create spill file in %s: %s\n",
+			dir, strerror(errno));
+		free(name);
+		return fd;
+	}
+	unlink(name);
+	free(name);
+	record_spill_fd = fd;
+	return 0;
+}
+
+static void *record_chunk_alloc(void)
+{
+	void *chunk;
+
+	if (record_spill_fd < 0)
+		return malloc(RECORD_SLAB_CHUNK_SIZE);
+
+	pthread_mutex_lock(&record_spill_mutex);
+	chunk = NULL;
+	if (ftruncate(record_spill_fd,
+		      record_spill_size + RECORD_SLAB_CHUNK_SIZE) < 0)
+		goto out;
+	chunk = mmap(NULL, RECORD_SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_SHARED, record_spill_fd, record_spill_size);
+	if (chunk == MAP_FAILED) {
+		chunk = NULL;
+		goto out;
+	}
+	record_spill_size += RECORD_SLAB_CHUNK_SIZE;
+out:
+	pthread_mutex_unlock(&record_spill_mutex);
+	return chunk;
+}
+
+static void record_chunk_free(void *chunk)
+{
+	if (record_spill_fd < 0)
+		free(chunk);
+	else
+		munmap(chunk, RECORD_SLAB_CHUNK_SIZE);
+}
+
+static void *record_slab_alloc(struct record_slab *slab)
+{
+	void *ptr;
+
+	if (slab->free_list) {
+		ptr = slab->free_list;
+		slab->free_list = *(void **)ptr;
+	} else {
+		if (slab->left < slab->size) {
+			void **chunk = record_chunk_alloc();
+
+			if (!chunk)
+				return NULL;
+			*chunk = slab->chunks;
+			slab->chunks = chunk;
+			slab->next = (char *)(chunk + 1);
+			slab->left = RECORD_SLAB_CHUNK_SIZE - sizeof(*chunk);
+		}
+		ptr = slab->next;
+		slab->next += slab->size;
+		slab->left -= slab->size;
+	}
+	slab->in_use++;
+	return ptr;
+}
+
+static void record_slab_free(struct record_slab *slab, void *ptr)
+{
+	if (!ptr)
+		return;
+	BUG_ON(!slab->in_use);
+	*(void **)ptr = slab->free_list;
+	slab->free_list = ptr;
+	slab->in_use--;
+}
+
+static void record_slab_release(struct record_slab *slab)
+{
+	void *chunk;
+
+	if (slab->in_use)
+		return;
+	while (slab->chunks) {
+		chunk = slab->chunks;
+		slab->chunks = *(void **)chunk;
+		record_chunk_free(chunk);
+	}
+	slab->free_list = NULL;
+	slab->next = NULL;
+	slab->left = 0;
+}
+
+/*
+ * Gives the chunks of all the record slabs back, returns 1 if some are
+ * still in use.
+ */
+static int release_record_slabs(void)
+{
+	struct record_slab *slabs[] = { &tree_rec_slab, &data_rec_slab,
+		&tree_backref_slab, &data_backref_slab, &extra_slab };
+	int busy = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(slabs); i++) {
+		record_slab_release(slabs[i]);
+		busy |= !!slabs[i]->chunks;
+	}
+	for (i = 0; i < BACKREF_ARRAY_CLASSES; i++) {
+		record_slab_release(&backref_array_slabs[i]);
+		busy |= !!backref_array_slabs[i].chunks;
+	}
+	return busy;
+}
+
+/* hands the records of a stopped shard over to @dst */
+static void record_slab_merge(struct record_slab *dst, struct record_slab *src)
+{
+	void **last;
+
+	if (src->chunks) {
+		for (last = src->chunks; *last; last = *last)
+			;
+		*last = dst->chunks;
+		dst->chunks = src->chunks;
+	}
+	if (src->free_list) {
+		for (last = src->free_list; *last; last = *last)
+			;
+		*last = dst->free_list;
+		dst->free_list = src->free_list;
+	}
+	dst->in_use += src->in_use;
+	memset(src, 0, sizeof(*src));
+}
+
+/*
+ * A metadata record is shorter than a data record, the inline backref and
+ * the tree block info of a metadata record take less room than the inline
+ * data backref.
+ */
+static struct extent_record *alloc_extent_record(int metadata)
+{
+	struct extent_record *rec;
+	size_t size;
+
+	if (metadata) {
+		size = TREE_EXTENT_RECORD_SIZE;
+		rec = record_slab_alloc(cur_shard ? &cur_shard->tree_rec_slab :
+					&tree_rec_slab);
+	} else {
+		size = DATA_EXTENT_RECORD_SIZE;
+		rec = record_slab_alloc(cur_shard ? &cur_shard->data_rec_slab :
+					&data_rec_slab);
+	}
+	if (!rec)
+		return NULL;
+	memset(rec, 0, size);
+	rec->metadata = !!metadata;
+	return rec;
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		record_slab_free(cur_shard ? &cur_shard->data_backref_slab :
+				 &data_backref_slab, back);
+	else
+		record_slab_free(cur_shard ? &cur_shard->tree_backref_slab :
+				 &tree_backref_slab, back);
+}
+
+static struct extent_record_extra *
+extent_record_extra(struct extent_record *rec)
+{
+	struct extent_record_extra *extra = rec->extra;
+
+	if (extra)
+		return extra;
+	extra = record_slab_alloc(cur_shard ? &cur_shard->extra_slab :
+				  &extra_slab);
+	if (!extra)
+		return NULL;
+	memset(extra, 0, sizeof(*extra));
+	extra->rec = rec;
+	INIT_LIST_HEAD(&extra->list);
+	INIT_LIST_HEAD(&extra->dups);
+	rec->extra = extra;
+	return extra;
+}
+
+/* the slab for arrays of @max backrefs, a power of two */
+static struct record_slab *backref_array_slab(u32 max)
+{
+	struct record_slab *slab;
+	int class = 0;
+
+	while ((BACKREF_ARRAY_MIN << class) < max)
+		class++;
+	slab = cur_shard ? &cur_shard->backref_array_slabs[class] :
+			   &backref_array_slabs[class];
+	if (!slab->size)
+		slab->size = max * sizeof(struct extent_backref *);
+	return slab;
+}
+
+static struct extent_backref **alloc_backref_array(u32 max)
+{
+	if (max > BACKREF_ARRAY_MAX)
+		return malloc(max * sizeof(struct extent_backref *));
+	return record_slab_alloc(backref_array_slab(max));
+}
+
+static void free_backref_array(struct extent_backref **backrefs, u32 max)
+{
+	if (!backrefs)
+		return;
+	if (max > BACKREF_ARRAY_MAX)
+		free(backrefs);
+	else
+		record_slab_free(backref_array_slab(max), backrefs);
+}
+
+static void free_extent_record_extra(struct extent_record_extra *extra)
+{
+	if (!extra)
+		return;
+	list_del(&extra->list);
+	record_slab_free(cur_shard ? &cur_shard->extra_slab : &extra_slab,
+			 extra);
+}
+
+/* the record on duplicate_extents or a dups list at @list */
+static struct extent_record *extent_record_entry(struct list_head *list)
+{
+	return list_entry(list, struct extent_record_extra, list)->rec;
+}
+
+static u32 nr_duplicates(struct extent_record *rec)
+{
+	return rec->extra ? rec->extra->num_duplicates : 0;
+}
+
+/* the tree block info of @rec, NULL for a data extent that has none */
+static struct tree_block_info_rec *
+find_tree_block_info(struct extent_record *rec)
+{
+	if (rec->metadata)
+		return &rec->tree.block;
+	return rec->extra ? &rec->extra->block : NULL;
+}
+
+static struct tree_block_info_rec *tree_block_info(struct extent_record *rec)
+{
+	struct extent_record_extra *extra;
+
+	if (rec->metadata)
+		return &rec->tree.block;
+	extra = extent_record_extra(rec);
+	BUG_ON(!extra);
+	return &extra->block;
+}
+
+/* the @nr-th backref of @rec in the order they were added, or NULL */
+static struct extent_backref *extent_backref_at(struct extent_record *rec,
+						u32 nr)
+{
+	if (rec->inline_ref) {
+		if (nr == 0)
+			return rec->metadata ? &rec->tree.ref.node :
+					       &rec->data.node;
+		nr--;
+	}
+	if (!rec->extra || nr >= rec->extra->nr_backrefs)
+		return NULL;
+	return rec->extra->backrefs[nr];
+}
+
+#define for_each_extent_backref(rec, back, nr)				\
+	for ((nr) = 0; ((back) = extent_backref_at(rec, nr)); (nr)++)
+
+static size_t extent_backref_size(int is_data)
+{
+	return is_data ? sizeof(struct data_backref) :
+			 sizeof(struct tree_backref);
+}
+
+/*
+ * Adds a zeroed backref to the end of the backrefs of @rec.  The first
+ * backref goes into the record if it is of the kind of the record.
+ */
+static struct extent_backref *alloc_extent_backref(struct extent_record *rec,
+						   int is_data)
+{
+	struct extent_record_extra *extra;
+	struct extent_backref **backrefs;
+	struct extent_backref *back;
+	u32 max;
+
+	if (!extent_backref_at(rec, 0) && !is_data == !!rec->metadata) {
+		rec->inline_ref = 1;
+		back = extent_backref_at(rec, 0);
+		memset(back, 0, extent_backref_size(is_data));
+		back->is_data = !!is_data;
+		return back;
+	}
+
+	extra = extent_record_extra(rec);
+	if (!extra)
+		return NULL;
+	if (extra->nr_backrefs == extra->max_backrefs) {
+		max = extra->max_backrefs ? extra->max_backrefs * 2 :
+					    BACKREF_ARRAY_MIN;
+		backrefs = alloc_backref_array(max);
+		if (!backrefs)
+			return NULL;
+		memcpy(backrefs, extra->backrefs,
+		       extra->nr_backrefs * sizeof(*backrefs));
+		free_backref_array(extra->backrefs, extra->max_backrefs);
+		extra->backrefs = backrefs;
+		extra->max_backrefs = max;
+	}
+	if (is_data)
+		back = record_slab_alloc(cur_shard ?
+					 &cur_shard->data_backref_slab :
+					 &data_backref_slab);
+	else
+		back = record_slab_alloc(cur_shard ?
+					 &cur_shard->tree_backref_slab :
+					 &tree_backref_slab);
+	if (!back)
+		return NULL;
+	memset(back, 0, extent_backref_size(is_data));
+	back->is_data = !!is_data;
+	extra->backrefs[extra->nr_backrefs++] = back;
+	return back;
+}
+
+static void free_all_extent_backrefs(struct extent_record *rec)
+{
+	struct extent_record_extra *extra = rec->extra;
+	u32 i;
+
+	rec->inline_ref = 0;
+	if (!extra)
+		return;
+	for (i = 0; i < extra->nr_backrefs; i++)
+		free_extent_backref(extra->backrefs[i]);
+	free_backref_array(extra->backrefs, extra->max_backrefs);
+	extra->backrefs = NULL;
+	extra->nr_backrefs = 0;
+	extra->max_backrefs = 0;
+}
+
+static void delete_extent_backref(struct extent_record *rec,
+				  struct extent_backref *back)
+{
+	struct extent_record_extra *extra = rec->extra;
+	u32 i;
+
+	if (rec->inline_ref && back == extent_backref_at(rec, 0)) {
+		rec->inline_ref = 0;
+		return;
+	}
+	for (i = 0; i < extra->nr_backrefs; i++) {
+		if (extra->backrefs[i] != back)
+			continue;
+		free_extent_backref(back);
+		extra->nr_backrefs--;
+		memmove(extra->backrefs + i, extra->backrefs + i + 1,
+			(extra->nr_backrefs - i) * sizeof(*extra->backrefs));
+		return;
+	}
+	BUG_ON(1);
+}
+
+/* appends the backrefs of @src to those of @dst */
+static int move_extent_backrefs(struct extent_record *dst,
+				struct extent_record *src)
+{
+	struct extent_backref *back;
+	struct extent_backref *copy;
+	u32 nr;
+
+	for_each_extent_backref(src, back, nr) {
+		copy = alloc_extent_backref(dst, back->is_data);
+		if (!copy)
+			return -ENOMEM;
+		memcpy(copy, back, extent_backref_size(back->is_data));
+	}
+	free_all_extent_backrefs(src);
+	return 0;
+}
+
+/* puts the backrefs of @src in front of those of @dst */
+static int splice_extent_backrefs(struct extent_record *dst,
+				  struct extent_record *src)
+{
+	struct extent_record tmp;
+	int ret;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.metadata = dst->metadata;
+	ret = move_extent_backrefs(&tmp, dst);
+	if (!ret)
+		ret = move_extent_backrefs(dst, src);
+	if (!ret)
+		ret = move_extent_backrefs(dst, &tmp);
+	free_all_extent_backrefs(&tmp);
+	free_extent_record_extra(tmp.extra);
+	return ret;
+}
+
+static void free_extent_record(struct extent_record *rec)
+{
+	struct extent_record_extra *extra = rec->extra;
+
+	free_all_extent_backrefs(rec);
+	free_extent_record_extra(extra);
+	if (rec->metadata)
+		record_slab_free(cur_shard ? &cur_shard->tree_rec_slab :
+				 &tree_rec_slab, rec);
+	else
+		record_slab_free(cur_shard ? &cur_shard->data_rec_slab :
+				 &data_rec_slab, rec);
+}
+
+/*
+ * Reports a problem with a record while it is built.  A shard keeps the
+ * message until extent_shards_flush(), which prints the messages of all
+ * shards in the order the updates were queued.
+ */
+static void rec_error(const char *fmt, ...)
+{
+	struct rec_msg *msg;
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	if (!cur_shard) {
+		vfprintf(stderr, fmt, args);
+		va_end(args);
+		return;
+	}
+	len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	msg = malloc(sizeof(*msg) + len + 1);
+	if (!msg)
+		return;
+	va_start(args, fmt);
+	vsnprintf(msg->text, len + 1, fmt, args);
+	va_end(args);
+	msg->seq = cur_shard->seq;
+	list_add_tail(&msg->list, &cur_shard->msgs);
+}
+
 static void record_root_in_trans(struct btrfs_trans_handle *trans,
 				 struct btrfs_root *root)
 {
@@ -323,72 +1079,72 @@ static void print_inode_error(struct btrfs_root *root, struct inode_record *rec)
 	/* reloc root errors, we print its corresponding fs root objectid*/
 	if (root_objectid == BTRFS_TREE_RELOC_OBJECTID) {
 		root_objectid = root->root_key.offset;
-		fprintf(stderr, "reloc");
+		fprintf(root_err(), "reloc");
 	}
-	fprintf(stderr, "root %llu inode %llu errors %x",
+	fprintf(root_err(), "root %llu inode %llu errors %x",
 		(unsigned long long) root_objectid,
 		(unsigned long long) rec->ino, rec->errors);
 
 	if (errors & I_ERR_NO_INODE_ITEM)
-		fprintf(stderr, ", no inode item");
+		fprintf(root_err(), ", no inode item");
 	if (errors & I_ERR_NO_ORPHAN_ITEM)
-		fprintf(stderr, ", no orphan item");
+		fprintf(root_err(), ", no orphan item");
 	if (errors & I_ERR_DUP_INODE_ITEM)
-		fprintf(stderr, ", dup inode item");
+		fprintf(root_err(), ", dup inode item");
 	if (errors & I_ERR_DUP_DIR_INDEX)
-		fprintf(stderr, ", dup dir index");
+		fprintf(root_err(), ", dup dir index");
 	if (errors & I_ERR_ODD_DIR_ITEM)
-		fprintf(stderr, ", odd dir item");
+		fprintf(root_err(), ", odd dir item");
 	if (errors & I_ERR_ODD_FILE_EXTENT)
-		fprintf(stderr, ", odd file extent");
+		fprintf(root_err(), ", odd file extent");
 	if (errors & I_ERR_BAD_FILE_EXTENT)
-		fprintf(stderr, ", bad file extent");
+		fprintf(root_err(), ", bad file extent");
 	if (errors & I_ERR_FILE_EXTENT_OVERLAP)
-		fprintf(stderr, ", file extent overlap");
+		fprintf(root_err(), ", file extent overlap");
 	if (errors & I_ERR_FILE_EXTENT_DISCOUNT)
-		fprintf(stderr, ", file extent discount");
+		fprintf(root_err(), ", file extent discount");
 	if (errors & I_ERR_DIR_ISIZE_WRONG)
-		fprintf(stderr, ", dir isize wrong");
+		fprintf(root_err(), ", dir isize wrong");
 	if (errors & I_ERR_FILE_NBYTES_WRONG)
-		fprintf(stderr, ", nbytes wrong");
+		fprintf(root_err(), ", nbytes wrong");
 	if (errors & I_ERR_ODD_CSUM_ITEM)
-		fprintf(stderr, ", odd csum item");
+		fprintf(root_err(), ", odd csum item");
 	if (errors & I_ERR_SOME_CSUM_MISSING)
-		fprintf(stderr, ", some csum missing");
+		fprintf(root_err(), ", some csum missing");
 	if (errors & I_ERR_LINK_COUNT_WRONG)
-		fprintf(stderr, ", link count wrong");
-	fprintf(stderr, "\n");
+		fprintf(root_err(), ", link count wrong");
+	fprintf(root_err(), "\n");
 }
 
 static void print_ref_error(int errors)
 {
 	if (errors & REF_ERR_NO_DIR_ITEM)
-		fprintf(stderr, ", no dir item");
+		fprintf(root_err(), ", no dir item");
 	if (errors & REF_ERR_NO_DIR_INDEX)
-		fprintf(stderr, ", no dir index");
+		fprintf(root_err(), ", no dir index");
 	if (errors & REF_ERR_NO_INODE_REF)
-		fprintf(stderr, ", no inode ref");
+		fprintf(root_err(), ", no inode ref");
 	if (errors & REF_ERR_DUP_DIR_ITEM)
-		fprintf(stderr, ", dup dir item");
+		fprintf(root_err(), ", dup dir item");
 	if (errors & REF_ERR_DUP_DIR_INDEX)
-		fprintf(stderr, ", dup dir index");
+		fprintf(root_err(), ", dup dir index");
 	if (errors & REF_ERR_DUP_INODE_REF)
-		fprintf(stderr, ", dup inode ref");
+		fprintf(root_err(), ", dup inode ref");
 	if (errors & REF_ERR_INDEX_UNMATCH)
-		fprintf(stderr, ", index unmatch");
+		fprintf(root_err(), ", index unmatch");
 	if (errors & REF_ERR_FILETYPE_UNMATCH)
-		fprintf(stderr, ", filetype unmatch");
+		fprintf(root_err(), ", filetype unmatch");
 	if (errors & REF_ERR_NAME_TOO_LONG)
-		fprintf(stderr, ", name too long");
+		fprintf(root_err(), ", name too long");
 	if (errors & REF_ERR_NO_ROOT_REF)
-		fprintf(stderr, ", no root ref");
+		fprintf(root_err(), ", no root ref");
 	if (errors & REF_ERR_NO_ROOT_BACKREF)
-		fprintf(stderr, ", no root backref");
+		fprintf(root_err(), ", no root backref");
 	if (errors & REF_ERR_DUP_ROOT_REF)
-		fprintf(stderr, ", dup root ref");
+		fprintf(root_err(), ", dup root ref");
 	if (errors & REF_ERR_DUP_ROOT_BACKREF)
-		fprintf(stderr, ", dup root backref");
-	fprintf(stderr, "\n");
+		fprintf(root_err(), ", dup root backref");
+	fprintf(root_err(), "\n");
 }
 
 static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
@@ -714,19 +1470,46 @@ static int merge_inode_recs(struct inode_record *src, struct inode_record *dst,
 	return 0;
 }
 
+/*
+ * Drop the reference of a tree on @node, with shared_node_mutex held when
+ * several threads walk.  The last reference takes the node out of the cache
+ * and waits for the threads still copying records out of it, the caller
+ * owns the node then and 1 is returned.  Otherwise @copy registers the
+ * caller as one more of those.
+ */
+static int put_shared_node(struct walk_control *wc, struct shared_node *node,
+			   int copy)
+{
+	node->done = 1;
+	if (fs_root_threads)
+		pthread_cond_broadcast(&shared_node_cond);
+	if (--node->refs == 0) {
+		remove_cache_extent(wc->shared, &node->cache);
+		while (node->readers)
+			pthread_cond_wait(&shared_node_cond,
+					  &shared_node_mutex);
+		return 1;
+	}
+	if (copy && fs_root_threads)
+		node->readers++;
+	return 0;
+}
+
+/*
+ * Add the records of @src_node to @dst_node.  With @splice the records are
+ * moved and @src_node is freed, else they are copied.  Threads don't share
+ * inode records, the copies are real ones then.
+ */
 static int splice_shared_node(struct shared_node *src_node,
-			      struct shared_node *dst_node)
+			      struct shared_node *dst_node, int splice)
 {
 	struct cache_extent *cache;
 	struct ptr_node *node, *ins;
 	struct cache_tree *src, *dst;
 	struct inode_record *rec, *conflict;
 	u64 current_ino = 0;
-	int splice = 0;
 	int ret;
 
-	if (--src_node->refs == 0)
-		splice = 1;
 	if (src_node->current)
 		current_ino = src_node->current->ino;
 
@@ -746,8 +1529,12 @@ again:
 			ins = malloc(sizeof(*ins));
 			ins->cache.start = node->cache.start;
 			ins->cache.size = node->cache.size;
-			ins->data = rec;
-			rec->refs++;
+			if (fs_root_threads) {
+				ins->data = clone_inode_rec(rec);
+			} else {
+				ins->data = rec;
+				rec->refs++;
+			}
 		}
 		ret = insert_cache_extent(dst, &ins->cache);
 		if (ret == -EEXIST) {
@@ -759,7 +1546,7 @@ again:
 					dst_node->current = NULL;
 			}
 			maybe_free_inode_rec(dst, conflict);
-			free_inode_rec(rec);
+			free_inode_rec(ins->data);
 			free(ins);
 		} else {
 			BUG_ON(ret);
@@ -780,6 +1567,15 @@ again:
 		}
 		dst_node->current = get_inode_rec(dst, current_ino, 1);
 	}
+
+	if (splice) {
+		free(src_node);
+	} else if (fs_root_threads) {
+		pthread_mutex_lock(&shared_node_mutex);
+		if (--src_node->readers == 0)
+			pthread_cond_broadcast(&shared_node_cond);
+		pthread_mutex_unlock(&shared_node_mutex);
+	}
 	return 0;
 }
 
@@ -796,6 +1592,13 @@ static void free_inode_ptr(struct cache_extent *cache)
 
 FREE_EXTENT_CACHE_BASED_TREE(inode_recs, free_inode_ptr);
 
+static void free_shared_node(struct shared_node *node)
+{
+	free_inode_recs_tree(&node->root_cache);
+	free_inode_recs_tree(&node->inode_cache);
+	free(node);
+}
+
 static struct shared_node *find_shared_node(struct cache_tree *shared,
 					    u64 bytenr)
 {
@@ -827,20 +1630,56 @@ static int add_shared_node(struct cache_tree *shared, u64 bytenr, u32 refs)
 	return 0;
 }
 
+/*
+ * With several threads a shared node in the cache may still be walked by
+ * another thread, wait for that to finish.  Returns the node, NULL if there
+ * is none or ERR_PTR(-ELOOP) if the walks would end up waiting for each
+ * other, which takes a loop in the trees.
+ */
+static struct shared_node *wait_shared_node(struct walk_control *wc,
+					    u64 bytenr)
+{
+	struct shared_node *node;
+	struct shared_node *busy;
+
+	node = find_shared_node(wc->shared, bytenr);
+	while (fs_root_threads && node && !node->done) {
+		for (busy = node; busy && !busy->done;
+		     busy = busy->walker->waiting) {
+			if (busy->walker == wc)
+				return ERR_PTR(-ELOOP);
+		}
+		wc->waiting = node;
+		pthread_cond_wait(&shared_node_cond, &shared_node_mutex);
+		wc->waiting = NULL;
+		node = find_shared_node(wc->shared, bytenr);
+	}
+	return node;
+}
+
 static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 			     struct walk_control *wc, int level)
 {
 	struct shared_node *node;
 	struct shared_node *dest;
+	int last;
 
 	if (level == wc->active_node)
 		return 0;
 
 	BUG_ON(wc->active_node <= level);
-	node = find_shared_node(&wc->shared, bytenr);
+	lock_shared_nodes();
+	node = wait_shared_node(wc, bytenr);
+	if (IS_ERR(node)) {
+		wc->looped = 1;
+		unlock_shared_nodes();
+		return 1;
+	}
 	if (!node) {
-		add_shared_node(&wc->shared, bytenr, refs);
-		node = find_shared_node(&wc->shared, bytenr);
+		add_shared_node(wc->shared, bytenr, refs);
+		node = find_shared_node(wc->shared, bytenr);
+		node->walker = wc;
+		unlock_shared_nodes();
 		wc->nodes[level] = node;
 		wc->active_node = level;
 		return 0;
@@ -848,21 +1687,17 @@ static int enter_shared_node(struct btrfs_root *root, u64 bytenr, u32 refs,
 
 	if (wc->root_level == wc->active_node &&
 	    btrfs_root_refs(&root->root_item) == 0) {
-		if (--node->refs == 0) {
-			free_inode_recs_tree(&node->root_cache);
-			free_inode_recs_tree(&node->inode_cache);
-			remove_cache_extent(&wc->shared, &node->cache);
-			free(node);
-		}
+		last = put_shared_node(wc, node, 0);
+		unlock_shared_nodes();
+		if (last)
+			free_shared_node(node);
 		return 1;
 	}
 
+	last = put_shared_node(wc, node, 1);
+	unlock_shared_nodes();
 	dest = wc->nodes[wc->active_node];
-	splice_shared_node(node, dest);
-	if (node->refs == 0) {
-		remove_cache_extent(&wc->shared, &node->cache);
-		free(node);
-	}
+	splice_shared_node(node, dest, last);
 	return 1;
 }
 
@@ -871,6 +1706,7 @@ static int leave_shared_node(struct btrfs_root *root,
 {
 	struct shared_node *node;
 	struct shared_node *dest;
+	int last;
 	int i;
 
 	if (level == wc->root_level)
@@ -886,14 +1722,21 @@ static int leave_shared_node(struct btrfs_root *root,
 	wc->nodes[wc->active_node] = NULL;
 	wc->active_node = i;
 
+	/* put_shared_node() marks the node done for the waiting threads */
 	dest = wc->nodes[wc->active_node];
+	lock_shared_nodes();
 	if (wc->active_node < wc->root_level ||
 	    btrfs_root_refs(&root->root_item) > 0) {
-		BUG_ON(node->refs <= 1);
-		splice_shared_node(node, dest);
+		BUG_ON(!fs_root_threads && node->refs <= 1);
+		last = put_shared_node(wc, node, 1);
+		unlock_shared_nodes();
+		splice_shared_node(node, dest, last);
 	} else {
-		BUG_ON(node->refs < 2);
-		node->refs--;
+		BUG_ON(!fs_root_threads && node->refs < 2);
+		last = put_shared_node(wc, node, 0);
+		unlock_shared_nodes();
+		if (last)
+			free_shared_node(node);
 	}
 	return 0;
 }
@@ -1020,7 +1863,7 @@ static int process_dir_item(struct btrfs_root *root,
 					  namebuf, len, filetype,
 					  key->type, error);
 		} else {
-			fprintf(stderr, "invalid location in dir item %u\n",
+			fprintf(root_err(), "invalid location in dir item %u\n",
 				location.type);
 			add_inode_backref(inode_cache, BTRFS_MULTIPLE_OBJECTIDS,
 					  key->objectid, key->offset, namebuf,
@@ -1257,7 +2100,9 @@ static int process_file_extent(struct btrfs_root *root,
 		else
 			disk_bytenr += extent_offset;
 
+		lock_fs_trees(root->fs_info);
 		ret = count_csum_range(root, disk_bytenr, num_bytes, &found);
+		unlock_fs_trees();
 		if (ret < 0)
 			return ret;
 		if (extent_type == BTRFS_FILE_EXTENT_REG) {
@@ -1333,9 +2178,17 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	return ret;
 }
 
+/*
+ * Read ahead the remaining children of @node from @slot on.  Children that
+ * are already in the shared node cache were checked as part of an earlier
+ * snapshot and are only spliced, not walked, so they are not read again.
+ */
 static void reada_walk_down(struct btrfs_root *root,
-			    struct extent_buffer *node, int slot)
+			    struct extent_buffer *node, int slot,
+			    struct walk_control *wc)
 {
+	struct btrfs_reada_block *blocks;
+	int nr_blocks = 0;
 	u64 bytenr;
 	u64 ptr_gen;
 	u32 nritems;
@@ -1344,15 +2197,34 @@ static void reada_walk_down(struct btrfs_root *root,
 	int level;
 
 	level = btrfs_header_level(node);
-	if (level != 1)
+	if (level < 1)
 		return;
 
 	nritems = btrfs_header_nritems(node);
 	blocksize = btrfs_level_size(root, level - 1);
+	if (slot >= nritems)
+		return;
+
+	blocks = malloc((nritems - slot) * sizeof(*blocks));
+	lock_shared_nodes();
 	for (i = slot; i < nritems; i++) {
 		bytenr = btrfs_node_blockptr(node, i);
 		ptr_gen = btrfs_node_ptr_generation(node, i);
-		readahead_tree_block(root, bytenr, blocksize, ptr_gen);
+		if (i != slot && find_shared_node(wc->shared, bytenr))
+			continue;
+		if (!blocks) {
+			readahead_tree_block(root, bytenr, blocksize, ptr_gen);
+			continue;
+		}
+		blocks[nr_blocks].bytenr = bytenr;
+		blocks[nr_blocks].blocksize = blocksize;
+		blocks[nr_blocks].parent_transid = ptr_gen;
+		nr_blocks++;
+	}
+	unlock_shared_nodes();
+	if (blocks) {
+		readahead_tree_blocks(root, blocks, nr_blocks);
+		free(blocks);
 	}
 }
 
@@ -1385,21 +2257,21 @@ static int check_child_node(struct btrfs_root *root,
 
 	if (memcmp(&parent_key, &child_key, sizeof(parent_key))) {
 		ret = -EINVAL;
-		fprintf(stderr,
+		fprintf(root_err(),
 			"Wrong key of child node/leaf, wanted: (%llu, %u, %llu), have: (%llu, %u, %llu)\n",
 			parent_key.objectid, parent_key.type, parent_key.offset,
 			child_key.objectid, child_key.type, child_key.offset);
 	}
 	if (btrfs_header_bytenr(child) != btrfs_node_blockptr(parent, slot)) {
 		ret = -EINVAL;
-		fprintf(stderr, "Wrong block of child node/leaf, wanted: %llu, have: %llu\n",
+		fprintf(root_err(), "Wrong block of child node/leaf, wanted: %llu, have: %llu\n",
 			btrfs_node_blockptr(parent, slot),
 			btrfs_header_bytenr(child));
 	}
 	if (btrfs_node_ptr_generation(parent, slot) !=
 	    btrfs_header_generation(child)) {
 		ret = -EINVAL;
-		fprintf(stderr, "Wrong generation of child node/leaf, wanted: %llu, have: %llu\n",
+		fprintf(root_err(), "Wrong generation of child node/leaf, wanted: %llu, have: %llu\n",
 			btrfs_header_generation(child),
 			btrfs_node_ptr_generation(parent, slot));
 	}
@@ -1420,9 +2292,11 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 
 	WARN_ON(*level < 0);
 	WARN_ON(*level >= BTRFS_MAX_LEVEL);
+	lock_fs_trees(root->fs_info);
 	ret = btrfs_lookup_extent_info(NULL, root,
 				       path->nodes[*level]->start,
 				       *level, 1, &refs, NULL);
+	unlock_fs_trees();
 	if (ret < 0) {
 		err = ret;
 		goto out;
@@ -1456,8 +2330,10 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		bytenr = btrfs_node_blockptr(cur, path->slots[*level]);
 		ptr_gen = btrfs_node_ptr_generation(cur, path->slots[*level]);
 		blocksize = btrfs_level_size(root, *level - 1);
+		lock_fs_trees(root->fs_info);
 		ret = btrfs_lookup_extent_info(NULL, root, bytenr, *level - 1,
 					       1, &refs, NULL);
+		unlock_fs_trees();
 		if (ret < 0)
 			refs = 0;
 
@@ -1470,10 +2346,11 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			}
 		}
 
+		lock_fs_trees(root->fs_info);
 		next = btrfs_find_tree_block(root, bytenr, blocksize);
 		if (!next || !btrfs_buffer_uptodate(next, ptr_gen)) {
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			reada_walk_down(root, cur, path->slots[*level], wc);
 			next = read_tree_block(root, bytenr, blocksize,
 					       ptr_gen);
 			if (!next) {
@@ -1486,6 +2363,7 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 						&node_key,
 						path->nodes[*level]->start,
 						root->leafsize, *level);
+				unlock_fs_trees();
 				err = -EIO;
 				goto out;
 			}
@@ -1493,6 +2371,7 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 
 		ret = check_child_node(root, cur, path->slots[*level], next);
 		if (ret) {
+			unlock_fs_trees();
 			err = ret;
 			goto out;
 		}
@@ -1503,12 +2382,14 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			status = btrfs_check_node(root, NULL, next);
 		if (status != BTRFS_TREE_BLOCK_CLEAN) {
 			free_extent_buffer(next);
+			unlock_fs_trees();
 			err = -EIO;
 			goto out;
 		}
 
 		*level = *level - 1;
 		free_extent_buffer(path->nodes[*level]);
+		unlock_fs_trees();
 		path->nodes[*level] = next;
 		path->slots[*level] = 0;
 	}
@@ -1530,7 +2411,9 @@ static int walk_up_tree(struct btrfs_root *root, struct btrfs_path *path,
 			*level = i;
 			return 0;
 		} else {
+			lock_fs_trees(root->fs_info);
 			free_extent_buffer(path->nodes[*level]);
+			unlock_fs_trees();
 			path->nodes[*level] = NULL;
 			BUG_ON(*level > wc->active_node);
 			if (*level == wc->active_node)
@@ -2313,7 +3196,7 @@ static int check_inode_recs(struct btrfs_root *root,
 
 	if (btrfs_root_refs(&root->root_item) == 0) {
 		if (!cache_tree_empty(inode_cache))
-			fprintf(stderr, "warning line %d\n", __LINE__);
+			fprintf(root_err(), "warning line %d\n", __LINE__);
 		return 0;
 	}
 
@@ -2387,7 +3270,7 @@ static int check_inode_recs(struct btrfs_root *root,
 	if (rec) {
 		ret = check_root_dir(rec);
 		if (ret) {
-			fprintf(stderr, "root %llu root dir %llu error\n",
+			fprintf(root_err(), "root %llu root dir %llu error\n",
 				(unsigned long long)root->root_key.objectid,
 				(unsigned long long)root_dirid);
 			print_inode_error(root, rec);
@@ -2403,7 +3286,7 @@ static int check_inode_recs(struct btrfs_root *root,
 				return err;
 			}
 
-			fprintf(stderr,
+			fprintf(root_err(),
 				"root %llu missing its root dir, recreating\n",
 				(unsigned long long)root->objectid);
 
@@ -2414,7 +3297,7 @@ static int check_inode_recs(struct btrfs_root *root,
 			return -EAGAIN;
 		}
 
-		fprintf(stderr, "root %llu root dir %llu not found\n",
+		fprintf(root_err(), "root %llu root dir %llu not found\n",
 			(unsigned long long)root->root_key.objectid,
 			(unsigned long long)root_dirid);
 	}
@@ -2434,7 +3317,9 @@ static int check_inode_recs(struct btrfs_root *root,
 		}
 
 		if (rec->errors & I_ERR_NO_ORPHAN_ITEM) {
+			lock_fs_trees(root->fs_info);
 			ret = check_orphan_item(root, rec->ino);
+			unlock_fs_trees();
 			if (ret == 0)
 				rec->errors &= ~I_ERR_NO_ORPHAN_ITEM;
 			if (can_free_inode_rec(rec)) {
@@ -2466,7 +3351,7 @@ static int check_inode_recs(struct btrfs_root *root,
 				backref->errors |= REF_ERR_NO_DIR_INDEX;
 			if (!backref->found_inode_ref)
 				backref->errors |= REF_ERR_NO_INODE_REF;
-			fprintf(stderr, "\tunresolved ref dir %llu index %llu"
+			fprintf(root_err(), "\tunresolved ref dir %llu index %llu"
 				" namelen %u name %s filetype %d errors %x",
 				(unsigned long long)backref->dir,
 				(unsigned long long)backref->index,
@@ -2619,7 +3504,9 @@ static int merge_root_recs(struct btrfs_root *root,
 		remove_cache_extent(src_cache, &node->cache);
 		free(node);
 
+		lock_fs_trees(root->fs_info);
 		ret = is_child_root(root, root->objectid, rec->ino);
+		unlock_fs_trees();
 		if (ret < 0)
 			break;
 		else if (ret == 0)
@@ -2761,40 +3648,60 @@ static int check_root_refs(struct btrfs_root *root,
 	return errors > 0 ? 1 : 0;
 }
 
-static int process_root_ref(struct extent_buffer *eb, int slot,
-			    struct btrfs_key *key,
-			    struct cache_tree *root_cache)
-{
+/* a root ref or backref item as add_root_ref() needs it */
+struct root_ref_info {
 	u64 dirid;
 	u64 index;
 	u32 len;
+	int error;
+	char name[BTRFS_NAME_LEN];
+};
+
+static void read_root_ref(struct extent_buffer *eb, int slot,
+			  struct root_ref_info *info)
+{
 	u32 name_len;
 	struct btrfs_root_ref *ref;
-	char namebuf[BTRFS_NAME_LEN];
-	int error;
 
 	ref = btrfs_item_ptr(eb, slot, struct btrfs_root_ref);
 
-	dirid = btrfs_root_ref_dirid(eb, ref);
-	index = btrfs_root_ref_sequence(eb, ref);
+	info->dirid = btrfs_root_ref_dirid(eb, ref);
+	info->index = btrfs_root_ref_sequence(eb, ref);
 	name_len = btrfs_root_ref_name_len(eb, ref);
 
 	if (name_len <= BTRFS_NAME_LEN) {
-		len = name_len;
-		error = 0;
+		info->len = name_len;
+		info->error = 0;
 	} else {
-		len = BTRFS_NAME_LEN;
-		error = REF_ERR_NAME_TOO_LONG;
+		info->len = BTRFS_NAME_LEN;
+		info->error = REF_ERR_NAME_TOO_LONG;
 	}
-	read_extent_buffer(eb, namebuf, (unsigned long)(ref + 1), len);
+	read_extent_buffer(eb, info->name, (unsigned long)(ref + 1),
+			   info->len);
+}
 
+static void add_root_ref(struct cache_tree *root_cache, struct btrfs_key *key,
+			 struct root_ref_info *info)
+{
 	if (key->type == BTRFS_ROOT_REF_KEY) {
-		add_root_backref(root_cache, key->offset, key->objectid, dirid,
-				 index, namebuf, len, key->type, error);
+		add_root_backref(root_cache, key->offset, key->objectid,
+				 info->dirid, info->index, info->name,
+				 info->len, key->type, info->error);
 	} else {
-		add_root_backref(root_cache, key->objectid, key->offset, dirid,
-				 index, namebuf, len, key->type, error);
+		add_root_backref(root_cache, key->objectid, key->offset,
+				 info->dirid, info->index, info->name,
+				 info->len, key->type, info->error);
 	}
+}
+
+static int process_root_ref(struct extent_buffer *eb, int slot,
+			    struct btrfs_key *key,
+			    struct cache_tree *root_cache)
+{
+	struct root_ref_info info;
+
+	read_root_ref(eb, slot, &info);
+	add_root_ref(root_cache, key, &info);
 	return 0;
 }
 
@@ -2900,54 +3807,44 @@ out_free_path:
 	return ret;
 }
 
-static int check_fs_root(struct btrfs_root *root,
-			 struct cache_tree *root_cache,
-			 struct walk_control *wc)
+static int check_root_block(struct btrfs_root *root)
+{
+	enum btrfs_tree_block_status status;
+
+	lock_fs_trees(root->fs_info);
+	if (btrfs_is_leaf(root->node))
+		status = btrfs_check_leaf(root, NULL, root->node);
+	else
+		status = btrfs_check_node(root, NULL, root->node);
+	unlock_fs_trees();
+	if (status != BTRFS_TREE_BLOCK_CLEAN)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Walk the tree of @root, its inode and subvolume records end up in
+ * @root_node.
+ */
+static int walk_fs_root(struct btrfs_root *root, struct walk_control *wc,
+			struct shared_node *root_node)
 {
 	int ret = 0;
-	int err = 0;
 	int wret;
 	int level;
+	int i;
 	struct btrfs_path path;
-	struct shared_node root_node;
-	struct root_record *rec;
+	struct shared_node *node;
 	struct btrfs_root_item *root_item = &root->root_item;
-	struct cache_tree corrupt_blocks;
-	enum btrfs_tree_block_status status;
-
-	/*
-	 * Reuse the corrupt_block cache tree to record corrupted tree block
-	 *
-	 * Unlike the usage in extent tree check, here we do it in a per
-	 * fs/subvol tree base.
-	 */
-	cache_tree_init(&corrupt_blocks);
-	root->fs_info->corrupt_blocks = &corrupt_blocks;
-	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
-		rec = get_root_rec(root_cache, root->root_key.objectid);
-		if (btrfs_root_refs(root_item) > 0)
-			rec->found_root_item = 1;
-	}
 
 	btrfs_init_path(&path);
-	memset(&root_node, 0, sizeof(root_node));
-	cache_tree_init(&root_node.root_cache);
-	cache_tree_init(&root_node.inode_cache);
-
 	level = btrfs_header_level(root->node);
 	memset(wc->nodes, 0, sizeof(wc->nodes));
-	wc->nodes[level] = &root_node;
+	wc->nodes[level] = root_node;
 	wc->active_node = level;
 	wc->root_level = level;
 
-	/* We may not have checked the root block, lets do that now */
-	if (btrfs_is_leaf(root->node))
-		status = btrfs_check_leaf(root, NULL, root->node);
-	else
-		status = btrfs_check_node(root, NULL, root->node);
-	if (status != BTRFS_TREE_BLOCK_CLEAN)
-		return -EIO;
-
+	lock_fs_trees(root->fs_info);
 	if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
@@ -2961,13 +3858,16 @@ static int check_fs_root(struct btrfs_root *root,
 		level = root_item->drop_level;
 		path.lowest_level = level;
 		wret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
-		if (wret < 0)
+		if (wret < 0) {
+			unlock_fs_trees();
 			goto skip_walking;
+		}
 		btrfs_node_key(path.nodes[level], &found_key,
 				path.slots[level]);
 		WARN_ON(memcmp(&found_key, &root_item->drop_progress,
 					sizeof(found_key)));
 	}
+	unlock_fs_trees();
 
 	while (1) {
 		wret = walk_down_tree(root, &path, wc, &level);
@@ -2983,25 +3883,92 @@ static int check_fs_root(struct btrfs_root *root,
 			break;
 	}
 skip_walking:
+	lock_fs_trees(root->fs_info);
 	btrfs_release_path(&path);
+	unlock_fs_trees();
+
+	/* nobody may wait for the shared nodes a failed walk left behind */
+	lock_shared_nodes();
+	for (i = 0; i < BTRFS_MAX_LEVEL; i++) {
+		node = wc->nodes[i];
+		if (node && node->walker == wc)
+			node->done = 1;
+	}
+	if (fs_root_threads)
+		pthread_cond_broadcast(&shared_node_cond);
+	unlock_shared_nodes();
+	return ret;
+}
+
+static void print_corrupt_blocks(struct btrfs_root *root,
+				 struct cache_tree *corrupt_blocks)
+{
+	struct cache_extent *cache;
+	struct btrfs_corrupt_block *corrupt;
+
+	printf("The following tree block(s) is corrupted in tree %llu:\n",
+	       root->root_key.objectid);
+	cache = first_cache_extent(corrupt_blocks);
+	while (cache) {
+		corrupt = container_of(cache, struct btrfs_corrupt_block,
+				       cache);
+		printf("\ttree block bytenr: %llu, level: %d, node key: (%llu, %u, %llu)\n",
+		       cache->start, corrupt->level,
+		       corrupt->key.objectid, corrupt->key.type,
+		       corrupt->key.offset);
+		cache = next_cache_extent(cache);
+	}
+}
+
+static int check_root_inodes(struct btrfs_root *root,
+			     struct shared_node *root_node)
+{
+	if (root_node->current) {
+		root_node->current->checked = 1;
+		maybe_free_inode_rec(&root_node->inode_cache,
+				root_node->current);
+	}
+
+	return check_inode_recs(root, &root_node->inode_cache);
+}
+
+static int check_fs_root(struct btrfs_root *root,
+			 struct cache_tree *root_cache,
+			 struct walk_control *wc)
+{
+	int ret = 0;
+	int err = 0;
+	struct shared_node root_node;
+	struct root_record *rec;
+	struct btrfs_root_item *root_item = &root->root_item;
+	struct cache_tree corrupt_blocks;
+
+	/*
+	 * Reuse the corrupt_block cache tree to record corrupted tree block
+	 *
+	 * Unlike the usage in extent tree check, here we do it in a per
+	 * fs/subvol tree base.
+	 */
+	cache_tree_init(&corrupt_blocks);
+	root->fs_info->corrupt_blocks = &corrupt_blocks;
+	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
+		rec = get_root_rec(root_cache, root->root_key.objectid);
+		if (btrfs_root_refs(root_item) > 0)
+			rec->found_root_item = 1;
+	}
+
+	memset(&root_node, 0, sizeof(root_node));
+	cache_tree_init(&root_node.root_cache);
+	cache_tree_init(&root_node.inode_cache);
+
+	/* We may not have checked the root block, lets do that now */
+	if (check_root_block(root))
+		return -EIO;
+
+	ret = walk_fs_root(root, wc, &root_node);
 
 	if (!cache_tree_empty(&corrupt_blocks)) {
-		struct cache_extent *cache;
-		struct btrfs_corrupt_block *corrupt;
-
-		printf("The following tree block(s) is corrupted in tree %llu:\n",
-		       root->root_key.objectid);
-		cache = first_cache_extent(&corrupt_blocks);
-		while (cache) {
-			corrupt = container_of(cache,
-					       struct btrfs_corrupt_block,
-					       cache);
-			printf("\ttree block bytenr: %llu, level: %d, node key: (%llu, %u, %llu)\n",
-			       cache->start, corrupt->level,
-			       corrupt->key.objectid, corrupt->key.type,
-			       corrupt->key.offset);
-			cache = next_cache_extent(cache);
-		}
+		print_corrupt_blocks(root, &corrupt_blocks);
 		if (repair) {
 			printf("Try to repair the btree for root %llu\n",
 			       root->root_key.objectid);
@@ -3019,13 +3986,7 @@ skip_walking:
 	if (err < 0)
 		ret = err;
 
-	if (root_node.current) {
-		root_node.current->checked = 1;
-		maybe_free_inode_rec(&root_node.inode_cache,
-				root_node.current);
-	}
-
-	err = check_inode_recs(root, &root_node.inode_cache);
+	err = check_root_inodes(root, &root_node);
 	if (!ret)
 		ret = err;
 
@@ -3042,12 +4003,351 @@ static int fs_root_objectid(u64 objectid)
 	return is_fstree(objectid);
 }
 
+/*
+ * Checking fs roots on several threads.
+ *
+ * The main thread goes through the root tree as check_fs_roots() does and
+ * queues a job for every fs root and root ref.  The workers walk the roots
+ * and check their inodes, everything that goes into the shared root cache
+ * is kept in the job.  Once all roots are checked the jobs are committed
+ * in the order of the root tree: the messages of the walk are printed, the
+ * corrupted blocks listed, the subvolume records merged into the root cache
+ * and then the messages of the inode check printed, which is the output of
+ * the single threaded check.
+ *
+ * Snapshots share tree blocks.  The first walk to reach a shared block
+ * fills its shared node, the others wait for that to finish and copy the
+ * records, see wait_shared_node().  Which walk that is doesn't matter as
+ * long as the walk goes fine.  When it doesn't, the single threaded check
+ * reports the problem with the first root in root tree order and that root
+ * is left incomplete, so as soon as any walk runs into trouble the threads
+ * stop, all results are dropped and the roots are checked again one after
+ * the other.
+ */
+struct fs_root_job {
+	struct list_head list;
+	struct list_head queue;
+	struct btrfs_key key;
+	/* the root to check, or NULL for a root ref */
+	struct btrfs_root *root;
+	struct root_ref_info ref;
+
+	struct shared_node root_node;
+	struct cache_tree corrupt_blocks;
+	char *log;
+	size_t log_size;
+	size_t walk_log_len;
+	int walk_ret;
+	int check_ret;
+	int trouble;
+	int done;
+};
+
+struct fs_root_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	/* all jobs in root tree order, only used by the main thread */
+	struct list_head jobs;
+	/* jobs no worker has taken yet */
+	struct list_head queue;
+	struct cache_tree *shared;
+	int abort;
+	int stop;
+};
+
+static void run_fs_root_job(struct fs_root_job *job, struct walk_control *wc)
+{
+	struct btrfs_root *root = job->root;
+	FILE *log;
+
+	memset(&job->root_node, 0, sizeof(job->root_node));
+	cache_tree_init(&job->root_node.root_cache);
+	cache_tree_init(&job->root_node.inode_cache);
+	cache_tree_init(&job->corrupt_blocks);
+	cur_corrupt_blocks = &job->corrupt_blocks;
+	log = open_memstream(&job->log, &job->log_size);
+	cur_root_log = log;
+	wc->looped = 0;
+
+	job->walk_ret = check_root_block(root);
+	if (!job->walk_ret)
+		job->walk_ret = walk_fs_root(root, wc, &job->root_node);
+	if (log)
+		fflush(log);
+	job->walk_log_len = job->log_size;
+	job->trouble = job->walk_ret || wc->looped || !log ||
+		job->walk_log_len || !cache_tree_empty(&job->corrupt_blocks);
+	if (!job->trouble)
+		job->check_ret = check_root_inodes(root, &job->root_node);
+
+	cur_root_log = NULL;
+	cur_corrupt_blocks = NULL;
+	if (log)
+		fclose(log);
+}
+
+static int commit_fs_root_job(struct fs_root_job *job,
+			      struct cache_tree *root_cache)
+{
+	struct btrfs_root *root = job->root;
+	struct root_record *rec;
+	int ret;
+
+	if (!root) {
+		add_root_ref(root_cache, &job->key, &job->ref);
+		return 0;
+	}
+
+	if (root->root_key.objectid != BTRFS_TREE_RELOC_OBJECTID) {
+		rec = get_root_rec(root_cache, root->root_key.objectid);
+		if (btrfs_root_refs(&root->root_item) > 0)
+			rec->found_root_item = 1;
+	}
+
+	ret = merge_root_recs(root, &job->root_node.root_cache, root_cache);
+	if (ret >= 0)
+		ret = job->check_ret;
+	fwrite(job->log, 1, job->log_size, stderr);
+	return ret;
+}
+
+/* free what the job holds, the root and root ref are left alone */
+static void free_fs_root_job(struct fs_root_job *job)
+{
+	if (job->root) {
+		free_inode_recs_tree(&job->root_node.root_cache);
+		free_inode_recs_tree(&job->root_node.inode_cache);
+		free_corrupt_blocks_tree(&job->corrupt_blocks);
+		if (job->root->root_key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+			btrfs_free_fs_root(job->root);
+	}
+	free(job->log);
+	free(job);
+}
+
+static void *fs_root_worker(void *data)
+{
+	struct fs_root_pool *pool = data;
+	struct fs_root_job *job;
+	struct walk_control wc;
+
+	memset(&wc, 0, sizeof(wc));
+	wc.shared = pool->shared;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->stop && list_empty(&pool->queue))
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (list_empty(&pool->queue))
+			break;
+		job = list_entry(pool->queue.next, struct fs_root_job, queue);
+		list_del_init(&job->queue);
+		if (!pool->abort) {
+			pthread_mutex_unlock(&pool->mutex);
+			run_fs_root_job(job, &wc);
+			pthread_mutex_lock(&pool->mutex);
+			if (job->trouble)
+				pool->abort = 1;
+		}
+		job->done = 1;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static void add_fs_root_job(struct fs_root_pool *pool,
+			    struct fs_root_job *job)
+{
+	list_add_tail(&job->list, &pool->jobs);
+	if (!job->root)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	list_add_tail(&job->queue, &pool->queue);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static int start_fs_root_pool(struct fs_root_pool *pool, int nr_threads)
+{
+	int i;
+
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads)
+		return -ENOMEM;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	INIT_LIST_HEAD(&pool->jobs);
+	INIT_LIST_HEAD(&pool->queue);
+
+	fs_root_threads = nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, fs_root_worker,
+				   pool))
+			break;
+		pool->nr_threads++;
+	}
+	if (pool->nr_threads)
+		return 0;
+
+	fs_root_threads = 0;
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	return -EAGAIN;
+}
+
+/* wait for the queued jobs and stop the workers */
+static void stop_fs_root_pool(struct fs_root_pool *pool)
+{
+	struct fs_root_job *job;
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	list_for_each_entry(job, &pool->jobs, list) {
+		while (job->root && !job->done)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	fs_root_threads = 0;
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+}
+
+static void free_shared_nodes(struct cache_tree *shared)
+{
+	struct cache_extent *cache;
+
+	while ((cache = search_cache_extent(shared, 0))) {
+		remove_cache_extent(shared, cache);
+		free_shared_node(container_of(cache, struct shared_node,
+					      cache));
+	}
+}
+
+/*
+ * Returns -EAGAIN if the roots have to be checked by check_fs_roots()
+ * itself, nothing was added to @root_cache then.
+ */
+static int check_fs_roots_threaded(struct btrfs_fs_info *info,
+				   struct cache_tree *root_cache,
+				   struct cache_tree *shared, int nr_threads)
+{
+	struct fs_root_pool pool;
+	struct fs_root_job *job;
+	struct btrfs_path path;
+	struct btrfs_key key;
+	struct extent_buffer *leaf;
+	struct btrfs_root *tmp_root;
+	struct btrfs_root *tree_root = info->tree_root;
+	int ret;
+	int err = 0;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.shared = shared;
+	if (start_fs_root_pool(&pool, nr_threads))
+		return -EAGAIN;
+
+	btrfs_init_path(&path);
+	key.offset = 0;
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	lock_fs_trees(info);
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	unlock_fs_trees();
+	if (ret < 0) {
+		err = 1;
+		goto out;
+	}
+	while (1) {
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			lock_fs_trees(info);
+			ret = btrfs_next_leaf(tree_root, &path);
+			unlock_fs_trees();
+			if (ret) {
+				if (ret < 0)
+					err = 1;
+				break;
+			}
+			leaf = path.nodes[0];
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.type == BTRFS_ROOT_ITEM_KEY &&
+		    fs_root_objectid(key.objectid)) {
+			lock_fs_trees(info);
+			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID) {
+				tmp_root = btrfs_read_fs_root_no_cache(info,
+								       &key);
+			} else {
+				key.offset = (u64)-1;
+				tmp_root = btrfs_read_fs_root(info, &key);
+			}
+			unlock_fs_trees();
+			if (IS_ERR(tmp_root)) {
+				pool.abort = 1;
+				break;
+			}
+			job = calloc(1, sizeof(*job));
+			if (!job) {
+				if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
+					btrfs_free_fs_root(tmp_root);
+				pool.abort = 1;
+				break;
+			}
+			job->root = tmp_root;
+			add_fs_root_job(&pool, job);
+		} else if (key.type == BTRFS_ROOT_REF_KEY ||
+			   key.type == BTRFS_ROOT_BACKREF_KEY) {
+			job = calloc(1, sizeof(*job));
+			if (!job) {
+				pool.abort = 1;
+				break;
+			}
+			job->key = key;
+			read_root_ref(leaf, path.slots[0], &job->ref);
+			add_fs_root_job(&pool, job);
+		}
+		path.slots[0]++;
+	}
+out:
+	stop_fs_root_pool(&pool);
+	btrfs_release_path(&path);
+	info->corrupt_blocks = NULL;
+
+	while (!list_empty(&pool.jobs)) {
+		job = list_entry(pool.jobs.next, struct fs_root_job, list);
+		list_del(&job->list);
+		if (!pool.abort && commit_fs_root_job(job, root_cache))
+			err = 1;
+		free_fs_root_job(job);
+	}
+	if (pool.abort) {
+		free_shared_nodes(shared);
+		return -EAGAIN;
+	}
+	return err;
+}
+
 static int check_fs_roots(struct btrfs_root *root,
-			  struct cache_tree *root_cache)
+			  struct cache_tree *root_cache, int nr_threads)
 {
 	struct btrfs_path path;
 	struct btrfs_key key;
 	struct walk_control wc;
+	struct cache_tree shared;
 	struct extent_buffer *leaf, *tree_node;
 	struct btrfs_root *tmp_root;
 	struct btrfs_root *tree_root = root->fs_info->tree_root;
@@ -3061,9 +4361,18 @@ static int check_fs_roots(struct btrfs_root *root,
 	if (repair)
 		reset_cached_block_groups(root->fs_info);
 	memset(&wc, 0, sizeof(wc));
-	cache_tree_init(&wc.shared);
+	cache_tree_init(&shared);
+	wc.shared = &shared;
 	btrfs_init_path(&path);
 
+	if (!repair && nr_threads > 0) {
+		err = check_fs_roots_threaded(root->fs_info, root_cache,
+					      &shared, nr_threads);
+		if (err != -EAGAIN)
+			goto out;
+		err = 0;
+	}
+
 again:
 	key.offset = 0;
 	key.objectid = 0;
@@ -3126,8 +4435,8 @@ next:
 out:
 	btrfs_release_path(&path);
 	if (err)
-		free_extent_cache_tree(&wc.shared);
-	if (!cache_tree_empty(&wc.shared))
+		free_extent_cache_tree(&shared);
+	if (!cache_tree_empty(&shared))
 		fprintf(stderr, "warning line %d\n", __LINE__);
 
 	return err;
@@ -3135,16 +4444,14 @@ out:
 
 static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 {
-	struct list_head *cur = rec->backrefs.next;
 	struct extent_backref *back;
 	struct tree_backref *tback;
 	struct data_backref *dback;
 	u64 found = 0;
 	int err = 0;
+	u32 nr;
 
-	while(cur != &rec->backrefs) {
-		back = list_entry(cur, struct extent_backref, list);
-		cur = cur->next;
+	for_each_extent_backref(rec, back, nr) {
 		if (!back->found_extent_tree) {
 			err = 1;
 			if (!print_errs)
@@ -3154,7 +4461,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Backref %llu %s %llu"
 					" owner %llu offset %llu num_refs %lu"
 					" not found in extent tree\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					back->full_backref ?
 					"parent" : "root",
 					back->full_backref ?
@@ -3167,7 +4474,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				tback = (struct tree_backref *)back;
 				fprintf(stderr, "Backref %llu parent %llu"
 					" root %llu not found in extent tree\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)tback->parent,
 					(unsigned long long)tback->root);
 			}
@@ -3178,7 +4485,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				goto out;
 			tback = (struct tree_backref *)back;
 			fprintf(stderr, "Backref %llu %s %llu not referenced back %p\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				back->full_backref ? "parent" : "root",
 				back->full_backref ?
 				(unsigned long long)tback->parent :
@@ -3193,7 +4500,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Incorrect local backref count"
 					" on %llu %s %llu owner %llu"
 					" offset %llu found %u wanted %u back %p\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					back->full_backref ?
 					"parent" : "root",
 					back->full_backref ?
@@ -3203,14 +4510,14 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 					(unsigned long long)dback->offset,
 					dback->found_ref, dback->num_refs, back);
 			}
-			if (dback->disk_bytenr != rec->start) {
+			if (dback->disk_bytenr != rec->cache.start) {
 				err = 1;
 				if (!print_errs)
 					goto out;
 				fprintf(stderr, "Backref disk bytenr does not"
 					" match extent record, bytenr=%llu, "
 					"ref bytenr=%llu\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)dback->disk_bytenr);
 			}
 
@@ -3221,7 +4528,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 				fprintf(stderr, "Backref bytes do not match "
 					"extent backref, bytenr=%llu, ref "
 					"bytes=%llu, backref bytes=%llu\n",
-					(unsigned long long)rec->start,
+					(unsigned long long)rec->cache.start,
 					(unsigned long long)rec->nr,
 					(unsigned long long)dback->bytes);
 			}
@@ -3239,7 +4546,7 @@ static int all_backpointers_checked(struct extent_record *rec, int print_errs)
 			goto out;
 		fprintf(stderr, "Incorrect global backref count "
 			"on %llu found %llu wanted %llu\n",
-			(unsigned long long)rec->start,
+			(unsigned long long)rec->cache.start,
 			(unsigned long long)found,
 			(unsigned long long)rec->refs);
 	}
@@ -3247,19 +4554,6 @@ out:
 	return err;
 }
 
-static int free_all_extent_backrefs(struct extent_record *rec)
-{
-	struct extent_backref *back;
-	struct list_head *cur;
-	while (!list_empty(&rec->backrefs)) {
-		cur = rec->backrefs.next;
-		back = list_entry(cur, struct extent_backref, list);
-		list_del(cur);
-		free(back);
-	}
-	return 0;
-}
-
 static void free_extent_record_cache(struct btrfs_fs_info *fs_info,
 				     struct cache_tree *extent_cache)
 {
@@ -3271,23 +4565,27 @@ static void free_extent_record_cache(struct btrfs_fs_info *fs_info,
 		if (!cache)
 			break;
 		rec = container_of(cache, struct extent_record, cache);
-		btrfs_unpin_extent(fs_info, rec->start, rec->max_size);
+		btrfs_unpin_extent(fs_info, rec->cache.start, rec->max_size);
 		remove_cache_extent(extent_cache, cache);
-		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_record(rec);
 	}
 }
 
 static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 				 struct extent_record *rec)
 {
+	if (extent_shards && !cur_shard) {
+		struct rec_op op = { .type = REC_OP_MAYBE_FREE, .rec = rec };
+
+		if (!extent_shards_queue(&op, rec->cache.start,
+					 rec->cache.size))
+			return 0;
+	}
 	if (rec->content_checked && rec->owner_ref_checked &&
 	    rec->extent_item_refs == rec->refs && rec->refs > 0 &&
-	    rec->num_duplicates == 0 && !all_backpointers_checked(rec, 0)) {
+	    !nr_duplicates(rec) && !all_backpointers_checked(rec, 0)) {
 		remove_cache_extent(extent_cache, &rec->cache);
-		free_all_extent_backrefs(rec);
-		list_del_init(&rec->list);
-		free(rec);
+		free_extent_record(rec);
 	}
 	return 0;
 }
@@ -3305,8 +4603,9 @@ static int check_owner_ref(struct btrfs_root *root,
 	int level;
 	int found = 0;
 	int ret;
+	u32 nr;
 
-	list_for_each_entry(node, &rec->backrefs, list) {
+	for_each_extent_backref(rec, node, nr) {
 		if (node->is_data)
 			continue;
 		if (!node->found_ref)
@@ -3351,14 +4650,12 @@ static int check_owner_ref(struct btrfs_root *root,
 
 static int is_extent_tree_record(struct extent_record *rec)
 {
-	struct list_head *cur = rec->backrefs.next;
 	struct extent_backref *node;
 	struct tree_backref *back;
 	int is_extent = 0;
+	u32 nr;
 
-	while(cur != &rec->backrefs) {
-		node = list_entry(cur, struct extent_backref, list);
-		cur = cur->next;
+	for_each_extent_backref(rec, node, nr) {
 		if (node->is_data)
 			return 0;
 		back = (struct tree_backref *)node;
@@ -3371,6 +4668,26 @@ static int is_extent_tree_record(struct extent_record *rec)
 }
 
 
+/*
+ * Records only overlap on a broken filesystem.  Take the first one then, so
+ * the answer doesn't depend on the shape of the tree holding them.
+ */
+static struct cache_extent *lookup_extent_rec(struct cache_tree *extent_cache,
+					      u64 start, u64 len)
+{
+	struct cache_extent *cache;
+	struct cache_extent *prev;
+
+	cache = lookup_cache_extent(extent_cache, start, len);
+	while (cache) {
+		prev = prev_cache_extent(cache);
+		if (!prev || prev->start + prev->size <= start)
+			break;
+		cache = prev;
+	}
+	return cache;
+}
+
 static int record_bad_block_io(struct btrfs_fs_info *info,
 			       struct cache_tree *extent_cache,
 			       u64 start, u64 len)
@@ -3379,7 +4696,8 @@ static int record_bad_block_io(struct btrfs_fs_info *info,
 	struct cache_extent *cache;
 	struct btrfs_key key;
 
-	cache = lookup_cache_extent(extent_cache, start, len);
+	extent_cache = extent_cache_of(extent_cache, start, len);
+	cache = lookup_extent_rec(extent_cache, start, len);
 	if (!cache)
 		return 0;
 
@@ -3387,7 +4705,11 @@ static int record_bad_block_io(struct btrfs_fs_info *info,
 	if (!is_extent_tree_record(rec))
 		return 0;
 
-	btrfs_disk_key_to_cpu(&key, &rec->parent_key);
+	/* the key of the pointer is gone once the block is read */
+	if (rec->block_read)
+		memset(&key, 0, sizeof(key));
+	else
+		btrfs_disk_key_to_cpu(&key, &tree_block_info(rec)->parent_key);
 	return btrfs_add_corrupt_extent_record(info, &key, start, len, 0);
 }
 
@@ -3671,16 +4993,26 @@ static int check_block(struct btrfs_trans_handle *trans,
 {
 	struct extent_record *rec;
 	struct cache_extent *cache;
+	struct tree_block_info_rec *block;
+	struct btrfs_disk_key parent_key;
 	struct btrfs_key key;
 	enum btrfs_tree_block_status status;
 	int ret = 0;
 	int level;
 
-	cache = lookup_cache_extent(extent_cache, buf->start, buf->len);
+	cache = lookup_extent_rec(extent_cache_of(extent_cache, buf->start,
+						  buf->len),
+				  buf->start, buf->len);
 	if (!cache)
 		return 1;
 	rec = container_of(cache, struct extent_record, cache);
-	rec->generation = btrfs_header_generation(buf);
+	block = tree_block_info(rec);
+	if (rec->block_read)
+		memset(&parent_key, 0, sizeof(parent_key));
+	else
+		parent_key = block->parent_key;
+	rec->block_read = 1;
+	block->generation = btrfs_header_generation(buf);
 
 	level = btrfs_header_level(buf);
 	if (btrfs_header_nritems(buf) > 0) {
@@ -3690,14 +5022,14 @@ static int check_block(struct btrfs_trans_handle *trans,
 		else
 			btrfs_node_key_to_cpu(buf, &key, 0);
 
-		rec->info_objectid = key.objectid;
+		block->info_objectid = key.objectid;
 	}
 	rec->info_level = level;
 
 	if (btrfs_is_leaf(buf))
-		status = btrfs_check_leaf(root, &rec->parent_key, buf);
+		status = btrfs_check_leaf(root, &parent_key, buf);
 	else
-		status = btrfs_check_node(root, &rec->parent_key, buf);
+		status = btrfs_check_node(root, &parent_key, buf);
 
 	if (status != BTRFS_TREE_BLOCK_CLEAN) {
 		if (repair)
@@ -3705,6 +5037,7 @@ static int check_block(struct btrfs_trans_handle *trans,
 						      status);
 		if (status != BTRFS_TREE_BLOCK_CLEAN) {
 			ret = -EIO;
+			extent_shards_flush();
 			fprintf(stderr, "bad block %llu\n",
 				(unsigned long long)buf->start);
 		} else {
@@ -3732,13 +5065,11 @@ static int check_block(struct btrfs_trans_handle *trans,
 static struct tree_backref *find_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct list_head *cur = rec->backrefs.next;
 	struct extent_backref *node;
 	struct tree_backref *back;
+	u32 nr;
 
-	while(cur != &rec->backrefs) {
-		node = list_entry(cur, struct extent_backref, list);
-		cur = cur->next;
+	for_each_extent_backref(rec, node, nr) {
 		if (node->is_data)
 			continue;
 		back = (struct tree_backref *)node;
@@ -3760,8 +5091,10 @@ static struct tree_backref *find_tree_backref(struct extent_record *rec,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
-	memset(&ref->node, 0, sizeof(ref->node));
+	struct tree_backref *ref;
+
+	ref = (struct tree_backref *)alloc_extent_backref(rec, 0);
+	BUG_ON(!ref);
 	if (parent > 0) {
 		ref->parent = parent;
 		ref->node.full_backref = 1;
@@ -3769,7 +5102,6 @@ static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 		ref->root = root;
 		ref->node.full_backref = 0;
 	}
-	list_add_tail(&ref->node.list, &rec->backrefs);
 
 	return ref;
 }
@@ -3780,13 +5112,11 @@ static struct data_backref *find_data_backref(struct extent_record *rec,
 						int found_ref,
 						u64 disk_bytenr, u64 bytes)
 {
-	struct list_head *cur = rec->backrefs.next;
 	struct extent_backref *node;
 	struct data_backref *back;
+	u32 nr;
 
-	while(cur != &rec->backrefs) {
-		node = list_entry(cur, struct extent_backref, list);
-		cur = cur->next;
+	for_each_extent_backref(rec, node, nr) {
 		if (!node->is_data)
 			continue;
 		back = (struct data_backref *)node;
@@ -3816,9 +5146,10 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
-	memset(&ref->node, 0, sizeof(ref->node));
-	ref->node.is_data = 1;
+	struct data_backref *ref;
+
+	ref = (struct data_backref *)alloc_extent_backref(rec, 1);
+	BUG_ON(!ref);
 
 	if (parent > 0) {
 		ref->parent = parent;
@@ -3832,14 +5163,29 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 		ref->node.full_backref = 0;
 	}
 	ref->bytes = max_size;
-	ref->found_ref = 0;
-	ref->num_refs = 0;
-	list_add_tail(&ref->node.list, &rec->backrefs);
 	if (max_size > rec->max_size)
 		rec->max_size = max_size;
 	return ref;
 }
 
+/*
+ * The key and generation of the pointer to a tree block are only needed
+ * until the block is read, they share their room with what is read from it.
+ */
+static void set_tree_block_parent(struct extent_record *rec,
+				  struct btrfs_key *parent_key, u64 parent_gen)
+{
+	struct tree_block_info_rec *block;
+
+	if ((!parent_key && !parent_gen) || rec->block_read)
+		return;
+	block = tree_block_info(rec);
+	if (parent_key)
+		btrfs_cpu_key_to_disk(&block->parent_key, parent_key);
+	if (parent_gen)
+		block->parent_generation = parent_gen;
+}
+
 static int add_extent_rec(struct cache_tree *extent_cache,
 			  struct btrfs_key *parent_key, u64 parent_gen,
 			  u64 start, u64 nr, u64 extent_item_refs,
@@ -3847,11 +5193,33 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 			  int metadata, int extent_rec, u64 max_size)
 {
 	struct extent_record *rec;
+	struct extent_record_extra *extra;
 	struct cache_extent *cache;
 	int ret = 0;
 	int dup = 0;
 
-	cache = lookup_cache_extent(extent_cache, start, nr);
+	if (extent_shards && !cur_shard) {
+		struct rec_op op = { .type = REC_OP_EXTENT_REC };
+
+		if (parent_key) {
+			op.extent.parent_key = *parent_key;
+			op.extent.has_parent_key = 1;
+		}
+		op.extent.parent_gen = parent_gen;
+		op.extent.start = start;
+		op.extent.nr = nr;
+		op.extent.extent_item_refs = extent_item_refs;
+		op.extent.max_size = max_size;
+		op.extent.is_root = !!is_root;
+		op.extent.inc_ref = !!inc_ref;
+		op.extent.set_checked = !!set_checked;
+		op.extent.metadata = !!metadata;
+		op.extent.extent_rec = !!extent_rec;
+		if (!extent_shards_queue(&op, start, nr))
+			return 0;
+	}
+
+	cache = lookup_extent_rec(extent_cache, start, nr);
 	if (cache) {
 		rec = container_of(cache, struct extent_record, cache);
 		if (inc_ref)
@@ -3865,12 +5233,16 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		 * the backrefs.
 		 */
 		if (extent_rec) {
-			if (start != rec->start || rec->found_rec) {
+			if (start != rec->cache.start || rec->found_rec) {
 				struct extent_record *tmp;
 
 				dup = 1;
-				if (list_empty(&rec->list))
-					list_add_tail(&rec->list,
+				extra = extent_record_extra(rec);
+				if (!extra)
+					return -ENOMEM;
+				if (list_empty(&extra->list))
+					list_add_tail(&extra->list, cur_shard ?
+						      &cur_shard->duplicates :
 						      &duplicate_extents);
 
 				/*
@@ -3879,18 +5251,20 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = alloc_extent_record(metadata);
 				if (!tmp)
 					return -ENOMEM;
-				tmp->start = start;
+				if (!extent_record_extra(tmp)) {
+					free_extent_record(tmp);
+					return -ENOMEM;
+				}
+				tmp->cache.start = start;
 				tmp->max_size = max_size;
 				tmp->nr = nr;
 				tmp->found_rec = 1;
-				tmp->metadata = metadata;
 				tmp->extent_item_refs = extent_item_refs;
-				INIT_LIST_HEAD(&tmp->list);
-				list_add_tail(&tmp->list, &rec->dups);
-				rec->num_duplicates++;
+				list_add_tail(&tmp->extra->list, &extra->dups);
+				extra->num_duplicates++;
 			} else {
 				rec->nr = nr;
 				rec->found_rec = 1;
@@ -3899,7 +5273,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 
 		if (extent_item_refs && !dup) {
 			if (rec->extent_item_refs) {
-				fprintf(stderr, "block %llu rec "
+				rec_error("block %llu rec "
 					"extent_item_refs %llu, passed %llu\n",
 					(unsigned long long)start,
 					(unsigned long long)
@@ -3915,10 +5289,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 			rec->owner_ref_checked = 1;
 		}
 
-		if (parent_key)
-			btrfs_cpu_key_to_disk(&rec->parent_key, parent_key);
-		if (parent_gen)
-			rec->parent_generation = parent_gen;
+		set_tree_block_parent(rec, parent_key, parent_gen);
 
 		if (rec->max_size < max_size)
 			rec->max_size = max_size;
@@ -3926,18 +5297,15 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 		maybe_free_extent_rec(extent_cache, rec);
 		return ret;
 	}
-	rec = malloc(sizeof(*rec));
-	rec->start = start;
+	rec = alloc_extent_record(metadata);
+	if (!rec)
+		return -ENOMEM;
+	rec->cache.start = start;
 	rec->max_size = max_size;
 	rec->nr = max(nr, max_size);
 	rec->found_rec = !!extent_rec;
 	rec->content_checked = 0;
 	rec->owner_ref_checked = 0;
-	rec->num_duplicates = 0;
-	rec->metadata = metadata;
-	INIT_LIST_HEAD(&rec->backrefs);
-	INIT_LIST_HEAD(&rec->dups);
-	INIT_LIST_HEAD(&rec->list);
 
 	if (is_root)
 		rec->is_root = 1;
@@ -3954,21 +5322,15 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 	else
 		rec->extent_item_refs = 0;
 
-	if (parent_key)
-		btrfs_cpu_key_to_disk(&rec->parent_key, parent_key);
-	else
-		memset(&rec->parent_key, 0, sizeof(*parent_key));
-
-	if (parent_gen)
-		rec->parent_generation = parent_gen;
-	else
-		rec->parent_generation = 0;
+	set_tree_block_parent(rec, parent_key, parent_gen);
 
-	rec->cache.start = start;
 	rec->cache.size = nr;
 	ret = insert_cache_extent(extent_cache, &rec->cache);
 	BUG_ON(ret);
-	bytes_used += nr;
+	if (cur_shard)
+		cur_shard->bytes_used += nr;
+	else
+		bytes_used += nr;
 	if (set_checked) {
 		rec->content_checked = 1;
 		rec->owner_ref_checked = 1;
@@ -3983,6 +5345,17 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	struct tree_backref *back;
 	struct cache_extent *cache;
 
+	if (extent_shards && !cur_shard) {
+		struct rec_op op = { .type = REC_OP_TREE_BACKREF };
+
+		op.tree.bytenr = bytenr;
+		op.tree.parent = parent;
+		op.tree.root = root;
+		op.tree.found_ref = found_ref;
+		if (!extent_shards_queue(&op, bytenr, 1))
+			return 0;
+	}
+
 	cache = lookup_cache_extent(extent_cache, bytenr, 1);
 	if (!cache) {
 		add_extent_rec(extent_cache, NULL, 0, bytenr,
@@ -3993,7 +5366,7 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	}
 
 	rec = container_of(cache, struct extent_record, cache);
-	if (rec->start != bytenr) {
+	if (rec->cache.start != bytenr) {
 		abort();
 	}
 
@@ -4003,7 +5376,7 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 
 	if (found_ref) {
 		if (back->node.found_ref) {
-			fprintf(stderr, "Extent back ref already exists "
+			rec_error("Extent back ref already exists "
 				"for %llu parent %llu root %llu \n",
 				(unsigned long long)bytenr,
 				(unsigned long long)parent,
@@ -4012,7 +5385,7 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 		back->node.found_ref = 1;
 	} else {
 		if (back->node.found_extent_tree) {
-			fprintf(stderr, "Extent back ref already exists "
+			rec_error("Extent back ref already exists "
 				"for %llu parent %llu root %llu \n",
 				(unsigned long long)bytenr,
 				(unsigned long long)parent,
@@ -4032,6 +5405,21 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 	struct data_backref *back;
 	struct cache_extent *cache;
 
+	if (extent_shards && !cur_shard) {
+		struct rec_op op = { .type = REC_OP_DATA_BACKREF };
+
+		op.data.bytenr = bytenr;
+		op.data.parent = parent;
+		op.data.root = root;
+		op.data.owner = owner;
+		op.data.offset = offset;
+		op.data.max_size = max_size;
+		op.data.num_refs = num_refs;
+		op.data.found_ref = found_ref;
+		if (!extent_shards_queue(&op, bytenr, 1))
+			return 0;
+	}
+
 	cache = lookup_cache_extent(extent_cache, bytenr, 1);
 	if (!cache) {
 		add_extent_rec(extent_cache, NULL, 0, bytenr, 1, 0, 0, 0, 0,
@@ -4074,7 +5462,7 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 		rec->owner_ref_checked = 1;
 	} else {
 		if (back->node.found_extent_tree) {
-			fprintf(stderr, "Extent back ref already exists "
+			rec_error("Extent back ref already exists "
 				"for %llu parent %llu root %llu "
 				"owner %llu offset %llu num_refs %lu\n",
 				(unsigned long long)bytenr,
@@ -4091,6 +5479,395 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 	return 0;
 }
 
+/*
+ * Parallel building of the extent records for the read only check.
+ *
+ * Extents never cross a chunk, so the records of two chunks never meet.
+ * The chunks are dealt out to the shards, each with a worker thread and its
+ * own record cache.  The main thread walks the trees as before and queues
+ * every record update to the shard of the chunk it falls into, the worker
+ * applies them in queueing order.  So every record goes through the same
+ * states as with a single cache, and lookup_extent_rec() makes sure a
+ * lookup finds the same record in a shard as in the whole cache.  Before
+ * the main thread looks at a record itself it drains that shard.
+ *
+ * The messages of the workers are kept and printed in queueing order at the
+ * points the main thread is about to report a problem itself, and at the end
+ * of the walk, when the shard caches are merged into the one
+ * check_extent_refs() goes through.  The output doesn't depend on the number
+ * of threads, with none the updates are applied inline to a single shard.
+ *
+ * An update that isn't inside one chunk, which only happens on a broken
+ * filesystem, stops the shards and the rest of the walk is done inline.
+ */
+static void extent_shard_apply(struct extent_shard *shard, struct rec_op *op)
+{
+	shard->seq = op->seq;
+	switch (op->type) {
+	case REC_OP_EXTENT_REC:
+		add_extent_rec(&shard->cache, op->extent.has_parent_key ?
+			       &op->extent.parent_key : NULL,
+			       op->extent.parent_gen, op->extent.start,
+			       op->extent.nr, op->extent.extent_item_refs,
+			       op->extent.is_root, op->extent.inc_ref,
+			       op->extent.set_checked, op->extent.metadata,
+			       op->extent.extent_rec, op->extent.max_size);
+		break;
+	case REC_OP_TREE_BACKREF:
+		add_tree_backref(&shard->cache, op->tree.bytenr,
+				 op->tree.parent, op->tree.root,
+				 op->tree.found_ref);
+		break;
+	case REC_OP_DATA_BACKREF:
+		add_data_backref(&shard->cache, op->data.bytenr,
+				 op->data.parent, op->data.root,
+				 op->data.owner, op->data.offset,
+				 op->data.num_refs, op->data.found_ref,
+				 op->data.max_size);
+		break;
+	case REC_OP_MAYBE_FREE:
+		maybe_free_extent_rec(&shard->cache, op->rec);
+		break;
+	}
+}
+
+static void *extent_shard_worker(void *data)
+{
+	struct extent_shard *shard = data;
+	struct rec_batch *batch;
+	int i;
+
+	cur_shard = shard;
+	pthread_mutex_lock(&shard->mutex);
+	while (1) {
+		while (!shard->stop && list_empty(&shard->queue))
+			pthread_cond_wait(&shard->work_cond, &shard->mutex);
+		if (list_empty(&shard->queue))
+			break;
+		batch = list_entry(shard->queue.next, struct rec_batch, list);
+		list_del(&batch->list);
+		pthread_mutex_unlock(&shard->mutex);
+
+		for (i = 0; i < batch->nr; i++)
+			extent_shard_apply(shard, &batch->ops[i]);
+
+		pthread_mutex_lock(&shard->mutex);
+		list_add_tail(&batch->list, &shard->free);
+		shard->queued--;
+		pthread_cond_broadcast(&shard->done_cond);
+	}
+	pthread_mutex_unlock(&shard->mutex);
+	return NULL;
+}
+
+/* hands the filled batch to the worker, waits for a free one if needed */
+static void extent_shard_submit(struct extent_shard *shard)
+{
+	struct rec_batch *batch = shard->fill;
+
+	pthread_mutex_lock(&shard->mutex);
+	while (list_empty(&shard->free))
+		pthread_cond_wait(&shard->done_cond, &shard->mutex);
+	shard->fill = list_entry(shard->free.next, struct rec_batch, list);
+	list_del(&shard->fill->list);
+	list_add_tail(&batch->list, &shard->queue);
+	shard->queued++;
+	pthread_cond_signal(&shard->work_cond);
+	pthread_mutex_unlock(&shard->mutex);
+	shard->fill->nr = 0;
+}
+
+static void extent_shard_drain(struct extent_shard *shard)
+{
+	int i;
+
+	if (!extent_shards->nr_threads)
+		return;
+	pthread_mutex_lock(&shard->mutex);
+	while (shard->queued)
+		pthread_cond_wait(&shard->done_cond, &shard->mutex);
+	pthread_mutex_unlock(&shard->mutex);
+
+	/* the worker is idle, the rest is quicker applied right here */
+	cur_shard = shard;
+	for (i = 0; i < shard->fill->nr; i++)
+		extent_shard_apply(shard, &shard->fill->ops[i]);
+	cur_shard = NULL;
+	shard->fill->nr = 0;
+}
+
+static struct extent_shard *extent_shard_of(u64 start, u64 len)
+{
+	struct extent_shards *es = extent_shards;
+	int lo = 0;
+	int hi = es->nr_chunks;
+	int mid;
+
+	/* the last chunk starting at or before @start */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (es->chunks[mid].start <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || start + len < start || start + len > es->chunks[lo - 1].end)
+		return NULL;
+	return &es->shards[(lo - 1) % es->nr_shards];
+}
+
+/* prints the messages of all updates queued so far */
+static void extent_shards_flush(void)
+{
+	struct extent_shards *es = extent_shards;
+	struct extent_shard *first;
+	struct rec_msg *msg;
+	int i;
+
+	if (!es)
+		return;
+	for (i = 0; i < es->nr_shards; i++)
+		extent_shard_drain(&es->shards[i]);
+	while (1) {
+		first = NULL;
+		msg = NULL;
+		for (i = 0; i < es->nr_shards; i++) {
+			struct list_head *msgs = &es->shards[i].msgs;
+
+			if (list_empty(msgs))
+				continue;
+			if (msg && list_entry(msgs->next, struct rec_msg,
+					      list)->seq > msg->seq)
+				continue;
+			first = &es->shards[i];
+			msg = list_entry(msgs->next, struct rec_msg, list);
+		}
+		if (!first)
+			break;
+		list_del(&msg->list);
+		fputs(msg->text, stderr);
+		free(msg);
+	}
+}
+
+/*
+ * Stops the shards and merges their records into the cache given to
+ * extent_shards_start(), a no-op if they aren't running.
+ */
+static void extent_shards_stop(void)
+{
+	struct extent_shards *es = extent_shards;
+	struct extent_shard *shard;
+	struct cache_extent *cache;
+	struct rec_batch *batch;
+	int ret;
+	int i;
+	int j;
+
+	if (!es)
+		return;
+	extent_shards_flush();
+	for (i = 0; i < es->nr_shards; i++) {
+		shard = &es->shards[i];
+		if (es->nr_threads) {
+			pthread_mutex_lock(&shard->mutex);
+			shard->stop = 1;
+			pthread_cond_signal(&shard->work_cond);
+			pthread_mutex_unlock(&shard->mutex);
+			pthread_join(shard->thread, NULL);
+			pthread_cond_destroy(&shard->done_cond);
+			pthread_cond_destroy(&shard->work_cond);
+			pthread_mutex_destroy(&shard->mutex);
+		}
+		while ((cache = first_cache_extent(&shard->cache))) {
+			remove_cache_extent(&shard->cache, cache);
+			ret = insert_cache_extent(es->extent_cache, cache);
+			BUG_ON(ret);
+		}
+		record_slab_merge(&tree_rec_slab, &shard->tree_rec_slab);
+		record_slab_merge(&data_rec_slab, &shard->data_rec_slab);
+		record_slab_merge(&tree_backref_slab,
+				  &shard->tree_backref_slab);
+		record_slab_merge(&data_backref_slab,
+				  &shard->data_backref_slab);
+		record_slab_merge(&extra_slab, &shard->extra_slab);
+		for (j = 0; j < BACKREF_ARRAY_CLASSES; j++)
+			record_slab_merge(&backref_array_slabs[j],
+					  &shard->backref_array_slabs[j]);
+		list_splice_tail(&shard->duplicates, &duplicate_extents);
+		bytes_used += shard->bytes_used;
+		free(shard->fill);
+		while (!list_empty(&shard->free)) {
+			batch = list_entry(shard->free.next, struct rec_batch,
+					   list);
+			list_del(&batch->list);
+			free(batch);
+		}
+	}
+	free(es->shards);
+	free(es->chunks);
+	free(es);
+	extent_shards = NULL;
+}
+
+static int extent_shards_queue(struct rec_op *op, u64 start, u64 len)
+{
+	struct extent_shard *shard;
+
+	shard = extent_shard_of(start, len);
+	if (!shard) {
+		extent_shards_stop();
+		return 1;
+	}
+	op->seq = extent_shards->seq++;
+	if (!extent_shards->nr_threads) {
+		cur_shard = shard;
+		extent_shard_apply(shard, op);
+		cur_shard = NULL;
+		return 0;
+	}
+	shard->fill->ops[shard->fill->nr++] = *op;
+	if (shard->fill->nr == EXTENT_SHARD_BATCH)
+		extent_shard_submit(shard);
+	return 0;
+}
+
+static struct cache_tree *extent_cache_of(struct cache_tree *extent_cache,
+					  u64 start, u64 len)
+{
+	struct extent_shard *shard;
+
+	if (!extent_shards)
+		return extent_cache;
+	shard = extent_shard_of(start, len);
+	if (!shard) {
+		extent_shards_stop();
+		return extent_cache;
+	}
+	extent_shard_drain(shard);
+	return &shard->cache;
+}
+
+static int extent_shard_init_threads(struct extent_shards *es)
+{
+	struct extent_shard *shard;
+	struct rec_batch *batch;
+	int i;
+	int j;
+
+	for (i = 0; i < es->nr_shards; i++) {
+		shard = &es->shards[i];
+		for (j = 0; j < EXTENT_SHARD_BATCHES; j++) {
+			batch = malloc(sizeof(*batch));
+			if (!batch)
+				return -ENOMEM;
+			batch->nr = 0;
+			list_add_tail(&batch->list, &shard->free);
+		}
+		shard->fill = list_entry(shard->free.next, struct rec_batch,
+					 list);
+		list_del(&shard->fill->list);
+	}
+	for (i = 0; i < es->nr_shards; i++) {
+		shard = &es->shards[i];
+		pthread_mutex_init(&shard->mutex, NULL);
+		pthread_cond_init(&shard->work_cond, NULL);
+		pthread_cond_init(&shard->done_cond, NULL);
+		if (pthread_create(&shard->thread, NULL, extent_shard_worker,
+				   shard))
+			break;
+		es->nr_threads++;
+	}
+	if (es->nr_threads == es->nr_shards)
+		return 0;
+
+	for (j = 0; j < es->nr_threads; j++) {
+		shard = &es->shards[j];
+		pthread_mutex_lock(&shard->mutex);
+		shard->stop = 1;
+		pthread_cond_signal(&shard->work_cond);
+		pthread_mutex_unlock(&shard->mutex);
+		pthread_join(shard->thread, NULL);
+	}
+	for (j = 0; j < es->nr_shards && j <= i; j++) {
+		shard = &es->shards[j];
+		pthread_cond_destroy(&shard->done_cond);
+		pthread_cond_destroy(&shard->work_cond);
+		pthread_mutex_destroy(&shard->mutex);
+	}
+	es->nr_threads = 0;
+	return -EAGAIN;
+}
+
+/*
+ * Starts building the extent records with @nr_threads shards, they end up
+ * in @extent_cache once extent_shards_stop() is called.  Without shards the
+ * records are built in @extent_cache directly as before.
+ */
+static void extent_shards_start(struct btrfs_fs_info *info,
+				struct cache_tree *extent_cache,
+				int nr_threads)
+{
+	struct extent_shards *es;
+	struct extent_shard *shard;
+	struct cache_extent *ce;
+	struct rec_batch *batch;
+	int i;
+
+	es = calloc(1, sizeof(*es));
+	if (!es)
+		return;
+	es->extent_cache = extent_cache;
+	for (ce = first_cache_extent(&info->mapping_tree.cache_tree); ce;
+	     ce = next_cache_extent(ce))
+		es->nr_chunks++;
+	es->nr_shards = max(nr_threads, 1);
+	es->chunks = calloc(es->nr_chunks, sizeof(*es->chunks));
+	es->shards = calloc(es->nr_shards, sizeof(*es->shards));
+	if (!es->chunks || !es->shards) {
+		free(es->chunks);
+		free(es->shards);
+		free(es);
+		return;
+	}
+	i = 0;
+	for (ce = first_cache_extent(&info->mapping_tree.cache_tree); ce;
+	     ce = next_cache_extent(ce)) {
+		es->chunks[i].start = ce->start;
+		es->chunks[i].end = ce->start + ce->size;
+		i++;
+	}
+	for (i = 0; i < es->nr_shards; i++) {
+		shard = &es->shards[i];
+		cache_tree_init(&shard->cache);
+		shard->tree_rec_slab.size = tree_rec_slab.size;
+		shard->data_rec_slab.size = data_rec_slab.size;
+		shard->tree_backref_slab.size = tree_backref_slab.size;
+		shard->data_backref_slab.size = data_backref_slab.size;
+		shard->extra_slab.size = extra_slab.size;
+		INIT_LIST_HEAD(&shard->duplicates);
+		INIT_LIST_HEAD(&shard->msgs);
+		INIT_LIST_HEAD(&shard->queue);
+		INIT_LIST_HEAD(&shard->free);
+	}
+
+	/* apply the updates inline if the workers can't be set up */
+	if (nr_threads > 0 && extent_shard_init_threads(es)) {
+		for (i = 0; i < es->nr_shards; i++) {
+			shard = &es->shards[i];
+			free(shard->fill);
+			shard->fill = NULL;
+			while (!list_empty(&shard->free)) {
+				batch = list_entry(shard->free.next,
+						   struct rec_batch, list);
+				list_del(&batch->list);
+				free(batch);
+			}
+		}
+	}
+	extent_shards = es;
+}
+
 static int add_pending(struct cache_tree *pending,
 		       struct cache_tree *seen, u64 bytenr, u32 size)
 {
@@ -4577,6 +6354,7 @@ static int process_extent_item(struct btrfs_root *root,
 					0, num_bytes);
 			break;
 		default:
+			extent_shards_flush();
 			fprintf(stderr, "corrupt extent record: key %Lu %u %Lu\n",
 				key.objectid, key.type, num_bytes);
 			goto out;
@@ -4821,6 +6599,9 @@ static int read_extent_data(struct btrfs_root *root, char *data,
 	int ret = 0;
 	u64 max_len = *len;
 
+	if (btrfs_is_raid56_rebuild(&info->mapping_tree, logical, mirror))
+		return read_raid56_rebuild(info, data, logical, len, mirror);
+
 	ret = btrfs_map_block(&info->mapping_tree, READ, logical, len,
 			      &multi, mirror, NULL);
 	if (ret) {
@@ -4845,14 +6626,13 @@ err:
 	return ret;
 }
 
+/* @csums holds the expected checksums for the sectors of the range */
 static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb) {
-
+			u64 num_bytes, const char *csums)
+{
 	u64 offset = 0;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
 	char *data;
-	unsigned long csum_offset;
 	u32 csum;
 	u32 csum_expected;
 	u64 read_len;
@@ -4888,10 +6668,9 @@ again:
 					       csum, root->sectorsize);
 			btrfs_csum_final(csum, (char *)&csum);
 
-			csum_offset = leaf_offset +
-				 tmp / root->sectorsize * csum_size;
-			read_extent_buffer(eb, (char *)&csum_expected,
-					   csum_offset, csum_size);
+			memcpy(&csum_expected,
+			       csums + tmp / root->sectorsize * csum_size,
+			       csum_size);
 			/* try another mirror */
 			if (csum != csum_expected) {
 				fprintf(stderr, "mirror %d bytenr %llu csum %u expected csum %u\n",
@@ -4914,6 +6693,319 @@ out:
 	return ret;
 }
 
+/*
+ * Pipelined data checksum verification for --check-data-csum.
+ *
+ * The csum tree is walked by the main thread, every csum item is cut into
+ * jobs of at most CSUM_JOB_SIZE on a single device stripe, mapped to the
+ * first mirror and put into a ring.  Worker threads read and verify the
+ * jobs, the main thread retires them in ring order so errors still show up
+ * in csum tree order.  A job that failed is handed to check_extent_csums(),
+ * which reports the bad sectors and tries the other mirrors.
+ */
+#define CSUM_JOB_SIZE		(4 * 1024 * 1024)
+#define CSUM_REPORT_INTERVAL	10
+
+struct csum_job {
+	u64 bytenr;
+	u64 len;
+	int fd;
+	u64 physical;
+	char *data;
+	char *csums;
+	int ret;
+	int done;
+};
+
+struct csum_verifier {
+	struct btrfs_root *root;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct csum_job *ring;
+	int ring_size;
+	/* oldest queued job, next job for a worker and next free slot */
+	u64 head;
+	u64 next;
+	u64 tail;
+	int stop;
+	u32 sectorsize;
+	u16 csum_size;
+	u64 bytes_checked;
+	struct timespec start;
+	double last_report;
+};
+
+static void csum_job_run(struct csum_verifier *cv, struct csum_job *job)
+{
+	u64 done = 0;
+	u64 sector;
+	u32 csums[32];
+	unsigned int nr;
+	unsigned int i;
+	ssize_t ret;
+
+	if (job->fd <= 0) {
+		job->ret = -EIO;
+		return;
+	}
+	while (done < job->len) {
+		ret = pread64(job->fd, job->data + done, job->len - done,
+			      job->physical + done);
+		if (ret <= 0) {
+			job->ret = -EIO;
+			return;
+		}
+		done += ret;
+	}
+	for (sector = 0; sector < job->len / cv->sectorsize; sector += nr) {
+		nr = min_t(u64, ARRAY_SIZE(csums),
+			   job->len / cv->sectorsize - sector);
+		btrfs_csum_sectors(NULL, job->data + sector * cv->sectorsize,
+				   cv->sectorsize, nr, csums);
+		for (i = 0; i < nr; i++) {
+			if (memcmp(&csums[i],
+				   job->csums + (sector + i) * cv->csum_size,
+				   cv->csum_size)) {
+				job->ret = 1;
+				return;
+			}
+		}
+	}
+	job->ret = 0;
+}
+
+static void *csum_worker(void *data)
+{
+	struct csum_verifier *cv = data;
+	struct csum_job *job;
+
+	pthread_mutex_lock(&cv->mutex);
+	while (1) {
+		while (!cv->stop && cv->next == cv->tail)
+			pthread_cond_wait(&cv->work_cond, &cv->mutex);
+		if (cv->stop)
+			break;
+		job = &cv->ring[cv->next++ % cv->ring_size];
+		pthread_mutex_unlock(&cv->mutex);
+
+		csum_job_run(cv, job);
+
+		pthread_mutex_lock(&cv->mutex);
+		job->done = 1;
+		pthread_cond_broadcast(&cv->done_cond);
+	}
+	pthread_mutex_unlock(&cv->mutex);
+	return NULL;
+}
+
+static double csum_elapsed(struct csum_verifier *cv)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - cv->start.tv_sec) +
+		(now.tv_nsec - cv->start.tv_nsec) / 1000000000.0;
+}
+
+static void csum_report(struct csum_verifier *cv, const char *what)
+{
+	double secs = csum_elapsed(cv);
+
+	fprintf(stderr, "%s %llu bytes of data in %.1f seconds (%.1f MiB/s)\n",
+		what, (unsigned long long)cv->bytes_checked, secs,
+		secs > 0 ? cv->bytes_checked / secs / (1024 * 1024) : 0.0);
+}
+
+static int csum_verifier_init(struct csum_verifier *cv,
+			      struct btrfs_root *root, int nr_threads)
+{
+	int i;
+
+	memset(cv, 0, sizeof(*cv));
+	cv->root = root;
+	cv->sectorsize = root->sectorsize;
+	cv->csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	clock_gettime(CLOCK_MONOTONIC, &cv->start);
+	if (nr_threads <= 0)
+		return 0;
+
+	cv->ring_size = nr_threads * 2;
+	cv->ring = calloc(cv->ring_size, sizeof(*cv->ring));
+	cv->threads = calloc(nr_threads, sizeof(*cv->threads));
+	if (!cv->ring || !cv->threads)
+		goto fail;
+	for (i = 0; i < cv->ring_size; i++) {
+		cv->ring[i].data = malloc(CSUM_JOB_SIZE);
+		cv->ring[i].csums = malloc(CSUM_JOB_SIZE / cv->sectorsize *
+					   cv->csum_size);
+		if (!cv->ring[i].data || !cv->ring[i].csums)
+			goto fail;
+	}
+	pthread_mutex_init(&cv->mutex, NULL);
+	pthread_cond_init(&cv->work_cond, NULL);
+	pthread_cond_init(&cv->done_cond, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&cv->threads[i], NULL, csum_worker, cv))
+			break;
+		cv->nr_threads++;
+	}
+	if (cv->nr_threads)
+		return 0;
+fail:
+	/* verify inline if the pipeline can't be set up */
+	for (i = 0; cv->ring && i < cv->ring_size; i++) {
+		free(cv->ring[i].data);
+		free(cv->ring[i].csums);
+	}
+	free(cv->ring);
+	free(cv->threads);
+	cv->ring = NULL;
+	cv->threads = NULL;
+	cv->ring_size = 0;
+	return 0;
+}
+
+/* wait for the oldest job and report it, returns what check_csums breaks on */
+static int csum_retire_one(struct csum_verifier *cv)
+{
+	struct csum_job *job = &cv->ring[cv->head % cv->ring_size];
+	int ret = 0;
+
+	pthread_mutex_lock(&cv->mutex);
+	while (!job->done)
+		pthread_cond_wait(&cv->done_cond, &cv->mutex);
+	pthread_mutex_unlock(&cv->mutex);
+
+	if (job->ret)
+		ret = check_extent_csums(cv->root, job->bytenr, job->len,
+					 job->csums);
+	cv->bytes_checked += job->len;
+	cv->head++;
+
+	if (verbose &&
+	    csum_elapsed(cv) - cv->last_report >= CSUM_REPORT_INTERVAL) {
+		cv->last_report = csum_elapsed(cv);
+		csum_report(cv, "checked");
+	}
+	return ret;
+}
+
+static int csum_verifier_queue(struct csum_verifier *cv, u64 bytenr,
+			       u64 num_bytes, struct extent_buffer *leaf,
+			       unsigned long leaf_offset)
+{
+	struct btrfs_fs_info *info = cv->root->fs_info;
+	struct btrfs_multi_bio *multi;
+	struct csum_job *job;
+	u64 offset = 0;
+	u64 len;
+	int ret;
+
+	if (num_bytes % cv->sectorsize)
+		return -EINVAL;
+
+	if (!cv->ring_size) {
+		char *csums;
+
+		len = num_bytes / cv->sectorsize * cv->csum_size;
+		csums = malloc(len);
+		if (!csums)
+			return -ENOMEM;
+		read_extent_buffer(leaf, csums, leaf_offset, len);
+		ret = check_extent_csums(cv->root, bytenr, num_bytes, csums);
+		free(csums);
+		cv->bytes_checked += num_bytes;
+		return ret;
+	}
+
+	while (offset < num_bytes) {
+		if (cv->tail - cv->head == cv->ring_size) {
+			ret = csum_retire_one(cv);
+			if (ret)
+				return ret;
+		}
+		job = &cv->ring[cv->tail % cv->ring_size];
+
+		len = min_t(u64, num_bytes - offset, CSUM_JOB_SIZE);
+		job->bytenr = bytenr + offset;
+		job->fd = -1;
+		multi = NULL;
+		ret = btrfs_map_block(&info->mapping_tree, READ, job->bytenr,
+				      &len, &multi, 0, NULL);
+		if (!ret) {
+			job->fd = multi->stripes[0].dev->fd;
+			job->physical = multi->stripes[0].physical;
+		}
+		kfree(multi);
+		len = min_t(u64, len, num_bytes - offset);
+		len = min_t(u64, len, CSUM_JOB_SIZE);
+		len -= len % cv->sectorsize;
+		if (!len)
+			len = cv->sectorsize;
+		job->len = len;
+		read_extent_buffer(leaf, job->csums, leaf_offset +
+				   offset / cv->sectorsize * cv->csum_size,
+				   len / cv->sectorsize * cv->csum_size);
+		job->ret = 0;
+		job->done = 0;
+
+		pthread_mutex_lock(&cv->mutex);
+		cv->tail++;
+		pthread_cond_signal(&cv->work_cond);
+		pthread_mutex_unlock(&cv->mutex);
+		offset += len;
+	}
+	return 0;
+}
+
+/* retire all queued jobs unless @drop, then stop the workers */
+static int csum_verifier_finish(struct csum_verifier *cv, int drop)
+{
+	int ret = 0;
+	int i;
+
+	while (cv->ring_size && cv->head != cv->tail) {
+		if (drop) {
+			struct csum_job *job = &cv->ring[cv->head % cv->ring_size];
+
+			pthread_mutex_lock(&cv->mutex);
+			while (!job->done)
+				pthread_cond_wait(&cv->done_cond, &cv->mutex);
+			pthread_mutex_unlock(&cv->mutex);
+			cv->head++;
+			continue;
+		}
+		ret = csum_retire_one(cv);
+		if (ret)
+			drop = 1;
+	}
+
+	if (cv->nr_threads) {
+		pthread_mutex_lock(&cv->mutex);
+		cv->stop = 1;
+		pthread_cond_broadcast(&cv->work_cond);
+		pthread_mutex_unlock(&cv->mutex);
+		for (i = 0; i < cv->nr_threads; i++)
+			pthread_join(cv->threads[i], NULL);
+		pthread_cond_destroy(&cv->done_cond);
+		pthread_cond_destroy(&cv->work_cond);
+		pthread_mutex_destroy(&cv->mutex);
+	}
+	for (i = 0; i < cv->ring_size; i++) {
+		free(cv->ring[i].data);
+		free(cv->ring[i].csums);
+	}
+	free(cv->ring);
+	free(cv->threads);
+
+	if (verbose)
+		csum_report(cv, "verified");
+	return ret;
+}
+
 static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
 			       u64 num_bytes)
 {
@@ -5063,8 +7155,10 @@ static int check_csums(struct btrfs_root *root)
 	struct btrfs_path *path;
 	struct extent_buffer *leaf;
 	struct btrfs_key key;
+	struct csum_verifier cv;
 	u64 offset = 0, num_bytes = 0;
 	u16 csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	int csum_failed = 0;
 	int errors = 0;
 	int ret;
 	u64 data_len;
@@ -5095,6 +7189,9 @@ static int check_csums(struct btrfs_root *root)
 		path->slots[0]--;
 	ret = 0;
 
+	if (check_data_csum)
+		csum_verifier_init(&cv, root, nr_check_threads);
+
 	while (1) {
 		if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
 			ret = btrfs_next_leaf(root, path);
@@ -5119,10 +7216,12 @@ static int check_csums(struct btrfs_root *root)
 		if (!check_data_csum)
 			goto skip_csum_check;
 		leaf_offset = btrfs_item_ptr_offset(leaf, path->slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
-		if (ret)
+		ret = csum_verifier_queue(&cv, key.offset, data_len, leaf,
+					  leaf_offset);
+		if (ret) {
+			csum_failed = 1;
 			break;
+		}
 skip_csum_check:
 		if (!num_bytes) {
 			offset = key.offset;
@@ -5141,6 +7240,8 @@ skip_csum_check:
 		path->slots[0]++;
 	}
 
+	if (check_data_csum)
+		csum_verifier_finish(&cv, csum_failed);
 	btrfs_free_path(path);
 	return errors;
 }
@@ -5318,6 +7419,10 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 		return 1;
 
 	if (!reada_bits) {
+		struct btrfs_reada_block *blocks;
+		int nr_blocks = 0;
+
+		blocks = malloc(nritems * sizeof(*blocks));
 		for(i = 0; i < nritems; i++) {
 			ret = add_cache_extent(reada, bits[i].start,
 					       bits[i].size);
@@ -5325,8 +7430,19 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 				continue;
 
 			/* fixme, get the parent transid */
-			readahead_tree_block(root, bits[i].start,
-					     bits[i].size, 0);
+			if (!blocks) {
+				readahead_tree_block(root, bits[i].start,
+						     bits[i].size, 0);
+				continue;
+			}
+			blocks[nr_blocks].bytenr = bits[i].start;
+			blocks[nr_blocks].blocksize = bits[i].size;
+			blocks[nr_blocks].parent_transid = 0;
+			nr_blocks++;
+		}
+		if (blocks) {
+			readahead_tree_blocks(root, blocks, nr_blocks);
+			free(blocks);
 		}
 	}
 	*last = bits[0].start;
@@ -5348,17 +7464,22 @@ static int run_next_block(struct btrfs_trans_handle *trans,
 		remove_cache_extent(nodes, cache);
 		free(cache);
 	}
-	cache = lookup_cache_extent(extent_cache, bytenr, size);
+	cache = lookup_extent_rec(extent_cache_of(extent_cache, bytenr, size),
+				  bytenr, size);
 	if (cache) {
 		struct extent_record *rec;
+		struct tree_block_info_rec *block;
 
 		rec = container_of(cache, struct extent_record, cache);
-		gen = rec->parent_generation;
+		block = find_tree_block_info(rec);
+		if (block)
+			gen = block->parent_generation;
 	}
 
 	/* fixme, get the real parent transid */
 	buf = read_tree_block(root, bytenr, size, gen);
 	if (!extent_buffer_uptodate(buf)) {
+		extent_shards_flush();
 		record_bad_block_io(root->fs_info,
 				    extent_cache, bytenr, size);
 		goto out;
@@ -5633,10 +7754,8 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 		if (back->num_refs == 0)
 			back->node.found_extent_tree = 0;
 
-		if (!back->node.found_extent_tree && back->node.found_ref) {
-			list_del(&back->node.list);
-			free(back);
-		}
+		if (!back->node.found_extent_tree && back->node.found_ref)
+			delete_extent_backref(rec, &back->node);
 	} else {
 		struct tree_backref *back;
 		back = find_tree_backref(rec, parent, root_objectid);
@@ -5652,10 +7771,8 @@ static int free_extent_hook(struct btrfs_trans_handle *trans,
 				rec->extent_item_refs--;
 			back->node.found_extent_tree = 0;
 		}
-		if (!back->node.found_extent_tree && back->node.found_ref) {
-			list_del(&back->node.list);
-			free(back);
-		}
+		if (!back->node.found_extent_tree && back->node.found_ref)
+			delete_extent_backref(rec, &back->node);
 	}
 	maybe_free_extent_rec(extent_cache, rec);
 out:
@@ -5761,6 +7878,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 	struct tree_backref *tback;
 	struct data_backref *dback;
 	struct btrfs_tree_block_info *bi;
+	struct tree_block_info_rec *block;
 
 	if (!back->is_data)
 		rec->max_size = max_t(u64, rec->max_size,
@@ -5772,7 +7890,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		if (!back->is_data)
 			item_size += sizeof(*bi);
 
-		ins_key.objectid = rec->start;
+		ins_key.objectid = rec->cache.start;
 		ins_key.offset = rec->max_size;
 		ins_key.type = BTRFS_EXTENT_ITEM_KEY;
 
@@ -5785,8 +7903,14 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		ei = btrfs_item_ptr(leaf, path->slots[0],
 				    struct btrfs_extent_item);
 
+		/*
+		 * A block that was never read only has the generation of the
+		 * pointer to it, which is as good.
+		 */
+		block = find_tree_block_info(rec);
 		btrfs_set_extent_refs(leaf, ei, 0);
-		btrfs_set_extent_generation(leaf, ei, rec->generation);
+		btrfs_set_extent_generation(leaf, ei,
+					    block ? block->generation : 0);
 
 		if (back->is_data) {
 			btrfs_set_extent_flags(leaf, ei,
@@ -5799,8 +7923,9 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			memset_extent_buffer(leaf, 0, (unsigned long)bi,
 					     sizeof(*bi));
 
+			block = tree_block_info(rec);
 			btrfs_set_disk_key_objectid(&copy_key,
-						    rec->info_objectid);
+						    block->info_objectid);
 			btrfs_set_disk_key_type(&copy_key, 0);
 			btrfs_set_disk_key_offset(&copy_key, 0);
 
@@ -5812,7 +7937,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		}
 
 		btrfs_mark_buffer_dirty(leaf);
-		ret = btrfs_update_block_group(trans, extent_root, rec->start,
+		ret = btrfs_update_block_group(trans, extent_root, rec->cache.start,
 					       rec->max_size, 1, 0);
 		if (ret)
 			goto fail;
@@ -5836,7 +7961,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			 * backref
 			 */
 			ret = btrfs_inc_extent_ref(trans, info->extent_root,
-						   rec->start, rec->max_size,
+						   rec->cache.start, rec->max_size,
 						   parent,
 						   dback->root,
 						   parent ?
@@ -5849,7 +7974,7 @@ static int record_extent(struct btrfs_trans_handle *trans,
 		fprintf(stderr, "adding new data backref"
 				" on %llu %s %llu owner %llu"
 				" offset %llu found %d\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				back->full_backref ?
 				"parent" : "root",
 				back->full_backref ?
@@ -5868,11 +7993,11 @@ static int record_extent(struct btrfs_trans_handle *trans,
 			parent = 0;
 
 		ret = btrfs_inc_extent_ref(trans, info->extent_root,
-					   rec->start, rec->max_size,
+					   rec->cache.start, rec->max_size,
 					   parent, tback->root, 0, 0);
 		fprintf(stderr, "adding new tree backref on "
 			"start %llu len %llu parent %llu root %llu\n",
-			rec->start, rec->max_size, tback->parent, tback->root);
+			rec->cache.start, rec->max_size, tback->parent, tback->root);
 	}
 	if (ret)
 		goto fail;
@@ -6105,6 +8230,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	int broken_entries = 0;
 	int ret = 0;
 	short mismatch = 0;
+	u32 nr;
 
 	/*
 	 * Metadata is easy and the backrefs should always agree on bytenr and
@@ -6113,7 +8239,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	if (rec->metadata)
 		return 0;
 
-	list_for_each_entry(back, &rec->backrefs, list) {
+	for_each_extent_backref(rec, back, nr) {
 		if (back->full_backref || !back->is_data)
 			continue;
 
@@ -6153,7 +8279,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 		 * If we only have on entry we may think the entries agree when
 		 * in reality they don't so we have to do some extra checking.
 		 */
-		if (dback->disk_bytenr != rec->start ||
+		if (dback->disk_bytenr != rec->cache.start ||
 		    dback->bytes != rec->nr || back->broken)
 			mismatch = 1;
 
@@ -6170,7 +8296,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 		goto out;
 
 	fprintf(stderr, "attempting to repair backref discrepency for bytenr "
-		"%Lu\n", rec->start);
+		"%Lu\n", rec->cache.start);
 
 	/*
 	 * First we want to see if the backrefs can agree amongst themselves who
@@ -6184,12 +8310,12 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	 * this is where we use the extent ref to see what it thinks.
 	 */
 	if (!best) {
-		entry = find_entry(&entries, rec->start, rec->nr);
+		entry = find_entry(&entries, rec->cache.start, rec->nr);
 		if (!entry && (!broken_entries || !rec->found_rec)) {
 			fprintf(stderr, "Backrefs don't agree with each other "
 				"and extent record doesn't agree with anybody,"
 				" so we can't fix bytenr %Lu bytes %Lu\n",
-				rec->start, rec->nr);
+				rec->cache.start, rec->nr);
 			ret = -EINVAL;
 			goto out;
 		} else if (!entry) {
@@ -6203,7 +8329,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 				goto out;
 			}
 			memset(entry, 0, sizeof(*entry));
-			entry->bytenr = rec->start;
+			entry->bytenr = rec->cache.start;
 			entry->bytes = rec->nr;
 			list_add_tail(&entry->list, &entries);
 			nr_entries++;
@@ -6214,7 +8340,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 			fprintf(stderr, "Backrefs and extent record evenly "
 				"split on who is right, this is going to "
 				"require user input to fix bytenr %Lu bytes "
-				"%Lu\n", rec->start, rec->nr);
+				"%Lu\n", rec->cache.start, rec->nr);
 			ret = -EINVAL;
 			goto out;
 		}
@@ -6225,12 +8351,12 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	 * this case higher up, but in case somebody removes that we still can't
 	 * deal with it properly here yet, so just bail out of that's the case.
 	 */
-	if (best->bytenr != rec->start) {
+	if (best->bytenr != rec->cache.start) {
 		fprintf(stderr, "Extent start and backref starts don't match, "
 			"please use btrfs-image on this file system and send "
 			"it to a btrfs developer so they can make fsck fix "
 			"this particular case.  bytenr is %Lu, bytes is %Lu\n",
-			rec->start, rec->nr);
+			rec->cache.start, rec->nr);
 		ret = -EINVAL;
 		goto out;
 	}
@@ -6239,7 +8365,7 @@ static int verify_backrefs(struct btrfs_trans_handle *trans,
 	 * Ok great we all agreed on an extent record, let's go find the real
 	 * references and fix up the ones that don't match.
 	 */
-	list_for_each_entry(back, &rec->backrefs, list) {
+	for_each_extent_backref(rec, back, nr) {
 		if (back->full_backref || !back->is_data)
 			continue;
 
@@ -6283,6 +8409,7 @@ static int process_duplicates(struct btrfs_root *root,
 			      struct extent_record *rec)
 {
 	struct extent_record *good, *tmp;
+	struct extent_record_extra *extra, *tmp_extra;
 	struct cache_extent *cache;
 	int ret;
 
@@ -6291,11 +8418,11 @@ static int process_duplicates(struct btrfs_root *root,
 	 * have more than one duplicate we are likely going to need to delete
 	 * something.
 	 */
-	if (rec->found_rec || rec->num_duplicates > 1)
+	if (rec->found_rec || nr_duplicates(rec) > 1)
 		return 0;
 
 	/* Shouldn't happen but just in case */
-	BUG_ON(!rec->num_duplicates);
+	BUG_ON(!nr_duplicates(rec));
 
 	/*
 	 * So this happens if we end up with a backref that doesn't match the
@@ -6307,19 +8434,18 @@ static int process_duplicates(struct btrfs_root *root,
 	 */
 	remove_cache_extent(extent_cache, &rec->cache);
 
-	good = list_entry(rec->dups.next, struct extent_record, list);
-	list_del_init(&good->list);
-	INIT_LIST_HEAD(&good->backrefs);
-	INIT_LIST_HEAD(&good->dups);
-	good->cache.start = good->start;
+	good = extent_record_entry(rec->extra->dups.next);
+	extra = good->extra;
+	list_del_init(&extra->list);
 	good->cache.size = good->nr;
 	good->content_checked = 0;
 	good->owner_ref_checked = 0;
-	good->num_duplicates = 0;
+	extra->num_duplicates = 0;
 	good->refs = rec->refs;
-	list_splice_init(&rec->backrefs, &good->backrefs);
+	ret = splice_extent_backrefs(good, rec);
+	BUG_ON(ret);
 	while (1) {
-		cache = lookup_cache_extent(extent_cache, good->start,
+		cache = lookup_cache_extent(extent_cache, good->cache.start,
 					    good->nr);
 		if (!cache)
 			break;
@@ -6330,14 +8456,16 @@ static int process_duplicates(struct btrfs_root *root,
 		 * set then it's a duplicate and we need to try and delete
 		 * something.
 		 */
-		if (tmp->found_rec || tmp->num_duplicates > 0) {
-			if (list_empty(&good->list))
-				list_add_tail(&good->list,
+		if (tmp->found_rec || nr_duplicates(tmp) > 0) {
+			if (list_empty(&extra->list))
+				list_add_tail(&extra->list,
 					      &duplicate_extents);
-			good->num_duplicates += tmp->num_duplicates + 1;
-			list_splice_init(&tmp->dups, &good->dups);
-			list_del_init(&tmp->list);
-			list_add_tail(&tmp->list, &good->dups);
+			extra->num_duplicates += nr_duplicates(tmp) + 1;
+			tmp_extra = extent_record_extra(tmp);
+			BUG_ON(!tmp_extra);
+			list_splice_init(&tmp_extra->dups, &extra->dups);
+			list_del_init(&tmp_extra->list);
+			list_add_tail(&tmp_extra->list, &extra->dups);
 			remove_cache_extent(extent_cache, &tmp->cache);
 			continue;
 		}
@@ -6347,14 +8475,15 @@ static int process_duplicates(struct btrfs_root *root,
 		 * just add it to this extent and carry on like we did above.
 		 */
 		good->refs += tmp->refs;
-		list_splice_init(&tmp->backrefs, &good->backrefs);
+		ret = splice_extent_backrefs(good, tmp);
+		BUG_ON(ret);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_record(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
-	return good->num_duplicates ? 0 : 1;
+	free_extent_record(rec);
+	return extra->num_duplicates ? 0 : 1;
 }
 
 static int delete_duplicate_records(struct btrfs_trans_handle *trans,
@@ -6363,7 +8492,8 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 {
 	LIST_HEAD(delete_list);
 	struct btrfs_path *path;
-	struct extent_record *tmp, *good, *n;
+	struct extent_record *tmp, *good;
+	struct extent_record_extra *extra, *n;
 	int nr_del = 0;
 	int ret = 0;
 	struct btrfs_key key;
@@ -6376,37 +8506,39 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 
 	good = rec;
 	/* Find the record that covers all of the duplicates. */
-	list_for_each_entry(tmp, &rec->dups, list) {
-		if (good->start < tmp->start)
+	list_for_each_entry(extra, &rec->extra->dups, list) {
+		tmp = extra->rec;
+		if (good->cache.start < tmp->cache.start)
 			continue;
 		if (good->nr > tmp->nr)
 			continue;
 
-		if (tmp->start + tmp->nr < good->start + good->nr) {
+		if (tmp->cache.start + tmp->nr < good->cache.start + good->nr) {
 			fprintf(stderr, "Ok we have overlapping extents that "
 				"aren't completely covered by eachother, this "
 				"is going to require more careful thought.  "
 				"The extents are [%Lu-%Lu] and [%Lu-%Lu]\n",
-				tmp->start, tmp->nr, good->start, good->nr);
+				tmp->cache.start, tmp->nr, good->cache.start, good->nr);
 			abort();
 		}
 		good = tmp;
 	}
 
 	if (good != rec)
-		list_add_tail(&rec->list, &delete_list);
+		list_add_tail(&rec->extra->list, &delete_list);
 
-	list_for_each_entry_safe(tmp, n, &rec->dups, list) {
-		if (tmp == good)
+	list_for_each_entry_safe(extra, n, &rec->extra->dups, list) {
+		if (extra->rec == good)
 			continue;
-		list_move_tail(&tmp->list, &delete_list);
+		list_move_tail(&extra->list, &delete_list);
 	}
 
 	root = root->fs_info->extent_root;
-	list_for_each_entry(tmp, &delete_list, list) {
+	list_for_each_entry(extra, &delete_list, list) {
+		tmp = extra->rec;
 		if (tmp->found_rec == 0)
 			continue;
-		key.objectid = tmp->start;
+		key.objectid = tmp->cache.start;
 		key.type = BTRFS_EXTENT_ITEM_KEY;
 		key.offset = tmp->nr;
 
@@ -6414,7 +8546,7 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 		if (tmp->metadata) {
 			fprintf(stderr, "Well this shouldn't happen, extent "
 				"record overlaps but is metadata? "
-				"[%Lu, %Lu]\n", tmp->start, tmp->nr);
+				"[%Lu, %Lu]\n", tmp->cache.start, tmp->nr);
 			abort();
 		}
 
@@ -6433,23 +8565,23 @@ static int delete_duplicate_records(struct btrfs_trans_handle *trans,
 
 out:
 	while (!list_empty(&delete_list)) {
-		tmp = list_entry(delete_list.next, struct extent_record, list);
-		list_del_init(&tmp->list);
+		tmp = extent_record_entry(delete_list.next);
+		list_del_init(&tmp->extra->list);
 		if (tmp == rec)
 			continue;
-		free(tmp);
+		free_extent_record(tmp);
 	}
 
-	while (!list_empty(&rec->dups)) {
-		tmp = list_entry(rec->dups.next, struct extent_record, list);
-		list_del_init(&tmp->list);
-		free(tmp);
+	while (!list_empty(&rec->extra->dups)) {
+		tmp = extent_record_entry(rec->extra->dups.next);
+		list_del_init(&tmp->extra->list);
+		free_extent_record(tmp);
 	}
 
 	btrfs_free_path(path);
 
 	if (!ret && !nr_del)
-		rec->num_duplicates = 0;
+		rec->extra->num_duplicates = 0;
 
 	return ret ? ret : nr_del;
 }
@@ -6468,8 +8600,9 @@ static int find_possible_backrefs(struct btrfs_trans_handle *trans,
 	struct btrfs_key key;
 	u64 bytenr, bytes;
 	int ret;
+	u32 nr;
 
-	list_for_each_entry(back, &rec->backrefs, list) {
+	for_each_extent_backref(rec, back, nr) {
 		/* Don't care about full backrefs (poor unloved backrefs) */
 		if (back->full_backref || !back->is_data)
 			continue;
@@ -6554,11 +8687,11 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 {
 	int ret;
 	struct btrfs_path *path;
-	struct list_head *cur = rec->backrefs.next;
 	struct cache_extent *cache;
 	struct extent_backref *back;
 	int allocated = 0;
 	u64 flags = 0;
+	u32 nr;
 
 	/*
 	 * remember our flags for recreating the extent.
@@ -6567,7 +8700,7 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 	 */
 	if (!init_extent_tree) {
 		ret = btrfs_lookup_extent_info(NULL, info->extent_root,
-					rec->start, rec->max_size,
+					rec->cache.start, rec->max_size,
 					rec->metadata, NULL, &flags);
 		if (ret < 0)
 			return ret;
@@ -6601,24 +8734,21 @@ static int fixup_extent_refs(struct btrfs_trans_handle *trans,
 
 	/* step two, delete all the existing records */
 	ret = delete_extent_records(trans, info->extent_root, path,
-				    rec->start, rec->max_size);
+				    rec->cache.start, rec->max_size);
 
 	if (ret < 0)
 		goto out;
 
 	/* was this block corrupt?  If so, don't add references to it */
 	cache = lookup_cache_extent(info->corrupt_blocks,
-				    rec->start, rec->max_size);
+				    rec->cache.start, rec->max_size);
 	if (cache) {
 		ret = 0;
 		goto out;
 	}
 
 	/* step three, recreate all the refs we did find */
-	while(cur != &rec->backrefs) {
-		back = list_entry(cur, struct extent_backref, list);
-		cur = cur->next;
-
+	for_each_extent_backref(rec, back, nr) {
 		/*
 		 * if we didn't find any references, don't create a
 		 * new extent record
@@ -6771,7 +8901,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		while(cache) {
 			rec = container_of(cache, struct extent_record, cache);
 			btrfs_pin_extent(root->fs_info,
-					 rec->start, rec->max_size);
+					 rec->cache.start, rec->max_size);
 			cache = next_cache_extent(cache);
 		}
 
@@ -6792,9 +8922,8 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 	 * belong to a different extent item and not the weird duplicate one.
 	 */
 	while (repair && !list_empty(&duplicate_extents)) {
-		rec = list_entry(duplicate_extents.next, struct extent_record,
-				 list);
-		list_del_init(&rec->list);
+		rec = extent_record_entry(duplicate_extents.next);
+		list_del_init(&rec->extra->list);
 
 		/* Sometimes we can find a backref before we find an actual
 		 * extent, so we need to process it a little bit to see if there
@@ -6826,15 +8955,15 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		if (!cache)
 			break;
 		rec = container_of(cache, struct extent_record, cache);
-		if (rec->num_duplicates) {
+		if (nr_duplicates(rec)) {
 			fprintf(stderr, "extent item %llu has multiple extent "
-				"items\n", (unsigned long long)rec->start);
+				"items\n", (unsigned long long)rec->cache.start);
 			err = 1;
 		}
 
 		if (rec->refs != rec->extent_item_refs) {
 			fprintf(stderr, "ref mismatch on [%llu %llu] ",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 			fprintf(stderr, "extent item %llu, found %llu\n",
 				(unsigned long long)rec->extent_item_refs,
@@ -6851,7 +8980,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		}
 		if (all_backpointers_checked(rec, 1)) {
 			fprintf(stderr, "backpointer mismatch on [%llu %llu]\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 
 			if (!fixed && repair) {
@@ -6866,7 +8995,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		}
 		if (!rec->owner_ref_checked) {
 			fprintf(stderr, "owner ref check failed [%llu %llu]\n",
-				(unsigned long long)rec->start,
+				(unsigned long long)rec->cache.start,
 				(unsigned long long)rec->nr);
 			if (!fixed && repair) {
 				ret = fixup_extent_refs(trans, root->fs_info,
@@ -6879,8 +9008,7 @@ static int check_extent_refs(struct btrfs_trans_handle *trans,
 		}
 
 		remove_cache_extent(extent_cache, cache);
-		free_all_extent_backrefs(rec);
-		free(rec);
+		free_extent_record(rec);
 	}
 repair_abort:
 	if (repair) {
@@ -7368,6 +9496,9 @@ again:
 		path.slots[0]++;
 	}
 	btrfs_release_path(&path);
+	if (!repair && !init_extent_tree)
+		extent_shards_start(root->fs_info, &extent_cache,
+				    nr_check_threads);
 	ret = deal_root_from_list(&normal_trees, trans, root,
 				  bits, bits_nr, &pending, &seen,
 				  &reada, &nodes, &extent_cache,
@@ -7382,6 +9513,7 @@ again:
 				  &dev_extent_cache);
 	if (ret < 0)
 		goto out;
+	extent_shards_stop();
 	if (ret >= 0)
 		ret = check_extent_refs(trans, root, &extent_cache);
 	if (ret == -EAGAIN) {
@@ -7418,6 +9550,7 @@ again:
 		ret = err;
 
 out:
+	extent_shards_stop();
 	if (trans) {
 		err = btrfs_commit_transaction(trans, root);
 		if (!ret)
@@ -7438,6 +9571,10 @@ out:
 	free_extent_cache_tree(&pending);
 	free_extent_cache_tree(&reada);
 	free_extent_cache_tree(&nodes);
+	if (!release_record_slabs() && record_spill_fd >= 0) {
+		if (!ftruncate(record_spill_fd, 0))
+			record_spill_size = 0;
+	}
 	return ret;
 }
 
@@ -8414,6 +10551,11 @@ const char * const cmd_check_usage[] = {
 	"--qgroup-report             print a report on qgroup consistency",
 	"--subvol-extents <subvolid> print subvolume extents and sharing state",
 	"--tree-root <bytenr>        use the given bytenr for the tree root",
+	"--cache-size <size>         limit the tree block cache to <size> bytes",
+	"--threads <N>               check with N worker threads",
+	"--spill-dir <dir>           keep extent records in a file in <dir>",
+	"-v|--verbose                print tree block cache statistics and the",
+	"                            progress of --check-data-csum",
 	NULL
 };
 
@@ -8431,13 +10573,15 @@ int cmd_check(int argc, char **argv)
 	int init_csum_tree = 0;
 	int readonly = 0;
 	int qgroup_report = 0;
+	int nr_fs_root_threads;
 	enum btrfs_open_ctree_flags ctree_flags = OPEN_CTREE_EXCLUSIVE;
 
 	while(1) {
 		int c;
 		int option_index = 0;
 		enum { OPT_REPAIR = 257, OPT_INIT_CSUM, OPT_INIT_EXTENT,
-			OPT_CHECK_CSUM, OPT_READONLY };
+			OPT_CHECK_CSUM, OPT_READONLY, OPT_CACHE_SIZE,
+			OPT_THREADS, OPT_SPILL_DIR };
 		static const struct option long_options[] = {
 			{ "super", 1, NULL, 's' },
 			{ "repair", 0, NULL, OPT_REPAIR },
@@ -8449,10 +10593,14 @@ int cmd_check(int argc, char **argv)
 			{ "subvol-extents", 1, NULL, 'E' },
 			{ "qgroup-report", 0, NULL, 'Q' },
 			{ "tree-root", 1, NULL, 'r' },
+			{ "cache-size", 1, NULL, OPT_CACHE_SIZE },
+			{ "threads", 1, NULL, OPT_THREADS },
+			{ "spill-dir", 1, NULL, OPT_SPILL_DIR },
+			{ "verbose", 0, NULL, 'v' },
 			{ NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long(argc, argv, "as:br:", long_options,
+		c = getopt_long(argc, argv, "as:br:v", long_options,
 				&option_index);
 		if (c < 0)
 			break;
@@ -8476,6 +10624,9 @@ int cmd_check(int argc, char **argv)
 			case 'Q':
 				qgroup_report = 1;
 				break;
+			case 'v':
+				verbose = 1;
+				break;
 			case 'E':
 				subvolid = arg_strtou64(optarg);
 				break;
@@ -8508,6 +10659,23 @@ int cmd_check(int argc, char **argv)
 			case OPT_CHECK_CSUM:
 				check_data_csum = 1;
 				break;
+			case OPT_CACHE_SIZE:
+				set_extent_cache_max(parse_size(optarg));
+				break;
+			case OPT_THREADS:
+				num = arg_strtou64(optarg);
+				if (num > 256) {
+					fprintf(stderr,
+						"ERROR: at most 256 threads are supported\n");
+					exit(1);
+				}
+				btrfs_set_reada_threads(num);
+				nr_check_threads = num;
+				break;
+			case OPT_SPILL_DIR:
+				if (record_spill_init(optarg))
+					exit(1);
+				break;
 		}
 	}
 	argc = argc - optind;
@@ -8641,9 +10809,17 @@ int cmd_check(int argc, char **argv)
 	}
 
 	fprintf(stderr, "checking extents\n");
+	nr_fs_root_threads = nr_check_threads;
 	ret = check_chunks_and_extents(root);
-	if (ret)
+	if (ret) {
 		fprintf(stderr, "Errors found in extent allocation tree or chunk allocation\n");
+		/*
+		 * The fs roots of a damaged filesystem are checked on one
+		 * thread, the tree code would print about bad blocks twice
+		 * if the threaded check had to be redone.
+		 */
+		nr_fs_root_threads = 0;
+	}
 
 	ret = repair_root_items(info);
 	if (ret < 0)
@@ -8675,7 +10851,7 @@ int cmd_check(int argc, char **argv)
 	no_holes = btrfs_fs_incompat(root->fs_info,
 				     BTRFS_FEATURE_INCOMPAT_NO_HOLES);
 	fprintf(stderr, "checking fs roots\n");
-	ret = check_fs_roots(root, &root_cache);
+	ret = check_fs_roots(root, &root_cache, nr_fs_root_threads);
 	if (ret)
 		goto out;
 
@@ -8749,6 +10925,8 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		(unsigned long long)data_bytes_allocated,
 		(unsigned long long)data_bytes_referenced);
+	if (verbose)
+		print_extent_cache_stats(&info->extent_cache);
 	printf("%s\n", BTRFS_BUILD_VERSION);
 
 	free_root_recs_tree(&root_cache);
@@ -55,8 +55,12 @@ struct btrfs_receive
 	int mnt_fd;
 	int dest_dir_fd;
 
-	int write_fd;
-	char *write_path;
+	/* open files and clone sources, most recently used first */
+	struct list_head fds;
+	int nr_fds;
+	pthread_mutex_t fd_lock;
+	struct list_head clone_subvols;
+	int nr_clone_subvols;
 
 	char *root_path;
 	char *dest_dir_path; /* relative to root_path */
@@ -67,8 +71,282 @@ struct btrfs_receive
 	struct subvol_uuid_search sus;
 
 	int honor_end_cmd;
+
+	/* worker threads applying the commands as jobs */
+	int max_threads;
+	int nr_threads;
+	pthread_t *threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	/* unfinished jobs in stream order, and those that can run */
+	struct list_head jobs;
+	struct list_head ready;
+	int nr_jobs;
+	int max_jobs;
+	int stop;
+	struct receive_job *write_job;
+	u64 errors;
+	u64 errors_reported;
+	int last_error;
+};
+
+/*
+ * Files are written and cloned through a cache of open fds keyed by the
+ * full path with duplicate slashes removed, so that interleaved writes and
+ * clones don't reopen them for every command.  Renames, unlinks and rmdirs
+ * drop the entries at and below the path.  An fd that is still used by a
+ * worker when its entry is dropped or evicted is closed by the last
+ * put_fd().
+ */
+#define RECEIVE_FD_CACHE_SIZE		64
+#define RECEIVE_SUBVOL_CACHE_SIZE	16
+
+struct receive_fd {
+	struct list_head list;
+	char *path;
+	int flags;
+	int fd;
+	int refs;
+	/* no longer in the cache */
+	int stale;
 };
 
+/* where the subvolumes clones are taken from are mounted */
+struct receive_subvol {
+	struct list_head list;
+	u8 uuid[BTRFS_UUID_SIZE];
+	u64 ctransid;
+	char *path;
+};
+
+/* is path @a equal to @b or a directory above it */
+static int path_contains(const char *a, const char *b)
+{
+	int len = strlen(a);
+
+	if (!len)
+		return 1;
+	return !strncmp(a, b, len) && (b[len] == 0 || b[len] == '/');
+}
+
+/*
+ * The cache key of @path.  The subvolume and clone paths are put together
+ * differently, receiving into the mount root gives "/mnt//sub" for one and
+ * "/mnt/sub" for the other.
+ */
+static char *fd_cache_key(const char *path)
+{
+	char *key = malloc(strlen(path) + 1);
+	char *p;
+
+	if (!key)
+		return NULL;
+	for (p = key; *path; path++)
+		if (*path != '/' || p == key || p[-1] != '/')
+			*p++ = *path;
+	if (p > key + 1 && p[-1] == '/')
+		p--;
+	*p = 0;
+	return key;
+}
+
+static void free_receive_fd(struct receive_fd *rfd)
+{
+	close(rfd->fd);
+	free(rfd->path);
+	free(rfd);
+}
+
+/* called with fd_lock held */
+static void drop_fd(struct btrfs_receive *r, struct receive_fd *rfd)
+{
+	list_del(&rfd->list);
+	r->nr_fds--;
+	if (rfd->refs)
+		rfd->stale = 1;
+	else
+		free_receive_fd(rfd);
+}
+
+static int get_fd(struct btrfs_receive *r, const char *path, int flags,
+		  struct receive_fd **ret)
+{
+	struct receive_fd *rfd;
+	struct receive_fd *tmp;
+	struct receive_fd *new;
+	char *key;
+	int fd;
+
+	key = fd_cache_key(path);
+	if (!key)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&r->fd_lock);
+	list_for_each_entry(rfd, &r->fds, list) {
+		if (rfd->flags == flags && !strcmp(rfd->path, key)) {
+			rfd->refs++;
+			list_move(&rfd->list, &r->fds);
+			pthread_mutex_unlock(&r->fd_lock);
+			free(key);
+			*ret = rfd;
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&r->fd_lock);
+
+	fd = open(path, flags);
+	if (fd < 0) {
+		fd = -errno;
+		free(key);
+		return fd;
+	}
+	new = calloc(1, sizeof(*new));
+	if (!new) {
+		free(key);
+		close(fd);
+		return -ENOMEM;
+	}
+	new->path = key;
+	new->flags = flags;
+	new->fd = fd;
+	new->refs = 1;
+
+	pthread_mutex_lock(&r->fd_lock);
+	list_add(&new->list, &r->fds);
+	r->nr_fds++;
+	list_for_each_entry_safe_reverse(rfd, tmp, &r->fds, list) {
+		if (r->nr_fds <= RECEIVE_FD_CACHE_SIZE)
+			break;
+		if (!rfd->refs)
+			drop_fd(r, rfd);
+	}
+	pthread_mutex_unlock(&r->fd_lock);
+
+	*ret = new;
+	return 0;
+}
+
+static void put_fd(struct btrfs_receive *r, struct receive_fd *rfd)
+{
+	pthread_mutex_lock(&r->fd_lock);
+	if (!--rfd->refs && rfd->stale)
+		free_receive_fd(rfd);
+	pthread_mutex_unlock(&r->fd_lock);
+}
+
+/* drop the fds of @path and of everything below it */
+static void invalidate_fds(struct btrfs_receive *r, const char *path)
+{
+	struct receive_fd *rfd;
+	struct receive_fd *tmp;
+	char *key;
+
+	/* without a key, drop them all rather than keep a stale one */
+	key = fd_cache_key(path);
+	pthread_mutex_lock(&r->fd_lock);
+	list_for_each_entry_safe(rfd, tmp, &r->fds, list)
+		if (!key || path_contains(key, rfd->path))
+			drop_fd(r, rfd);
+	pthread_mutex_unlock(&r->fd_lock);
+	free(key);
+}
+
+static void close_fds(struct btrfs_receive *r)
+{
+	struct receive_fd *rfd;
+	struct receive_fd *tmp;
+
+	pthread_mutex_lock(&r->fd_lock);
+	list_for_each_entry_safe(rfd, tmp, &r->fds, list)
+		drop_fd(r, rfd);
+	pthread_mutex_unlock(&r->fd_lock);
+}
+
+/*
+ * Returns the path of the subvolume with the given received uuid, or of
+ * the one being received, without searching the uuid tree every time.
+ */
+static const char *find_clone_subvol(struct btrfs_receive *r, const u8 *uuid,
+				     u64 ctransid)
+{
+	struct receive_subvol *rs;
+	struct subvol_info *si;
+	char *path;
+
+	list_for_each_entry(rs, &r->clone_subvols, list) {
+		if (rs->ctransid == ctransid &&
+		    !memcmp(rs->uuid, uuid, BTRFS_UUID_SIZE)) {
+			list_move(&rs->list, &r->clone_subvols);
+			return rs->path;
+		}
+	}
+
+	si = subvol_uuid_search(&r->sus, 0, uuid, ctransid, NULL,
+			subvol_search_by_received_uuid);
+	if (si) {
+		/*if (rs_args.ctransid > rs_args.rtransid) {
+			if (!r->force) {
+				ret = -EINVAL;
+				fprintf(stderr, "ERROR: subvolume %s was "
+						"modified after it was "
+						"received.\n",
+						r->subvol_parent_name);
+				goto out;
+			} else {
+				fprintf(stderr, "WARNING: subvolume %s was "
+						"modified after it was "
+						"received.\n",
+						r->subvol_parent_name);
+			}
+		}*/
+		path = si->path;
+		free(si);
+	} else if (!memcmp(uuid, r->cur_subvol->received_uuid,
+			   BTRFS_UUID_SIZE)) {
+		/* TODO check generation of extent */
+		path = strdup(r->cur_subvol->path);
+	} else {
+		return NULL;
+	}
+
+	rs = calloc(1, sizeof(*rs));
+	if (!rs || !path) {
+		free(rs);
+		free(path);
+		return NULL;
+	}
+	memcpy(rs->uuid, uuid, BTRFS_UUID_SIZE);
+	rs->ctransid = ctransid;
+	rs->path = path;
+	list_add(&rs->list, &r->clone_subvols);
+	if (++r->nr_clone_subvols > RECEIVE_SUBVOL_CACHE_SIZE) {
+		struct receive_subvol *old;
+
+		old = list_entry(r->clone_subvols.prev, struct receive_subvol,
+				 list);
+		list_del(&old->list);
+		free(old->path);
+		free(old);
+		r->nr_clone_subvols--;
+	}
+	return path;
+}
+
+static void free_clone_subvols(struct btrfs_receive *r)
+{
+	struct receive_subvol *rs;
+
+	while (!list_empty(&r->clone_subvols)) {
+		rs = list_entry(r->clone_subvols.next, struct receive_subvol,
+				list);
+		list_del(&rs->list);
+		free(rs->path);
+		free(rs);
+	}
+	r->nr_clone_subvols = 0;
+}
+
 static int finish_subvol(struct btrfs_receive *r)
 {
 	int ret;
@@ -134,6 +412,7 @@ out:
 		free(r->cur_subvol);
 		r->cur_subvol = NULL;
 	}
+	free_clone_subvols(r);
 	if (subvol_fd != -1)
 		close(subvol_fd);
 	return ret;
@@ -418,6 +697,9 @@ static int process_rename(const char *from, const char *to, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
+	invalidate_fds(r, full_from);
+	invalidate_fds(r, full_to);
+
 	ret = rename(full_from, full_to);
 	if (ret < 0) {
 		ret = -errno;
@@ -462,6 +744,8 @@ static int process_unlink(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "unlink %s\n", path);
 
+	invalidate_fds(r, full_path);
+
 	ret = unlink(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -482,6 +766,8 @@ static int process_rmdir(const char *path, void *user)
 	if (g_verbose >= 2)
 		fprintf(stderr, "rmdir %s\n", path);
 
+	invalidate_fds(r, full_path);
+
 	ret = rmdir(full_path);
 	if (ret < 0) {
 		ret = -errno;
@@ -494,65 +780,35 @@ static int process_rmdir(const char *path, void *user)
 }
 
 
-static int open_inode_for_write(struct btrfs_receive *r, const char *path)
-{
-	int ret = 0;
-
-	if (r->write_fd != -1) {
-		if (strcmp(r->write_path, path) == 0)
-			goto out;
-		close(r->write_fd);
-		r->write_fd = -1;
-	}
-
-	r->write_fd = open(path, O_RDWR);
-	if (r->write_fd < 0) {
-		ret = -errno;
-		fprintf(stderr, "ERROR: open %s failed. %s\n", path,
-				strerror(-ret));
-		goto out;
-	}
-	free(r->write_path);
-	r->write_path = strdup(path);
-
-out:
-	return ret;
-}
-
-static void close_inode_for_write(struct btrfs_receive *r)
-{
-	if(r->write_fd == -1)
-		return;
-
-	close(r->write_fd);
-	r->write_fd = -1;
-	r->write_path[0] = 0;
-}
-
 static int process_write(const char *path, const void *data, u64 offset,
 			 u64 len, void *user)
 {
 	int ret = 0;
 	struct btrfs_receive *r = user;
 	char *full_path = path_cat(r->full_subvol_path, path);
+	struct receive_fd *rfd;
 	u64 pos = 0;
 	int w;
 
-	ret = open_inode_for_write(r, full_path);
-	if (ret < 0)
+	ret = get_fd(r, full_path, O_RDWR, &rfd);
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: open %s failed. %s\n", full_path,
+				strerror(-ret));
 		goto out;
+	}
 
 	while (pos < len) {
-		w = pwrite(r->write_fd, (char*)data + pos, len - pos,
+		w = pwrite(rfd->fd, (char*)data + pos, len - pos,
 				offset + pos);
 		if (w < 0) {
 			ret = -errno;
 			fprintf(stderr, "ERROR: writing to %s failed. %s\n",
 					path, strerror(-ret));
-			goto out;
+			break;
 		}
 		pos += w;
 	}
+	put_fd(r, rfd);
 
 out:
 	free(full_path);
@@ -567,62 +823,42 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	int ret;
 	struct btrfs_receive *r = user;
 	struct btrfs_ioctl_clone_range_args clone_args;
-	struct subvol_info *si = NULL;
 	char *full_path = path_cat(r->full_subvol_path, path);
-	char *subvol_path = NULL;
+	const char *subvol_path;
 	char *full_clone_path = NULL;
-	int clone_fd = -1;
+	struct receive_fd *rfd = NULL;
+	struct receive_fd *clone_rfd = NULL;
 
-	ret = open_inode_for_write(r, full_path);
-	if (ret < 0)
+	ret = get_fd(r, full_path, O_RDWR, &rfd);
+	if (ret < 0) {
+		fprintf(stderr, "ERROR: open %s failed. %s\n", full_path,
+				strerror(-ret));
+		rfd = NULL;
 		goto out;
+	}
 
-	si = subvol_uuid_search(&r->sus, 0, clone_uuid, clone_ctransid, NULL,
-			subvol_search_by_received_uuid);
-	if (!si) {
-		if (memcmp(clone_uuid, r->cur_subvol->received_uuid,
-				BTRFS_UUID_SIZE) == 0) {
-			/* TODO check generation of extent */
-			subvol_path = strdup(r->cur_subvol->path);
-		} else {
-			ret = -ENOENT;
-			fprintf(stderr, "ERROR: did not find source subvol.\n");
-			goto out;
-		}
-	} else {
-		/*if (rs_args.ctransid > rs_args.rtransid) {
-			if (!r->force) {
-				ret = -EINVAL;
-				fprintf(stderr, "ERROR: subvolume %s was "
-						"modified after it was "
-						"received.\n",
-						r->subvol_parent_name);
-				goto out;
-			} else {
-				fprintf(stderr, "WARNING: subvolume %s was "
-						"modified after it was "
-						"received.\n",
-						r->subvol_parent_name);
-			}
-		}*/
-		subvol_path = strdup(si->path);
+	subvol_path = find_clone_subvol(r, clone_uuid, clone_ctransid);
+	if (!subvol_path) {
+		ret = -ENOENT;
+		fprintf(stderr, "ERROR: did not find source subvol.\n");
+		goto out;
 	}
 
 	full_clone_path = path_cat3(r->root_path, subvol_path, clone_path);
 
-	clone_fd = open(full_clone_path, O_RDONLY | O_NOATIME);
-	if (clone_fd < 0) {
-		ret = -errno;
+	ret = get_fd(r, full_clone_path, O_RDONLY | O_NOATIME, &clone_rfd);
+	if (ret < 0) {
 		fprintf(stderr, "ERROR: failed to open %s. %s\n",
 				full_clone_path, strerror(-ret));
+		clone_rfd = NULL;
 		goto out;
 	}
 
-	clone_args.src_fd = clone_fd;
+	clone_args.src_fd = clone_rfd->fd;
 	clone_args.src_offset = clone_offset;
 	clone_args.src_length = len;
 	clone_args.dest_offset = offset;
-	ret = ioctl(r->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
+	ret = ioctl(rfd->fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
 	if (ret) {
 		ret = -errno;
 		fprintf(stderr, "ERROR: failed to clone extents to %s\n%s\n",
@@ -631,15 +867,12 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	}
 
 out:
-	if (si) {
-		free(si->path);
-		free(si);
-	}
+	if (rfd)
+		put_fd(r, rfd);
+	if (clone_rfd)
+		put_fd(r, clone_rfd);
 	free(full_path);
 	free(full_clone_path);
-	free(subvol_path);
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
@@ -788,6 +1021,602 @@ out:
 	return ret;
 }
 
+/*
+ * With worker threads the commands are queued as jobs and applied in
+ * parallel.  Every job names one or two paths, either as an inode it
+ * changes or as a directory entry it adds or removes.  A job waits for the
+ * earlier jobs it conflicts with:
+ *
+ * - two inode references conflict if the paths are the same
+ * - an entry conflicts with an inode reference to the entry itself, to
+ *   anything below it and to the directory it is in
+ * - two entries conflict if they are in the same directory or one is
+ *   below the other
+ *
+ * Jobs that don't conflict touch different inodes, so the result is the
+ * same as applying the commands one by one.  This relies on send naming
+ * an inode by a single path until it is renamed or linked.  Clones and
+ * new subvolumes wait for all queued jobs and are done by the main thread.
+ *
+ * Consecutive writes to the same file are merged into jobs of up to
+ * RECEIVE_WRITE_BATCH bytes.
+ */
+#define RECEIVE_THREADS			8
+#define RECEIVE_JOBS_PER_THREAD		32
+#define RECEIVE_WRITE_BATCH		(1024 * 1024)
+
+struct receive_ref {
+	const char *path;
+	int entry;
+};
+
+struct receive_job {
+	struct list_head list;
+	struct list_head ready;
+	int cmd;
+	char *path;
+	char *path2;
+	char *name;
+	char *data;
+	u64 len;
+	u64 offset;
+	u64 arg1;
+	u64 arg2;
+	struct timespec at;
+	struct timespec mt;
+	struct timespec ct;
+	struct receive_ref refs[2];
+	int nr_refs;
+	/* number of earlier jobs that conflict with this one */
+	int waiting;
+};
+
+static int path_parent_len(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p - path : 0;
+}
+
+static int refs_conflict(struct receive_ref *a, struct receive_ref *b)
+{
+	int len;
+
+	if (!a->entry && !b->entry)
+		return !strcmp(a->path, b->path);
+	if (a->entry && b->entry) {
+		len = path_parent_len(a->path);
+		if (len == path_parent_len(b->path) &&
+		    !strncmp(a->path, b->path, len))
+			return 1;
+		return path_contains(a->path, b->path) ||
+		       path_contains(b->path, a->path);
+	}
+	if (!a->entry) {
+		struct receive_ref *tmp = a;
+
+		a = b;
+		b = tmp;
+	}
+	/* a is the entry, b the inode */
+	len = path_parent_len(a->path);
+	if (strlen(b->path) == len && !strncmp(a->path, b->path, len))
+		return 1;
+	return path_contains(a->path, b->path);
+}
+
+static int jobs_conflict(struct receive_job *a, struct receive_job *b)
+{
+	int i;
+	int j;
+
+	for (i = 0; i < a->nr_refs; i++)
+		for (j = 0; j < b->nr_refs; j++)
+			if (refs_conflict(&a->refs[i], &b->refs[j]))
+				return 1;
+	return 0;
+}
+
+static void free_receive_job(struct receive_job *job)
+{
+	free(job->path);
+	free(job->path2);
+	free(job->name);
+	free(job->data);
+	free(job);
+}
+
+static int receive_run_job(struct btrfs_receive *r, struct receive_job *job)
+{
+	switch (job->cmd) {
+	case BTRFS_SEND_C_MKFILE:
+		return process_mkfile(job->path, r);
+	case BTRFS_SEND_C_MKDIR:
+		return process_mkdir(job->path, r);
+	case BTRFS_SEND_C_MKNOD:
+		return process_mknod(job->path, job->arg1, job->arg2, r);
+	case BTRFS_SEND_C_MKFIFO:
+		return process_mkfifo(job->path, r);
+	case BTRFS_SEND_C_MKSOCK:
+		return process_mksock(job->path, r);
+	case BTRFS_SEND_C_SYMLINK:
+		return process_symlink(job->path, job->path2, r);
+	case BTRFS_SEND_C_RENAME:
+		return process_rename(job->path, job->path2, r);
+	case BTRFS_SEND_C_LINK:
+		return process_link(job->path, job->path2, r);
+	case BTRFS_SEND_C_UNLINK:
+		return process_unlink(job->path, r);
+	case BTRFS_SEND_C_RMDIR:
+		return process_rmdir(job->path, r);
+	case BTRFS_SEND_C_WRITE:
+		return process_write(job->path, job->data, job->offset,
+				     job->len, r);
+	case BTRFS_SEND_C_SET_XATTR:
+		return process_set_xattr(job->path, job->name, job->data,
+					 job->len, r);
+	case BTRFS_SEND_C_REMOVE_XATTR:
+		return process_remove_xattr(job->path, job->name, r);
+	case BTRFS_SEND_C_TRUNCATE:
+		return process_truncate(job->path, job->arg1, r);
+	case BTRFS_SEND_C_CHMOD:
+		return process_chmod(job->path, job->arg1, r);
+	case BTRFS_SEND_C_CHOWN:
+		return process_chown(job->path, job->arg1, job->arg2, r);
+	case BTRFS_SEND_C_UTIMES:
+		return process_utimes(job->path, &job->at, &job->mt, &job->ct,
+				      r);
+	}
+	return -EINVAL;
+}
+
+static void *receive_worker(void *data)
+{
+	struct btrfs_receive *r = data;
+	struct receive_job *job;
+	struct receive_job *next;
+	int ret;
+
+	pthread_mutex_lock(&r->mutex);
+	while (1) {
+		while (!r->stop && list_empty(&r->ready))
+			pthread_cond_wait(&r->work_cond, &r->mutex);
+		if (list_empty(&r->ready))
+			break;
+		job = list_entry(r->ready.next, struct receive_job, ready);
+		list_del(&job->ready);
+		pthread_mutex_unlock(&r->mutex);
+
+		ret = receive_run_job(r, job);
+
+		pthread_mutex_lock(&r->mutex);
+		if (ret < 0) {
+			r->errors++;
+			r->last_error = ret;
+		}
+		next = job;
+		list_for_each_entry_continue(next, &r->jobs, list) {
+			if (!jobs_conflict(job, next) || --next->waiting)
+				continue;
+			list_add_tail(&next->ready, &r->ready);
+			pthread_cond_signal(&r->work_cond);
+		}
+		list_del(&job->list);
+		r->nr_jobs--;
+		pthread_cond_broadcast(&r->done_cond);
+		free_receive_job(job);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+static void receive_start_workers(struct btrfs_receive *r)
+{
+	int i;
+
+	INIT_LIST_HEAD(&r->jobs);
+	INIT_LIST_HEAD(&r->ready);
+	if (r->max_threads <= 0)
+		return;
+
+	r->threads = calloc(r->max_threads, sizeof(*r->threads));
+	if (!r->threads)
+		return;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->work_cond, NULL);
+	pthread_cond_init(&r->done_cond, NULL);
+	for (i = 0; i < r->max_threads; i++) {
+		if (pthread_create(&r->threads[i], NULL, receive_worker, r))
+			break;
+		r->nr_threads++;
+	}
+	r->max_jobs = r->nr_threads * RECEIVE_JOBS_PER_THREAD;
+	if (r->nr_threads)
+		return;
+
+	/* apply the commands in the main thread */
+	pthread_cond_destroy(&r->done_cond);
+	pthread_cond_destroy(&r->work_cond);
+	pthread_mutex_destroy(&r->mutex);
+	free(r->threads);
+	r->threads = NULL;
+}
+
+/*
+ * Returns an error a worker ran into and that wasn't passed on yet, so
+ * that every failed job counts towards --max-errors.
+ */
+static int receive_error(struct btrfs_receive *r)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&r->mutex);
+	if (r->errors > r->errors_reported) {
+		r->errors_reported++;
+		ret = r->last_error;
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return ret;
+}
+
+static void receive_queue(struct btrfs_receive *r, struct receive_job *job)
+{
+	struct receive_job *prev;
+
+	pthread_mutex_lock(&r->mutex);
+	while (r->nr_jobs >= r->max_jobs)
+		pthread_cond_wait(&r->done_cond, &r->mutex);
+	list_for_each_entry(prev, &r->jobs, list)
+		if (jobs_conflict(prev, job))
+			job->waiting++;
+	list_add_tail(&job->list, &r->jobs);
+	r->nr_jobs++;
+	if (!job->waiting) {
+		list_add_tail(&job->ready, &r->ready);
+		pthread_cond_signal(&r->work_cond);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void receive_flush_write(struct btrfs_receive *r)
+{
+	struct receive_job *job = r->write_job;
+
+	if (job) {
+		r->write_job = NULL;
+		receive_queue(r, job);
+	}
+}
+
+static int receive_submit(struct btrfs_receive *r, struct receive_job *job)
+{
+	receive_flush_write(r);
+	receive_queue(r, job);
+	return receive_error(r);
+}
+
+/* wait until all queued jobs are done */
+static void receive_drain(struct btrfs_receive *r)
+{
+	if (!r->nr_threads)
+		return;
+	receive_flush_write(r);
+	pthread_mutex_lock(&r->mutex);
+	while (r->nr_jobs)
+		pthread_cond_wait(&r->done_cond, &r->mutex);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void receive_stop_workers(struct btrfs_receive *r)
+{
+	int i;
+
+	if (!r->nr_threads)
+		return;
+	receive_drain(r);
+	pthread_mutex_lock(&r->mutex);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->work_cond);
+	pthread_mutex_unlock(&r->mutex);
+	for (i = 0; i < r->nr_threads; i++)
+		pthread_join(r->threads[i], NULL);
+	pthread_cond_destroy(&r->done_cond);
+	pthread_cond_destroy(&r->work_cond);
+	pthread_mutex_destroy(&r->mutex);
+	free(r->threads);
+	r->threads = NULL;
+	r->nr_threads = 0;
+}
+
+static struct receive_job *receive_new_job(int cmd, const char *path,
+					   const char *path2)
+{
+	struct receive_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		goto fail;
+	job->cmd = cmd;
+	job->path = strdup(path);
+	if (!job->path)
+		goto fail;
+	if (path2) {
+		job->path2 = strdup(path2);
+		if (!job->path2)
+			goto fail;
+	}
+
+	job->refs[0].path = job->path;
+	job->nr_refs = 1;
+	switch (cmd) {
+	case BTRFS_SEND_C_RENAME:
+		job->refs[1].path = job->path2;
+		job->refs[1].entry = 1;
+		job->nr_refs = 2;
+		/* fall through */
+	case BTRFS_SEND_C_MKFILE:
+	case BTRFS_SEND_C_MKDIR:
+	case BTRFS_SEND_C_MKNOD:
+	case BTRFS_SEND_C_MKFIFO:
+	case BTRFS_SEND_C_MKSOCK:
+	case BTRFS_SEND_C_SYMLINK:
+	case BTRFS_SEND_C_UNLINK:
+	case BTRFS_SEND_C_RMDIR:
+		job->refs[0].entry = 1;
+		break;
+	case BTRFS_SEND_C_LINK:
+		job->refs[0].entry = 1;
+		job->refs[1].path = job->path2;
+		job->nr_refs = 2;
+		break;
+	}
+	return job;
+
+fail:
+	fprintf(stderr, "ERROR: not enough memory\n");
+	if (job)
+		free_receive_job(job);
+	return NULL;
+}
+
+static int queue_path_cmd(struct btrfs_receive *r, int cmd, const char *path,
+			  const char *path2)
+{
+	struct receive_job *job = receive_new_job(cmd, path, path2);
+
+	if (!job)
+		return -ENOMEM;
+	return receive_submit(r, job);
+}
+
+static int queue_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			void *user)
+{
+	struct btrfs_receive *r = user;
+	int ret;
+
+	receive_drain(r);
+	ret = process_subvol(path, uuid, ctransid, user);
+	return ret ? ret : receive_error(r);
+}
+
+static int queue_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			  const u8 *parent_uuid, u64 parent_ctransid,
+			  void *user)
+{
+	struct btrfs_receive *r = user;
+	int ret;
+
+	receive_drain(r);
+	ret = process_snapshot(path, uuid, ctransid, parent_uuid,
+			       parent_ctransid, user);
+	return ret ? ret : receive_error(r);
+}
+
+static int queue_mkfile(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_MKFILE, path, NULL);
+}
+
+static int queue_mkdir(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_MKDIR, path, NULL);
+}
+
+static int queue_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_MKNOD, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->arg1 = mode;
+	job->arg2 = dev;
+	return receive_submit(user, job);
+}
+
+static int queue_mkfifo(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_MKFIFO, path, NULL);
+}
+
+static int queue_mksock(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_MKSOCK, path, NULL);
+}
+
+static int queue_symlink(const char *path, const char *lnk, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_SYMLINK, path, lnk);
+}
+
+static int queue_rename(const char *from, const char *to, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_RENAME, from, to);
+}
+
+static int queue_link(const char *path, const char *lnk, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_LINK, path, lnk);
+}
+
+static int queue_unlink(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_UNLINK, path, NULL);
+}
+
+static int queue_rmdir(const char *path, void *user)
+{
+	return queue_path_cmd(user, BTRFS_SEND_C_RMDIR, path, NULL);
+}
+
+static int queue_write(const char *path, const void *data, u64 offset,
+		       u64 len, void *user)
+{
+	struct btrfs_receive *r = user;
+	struct receive_job *job = r->write_job;
+
+	if (!job || strcmp(job->path, path) ||
+	    job->offset + job->len != offset ||
+	    job->len + len > RECEIVE_WRITE_BATCH) {
+		receive_flush_write(r);
+		job = receive_new_job(BTRFS_SEND_C_WRITE, path, NULL);
+		if (!job)
+			return -ENOMEM;
+		job->offset = offset;
+		job->data = malloc(max_t(u64, len, RECEIVE_WRITE_BATCH));
+		if (!job->data) {
+			free_receive_job(job);
+			return -ENOMEM;
+		}
+		r->write_job = job;
+	}
+
+	memcpy(job->data + job->len, data, len);
+	job->len += len;
+	return receive_error(r);
+}
+
+static int queue_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset,
+		       void *user)
+{
+	struct btrfs_receive *r = user;
+	int ret;
+
+	receive_drain(r);
+	ret = process_clone(path, offset, len, clone_uuid, clone_ctransid,
+			    clone_path, clone_offset, user);
+	return ret ? ret : receive_error(r);
+}
+
+static int queue_set_xattr(const char *path, const char *name,
+			   const void *data, int len, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_SET_XATTR, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->name = strdup(name);
+	job->data = malloc(len);
+	if (!job->name || !job->data) {
+		free_receive_job(job);
+		return -ENOMEM;
+	}
+	memcpy(job->data, data, len);
+	job->len = len;
+	return receive_submit(user, job);
+}
+
+static int queue_remove_xattr(const char *path, const char *name, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_REMOVE_XATTR, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->name = strdup(name);
+	if (!job->name) {
+		free_receive_job(job);
+		return -ENOMEM;
+	}
+	return receive_submit(user, job);
+}
+
+static int queue_truncate(const char *path, u64 size, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_TRUNCATE, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->arg1 = size;
+	return receive_submit(user, job);
+}
+
+static int queue_chmod(const char *path, u64 mode, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_CHMOD, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->arg1 = mode;
+	return receive_submit(user, job);
+}
+
+static int queue_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_CHOWN, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->arg1 = uid;
+	job->arg2 = gid;
+	return receive_submit(user, job);
+}
+
+static int queue_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct,
+			void *user)
+{
+	struct receive_job *job;
+
+	job = receive_new_job(BTRFS_SEND_C_UTIMES, path, NULL);
+	if (!job)
+		return -ENOMEM;
+	job->at = *at;
+	job->mt = *mt;
+	job->ct = *ct;
+	return receive_submit(user, job);
+}
+
+static struct btrfs_send_ops queue_ops = {
+	.subvol = queue_subvol,
+	.snapshot = queue_snapshot,
+	.mkfile = queue_mkfile,
+	.mkdir = queue_mkdir,
+	.mknod = queue_mknod,
+	.mkfifo = queue_mkfifo,
+	.mksock = queue_mksock,
+	.symlink = queue_symlink,
+	.rename = queue_rename,
+	.link = queue_link,
+	.unlink = queue_unlink,
+	.rmdir = queue_rmdir,
+	.write = queue_write,
+	.clone = queue_clone,
+	.set_xattr = queue_set_xattr,
+	.remove_xattr = queue_remove_xattr,
+	.truncate = queue_truncate,
+	.chmod = queue_chmod,
+	.chown = queue_chown,
+	.utimes = queue_utimes,
+};
+
 
 static struct btrfs_send_ops send_ops = {
 	.subvol = process_subvol,
@@ -817,7 +1646,9 @@ static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
 {
 	int ret;
 	char *dest_dir_full_path;
+	struct btrfs_send_reader *reader = NULL;
 	int end = 0;
+	int err;
 
 	dest_dir_full_path = realpath(tomnt, NULL);
 	if (!dest_dir_full_path) {
@@ -871,16 +1702,41 @@ static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
 	if (ret < 0)
 		goto out;
 
+	/*
+	 * One reader takes all the streams from the fd in large reads.  With
+	 * -e the fd isn't read beyond the END command, for whoever reads it
+	 * after us.
+	 */
+	if (!r->honor_end_cmd) {
+		reader = btrfs_send_reader_open(r_fd);
+		if (!reader) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	receive_start_workers(r);
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops, r,
-							 r->honor_end_cmd,
-							 max_errors);
+		if (reader)
+			ret = btrfs_read_and_process_send_reader(reader,
+				r->nr_threads ? &queue_ops : &send_ops, r,
+				r->honor_end_cmd, max_errors);
+		else
+			ret = btrfs_read_and_process_send_stream(r_fd,
+				r->nr_threads ? &queue_ops : &send_ops, r,
+				r->honor_end_cmd, max_errors);
+		if (r->nr_threads) {
+			receive_drain(r);
+			err = receive_error(r);
+			if (err && ret >= 0)
+				ret = err;
+		}
 		if (ret < 0)
 			goto out;
 		if (ret)
 			end = 1;
 
-		close_inode_for_write(r);
+		close_fds(r);
 		ret = finish_subvol(r);
 		if (ret < 0)
 			goto out;
@@ -888,14 +1744,12 @@ static int do_receive(struct btrfs_receive *r, const char *tomnt, int r_fd,
 	ret = 0;
 
 out:
-	if (r->write_fd != -1) {
-		close(r->write_fd);
-		r->write_fd = -1;
-	}
+	receive_stop_workers(r);
+	btrfs_send_reader_close(reader);
+	close_fds(r);
+	free_clone_subvols(r);
 	free(r->root_path);
 	r->root_path = NULL;
-	free(r->write_path);
-	r->write_path = NULL;
 	free(r->full_subvol_path);
 	r->full_subvol_path = NULL;
 	r->dest_dir_path = NULL;
@@ -924,17 +1778,22 @@ int cmd_receive(int argc, char **argv)
 	struct btrfs_receive r;
 	int receive_fd = fileno(stdin);
 	u64 max_errors = 1;
+	u64 threads;
 	int ret;
 
 	memset(&r, 0, sizeof(r));
 	r.mnt_fd = -1;
-	r.write_fd = -1;
+	INIT_LIST_HEAD(&r.fds);
+	INIT_LIST_HEAD(&r.clone_subvols);
+	pthread_mutex_init(&r.fd_lock, NULL);
 	r.dest_dir_fd = -1;
+	r.max_threads = RECEIVE_THREADS;
 
 	while (1) {
 		int c;
 		static const struct option long_opts[] = {
 			{ "max-errors", 1, NULL, 'E' },
+			{ "threads", 1, NULL, 'T' },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -955,6 +1814,15 @@ int cmd_receive(int argc, char **argv)
 		case 'E':
 			max_errors = arg_strtou64(optarg);
 			break;
+		case 'T':
+			threads = arg_strtou64(optarg);
+			if (threads > 256) {
+				fprintf(stderr,
+					"ERROR: at most 256 threads are supported\n");
+				return 1;
+			}
+			r.max_threads = threads;
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "ERROR: receive args invalid.\n");
@@ -981,7 +1849,7 @@ int cmd_receive(int argc, char **argv)
 }
 
 const char * const cmd_receive_usage[] = {
-	"btrfs receive [-ve] [-f <infile>] [--max-errors <N>] <mount>",
+	"btrfs receive [-ve] [-f <infile>] [--max-errors <N>] [--threads <N>] <mount>",
 	"Receive subvolumes from stdin.",
 	"Receives one or more subvolumes that were previously",
 	"sent with btrfs send. The received subvolumes are stored",
@@ -1004,5 +1872,7 @@ const char * const cmd_receive_usage[] = {
 	"--max-errors <N> Terminate as soon as N errors happened while",
 	"                 processing commands from the send stream.",
 	"                 Default value is 1. A value of 0 means no limit.",
+	"--threads <N>    Apply the commands with N threads, the default",
+	"                 is 8. 0 applies them one by one.",
 	NULL
 };
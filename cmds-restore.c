@@ -33,6 +33,8 @@
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "ctree.h"
 #include "disk-io.h"
@@ -43,6 +45,8 @@
 #include "volumes.h"
 #include "utils.h"
 #include "commands.h"
+#include "ioctl.h"
+#include "extent-cache.h"
 
 static char fs_name[4096];
 static char path_name[4096];
@@ -223,7 +227,7 @@ static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
 {
 	struct extent_buffer *leaf = path->nodes[0];
 	struct btrfs_file_extent_item *fi;
-	char buf[4096];
+	char *buf;
 	char *outbuf;
 	u64 ram_size;
 	ssize_t done;
@@ -238,11 +242,18 @@ static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
 	ptr = btrfs_file_extent_inline_start(fi);
 	len = btrfs_file_extent_inline_len(leaf, path->slots[0], fi);
 	inline_item_len = btrfs_file_extent_inline_item_len(leaf, btrfs_item_nr(path->slots[0]));
+	/* the item can be as large as the leaf */
+	buf = malloc(inline_item_len);
+	if (!buf) {
+		fprintf(stderr, "No memory\n");
+		return -ENOMEM;
+	}
 	read_extent_buffer(leaf, buf, ptr, inline_item_len);
 
 	compress = btrfs_file_extent_compression(leaf, fi);
 	if (compress == BTRFS_COMPRESS_NONE) {
 		done = pwrite(fd, buf, len, pos);
+		free(buf);
 		if (done < len) {
 			fprintf(stderr, "Short inline write, wanted %d, did "
 				"%zd: %d\n", len, done, errno);
@@ -255,10 +266,12 @@ static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
 	outbuf = calloc(1, ram_size);
 	if (!outbuf) {
 		fprintf(stderr, "No memory\n");
+		free(buf);
 		return -ENOMEM;
 	}
 
-	ret = decompress(buf, outbuf, len, &ram_size, compress);
+	ret = decompress(buf, outbuf, inline_item_len, &ram_size, compress);
+	free(buf);
 	if (ret) {
 		free(outbuf);
 		return ret;
@@ -275,38 +288,858 @@ static int copy_one_inline(int fd, struct btrfs_path *path, u64 pos)
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
+/*
+ * The part of a file extent that is copied as one unit: @disk_len bytes
+ * at @bytenr are read and verified and, if compressed, inflated to
+ * @ram_size bytes, of which @num_bytes at @offset are written to @pos.
+ */
+struct restore_extent {
+	u64 bytenr;
+	u64 disk_len;
+	u64 ram_size;
+	u64 offset;
+	u64 num_bytes;
+	u64 pos;
+	int compress;
+};
+
+/*
+ * Copy the checksums of the sectors in [@bytenr, @bytenr + @len) from the
+ * csum tree, @have tells which sectors have one.  Sectors without a
+ * checksum, or behind a broken csum tree, are restored unverified.
+ */
+static void lookup_data_csums(struct btrfs_root *root, u64 bytenr, u64 len,
+			      char *csums, char *have)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	struct btrfs_root *csum_root = info->csum_root;
+	struct btrfs_path *path;
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	u16 csum_size = btrfs_super_csum_size(info->super_copy);
+	u32 sectorsize = root->sectorsize;
+	u64 item_end;
+	u64 start;
+	u64 end;
+	int ret;
+
+	memset(have, 0, len / sectorsize);
+	if (!csum_root || !extent_buffer_uptodate(csum_root->node))
+		return;
+	path = btrfs_alloc_path();
+	if (!path)
+		return;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = bytenr;
+	ret = btrfs_search_slot(NULL, csum_root, &key, path, 0, 0);
+	if (ret < 0)
+		goto out;
+	/* the item before the key may cover the start of the range */
+	if (ret > 0 && btrfs_previous_item(csum_root, path, 0,
+					   BTRFS_EXTENT_CSUM_KEY)) {
+		btrfs_release_path(path);
+		if (btrfs_search_slot(NULL, csum_root, &key, path, 0, 0) < 0)
+			goto out;
+	}
+
+	while (1) {
+		leaf = path->nodes[0];
+		if (!leaf || path->slots[0] >= btrfs_header_nritems(leaf)) {
+			if (next_leaf(csum_root, path))
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY ||
+		    key.offset >= bytenr + len)
+			break;
+		item_end = key.offset + btrfs_item_size_nr(leaf, path->slots[0]) /
+			   csum_size * sectorsize;
+		start = max(key.offset, bytenr);
+		end = min(item_end, bytenr + len);
+		if (start < end) {
+			read_extent_buffer(leaf,
+				csums + (start - bytenr) / sectorsize * csum_size,
+				btrfs_item_ptr_offset(leaf, path->slots[0]) +
+				(start - key.offset) / sectorsize * csum_size,
+				(end - start) / sectorsize * csum_size);
+			memset(have + (start - bytenr) / sectorsize, 1,
+			       (end - start) / sectorsize);
+		}
+		path->slots[0]++;
+	}
+out:
+	btrfs_free_path(path);
+}
+
+static int read_data_mirror(struct btrfs_fs_info *info, char *data,
+			    u64 bytenr, u64 len, int mirror)
 {
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
-	char *inbuf, *outbuf = NULL;
-	ssize_t done, total = 0;
+	u64 physical;
+	u64 length;
+	ssize_t done;
+	int ret;
+
+	while (len > 0) {
+		length = len;
+		if (btrfs_is_raid56_rebuild(&info->mapping_tree, bytenr,
+					    mirror)) {
+			if (read_raid56_rebuild(info, data, bytenr, &length,
+						mirror))
+				return -EIO;
+			goto next;
+		}
+		ret = btrfs_map_block(&info->mapping_tree, READ, bytenr,
+				      &length, &multi, mirror, NULL);
+		if (ret) {
+			fprintf(stderr, "Error mapping block %d\n", ret);
+			return ret;
+		}
+		device = multi->stripes[0].dev;
+		device->total_ios++;
+		physical = multi->stripes[0].physical;
+		kfree(multi);
+		multi = NULL;
+
+		length = min(length, len);
+		done = pread(device->fd, data, length, physical);
+		/* Need both checks, or we miss negative values due to u64 conversion */
+		if (done < 0 || done < length)
+			return -EIO;
+next:
+		data += length;
+		bytenr += length;
+		len -= length;
+	}
+	return 0;
+}
+
+/*
+ * Verify the data read for @ext against @csums and inflate it, @out is set
+ * to the data to write.  Returns 1 for a checksum mismatch, or a negative
+ * error if it can't be inflated.
+ */
+static int decode_extent(struct restore_extent *ext, char *inbuf,
+			 char *outbuf, const char *csums, const char *have,
+			 u32 sectorsize, u16 csum_size, char **out)
+{
+	u64 nr = ext->disk_len / sectorsize;
+	u64 ram_size = ext->ram_size;
+	u32 result[32];
+	u64 i;
+	u64 j;
+	u64 n;
+	int ret;
+
+	for (i = 0; have && i < nr; i += n) {
+		n = min_t(u64, nr - i, ARRAY_SIZE(result));
+		if (!memchr(have + i, 1, n))
+			continue;
+		btrfs_csum_sectors(NULL, inbuf + i * sectorsize, sectorsize, n,
+				   result);
+		for (j = 0; j < n; j++) {
+			if (have[i + j] &&
+			    memcmp(&result[j], csums + (i + j) * csum_size,
+				   csum_size))
+				return 1;
+		}
+	}
+
+	if (ext->compress == BTRFS_COMPRESS_NONE) {
+		*out = inbuf;
+		return 0;
+	}
+
+	ret = decompress(inbuf, outbuf, ext->disk_len, &ram_size,
+			 ext->compress);
+	if (ret)
+		return ret;
+	if (ext->offset + ext->num_bytes > ram_size) {
+		fprintf(stderr, "Extent at %llu is shorter than its file extent\n",
+			(unsigned long long)ext->bytenr);
+		return -EINVAL;
+	}
+	*out = outbuf + ext->offset;
+	return 0;
+}
+
+static int write_data(int fd, char *buf, u64 len, u64 pos)
+{
+	ssize_t done;
+	u64 total = 0;
+
+	while (total < len) {
+		done = pwrite(fd, buf + total, len - total, pos + total);
+		if (done < 0) {
+			fprintf(stderr, "Error writing: %d %s\n", errno,
+				strerror(errno));
+			return -1;
+		}
+		total += done;
+	}
+	return 0;
+}
+
+/*
+ * Copy @ext trying all the mirrors until one reads, matches its checksums
+ * and inflates.  If no mirror has good checksums the first readable one is
+ * restored anyway, restore is about getting back what's left.
+ */
+static int copy_one_extent(struct btrfs_root *root, int fd,
+			   struct restore_extent *ext)
+{
+	struct btrfs_fs_info *info = root->fs_info;
+	u16 csum_size = btrfs_super_csum_size(info->super_copy);
+	u32 sectorsize = root->sectorsize;
+	u64 nr = ext->disk_len / sectorsize;
+	char *inbuf;
+	char *outbuf = NULL;
+	char *csums;
+	char *have;
+	char *data;
+	int csum_failed = 0;
+	int num_copies;
+	int mirror;
+	int verify;
+	int ret = -ENOMEM;
+
+	inbuf = malloc(ext->disk_len);
+	csums = malloc(nr * csum_size + 1);
+	have = malloc(nr + 1);
+	if (ext->compress != BTRFS_COMPRESS_NONE)
+		outbuf = calloc(1, ext->ram_size);
+	if (!inbuf || !csums || !have ||
+	    (ext->compress != BTRFS_COMPRESS_NONE && !outbuf)) {
+		fprintf(stderr, "No memory\n");
+		goto out;
+	}
+	lookup_data_csums(root, ext->bytenr, nr * sectorsize, csums, have);
+
+	num_copies = btrfs_num_copies(&info->mapping_tree, ext->bytenr,
+				      ext->disk_len);
+	for (verify = 1; verify >= 0; verify--) {
+		for (mirror = 1; mirror <= num_copies; mirror++) {
+			if (mirror > 1)
+				fprintf(stderr, "Trying another mirror\n");
+			ret = read_data_mirror(info, inbuf, ext->bytenr,
+					       ext->disk_len, mirror);
+			if (ret)
+				continue;
+			ret = decode_extent(ext, inbuf, outbuf, csums,
+					    verify ? have : NULL, sectorsize,
+					    csum_size, &data);
+			if (ret == 1) {
+				fprintf(stderr, "mirror %d of extent %llu has bad checksums\n",
+					mirror, (unsigned long long)ext->bytenr);
+				csum_failed = 1;
+			}
+			if (!ret) {
+				ret = write_data(fd, data, ext->num_bytes,
+						 ext->pos);
+				goto out;
+			}
+		}
+		if (!csum_failed)
+			break;
+		fprintf(stderr, "No good copy of extent %llu, restoring it unverified\n",
+			(unsigned long long)ext->bytenr);
+	}
+	fprintf(stderr, "Exhausted mirrors trying to read\n");
+	ret = -1;
+out:
+	free(inbuf);
+	free(outbuf);
+	free(csums);
+	free(have);
+	return ret;
+}
+
+/*
+ * Restored files stay open until all their extents are written, the size is
+ * set when the last reference is dropped.
+ */
+struct restore_file {
+	char *name;
+	int fd;
+	int refs;
+	int failed;
+	u64 size;
+	struct restore_src *src;
+};
+
+/*
+ * Extents already restored, so that later references to them from
+ * snapshots or reflinked files are cloned from the first copy instead of
+ * being read and written again.  Plain extents are indexed by the disk
+ * range the file extent points to, compressed ones by the range of the
+ * inflated data with the disk bytenr as objectid.
+ */
+struct restore_src {
+	struct list_head list;
+	u64 size;
+	char name[0];
+};
+
+struct restored_extent {
+	struct cache_extent cache;
+	struct restore_src *src;
+	/* where cache.start ended up in the file */
+	u64 pos;
+	int failed;
+	/*
+	 * The next extent restored by the same merged job.  Earlier jobs of
+	 * a large extent mark these failed too, which only means they are
+	 * copied instead of cloned.
+	 */
+	struct restored_extent *merged;
+};
+
+/*
+ * Data is restored by a pipeline.  The main thread walks the trees, cuts
+ * the file extents into jobs, looks up their checksums and maps them to
+ * the first mirror.  Worker threads read, verify, inflate and write the
+ * jobs from a deep ring, and the main thread retires them in order.  A job
+ * that failed, or that the workers can't do like a degraded RAID5/6 read,
+ * is redone by copy_one_extent() which reports the errors and tries the
+ * other mirrors.
+ */
+#define RESTORE_JOB_SIZE	(1024 * 1024)
+#define RESTORE_JOB_STRIPES	16
+#define RESTORE_JOBS_PER_THREAD	8
+
+struct restore_stripe {
+	int fd;
+	u64 physical;
+	u64 len;
+};
+
+struct restore_job {
+	struct restore_file *file;
+	struct restore_extent ext;
+	/* the extent this job restores, or the copy to clone it from */
+	struct restored_extent *rec;
+	struct restored_extent *clone;
+	u64 clone_pos;
+	/* 0 means the job is done by copy_one_extent() */
+	int nr_stripes;
+	struct restore_stripe stripes[RESTORE_JOB_STRIPES];
+	char *data;
+	char *outbuf;
+	char *csums;
+	char *have;
+	int ret;
+	int done;
+};
+
+struct restore_pipe {
+	struct btrfs_root *root;
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct restore_job *ring;
+	int ring_size;
+	/* oldest queued job, next job for a worker and next free slot */
+	u64 head;
+	u64 next;
+	u64 tail;
+	int stop;
+	/* set on the first error unless errors are ignored */
+	int aborted;
+	u32 sectorsize;
+	u16 csum_size;
+	struct cache_tree restored;
+	struct list_head srcs;
+	/* cleared when the target can't clone */
+	int reflink;
+	struct restore_src *clone_src;
+	int clone_fd;
+	u64 bytes_cloned;
+	/* plain extents that continue on disk are merged into this job */
+	struct restore_file *pending_file;
+	struct restored_extent *pending_rec;
+	struct restored_extent *pending_last;
+	struct restore_extent pending;
+	/* cleared when the target can't preallocate */
+	int falloc;
+};
+
+static int restore_threads = BTRFS_READA_THREADS;
+static struct restore_pipe restore_pipe;
+
+static void restore_job_run(struct restore_pipe *rp, struct restore_job *job)
+{
+	u64 done = 0;
+	char *data;
+	ssize_t ret;
+	int i;
+
+	if (job->clone) {
+		job->ret = 0;
+		return;
+	}
+	if (!job->nr_stripes) {
+		job->ret = -EAGAIN;
+		return;
+	}
+	for (i = 0; i < job->nr_stripes; i++) {
+		struct restore_stripe *stripe = &job->stripes[i];
+		u64 cur = 0;
+
+		if (stripe->fd <= 0) {
+			job->ret = -EIO;
+			return;
+		}
+		while (cur < stripe->len) {
+			ret = pread64(stripe->fd, job->data + done + cur,
+				      stripe->len - cur, stripe->physical + cur);
+			if (ret <= 0) {
+				job->ret = -EIO;
+				return;
+			}
+			cur += ret;
+		}
+		done += stripe->len;
+	}
+
+	job->ret = decode_extent(&job->ext, job->data, job->outbuf,
+				 job->csums, job->have, rp->sectorsize,
+				 rp->csum_size, &data);
+	if (!job->ret)
+		job->ret = write_data(job->file->fd, data, job->ext.num_bytes,
+				      job->ext.pos);
+}
+
+static void *restore_worker(void *data)
+{
+	struct restore_pipe *rp = data;
+	struct restore_job *job;
+
+	pthread_mutex_lock(&rp->mutex);
+	while (1) {
+		while (!rp->stop && rp->next == rp->tail)
+			pthread_cond_wait(&rp->work_cond, &rp->mutex);
+		if (rp->stop)
+			break;
+		job = &rp->ring[rp->next++ % rp->ring_size];
+		pthread_mutex_unlock(&rp->mutex);
+
+		restore_job_run(rp, job);
+
+		pthread_mutex_lock(&rp->mutex);
+		job->done = 1;
+		pthread_cond_broadcast(&rp->done_cond);
+	}
+	pthread_mutex_unlock(&rp->mutex);
+	return NULL;
+}
+
+static void restore_pipe_free(struct restore_pipe *rp)
+{
+	int i;
+
+	for (i = 0; rp->ring && i < rp->ring_size; i++) {
+		free(rp->ring[i].data);
+		free(rp->ring[i].outbuf);
+		free(rp->ring[i].csums);
+		free(rp->ring[i].have);
+	}
+	free(rp->ring);
+	free(rp->threads);
+	rp->ring = NULL;
+	rp->threads = NULL;
+	rp->ring_size = 0;
+}
+
+static void restore_pipe_init(struct restore_pipe *rp, struct btrfs_root *root,
+			      int nr_threads)
+{
+	struct restore_job *job;
+	int i;
+
+	memset(rp, 0, sizeof(*rp));
+	rp->root = root;
+	rp->sectorsize = root->sectorsize;
+	rp->csum_size = btrfs_super_csum_size(root->fs_info->super_copy);
+	cache_tree_init(&rp->restored);
+	INIT_LIST_HEAD(&rp->srcs);
+	rp->reflink = 1;
+	rp->clone_fd = -1;
+	rp->falloc = 1;
+	if (nr_threads <= 0)
+		return;
+
+	rp->ring_size = nr_threads * RESTORE_JOBS_PER_THREAD;
+	rp->ring = calloc(rp->ring_size, sizeof(*rp->ring));
+	rp->threads = calloc(nr_threads, sizeof(*rp->threads));
+	if (!rp->ring || !rp->threads)
+		goto fail;
+	for (i = 0; i < rp->ring_size; i++) {
+		job = &rp->ring[i];
+		job->data = malloc(RESTORE_JOB_SIZE);
+		job->outbuf = malloc(RESTORE_JOB_SIZE);
+		job->csums = malloc(RESTORE_JOB_SIZE / rp->sectorsize *
+				    rp->csum_size);
+		job->have = malloc(RESTORE_JOB_SIZE / rp->sectorsize);
+		if (!job->data || !job->outbuf || !job->csums || !job->have)
+			goto fail;
+	}
+	pthread_mutex_init(&rp->mutex, NULL);
+	pthread_cond_init(&rp->work_cond, NULL);
+	pthread_cond_init(&rp->done_cond, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&rp->threads[i], NULL, restore_worker, rp))
+			break;
+		rp->nr_threads++;
+	}
+	if (rp->nr_threads)
+		return;
+	pthread_cond_destroy(&rp->done_cond);
+	pthread_cond_destroy(&rp->work_cond);
+	pthread_mutex_destroy(&rp->mutex);
+fail:
+	/* copy in the main thread if the pipeline can't be set up */
+	restore_pipe_free(rp);
+}
+
+static void restore_file_error(struct restore_pipe *rp,
+			       struct restore_file *file)
+{
+	if (file->failed)
+		return;
+	fprintf(stderr, "Error copying data for %s\n", file->name);
+	file->failed = 1;
+	if (!ignore_errors)
+		rp->aborted = 1;
+}
+
+static void restore_file_put(struct restore_pipe *rp, struct restore_file *file)
+{
+	if (--file->refs)
+		return;
+	if (file->size && ftruncate(file->fd, (loff_t)file->size))
+		restore_file_error(rp, file);
+	close(file->fd);
+	free(file->name);
+	free(file);
+}
+
+static int clone_extent(struct restore_pipe *rp, int fd,
+			struct restored_extent *rec, u64 src_pos, u64 len,
+			u64 pos)
+{
+	struct btrfs_ioctl_clone_range_args args;
+	int ret;
+
+	if (rp->clone_src != rec->src) {
+		if (rp->clone_fd >= 0)
+			close(rp->clone_fd);
+		rp->clone_src = rec->src;
+		rp->clone_fd = open(rec->src->name, O_RDONLY);
+	}
+	if (rp->clone_fd < 0)
+		return -ENOENT;
+
+	args.src_fd = rp->clone_fd;
+	args.src_offset = src_pos;
+	args.src_length = len;
+	args.dest_offset = pos;
+	/* the same ioctl as FICLONERANGE, which other filesystems support */
+	ret = ioctl(fd, BTRFS_IOC_CLONE_RANGE, &args);
+	if (ret < 0) {
+		ret = -errno;
+		if (ret == -EOPNOTSUPP || ret == -ENOTTY || ret == -EXDEV) {
+			if (verbose)
+				printf("Target can't clone extents, copying "
+				       "them instead\n");
+			rp->reflink = 0;
+		}
+		return ret;
+	}
+	rp->bytes_cloned += len;
+	return 0;
+}
+
+/*
+ * The source file may already be cut to its size, so only the aligned part
+ * of the range within both files is cloned and the rest is copied.
+ */
+static int restore_clone(struct restore_pipe *rp, struct restore_job *job)
+{
+	struct restored_extent *rec = job->clone;
+	struct restore_extent tail = job->ext;
+	u64 size = job->file->size;
+	u64 needed = job->ext.num_bytes;
+	u64 len;
+	int ret;
+
+	if (size > job->ext.pos)
+		needed = min(needed, size - job->ext.pos);
+	len = needed;
+	if (rec->src->size)
+		len = min(len, rec->src->size - min(rec->src->size,
+						    job->clone_pos));
+	len = round_down(len, rp->sectorsize);
+	if (len) {
+		ret = clone_extent(rp, job->file->fd, rec, job->clone_pos, len,
+				   job->ext.pos);
+		if (ret)
+			return ret;
+	}
+	if (len == needed)
+		return 0;
+
+	if (tail.compress == BTRFS_COMPRESS_NONE) {
+		tail.bytenr += len;
+		tail.disk_len = round_up(needed - len, rp->sectorsize);
+		tail.ram_size = tail.disk_len;
+	} else {
+		tail.offset += len;
+	}
+	tail.num_bytes = needed - len;
+	tail.pos += len;
+	return copy_one_extent(rp->root, job->file->fd, &tail);
+}
+
+/*
+ * Finish a job the workers are done with, in the main thread: clone it or
+ * copy it again if the workers failed.
+ */
+static void restore_job_finish(struct restore_pipe *rp, struct restore_job *job)
+{
+	struct restored_extent *rec;
+
+	if (job->clone && rp->reflink && !job->clone->failed &&
+	    !restore_clone(rp, job))
+		return;
+	if (!job->clone && !job->ret)
+		return;
+	if (copy_one_extent(rp->root, job->file->fd, &job->ext)) {
+		restore_file_error(rp, job->file);
+		for (rec = job->rec; rec; rec = rec->merged)
+			rec->failed = 1;
+	}
+}
+
+static void restore_retire_one(struct restore_pipe *rp)
+{
+	struct restore_job *job = &rp->ring[rp->head % rp->ring_size];
+
+	pthread_mutex_lock(&rp->mutex);
+	while (!job->done)
+		pthread_cond_wait(&rp->done_cond, &rp->mutex);
+	pthread_mutex_unlock(&rp->mutex);
+
+	restore_job_finish(rp, job);
+	restore_file_put(rp, job->file);
+	rp->head++;
+}
+
+/* map the job on the first mirror, returns how many bytes the stripes cover */
+static u64 restore_map_job(struct btrfs_fs_info *info, struct restore_job *job,
+			   u64 bytenr, u64 len)
+{
+	struct btrfs_multi_bio *multi;
+	struct restore_stripe *stripe;
+	u64 mapped = 0;
+	u64 length;
+
+	job->nr_stripes = 0;
+	while (mapped < len && job->nr_stripes < RESTORE_JOB_STRIPES) {
+		if (btrfs_is_raid56_rebuild(&info->mapping_tree,
+					    bytenr + mapped, 1))
+			break;
+		length = len - mapped;
+		multi = NULL;
+		if (btrfs_map_block(&info->mapping_tree, READ, bytenr + mapped,
+				    &length, &multi, 1, NULL))
+			break;
+		stripe = &job->stripes[job->nr_stripes++];
+		stripe->fd = multi->stripes[0].dev->fd;
+		stripe->physical = multi->stripes[0].physical;
+		stripe->len = min(length, len - mapped);
+		kfree(multi);
+		mapped += stripe->len;
+	}
+	return mapped;
+}
+
+/*
+ * Queue @ext for restoring into @file, @rec is the record of the extent
+ * if it's the first copy, @clone the one to clone it from.
+ */
+static int restore_queue(struct restore_pipe *rp, struct restore_file *file,
+			 struct restore_extent *ext, struct restored_extent *rec,
+			 struct restored_extent *clone, u64 clone_pos)
+{
+	struct restore_job sync_job;
+	struct restore_job *job;
+	u64 mapped;
+
+	if (!rp->ring_size) {
+		memset(&sync_job, 0, sizeof(sync_job));
+		job = &sync_job;
+	} else {
+		if (rp->tail - rp->head == rp->ring_size)
+			restore_retire_one(rp);
+		job = &rp->ring[rp->tail % rp->ring_size];
+	}
+	job->file = file;
+	job->ext = *ext;
+	job->rec = rec;
+	job->clone = clone;
+	job->clone_pos = clone_pos;
+	job->nr_stripes = 0;
+	job->ret = 0;
+	job->done = 0;
+
+	if (!rp->ring_size) {
+		job->ret = -EAGAIN;
+		restore_job_finish(rp, job);
+		return 0;
+	}
+
+	if (!clone && ext->disk_len <= RESTORE_JOB_SIZE &&
+	    ext->ram_size <= RESTORE_JOB_SIZE) {
+		mapped = restore_map_job(rp->root->fs_info, job, ext->bytenr,
+					 ext->disk_len);
+		if (mapped < ext->disk_len)
+			job->nr_stripes = 0;
+		else
+			lookup_data_csums(rp->root, ext->bytenr, ext->disk_len,
+					  job->csums, job->have);
+	}
+	file->refs++;
+
+	pthread_mutex_lock(&rp->mutex);
+	rp->tail++;
+	pthread_cond_signal(&rp->work_cond);
+	pthread_mutex_unlock(&rp->mutex);
+	return 0;
+}
+
+/*
+ * Look for a restored copy of [@start, @start + @len) of @objectid, if
+ * there's none the range is recorded as restored to @pos of @file.
+ */
+static struct restored_extent *find_restored(struct restore_pipe *rp,
+					     struct restore_file *file,
+					     u64 objectid, u64 start, u64 len,
+					     u64 pos, u64 *clone_pos,
+					     struct restored_extent **rec_ret)
+{
+	struct cache_extent *ce;
+	struct restored_extent *rec;
+
+	*rec_ret = NULL;
+	if (!rp->reflink)
+		return NULL;
+	ce = lookup_cache_extent2(&rp->restored, objectid, start, len);
+	if (ce) {
+		if (ce->objectid != objectid || ce->start > start ||
+		    ce->start + ce->size < start + len)
+			return NULL;
+		rec = container_of(ce, struct restored_extent, cache);
+		*clone_pos = rec->pos + (start - ce->start);
+		return rec;
+	}
+
+	if (!file->src) {
+		file->src = malloc(sizeof(*file->src) + strlen(file->name) + 1);
+		if (!file->src)
+			return NULL;
+		strcpy(file->src->name, file->name);
+		file->src->size = file->size;
+		list_add_tail(&file->src->list, &rp->srcs);
+	}
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+	rec->cache.objectid = objectid;
+	rec->cache.start = start;
+	rec->cache.size = len;
+	rec->src = file->src;
+	rec->pos = pos;
+	if (insert_cache_extent2(&rp->restored, &rec->cache))
+		free(rec);
+	else
+		*rec_ret = rec;
+	return NULL;
+}
+
+static int restore_flush(struct restore_pipe *rp)
+{
+	struct restore_file *file = rp->pending_file;
+
+	if (!file)
+		return 0;
+	rp->pending_file = NULL;
+	return restore_queue(rp, file, &rp->pending, rp->pending_rec, NULL, 0);
+}
+
+/*
+ * Small files written by appending often end up as a row of small extents
+ * next to each other on disk, they are read and written as one job.
+ */
+static int restore_queue_plain(struct restore_pipe *rp,
+			       struct restore_file *file,
+			       struct restore_extent *ext,
+			       struct restored_extent *rec)
+{
+	struct restore_extent *pending = &rp->pending;
+	int ret;
+
+	if (rp->pending_file == file &&
+	    pending->pos + pending->num_bytes == ext->pos &&
+	    pending->bytenr + pending->disk_len == ext->bytenr &&
+	    pending->num_bytes + ext->num_bytes <= RESTORE_JOB_SIZE) {
+		pending->disk_len += ext->disk_len;
+		pending->ram_size += ext->ram_size;
+		pending->num_bytes += ext->num_bytes;
+		if (rec && rec != rp->pending_last) {
+			if (rp->pending_last)
+				rp->pending_last->merged = rec;
+			else
+				rp->pending_rec = rec;
+			rp->pending_last = rec;
+		}
+		return 0;
+	}
+	ret = restore_flush(rp);
+	if (ret)
+		return ret;
+	rp->pending = *ext;
+	rp->pending_file = file;
+	rp->pending_rec = rec;
+	rp->pending_last = rec;
+	return 0;
+}
+
+static int queue_one_extent(struct restore_pipe *rp, struct restore_file *file,
+			    struct extent_buffer *leaf,
+			    struct btrfs_file_extent_item *fi, u64 pos)
+{
+	struct restore_extent ext;
+	struct restored_extent *clone;
+	struct restored_extent *rec;
+	u64 clone_pos = 0;
 	u64 bytenr;
-	u64 ram_size;
 	u64 disk_size;
 	u64 num_bytes;
-	u64 length;
-	u64 size_left;
-	u64 dev_bytenr;
 	u64 offset;
-	u64 count = 0;
-	int compress;
+	u64 len;
 	int ret;
-	int dev_fd;
-	int mirror_num = 1;
-	int num_copies;
 
-	compress = btrfs_file_extent_compression(leaf, fi);
 	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
 	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
 	offset = btrfs_file_extent_offset(leaf, fi);
 	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
-	size_left = disk_size;
-	if (compress == BTRFS_COMPRESS_NONE)
-		bytenr += offset;
 
 	if (verbose && offset)
 		printf("offset is %Lu\n", offset);
@@ -314,102 +1147,110 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 	if (disk_size == 0)
 		return 0;
 
-	inbuf = malloc(size_left);
-	if (!inbuf) {
-		fprintf(stderr, "No memory\n");
-		return -ENOMEM;
-	}
-
-	if (compress != BTRFS_COMPRESS_NONE) {
-		outbuf = calloc(1, ram_size);
-		if (!outbuf) {
-			fprintf(stderr, "No memory\n");
-			free(inbuf);
-			return -ENOMEM;
+	ext.compress = btrfs_file_extent_compression(leaf, fi);
+	ext.ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	if (ext.compress != BTRFS_COMPRESS_NONE) {
+		ext.bytenr = bytenr;
+		ext.disk_len = disk_size;
+		ext.offset = offset;
+		ext.num_bytes = num_bytes;
+		ext.pos = pos;
+		clone = find_restored(rp, file, bytenr, offset, num_bytes,
+				      pos, &clone_pos, &rec);
+		if (clone) {
+			ret = restore_flush(rp);
+			if (ret)
+				return ret;
 		}
+		return restore_queue(rp, file, &ext, rec, clone, clone_pos);
 	}
-again:
-	length = size_left;
-	ret = btrfs_map_block(&root->fs_info->mapping_tree, READ,
-			      bytenr, &length, &multi, mirror_num, NULL);
-	if (ret) {
-		fprintf(stderr, "Error mapping block %d\n", ret);
-		goto out;
+
+	ext.offset = 0;
+	clone = find_restored(rp, file, 0, bytenr + offset, num_bytes, pos,
+			      &clone_pos, &rec);
+	if (clone) {
+		/* the copy to clone may still be held back as pending */
+		ret = restore_flush(rp);
+		if (ret)
+			return ret;
+		ext.bytenr = bytenr + offset;
+		ext.disk_len = num_bytes;
+		ext.ram_size = num_bytes;
+		ext.num_bytes = num_bytes;
+		ext.pos = pos;
+		return restore_queue(rp, file, &ext, NULL, clone, clone_pos);
 	}
-	device = multi->stripes[0].dev;
-	dev_fd = device->fd;
-	device->total_ios++;
-	dev_bytenr = multi->stripes[0].physical;
-	kfree(multi);
-
-	if (size_left < length)
-		length = size_left;
-
-	done = pread(dev_fd, inbuf+count, length, dev_bytenr);
-	/* Need both checks, or we miss negative values due to u64 conversion */
-	if (done < 0 || done < length) {
-		num_copies = btrfs_num_copies(&root->fs_info->mapping_tree,
-					      bytenr, length);
-		mirror_num++;
-		/* mirror_num is 1-indexed, so num_copies is a valid mirror. */
-		if (mirror_num > num_copies) {
-			ret = -1;
-			fprintf(stderr, "Exhausted mirrors trying to read\n");
-			goto out;
-		}
-		fprintf(stderr, "Trying another mirror\n");
-		goto again;
+
+	/*
+	 * The pieces of large extents may be written out of order, allocate
+	 * them up front so the file doesn't end up fragmented.
+	 */
+	if (num_bytes > RESTORE_JOB_SIZE && rp->falloc &&
+	    fallocate(file->fd, FALLOC_FL_KEEP_SIZE, pos, num_bytes) &&
+	    (errno == EOPNOTSUPP || errno == ENOSYS))
+		rp->falloc = 0;
+
+	/* only the referenced part of a plain extent is read */
+	while (num_bytes > 0) {
+		len = min_t(u64, num_bytes, RESTORE_JOB_SIZE);
+		ext.bytenr = bytenr + offset;
+		ext.disk_len = len;
+		ext.ram_size = len;
+		ext.num_bytes = len;
+		ext.pos = pos;
+		ret = restore_queue_plain(rp, file, &ext, rec);
+		if (ret)
+			return ret;
+		offset += len;
+		pos += len;
+		num_bytes -= len;
 	}
+	return 0;
+}
 
-	mirror_num = 1;
-	size_left -= length;
-	count += length;
-	bytenr += length;
-	if (size_left)
-		goto again;
+static void free_restored_extent(struct cache_extent *ce)
+{
+	free(container_of(ce, struct restored_extent, cache));
+}
 
-	if (compress == BTRFS_COMPRESS_NONE) {
-		while (total < num_bytes) {
-			done = pwrite(fd, inbuf+total, num_bytes-total,
-				      pos+total);
-			if (done < 0) {
-				ret = -1;
-				fprintf(stderr, "Error writing: %d %s\n", errno, strerror(errno));
-				goto out;
-			}
-			total += done;
-		}
-		ret = 0;
-		goto out;
-	}
+FREE_EXTENT_CACHE_BASED_TREE(restored, free_restored_extent);
 
-	ret = decompress(inbuf, outbuf, disk_size, &ram_size, compress);
-	if (ret) {
-		num_copies = btrfs_num_copies(&root->fs_info->mapping_tree,
-					      bytenr, length);
-		mirror_num++;
-		if (mirror_num >= num_copies) {
-			ret = -1;
-			goto out;
-		}
-		fprintf(stderr, "Trying another mirror\n");
-		goto again;
-	}
+/* wait for all queued jobs and stop the workers */
+static int restore_pipe_finish(struct restore_pipe *rp)
+{
+	int i;
 
-	while (total < num_bytes) {
-		done = pwrite(fd, outbuf + offset + total,
-			      num_bytes - total,
-			      pos + total);
-		if (done < 0) {
-			ret = -1;
-			goto out;
-		}
-		total += done;
+	restore_flush(rp);
+	while (rp->ring_size && rp->head != rp->tail)
+		restore_retire_one(rp);
+
+	if (rp->nr_threads) {
+		pthread_mutex_lock(&rp->mutex);
+		rp->stop = 1;
+		pthread_cond_broadcast(&rp->work_cond);
+		pthread_mutex_unlock(&rp->mutex);
+		for (i = 0; i < rp->nr_threads; i++)
+			pthread_join(rp->threads[i], NULL);
+		pthread_cond_destroy(&rp->done_cond);
+		pthread_cond_destroy(&rp->work_cond);
+		pthread_mutex_destroy(&rp->mutex);
 	}
-out:
-	free(inbuf);
-	free(outbuf);
-	return ret;
+	restore_pipe_free(rp);
+
+	if (verbose && rp->bytes_cloned)
+		printf("Cloned %llu bytes of shared extents\n",
+		       (unsigned long long)rp->bytes_cloned);
+	if (rp->clone_fd >= 0)
+		close(rp->clone_fd);
+	free_restored_tree(&rp->restored);
+	while (!list_empty(&rp->srcs)) {
+		struct restore_src *src;
+
+		src = list_entry(rp->srcs.next, struct restore_src, list);
+		list_del(&src->list);
+		free(src);
+	}
+	return rp->aborted ? -EIO : 0;
 }
 
 enum loop_response {
@@ -548,9 +1389,16 @@ out:
 }
 
 
+/*
+ * Queue the data of the inode at @key for restoring into @fd, which is
+ * closed once all of it is written.  Errors with the file are reported and
+ * only returned if they abort the restore.
+ */
 static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		     const char *file)
 {
+	struct restore_pipe *rp = &restore_pipe;
+	struct restore_file *rfile;
 	struct extent_buffer *leaf;
 	struct btrfs_path *path;
 	struct btrfs_file_extent_item *fi;
@@ -562,11 +1410,21 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	int loops = 0;
 	u64 found_size = 0;
 
+	rfile = calloc(1, sizeof(*rfile));
+	if (rfile)
+		rfile->name = strdup(file);
 	path = btrfs_alloc_path();
-	if (!path) {
+	if (!rfile || !rfile->name || !path) {
 		fprintf(stderr, "Ran out of memory\n");
+		if (rfile)
+			free(rfile->name);
+		free(rfile);
+		btrfs_free_path(path);
+		close(fd);
 		return -ENOMEM;
 	}
+	rfile->fd = fd;
+	rfile->refs = 1;
 
 	ret = btrfs_lookup_inode(NULL, root, path, key, 0);
 	if (ret == 0) {
@@ -575,6 +1433,14 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		found_size = btrfs_inode_size(path->nodes[0], inode_item);
 	}
 	btrfs_release_path(path);
+	rfile->size = found_size;
+
+	/* size the file up front, holes and prealloc extents stay holes */
+	if (found_size && ftruncate(fd, (loff_t)found_size)) {
+		fprintf(stderr, "Error setting the size of %s: %d\n", file,
+			errno);
+		goto fail;
+	}
 
 	key->offset = 0;
 	key->type = BTRFS_EXTENT_DATA_KEY;
@@ -582,8 +1448,7 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	ret = btrfs_search_slot(NULL, root, key, path, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "Error searching %d\n", ret);
-		btrfs_free_path(path);
-		return ret;
+		goto fail;
 	}
 
 	leaf = path->nodes[0];
@@ -592,17 +1457,15 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (ret < 0) {
 			fprintf(stderr, "Error getting next leaf %d\n",
 				ret);
-			btrfs_free_path(path);
-			return ret;
+			goto fail;
 		} else if (ret > 0) {
 			/* No more leaves to search */
-			btrfs_free_path(path);
-			return 0;
+			goto out;
 		}
 		leaf = path->nodes[0];
 	}
 
-	while (1) {
+	while (!rp->aborted) {
 		if (loops >= 0 && loops++ >= 1024) {
 			enum loop_response resp;
 
@@ -619,11 +1482,9 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 				ret = next_leaf(root, path);
 				if (ret < 0) {
 					fprintf(stderr, "Error searching %d\n", ret);
-					btrfs_free_path(path);
-					return ret;
+					goto fail;
 				} else if (ret) {
 					/* No more leaves to search */
-					btrfs_free_path(path);
 					goto set_size;
 				}
 				leaf = path->nodes[0];
@@ -642,25 +1503,20 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 		if (compression >= BTRFS_COMPRESS_LAST) {
 			fprintf(stderr, "Don't support compression yet %d\n",
 				compression);
-			btrfs_free_path(path);
-			return -1;
+			goto fail;
 		}
 
 		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC)
 			goto next;
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
 			ret = copy_one_inline(fd, path, found_key.offset);
-			if (ret) {
-				btrfs_free_path(path);
-				return -1;
-			}
+			if (ret)
+				goto fail;
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
-			ret = copy_one_extent(root, fd, leaf, fi,
-					      found_key.offset);
-			if (ret) {
-				btrfs_free_path(path);
-				return ret;
-			}
+			ret = queue_one_extent(rp, rfile, leaf, fi,
+					       found_key.offset);
+			if (ret)
+				goto fail;
 		} else {
 			printf("Weird extent type %d\n", extent_type);
 		}
@@ -668,19 +1524,17 @@ next:
 		path->slots[0]++;
 	}
 
-	btrfs_free_path(path);
 set_size:
-	if (found_size) {
-		ret = ftruncate(fd, (loff_t)found_size);
-		if (ret)
-			return ret;
-	}
-	if (get_xattrs) {
-		ret = set_file_xattrs(root, key->objectid, fd, file);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	if (get_xattrs && set_file_xattrs(root, key->objectid, fd, file))
+		restore_file_error(rp, rfile);
+	goto out;
+fail:
+	restore_file_error(rp, rfile);
+out:
+	btrfs_free_path(path);
+	restore_flush(rp);
+	restore_file_put(rp, rfile);
+	return rp->aborted ? -EIO : 0;
 }
 
 static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
@@ -738,6 +1592,10 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	}
 
 	while (leaf) {
+		if (restore_pipe.aborted) {
+			btrfs_free_path(path);
+			return -EIO;
+		}
 		if (loops++ >= 1024) {
 			printf("We have looped trying to restore files in %s "
 			       "too many times to be making progress, "
@@ -825,7 +1683,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 				printf("Restoring %s\n", path_name);
 			if (dry_run)
 				goto next;
-			fd = open(path_name, O_CREAT|O_WRONLY, 0644);
+			fd = open(path_name, O_CREAT|O_WRONLY|O_TRUNC, 0644);
 			if (fd < 0) {
 				fprintf(stderr, "Error creating %s: %d\n",
 					path_name, errno);
@@ -836,12 +1694,7 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 			}
 			loops = 0;
 			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
 			if (ret) {
-				fprintf(stderr, "Error copying data for %s\n",
-					path_name);
-				if (ignore_errors)
-					goto next;
 				btrfs_free_path(path);
 				return ret;
 			}
@@ -1141,6 +1994,9 @@ const char * const cmd_restore_usage[] = {
 	"                you have to use following syntax (possibly quoted):",
 	"                ^/(|home(|/username(|/Desktop(|/.*))))$",
 	"-c              ignore case (--path-regrex only)",
+	"--cache-size <size>",
+	"                limit the tree block cache to <size> bytes",
+	"--threads <N>   read, verify and write file data with N threads",
 	NULL
 };
 
@@ -1152,6 +2008,7 @@ int cmd_restore(int argc, char **argv)
 	u64 tree_location = 0;
 	u64 fs_location = 0;
 	u64 root_objectid = 0;
+	u64 num;
 	int len;
 	int ret;
 	int super_mirror = 0;
@@ -1168,6 +2025,8 @@ int cmd_restore(int argc, char **argv)
 		static const struct option long_options[] = {
 			{ "path-regex", 1, NULL, 256},
 			{ "dry-run", 0, NULL, 'D'},
+			{ "cache-size", 1, NULL, 257},
+			{ "threads", 1, NULL, 258},
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -1227,6 +2086,19 @@ int cmd_restore(int argc, char **argv)
 			case 256:
 				match_regstr = optarg;
 				break;
+			case 257:
+				set_extent_cache_max(parse_size(optarg));
+				break;
+			case 258:
+				num = arg_strtou64(optarg);
+				if (num > 256) {
+					fprintf(stderr,
+						"ERROR: at most 256 threads are supported\n");
+					exit(1);
+				}
+				restore_threads = num;
+				btrfs_set_reada_threads(num);
+				break;
 			case 'x':
 				get_xattrs = 1;
 				break;
@@ -1321,7 +2193,12 @@ int cmd_restore(int argc, char **argv)
 	if (dry_run)
 		printf("This is a dry-run, no files are going to be restored\n");
 
+	restore_pipe_init(&restore_pipe, root, restore_threads);
 	ret = search_dir(root, &key, dir_name, "", mreg);
+	if (restore_pipe_finish(&restore_pipe) && !ret)
+		ret = -EIO;
+	if (verbose > 1)
+		print_extent_cache_stats(&root->fs_info->extent_cache);
 
 out:
 	if (mreg)
@@ -31,6 +31,9 @@
 #include <libgen.h>
 #include <mntent.h>
 #include <assert.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
 
 #include <uuid/uuid.h>
 
@@ -45,10 +48,17 @@
 
 static int g_verbose = 0;
 
+/* the most the stream pump moves at once */
+#define SEND_PUMP_SIZE		(1024 * 1024)
+/* default size of the pipe the kernel writes the stream into */
+#define SEND_PIPE_SIZE		(1024 * 1024)
+
 struct btrfs_send {
 	int send_fd;
 	int dump_fd;
 	int mnt_fd;
+	int pipe_size;
+	u64 bytes_dumped;
 
 	u64 *clone_sources;
 	u64 clone_sources_count;
@@ -210,31 +220,73 @@ out:
 	return ret;
 }
 
+/*
+ * Move the stream from the pipe to the output with splice() so it doesn't
+ * pass through user space, and copy it through a large buffer for outputs
+ * that can't be spliced to, like files opened for appending.
+ */
 static void *dump_thread(void *arg_)
 {
 	int ret;
 	struct btrfs_send *s = (struct btrfs_send*)arg_;
-	char buf[4096];
-	int readed;
+	char *buf = NULL;
+	ssize_t readed;
+	int use_splice = 1;
 
 	while (1) {
-		readed = read(s->send_fd, buf, sizeof(buf));
-		if (readed < 0) {
-			ret = -errno;
-			fprintf(stderr, "ERROR: failed to read stream from "
-					"kernel. %s\n", strerror(-ret));
-			goto out;
+		if (use_splice) {
+			readed = splice(s->send_fd, NULL, s->dump_fd, NULL,
+					SEND_PUMP_SIZE,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (readed < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				if (g_verbose > 1)
+					fprintf(stderr, "can't splice to the "
+						"output, copying the stream\n");
+				use_splice = 0;
+				continue;
+			}
+			if (readed < 0 && errno == EINTR)
+				continue;
+			if (readed < 0) {
+				ret = -errno;
+				fprintf(stderr, "ERROR: failed to dump stream. "
+					"%s\n", strerror(-ret));
+				goto out;
+			}
+		} else {
+			if (!buf) {
+				buf = malloc(SEND_PUMP_SIZE);
+				if (!buf) {
+					ret = -ENOMEM;
+					fprintf(stderr, "ERROR: not enough "
+						"memory\n");
+					goto out;
+				}
+			}
+			readed = read(s->send_fd, buf, SEND_PUMP_SIZE);
+			if (readed < 0 && errno == EINTR)
+				continue;
+			if (readed < 0) {
+				ret = -errno;
+				fprintf(stderr, "ERROR: failed to read stream from "
+						"kernel. %s\n", strerror(-ret));
+				goto out;
+			}
+			if (readed) {
+				ret = write_buf(s->dump_fd, buf, readed);
+				if (ret < 0)
+					goto out;
+			}
 		}
 		if (!readed) {
 			ret = 0;
 			goto out;
 		}
-		ret = write_buf(s->dump_fd, buf, readed);
-		if (ret < 0)
-			goto out;
+		s->bytes_dumped += readed;
 	}
 
 out:
+	free(buf);
 	if (ret < 0) {
 		exit(-ret);
 	}
@@ -251,6 +303,9 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 	void *t_err = NULL;
 	int subvol_fd = -1;
 	int pipefd[2] = {-1, -1};
+	struct timespec start;
+	struct timespec end;
+	double secs;
 
 	subvol_fd = openat(send->mnt_fd, subvol, O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -267,9 +322,18 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		goto out;
 	}
 
+	/* a larger pipe lets the kernel and the pump run with fewer wakeups */
+	if (send->pipe_size &&
+	    fcntl(pipefd[1], F_SETPIPE_SZ, send->pipe_size) < 0 &&
+	    g_verbose > 0)
+		fprintf(stderr, "WARNING: can't set the pipe size to %d: %s\n",
+			send->pipe_size, strerror(errno));
+
 	memset(&io_send, 0, sizeof(io_send));
 	io_send.send_fd = pipefd[1];
 	send->send_fd = pipefd[0];
+	send->bytes_dumped = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	if (!ret)
 		ret = pthread_create(&t_read, NULL, dump_thread,
@@ -321,6 +385,16 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		goto out;
 	}
 
+	if (g_verbose > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		secs = (end.tv_sec - start.tv_sec) +
+			(end.tv_nsec - start.tv_nsec) / 1000000000.0;
+		fprintf(stderr, "sent %llu bytes in %.1f seconds (%.1f MiB/s)\n",
+			(unsigned long long)send->bytes_dumped, secs,
+			secs > 0 ? send->bytes_dumped / secs / (1024 * 1024) :
+			0.0);
+	}
+
 	ret = 0;
 
 out:
@@ -438,8 +512,17 @@ int cmd_send(int argc, char **argv)
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
+	send.pipe_size = SEND_PIPE_SIZE;
+
+	while (1) {
+		static const struct option long_options[] = {
+			{ "pipe-size", 1, NULL, 256 },
+			{ NULL, 0, NULL, 0 }
+		};
 
-	while ((c = getopt(argc, argv, "vec:f:i:p:")) != -1) {
+		c = getopt_long(argc, argv, "vec:f:i:p:", long_options, NULL);
+		if (c < 0)
+			break;
 		switch (c) {
 		case 'v':
 			g_verbose++;
@@ -530,6 +613,10 @@ int cmd_send(int argc, char **argv)
 				"ERROR: -i was removed, use -c instead\n");
 			ret = 1;
 			goto out;
+		case 256:
+			send.pipe_size = min_t(u64, parse_size(optarg),
+					       INT_MAX);
+			break;
 		case '?':
 		default:
 			fprintf(stderr, "ERROR: send args invalid.\n");
@@ -731,5 +818,8 @@ const char * const cmd_send_usage[] = {
 	"-f <outfile>     Output is normally written to stdout. To write to",
 	"                 a file, use this option. An alternative would be to",
 	"                 use pipes.",
+	"--pipe-size <size>",
+	"                 Size of the pipe the stream is read from, 1MiB by",
+	"                 default. 0 keeps the system default.",
 	NULL
 };
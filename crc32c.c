@@ -18,10 +18,33 @@
 #include <sys/wait.h>
 
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length);
+static void crc32c_le_sectors_generic(u32 seed, unsigned char const *data,
+				      size_t sectorsize, unsigned int nr,
+				      u32 *crcs);
+
 static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) = __crc32c_le;
+static void (*crc_sectors_function)(u32 seed, unsigned char const *data,
+				    size_t sectorsize, unsigned int nr,
+				    u32 *crcs) = crc32c_le_sectors_generic;
+
+/*
+ * x^n mod P in the bit reflected representation the crc is kept in, bit 31
+ * being x^0.
+ */
+static u32 crc32c_xpow(unsigned int n)
+{
+	u32 v = 0x80000000;
+
+	while (n--)
+		v = (v >> 1) ^ ((v & 1) ? 0x82F63B78 : 0);
+	return v;
+}
 
 #ifdef __x86_64__
 
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
 /*
  * Based on a posting to lkml by Austin Zhang <austin.zhang@intel.com>
  *
@@ -40,8 +63,8 @@ static u32 (*crc_function)(u32 crc, unsigned char const *data, size_t length) =
 #define SCALE_F 4
 #endif
 
-static int crc32c_probed = 0;
 static int crc32c_intel_available = 0;
+static int crc32c_pclmul_available = 0;
 
 static uint32_t crc32c_intel_le_hw_byte(uint32_t crc, unsigned char const *data,
 					unsigned long length)
@@ -84,6 +107,114 @@ static uint32_t crc32c_intel(u32 crc, unsigned char const *data, unsigned long l
 	return crc;
 }
 
+/*
+ * The crc32 instruction has a latency of 3 cycles but can start one every
+ * cycle, so a single dependency chain leaves it mostly idle.  Large buffers
+ * are cut into rounds of three equally sized streams that are checksummed
+ * side by side, the partial crcs are then shifted over the streams following
+ * them with a carry-less multiply by x^(8 * stream - 33) and folded together.
+ */
+#define CRC32C_LONG	1024
+#define CRC32C_SHORT	128
+
+static u32 crc32c_long_shift;
+static u32 crc32c_short_shift;
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u64 crc32c_shift(u64 crc, u32 k)
+{
+	__m128i tmp;
+
+	tmp = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				   _mm_cvtsi32_si128(k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(tmp));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u64 crc32c_intel_3way_rounds(u64 crc,
+					   unsigned char const **data,
+					   size_t *length, size_t stream, u32 k)
+{
+	const u64 *p0;
+	const u64 *p1;
+	const u64 *p2;
+	u64 crc1;
+	u64 crc2;
+	size_t i;
+
+	while (*length >= 3 * stream) {
+		p0 = (const u64 *)*data;
+		p1 = (const u64 *)(*data + stream);
+		p2 = (const u64 *)(*data + 2 * stream);
+		crc1 = 0;
+		crc2 = 0;
+		for (i = 0; i < stream / 8; i++) {
+			crc = _mm_crc32_u64(crc, p0[i]);
+			crc1 = _mm_crc32_u64(crc1, p1[i]);
+			crc2 = _mm_crc32_u64(crc2, p2[i]);
+		}
+		crc = crc32c_shift(crc, k) ^ crc1;
+		crc = crc32c_shift(crc, k) ^ crc2;
+		*data += 3 * stream;
+		*length -= 3 * stream;
+	}
+	return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_intel_3way(u32 crc, unsigned char const *data, size_t length)
+{
+	u64 crc64 = crc;
+
+	crc64 = crc32c_intel_3way_rounds(crc64, &data, &length, CRC32C_LONG,
+					 crc32c_long_shift);
+	crc64 = crc32c_intel_3way_rounds(crc64, &data, &length, CRC32C_SHORT,
+					 crc32c_short_shift);
+	return crc32c_intel(crc64, data, length);
+}
+
+/*
+ * Sectors are independent of each other, so three of them can be checksummed
+ * side by side without any folding.
+ */
+__attribute__((target("sse4.2")))
+static void crc32c_intel_sectors(u32 seed, unsigned char const *data,
+				 size_t sectorsize, unsigned int nr, u32 *crcs)
+{
+	const u64 *p0;
+	const u64 *p1;
+	const u64 *p2;
+	u64 crc0;
+	u64 crc1;
+	u64 crc2;
+	size_t tail = sectorsize & 7;
+	size_t i;
+
+	for (; nr >= 3; nr -= 3, crcs += 3, data += 3 * sectorsize) {
+		p0 = (const u64 *)data;
+		p1 = (const u64 *)(data + sectorsize);
+		p2 = (const u64 *)(data + 2 * sectorsize);
+		crc0 = seed;
+		crc1 = seed;
+		crc2 = seed;
+		for (i = 0; i < sectorsize / 8; i++) {
+			crc0 = _mm_crc32_u64(crc0, p0[i]);
+			crc1 = _mm_crc32_u64(crc1, p1[i]);
+			crc2 = _mm_crc32_u64(crc2, p2[i]);
+		}
+		crcs[0] = crc0;
+		crcs[1] = crc1;
+		crcs[2] = crc2;
+		if (tail) {
+			for (i = 0; i < 3; i++)
+				crcs[i] = crc32c_intel_le_hw_byte(crcs[i],
+					data + (i + 1) * sectorsize - tail,
+					tail);
+		}
+	}
+	crc32c_le_sectors_generic(seed, data, sectorsize, nr, crcs);
+}
+
 static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
 		     unsigned int *edx)
 {
@@ -100,28 +231,63 @@ static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
 		: "eax", "ebx", "ecx", "edx");
 }
 
-static void crc32c_intel_probe(void)
+static void crc32c_hw_probe(void)
 {
-	if (!crc32c_probed) {
-		unsigned int eax, ebx, ecx, edx;
+	unsigned int eax, ebx, ecx, edx;
+
+	eax = 1;
 
-		eax = 1;
+	do_cpuid(&eax, &ebx, &ecx, &edx);
+	crc32c_intel_available = (ecx & (1 << 20)) != 0;
+	crc32c_pclmul_available = (ecx & (1 << 1)) != 0;
 
-		do_cpuid(&eax, &ebx, &ecx, &edx);
-		crc32c_intel_available = (ecx & (1 << 20)) != 0;
-		crc32c_probed = 1;
+	if (!crc32c_intel_available)
+		return;
+	crc_function = crc32c_intel;
+	crc_sectors_function = crc32c_intel_sectors;
+	if (crc32c_pclmul_available) {
+		crc32c_long_shift = crc32c_xpow(8 * CRC32C_LONG - 33);
+		crc32c_short_shift = crc32c_xpow(8 * CRC32C_SHORT - 33);
+		crc_function = crc32c_intel_3way;
 	}
 }
 
-void crc32c_optimization_init(void)
+#elif defined(__aarch64__) && !defined(__AARCH64EB__)
+
+#include <sys/auxv.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32	(1 << 7)
+#endif
+
+/* ARMv8.0 optional CRC32 extension, mandatory from ARMv8.1 */
+__attribute__((target("+crc")))
+static u32 crc32c_arm64(u32 crc, unsigned char const *data, size_t length)
+{
+	u64 val;
+
+	while (length >= 8) {
+		memcpy(&val, data, 8);
+		__asm__("crc32cx %w0, %w0, %x1" : "+r"(crc) : "r"(val));
+		data += 8;
+		length -= 8;
+	}
+	while (length--) {
+		__asm__("crc32cb %w0, %w0, %w1" : "+r"(crc) : "r"((u32)*data));
+		data++;
+	}
+	return crc;
+}
+
+static void crc32c_hw_probe(void)
 {
-	crc32c_intel_probe();
-	if (crc32c_intel_available)
-		crc_function = crc32c_intel;
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc_function = crc32c_arm64;
 }
+
 #else
 
-void crc32c_optimization_init(void)
+static void crc32c_hw_probe(void)
 {
 }
 
@@ -204,19 +370,81 @@ static const u32 crc32c_table[256] = {
 };
 
 /*
- * Steps through buffer one byte at at time, calculates reflected 
- * crc using table.
+ * Tables for slicing by 8, crc32c_table8[n][i] is the crc of byte i followed
+ * by n zero bytes.  Filled from crc32c_table by crc32c_optimization_init().
  */
+static u32 crc32c_table8[8][256];
 
+/*
+ * Software fallback, folds in 8 bytes at a time through the sliced tables and
+ * the rest one byte at a time through crc32c_table.
+ */
 u32 __crc32c_le(u32 crc, unsigned char const *data, size_t length)
 {
+	u32 lo;
+
+	while (length >= 8) {
+		lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+			    (u32)data[3] << 24);
+		crc = crc32c_table8[7][lo & 0xff] ^
+		      crc32c_table8[6][(lo >> 8) & 0xff] ^
+		      crc32c_table8[5][(lo >> 16) & 0xff] ^
+		      crc32c_table8[4][lo >> 24] ^
+		      crc32c_table8[3][data[4]] ^
+		      crc32c_table8[2][data[5]] ^
+		      crc32c_table8[1][data[6]] ^
+		      crc32c_table8[0][data[7]];
+		data += 8;
+		length -= 8;
+	}
 	while (length--)
 		crc =
 		    crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 	return crc;
 }
 
+static void crc32c_le_sectors_generic(u32 seed, unsigned char const *data,
+				      size_t sectorsize, unsigned int nr,
+				      u32 *crcs)
+{
+	while (nr--) {
+		*crcs++ = crc_function(seed, data, sectorsize);
+		data += sectorsize;
+	}
+}
+
+/*
+ * Pick the fastest implementation the cpu supports.  This runs before main(),
+ * calling it again is harmless.
+ */
+__attribute__((constructor))
+void crc32c_optimization_init(void)
+{
+	static int initialized = 0;
+	int i, n;
+
+	if (initialized)
+		return;
+	memcpy(crc32c_table8[0], crc32c_table, sizeof(crc32c_table));
+	for (n = 1; n < 8; n++)
+		for (i = 0; i < 256; i++)
+			crc32c_table8[n][i] = (crc32c_table8[n - 1][i] >> 8) ^
+				crc32c_table[crc32c_table8[n - 1][i] & 0xff];
+	crc32c_hw_probe();
+	initialized = 1;
+}
+
 u32 crc32c_le(u32 crc, unsigned char const *data, size_t length)
 {
 	return crc_function(crc, data, length);
 }
+
+/*
+ * Checksum @nr consecutive blocks of @sectorsize bytes each starting from
+ * @seed, storing the raw crc of each block in @crcs.
+ */
+void crc32c_le_sectors(u32 seed, unsigned char const *data, size_t sectorsize,
+		       unsigned int nr, u32 *crcs)
+{
+	crc_sectors_function(seed, data, sectorsize, nr, crcs);
+}
@@ -26,6 +26,8 @@
 #endif /* BTRFS_FLAT_INCLUDES */
 
 u32 crc32c_le(u32 seed, unsigned char const *data, size_t length);
+void crc32c_le_sectors(u32 seed, unsigned char const *data, size_t sectorsize,
+		       unsigned int nr, u32 *crcs);
 void crc32c_optimization_init(void);
 
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
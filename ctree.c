@@ -966,6 +966,9 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 	u32 nr;
 	u32 blocksize;
 	u32 nscan = 0;
+	/* the target block and at most 129 scanned neighbours */
+	struct btrfs_reada_block blocks[130];
+	int nr_blocks = 0;
 
 	if (level != 1)
 		return;
@@ -985,6 +988,12 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 	highest_read = search;
 	lowest_read = search;
 
+	blocks[nr_blocks].bytenr = search;
+	blocks[nr_blocks].blocksize = blocksize;
+	blocks[nr_blocks].parent_transid =
+		btrfs_node_ptr_generation(node, slot);
+	nr_blocks++;
+
 	nritems = btrfs_header_nritems(node);
 	nr = slot;
 	while(1) {
@@ -1006,8 +1015,11 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 		if ((search >= lowest_read && search <= highest_read) ||
 		    (search < lowest_read && lowest_read - search <= 32768) ||
 		    (search > highest_read && search - highest_read <= 32768)) {
-			readahead_tree_block(root, search, blocksize,
-				     btrfs_node_ptr_generation(node, nr));
+			blocks[nr_blocks].bytenr = search;
+			blocks[nr_blocks].blocksize = blocksize;
+			blocks[nr_blocks].parent_transid =
+				btrfs_node_ptr_generation(node, nr);
+			nr_blocks++;
 			nread += blocksize;
 		}
 		nscan++;
@@ -1021,6 +1033,7 @@ void reada_for_search(struct btrfs_root *root, struct btrfs_path *path,
 		if (search > highest_read)
 			highest_read = search;
 	}
+	readahead_tree_blocks(root, blocks, nr_blocks);
 }
 
 int btrfs_find_item(struct btrfs_root *fs_root, struct btrfs_path *found_path,
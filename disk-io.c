@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "kerncompat.h"
 #include "radix-tree.h"
 #include "ctree.h"
@@ -32,6 +33,7 @@
 #include "utils.h"
 #include "print-tree.h"
 #include "rbtree-utils.h"
+#include "metadump.h"
 
 static int check_tree_block(struct btrfs_root *root, struct extent_buffer *buf)
 {
@@ -68,6 +70,21 @@ void btrfs_csum_final(u32 crc, char *result)
 	*(__le32 *)result = ~cpu_to_le32(crc);
 }
 
+/*
+ * Checksum @nr consecutive sectors of @data, the final csum of each sector is
+ * stored in @result.
+ */
+void btrfs_csum_sectors(struct btrfs_root *root, char *data, u32 sectorsize,
+			unsigned int nr, u32 *result)
+{
+	unsigned int i;
+
+	crc32c_le_sectors(~(u32)0, (unsigned char *)data, sectorsize, nr,
+			  result);
+	for (i = 0; i < nr; i++)
+		btrfs_csum_final(result[i], (char *)&result[i]);
+}
+
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
 				  int verify, int silent)
 {
@@ -140,6 +157,10 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	struct btrfs_multi_bio *multi = NULL;
 	struct btrfs_device *device;
 
+	/* the image is read through its own cache */
+	if (root->fs_info->metadump)
+		return;
+
 	eb = btrfs_find_tree_block(root, bytenr, blocksize);
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid)) &&
 	    !btrfs_map_block(&root->fs_info->mapping_tree, READ,
@@ -154,6 +175,261 @@ void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 	kfree(multi);
 }
 
+/*
+ * Batched tree block readahead.
+ *
+ * readahead(2) only hints the page cache one block at a time.  Instead the
+ * blocks are allocated and mapped here, then a pool of reader threads does
+ * the preads and checksum verification with many requests in flight.  Good
+ * blocks are marked uptodate and stay in the extent buffer cache for the
+ * read_tree_block() that follows, bad ones are dropped and left for the
+ * regular read path with its mirror retries and error reporting.
+ *
+ * This is a synchronous batch: readahead_tree_blocks() returns once the
+ * whole batch has been read.  Like the rest of the tree code it is meant to
+ * be called from one thread at a time, the pool has a single batch slot and
+ * a second caller finding it busy reads its batch itself.
+ */
+struct reada_job {
+	struct extent_buffer *eb;
+	u64 parent_transid;
+	int ret;
+};
+
+struct btrfs_reada_pool {
+	pthread_t *threads;
+	int nr_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct reada_job *jobs;
+	int nr_jobs;
+	int next_job;
+	int nr_done;
+	u16 csum_size;
+	int stop;
+};
+
+static int reada_threads = BTRFS_READA_THREADS;
+
+/* 0 does the batched reads in the calling thread */
+void btrfs_set_reada_threads(int nr)
+{
+	reada_threads = nr;
+}
+
+static void reada_read_one(struct reada_job *job, u16 csum_size)
+{
+	job->ret = read_extent_from_disk(job->eb, 0, job->eb->len);
+	if (!job->ret && verify_tree_block_csum_silent(job->eb, csum_size))
+		job->ret = -EIO;
+}
+
+static void *reada_worker(void *data)
+{
+	struct btrfs_reada_pool *pool = data;
+	struct reada_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (1) {
+		while (!pool->stop && pool->next_job >= pool->nr_jobs)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->stop)
+			break;
+		job = &pool->jobs[pool->next_job++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		reada_read_one(job, pool->csum_size);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (++pool->nr_done == pool->nr_jobs)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+static struct btrfs_reada_pool *reada_pool_get(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada_pool *pool = fs_info->reada_pool;
+	int i;
+
+	if (pool || reada_threads <= 0)
+		return pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(reada_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->csum_size = btrfs_super_csum_size(fs_info->super_copy);
+
+	for (i = 0; i < reada_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, reada_worker, pool))
+			break;
+		pool->nr_threads++;
+	}
+	if (!pool->nr_threads) {
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	fs_info->reada_pool = pool;
+	return pool;
+}
+
+static void reada_pool_free(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_reada_pool *pool = fs_info->reada_pool;
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+	fs_info->reada_pool = NULL;
+}
+
+static void reada_run_jobs(struct btrfs_fs_info *fs_info,
+			   struct reada_job *jobs, int nr)
+{
+	struct btrfs_reada_pool *pool = NULL;
+	int i;
+
+	if (nr > 1)
+		pool = reada_pool_get(fs_info);
+	if (!pool) {
+		u16 csum_size = btrfs_super_csum_size(fs_info->super_copy);
+
+		for (i = 0; i < nr; i++)
+			reada_read_one(&jobs[i], csum_size);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->jobs) {
+		u16 csum_size = pool->csum_size;
+
+		pthread_mutex_unlock(&pool->mutex);
+		for (i = 0; i < nr; i++)
+			reada_read_one(&jobs[i], csum_size);
+		return;
+	}
+	pool->jobs = jobs;
+	pool->nr_jobs = nr;
+	pool->next_job = 0;
+	pool->nr_done = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+	while (pool->nr_done < pool->nr_jobs)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pool->jobs = NULL;
+	pool->nr_jobs = 0;
+	pool->next_job = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Read the given tree blocks into the extent buffer cache in one batch.
+ * This is only a hint, blocks that can't be mapped to a single device
+ * or fail verification are silently skipped.
+ */
+void readahead_tree_blocks(struct btrfs_root *root,
+			   struct btrfs_reada_block *blocks, int nr)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_multi_bio *multi;
+	struct btrfs_device *device;
+	struct extent_buffer *eb;
+	struct reada_job *jobs;
+	u64 length;
+	int nr_jobs = 0;
+	int ret;
+	int i;
+
+	/* nothing would be kept around, fall back to the kernel readahead */
+	if (!fs_info->extent_cache.cache_max || fs_info->on_restoring ||
+	    fs_info->metadump)
+		goto fallback;
+
+	jobs = calloc(nr, sizeof(*jobs));
+	if (!jobs)
+		goto fallback;
+
+	for (i = 0; i < nr; i++) {
+		u64 transid = blocks[i].parent_transid;
+
+		eb = btrfs_find_create_tree_block(root, blocks[i].bytenr,
+						  blocks[i].blocksize);
+		if (!eb)
+			continue;
+		/*
+		 * In use by somebody else, or uptodate already.  An uptodate
+		 * block with the wrong generation is left to read_tree_block(),
+		 * reading over it here would leave the flag on unverified data.
+		 */
+		if (eb->refs > 1 || extent_buffer_uptodate(eb)) {
+			free_extent_buffer(eb);
+			continue;
+		}
+
+		multi = NULL;
+		length = eb->len;
+		ret = btrfs_map_block(&fs_info->mapping_tree, READ, eb->start,
+				      &length, &multi, 0, NULL);
+		if (ret || length < eb->len || multi->stripes[0].dev->fd <= 0) {
+			kfree(multi);
+			free_extent_buffer(eb);
+			continue;
+		}
+		device = multi->stripes[0].dev;
+		device->total_ios++;
+		eb->fd = device->fd;
+		eb->dev_bytenr = multi->stripes[0].physical;
+		kfree(multi);
+
+		jobs[nr_jobs].eb = eb;
+		jobs[nr_jobs].parent_transid = transid;
+		nr_jobs++;
+	}
+
+	reada_run_jobs(fs_info, jobs, nr_jobs);
+
+	for (i = 0; i < nr_jobs; i++) {
+		eb = jobs[i].eb;
+		if (!jobs[i].ret && btrfs_header_bytenr(eb) == eb->start &&
+		    !check_tree_block(root, eb) &&
+		    (!jobs[i].parent_transid ||
+		     btrfs_header_generation(eb) == jobs[i].parent_transid))
+			btrfs_set_buffer_uptodate(eb);
+		free_extent_buffer(eb);
+	}
+	free(jobs);
+	return;
+
+fallback:
+	for (i = 0; i < nr; i++)
+		readahead_tree_block(root, blocks[i].bytenr,
+				     blocks[i].blocksize,
+				     blocks[i].parent_transid);
+}
+
 static int verify_parent_transid(struct extent_io_tree *io_tree,
 				 struct extent_buffer *eb, u64 parent_transid,
 				 int ignore)
@@ -195,11 +471,34 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	u64 read_len;
 	unsigned long bytes_left = eb->len;
 
+	if (info->metadump) {
+		ret = metadump_image_read(info->metadump, eb->start, eb->data,
+					  eb->len);
+		if (ret == -ENOENT)
+			fprintf(stderr, "Block %llu is not in the image\n",
+				(unsigned long long)eb->start);
+		return ret ? -EIO : 0;
+	}
+
 	while (bytes_left) {
 		read_len = bytes_left;
 		device = NULL;
 
 		if (!info->on_restoring &&
+		    eb->start != BTRFS_SUPER_INFO_OFFSET &&
+		    btrfs_is_raid56_rebuild(&info->mapping_tree,
+					    eb->start + offset, mirror)) {
+			if (read_len > bytes_left)
+				read_len = bytes_left;
+			ret = read_raid56_rebuild(info, eb->data + offset,
+						  eb->start + offset,
+						  &read_len, mirror);
+			if (ret)
+				return -EIO;
+			offset += read_len;
+			bytes_left -= read_len;
+			continue;
+		} else if (!info->on_restoring &&
 		    eb->start != BTRFS_SUPER_INFO_OFFSET) {
 			ret = btrfs_map_block(&info->mapping_tree, READ,
 					      eb->start + offset, &read_len, &multi,
@@ -720,6 +1019,7 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 	free(fs_info->quota_root);
 	free(fs_info->super_copy);
 	free(fs_info->log_root_tree);
+	metadump_image_close(fs_info->metadump);
 	free(fs_info);
 }
 
@@ -756,6 +1056,8 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 	memset(fs_info->quota_root, 0, sizeof(struct btrfs_root));
 
 	extent_io_tree_init(&fs_info->extent_cache);
+	extent_io_tree_init_cache_max(&fs_info->extent_cache,
+				      get_extent_cache_max());
 	extent_io_tree_init(&fs_info->free_space_cache);
 	extent_io_tree_init(&fs_info->block_group_cache);
 	extent_io_tree_init(&fs_info->pinned_extents);
@@ -984,6 +1286,7 @@ FREE_EXTENT_CACHE_BASED_TREE(mapping_cache, free_map_lookup);
 
 void btrfs_cleanup_all_caches(struct btrfs_fs_info *fs_info)
 {
+	reada_pool_free(fs_info);
 	while (!list_empty(&fs_info->recow_ebs)) {
 		struct extent_buffer *eb;
 		eb = list_first_entry(&fs_info->recow_ebs,
@@ -1083,6 +1386,43 @@ int btrfs_setup_chunk_tree_and_device_map(struct btrfs_fs_info *fs_info)
 	return 0;
 }
 
+/*
+ * Set up @fs_info to read the filesystem straight out of the btrfs-image
+ * dump in @fp, without restoring it first.  Returns -ENOENT if @fp is not
+ * a dump.
+ */
+static int open_metadump(struct btrfs_fs_info *fs_info, int fp,
+			 const char *path, enum btrfs_open_ctree_flags flags,
+			 struct btrfs_fs_devices **fs_devices)
+{
+	struct btrfs_super_block *sb = fs_info->super_copy;
+	struct metadump_image *image;
+	int ret;
+
+	image = metadump_image_open(fp, 1);
+	if (IS_ERR(image))
+		return PTR_ERR(image);
+	fs_info->metadump = image;
+
+	if (flags & (OPEN_CTREE_WRITES | OPEN_CTREE_RESTORE |
+		     OPEN_CTREE_RECOVER_SUPER)) {
+		fprintf(stderr, "%s is a metadump image, it can only be opened read-only\n",
+			path);
+		return -EINVAL;
+	}
+
+	ret = metadump_image_read(image, fs_info->super_bytenr, sb,
+				  BTRFS_SUPER_INFO_SIZE);
+	if (ret || btrfs_super_bytenr(sb) != fs_info->super_bytenr ||
+	    btrfs_super_magic(sb) != BTRFS_MAGIC) {
+		fprintf(stderr, "No valid super block in metadump image %s\n",
+			path);
+		return -EIO;
+	}
+
+	return btrfs_scan_one_metadump(path, sb, fs_devices);
+}
+
 static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 					     u64 sb_bytenr,
 					     u64 root_tree_bytenr,
@@ -1110,8 +1450,10 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 	if (flags & OPEN_CTREE_RESTORE)
 		fs_info->on_restoring = 1;
 
-	ret = btrfs_scan_fs_devices(fp, path, &fs_devices, sb_bytenr,
-				    (flags & OPEN_CTREE_RECOVER_SUPER));
+	ret = open_metadump(fs_info, fp, path, flags, &fs_devices);
+	if (ret == -ENOENT)
+		ret = btrfs_scan_fs_devices(fp, path, &fs_devices, sb_bytenr,
+					    (flags & OPEN_CTREE_RECOVER_SUPER));
 	if (ret)
 		goto out;
 
@@ -1129,7 +1471,9 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, const char *path,
 		goto out;
 
 	disk_super = fs_info->super_copy;
-	if (!(flags & OPEN_CTREE_RECOVER_SUPER))
+	if (fs_info->metadump)
+		ret = 0;	/* already read from the image */
+	else if (!(flags & OPEN_CTREE_RECOVER_SUPER))
 		ret = btrfs_read_dev_super(fs_devices->latest_bdev,
 					   disk_super, sb_bytenr, 1);
 	else
@@ -50,6 +50,19 @@ struct extent_buffer *read_tree_block(struct btrfs_root *root, u64 bytenr,
 				      u32 blocksize, u64 parent_transid);
 void readahead_tree_block(struct btrfs_root *root, u64 bytenr, u32 blocksize,
 			  u64 parent_transid);
+
+/* default number of reader threads used by readahead_tree_blocks() */
+#define BTRFS_READA_THREADS	8
+
+struct btrfs_reada_block {
+	u64 bytenr;
+	u32 blocksize;
+	u64 parent_transid;
+};
+
+void readahead_tree_blocks(struct btrfs_root *root,
+			   struct btrfs_reada_block *blocks, int nr);
+void btrfs_set_reada_threads(int nr);
 struct extent_buffer *btrfs_find_create_tree_block(struct btrfs_root *root,
 						   u64 bytenr, u32 blocksize);
 
@@ -100,6 +113,8 @@ int wait_on_tree_block_writeback(struct btrfs_root *root,
 				 struct extent_buffer *buf);
 u32 btrfs_csum_data(struct btrfs_root *root, char *data, u32 seed, size_t len);
 void btrfs_csum_final(u32 crc, char *result);
+void btrfs_csum_sectors(struct btrfs_root *root, char *data, u32 sectorsize,
+			unsigned int nr, u32 *result);
 
 int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root);
@@ -113,5 +128,10 @@ int write_and_map_eb(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 
 /* raid6.c */
 void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs);
+void raid5_gen_parity(int disks, size_t bytes, void **ptrs);
+int raid6_recov_2data(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs);
+int raid6_recov_datap(int disks, size_t bytes, int faila, void **ptrs);
+void raid5_recov(int disks, size_t bytes, int faila, void **ptrs);
 
 #endif
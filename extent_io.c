@@ -27,6 +27,11 @@
 #include "list.h"
 #include "ctree.h"
 #include "volumes.h"
+#include "utils.h"
+#include "metadump.h"
+
+/* (u64)-1 means not set yet, fall back to the environment or the default */
+static u64 extent_cache_max = (u64)-1;
 
 void extent_io_tree_init(struct extent_io_tree *tree)
 {
@@ -34,6 +39,50 @@ void extent_io_tree_init(struct extent_io_tree *tree)
 	cache_tree_init(&tree->cache);
 	INIT_LIST_HEAD(&tree->lru);
 	tree->cache_size = 0;
+	tree->cache_max = 0;
+	tree->cache_hits = 0;
+	tree->cache_misses = 0;
+	tree->cache_evictions = 0;
+}
+
+/*
+ * Allow up to @cache_max bytes of extent buffers to stay in the tree after
+ * their last reference is dropped, 0 frees them immediately.
+ */
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 cache_max)
+{
+	tree->cache_max = cache_max;
+}
+
+void set_extent_cache_max(u64 cache_max)
+{
+	extent_cache_max = cache_max;
+}
+
+u64 get_extent_cache_max(void)
+{
+	char *env;
+
+	if (extent_cache_max != (u64)-1)
+		return extent_cache_max;
+
+	env = getenv(BTRFS_EXTENT_CACHE_ENV);
+	if (env && env[0])
+		extent_cache_max = parse_size(env);
+	else
+		extent_cache_max = BTRFS_DEFAULT_EXTENT_CACHE_MAX;
+	return extent_cache_max;
+}
+
+void print_extent_cache_stats(struct extent_io_tree *tree)
+{
+	printf("extent buffer cache: size %llu max %llu hits %llu misses %llu evictions %llu\n",
+	       (unsigned long long)tree->cache_size,
+	       (unsigned long long)tree->cache_max,
+	       (unsigned long long)tree->cache_hits,
+	       (unsigned long long)tree->cache_misses,
+	       (unsigned long long)tree->cache_evictions);
 }
 
 static struct extent_state *alloc_extent_state(void)
@@ -66,16 +115,50 @@ static void free_extent_state_func(struct cache_extent *cache)
 	btrfs_free_extent_state(es);
 }
 
-void extent_io_tree_cleanup(struct extent_io_tree *tree)
+static void free_extent_buffer_internal(struct extent_buffer *eb)
+{
+	struct extent_io_tree *tree = eb->tree;
+
+	list_del_init(&eb->lru);
+	list_del_init(&eb->recow);
+	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
+		BUG_ON(tree->cache_size < eb->len);
+		remove_cache_extent(&tree->cache, &eb->cache_node);
+		tree->cache_size -= eb->len;
+	}
+	free(eb);
+}
+
+/*
+ * Drop unreferenced buffers from the head of the lru list until the tree
+ * fits into cache_max again.  Referenced buffers are never on the list.
+ */
+static void trim_extent_buffer_cache(struct extent_io_tree *tree)
 {
 	struct extent_buffer *eb;
 
-	while(!list_empty(&tree->lru)) {
+	while (tree->cache_size > tree->cache_max && !list_empty(&tree->lru)) {
 		eb = list_entry(tree->lru.next, struct extent_buffer, lru);
+		BUG_ON(eb->refs);
+		free_extent_buffer_internal(eb);
+		tree->cache_evictions++;
+	}
+}
+
+void extent_io_tree_cleanup(struct extent_io_tree *tree)
+{
+	struct extent_buffer *eb;
+	struct cache_extent *cache;
+
+	tree->cache_max = 0;
+	trim_extent_buffer_cache(tree);
+
+	while ((cache = first_cache_extent(&tree->cache))) {
+		eb = container_of(cache, struct extent_buffer, cache_node);
 		fprintf(stderr, "extent buffer leak: "
 			"start %llu len %u\n",
 			(unsigned long long)eb->start, eb->len);
-		free_extent_buffer(eb);
+		free_extent_buffer_internal(eb);
 	}
 
 	cache_tree_free_extents(&tree->state, free_extent_state_func);
@@ -554,6 +637,7 @@ static struct extent_buffer *__alloc_extent_buffer(struct extent_io_tree *tree,
 	eb->dev_bytenr = (u64)-1;
 	eb->cache_node.start = bytenr;
 	eb->cache_node.size = blocksize;
+	INIT_LIST_HEAD(&eb->lru);
 	INIT_LIST_HEAD(&eb->recow);
 
 	return eb;
@@ -573,6 +657,22 @@ struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 	return new;
 }
 
+/*
+ * Only buffers that can be handed out again as they are may stay cached
+ * without a reference, everything else is freed on the last put.
+ */
+static int extent_buffer_cacheable(struct extent_buffer *eb)
+{
+	struct extent_io_tree *tree = eb->tree;
+
+	if (!tree || !tree->cache_max)
+		return 0;
+	if (eb->flags & (EXTENT_BUFFER_DUMMY | EXTENT_DIRTY |
+			 EXTENT_BAD_TRANSID))
+		return 0;
+	return eb->flags & EXTENT_UPTODATE;
+}
+
 void free_extent_buffer(struct extent_buffer *eb)
 {
 	if (!eb)
@@ -582,18 +682,27 @@ void free_extent_buffer(struct extent_buffer *eb)
 	BUG_ON(eb->refs < 0);
 	if (eb->refs == 0) {
 		struct extent_io_tree *tree = eb->tree;
+
 		BUG_ON(eb->flags & EXTENT_DIRTY);
-		list_del_init(&eb->lru);
-		list_del_init(&eb->recow);
-		if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
-			BUG_ON(tree->cache_size < eb->len);
-			remove_cache_extent(&tree->cache, &eb->cache_node);
-			tree->cache_size -= eb->len;
+		if (extent_buffer_cacheable(eb)) {
+			list_add_tail(&eb->lru, &tree->lru);
+			trim_extent_buffer_cache(tree);
+		} else {
+			free_extent_buffer_internal(eb);
 		}
-		free(eb);
 	}
 }
 
+/* take a reference on a cached buffer, pulling it off the lru if unused */
+static void grab_cached_extent_buffer(struct extent_io_tree *tree,
+				      struct extent_buffer *eb)
+{
+	if (eb->refs == 0)
+		list_del_init(&eb->lru);
+	eb->refs++;
+	tree->cache_hits++;
+}
+
 struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 					 u64 bytenr, u32 blocksize)
 {
@@ -604,8 +713,7 @@ struct extent_buffer *find_extent_buffer(struct extent_io_tree *tree,
 	if (cache && cache->start == bytenr &&
 	    cache->size == blocksize) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		grab_cached_extent_buffer(tree, eb);
 	}
 	return eb;
 }
@@ -619,8 +727,7 @@ struct extent_buffer *find_first_extent_buffer(struct extent_io_tree *tree,
 	cache = search_cache_extent(&tree->cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		grab_cached_extent_buffer(tree, eb);
 	}
 	return eb;
 }
@@ -635,15 +742,26 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 	if (cache && cache->start == bytenr &&
 	    cache->size == blocksize) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &tree->lru);
-		eb->refs++;
+		grab_cached_extent_buffer(tree, eb);
 	} else {
 		int ret;
 
-		if (cache) {
+		/*
+		 * Overlapping buffers are stale, drop them without keeping
+		 * them around on the lru list as they would block the insert.
+		 */
+		while (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
-			free_extent_buffer(eb);
+			if (eb->refs > 1) {
+				eb->refs--;
+				break;
+			}
+			BUG_ON(eb->flags & EXTENT_DIRTY);
+			eb->refs = 0;
+			free_extent_buffer_internal(eb);
+			cache = lookup_cache_extent(&tree->cache, bytenr,
+						    blocksize);
 		}
 		eb = __alloc_extent_buffer(tree, bytenr, blocksize);
 		if (!eb)
@@ -653,8 +771,9 @@ struct extent_buffer *alloc_extent_buffer(struct extent_io_tree *tree,
 			free(eb);
 			return NULL;
 		}
-		list_add_tail(&eb->lru, &tree->lru);
 		tree->cache_size += blocksize;
+		tree->cache_misses++;
+		trim_extent_buffer_cache(tree);
 	}
 	return eb;
 }
@@ -702,8 +821,24 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 	u64 total_read = 0;
 	int ret;
 
+	/* data isn't dumped, it reads back as zeroes like after a restore */
+	if (info->metadump)
+		return metadump_image_read_sparse(info->metadump, offset, buf,
+						  bytes);
+
 	while (bytes_left) {
 		read_len = bytes_left;
+		if (btrfs_is_raid56_rebuild(&info->mapping_tree, offset,
+					    mirror)) {
+			ret = read_raid56_rebuild(info, buf + total_read,
+						  offset, &read_len, mirror);
+			if (ret) {
+				fprintf(stderr, "Couldn't rebuild %Lu\n",
+					offset);
+				return ret;
+			}
+			goto next;
+		}
 		ret = btrfs_map_block(&info->mapping_tree, READ, offset,
 				      &read_len, &multi, mirror, NULL);
 		if (ret) {
@@ -732,7 +867,7 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 offset,
 				"read_len %Lu\n", offset, ret, read_len);
 			return -EIO;
 		}
-
+next:
 		bytes_left -= read_len;
 		offset += read_len;
 		total_read += read_len;
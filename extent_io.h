@@ -51,11 +51,23 @@
 
 struct btrfs_fs_info;
 
+/*
+ * Default byte budget for the tree block cache of an opened filesystem,
+ * can be overridden by BTRFS_EXTENT_CACHE_ENV or set_extent_cache_max()
+ */
+#define BTRFS_DEFAULT_EXTENT_CACHE_MAX	(256 * 1024 * 1024ULL)
+#define BTRFS_EXTENT_CACHE_ENV		"BTRFS_EXTENT_CACHE_SIZE"
+
 struct extent_io_tree {
 	struct cache_tree state;
 	struct cache_tree cache;
+	/* unreferenced buffers kept for reuse, least recently used first */
 	struct list_head lru;
 	u64 cache_size;
+	u64 cache_max;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 cache_evictions;
 };
 
 struct extent_state {
@@ -87,6 +99,11 @@ static inline void extent_buffer_get(struct extent_buffer *eb)
 }
 
 void extent_io_tree_init(struct extent_io_tree *tree);
+void extent_io_tree_init_cache_max(struct extent_io_tree *tree,
+				   u64 cache_max);
+void set_extent_cache_max(u64 cache_max);
+u64 get_extent_cache_max(void);
+void print_extent_cache_stats(struct extent_io_tree *tree);
 void extent_io_tree_cleanup(struct extent_io_tree *tree);
 int set_extent_bits(struct extent_io_tree *tree, u64 start,
 		    u64 end, int bits, gfp_t mask);
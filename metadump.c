@@ -0,0 +1,671 @@
+/*
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifndef BTRFS_DISABLE_ZSTD
+#include <zstd.h>
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#include "kerncompat.h"
+#include "metadump.h"
+
+const struct compress_codec metadump_codecs[] = {
+	{ "zlib", COMPRESS_ZLIB, 6, 9 },
+#ifndef BTRFS_DISABLE_ZSTD
+	{ "zstd", COMPRESS_ZSTD, 3, 19 },
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+	/* level 1 is plain lz4, anything above uses lz4hc */
+	{ "lz4", COMPRESS_LZ4, 1, LZ4HC_CLEVEL_MAX },
+#endif
+};
+
+const int metadump_nr_codecs = ARRAY_SIZE(metadump_codecs);
+
+const struct compress_codec *find_codec(int method)
+{
+	int i;
+
+	for (i = 0; i < metadump_nr_codecs; i++)
+		if (metadump_codecs[i].method == method)
+			return &metadump_codecs[i];
+	return NULL;
+}
+
+int check_compress_method(int method)
+{
+	if (method == COMPRESS_NONE || find_codec(method))
+		return 0;
+	fprintf(stderr, "unsupported compression method %d in metadump image\n",
+		method);
+	return -EOPNOTSUPP;
+}
+
+void compress_ctx_free(struct compress_ctx *ctx)
+{
+#ifndef BTRFS_DISABLE_ZSTD
+	ZSTD_freeCCtx(ctx->zstd_cctx);
+	ZSTD_freeDCtx(ctx->zstd_dctx);
+	ctx->zstd_cctx = NULL;
+	ctx->zstd_dctx = NULL;
+#endif
+}
+
+size_t compress_bound(int method, size_t size)
+{
+	switch (method) {
+#ifndef BTRFS_DISABLE_ZSTD
+	case COMPRESS_ZSTD:
+		return ZSTD_compressBound(size);
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+	case COMPRESS_LZ4:
+		return LZ4_compressBound(size);
+#endif
+	default:
+		return compressBound(size);
+	}
+}
+
+/*
+ * Compress @len bytes at @src into @dst, which holds *@dst_len bytes.
+ * On success *@dst_len is set to the compressed size.
+ */
+int compress_item(struct compress_ctx *ctx, int method, int level,
+		  u8 *dst, size_t *dst_len, const u8 *src, size_t len)
+{
+	unsigned long zlen;
+#ifndef BTRFS_DISABLE_ZSTD
+	size_t ret;
+#endif
+	int zret;
+
+	switch (method) {
+	case COMPRESS_ZLIB:
+		zlen = *dst_len;
+		zret = compress2(dst, &zlen, src, len, level);
+		if (zret != Z_OK)
+			return -EIO;
+		*dst_len = zlen;
+		return 0;
+#ifndef BTRFS_DISABLE_ZSTD
+	case COMPRESS_ZSTD:
+		if (!ctx->zstd_cctx) {
+			ctx->zstd_cctx = ZSTD_createCCtx();
+			if (!ctx->zstd_cctx)
+				return -ENOMEM;
+		}
+		ret = ZSTD_compressCCtx(ctx->zstd_cctx, dst, *dst_len, src,
+					len, level);
+		if (ZSTD_isError(ret))
+			return -EIO;
+		*dst_len = ret;
+		return 0;
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+	case COMPRESS_LZ4:
+		if (level > 1)
+			zret = LZ4_compress_HC((const char *)src, (char *)dst,
+					       len, *dst_len, level);
+		else
+			zret = LZ4_compress_default((const char *)src,
+						    (char *)dst, len, *dst_len);
+		if (zret <= 0)
+			return -EIO;
+		*dst_len = zret;
+		return 0;
+#endif
+	}
+	return -EINVAL;
+}
+
+/*
+ * Decompress @len bytes at @src into @dst, which holds *@dst_len bytes.
+ * @ctx may be NULL for one off users.
+ */
+int decompress_item(struct compress_ctx *ctx, int method, u8 *dst,
+		    size_t *dst_len, const u8 *src, size_t len)
+{
+	unsigned long zlen;
+#ifndef BTRFS_DISABLE_ZSTD
+	size_t ret;
+#endif
+	int zret;
+
+	switch (method) {
+	case COMPRESS_ZLIB:
+		zlen = *dst_len;
+		zret = uncompress(dst, &zlen, src, len);
+		if (zret != Z_OK) {
+			fprintf(stderr, "Error decompressing %d\n", zret);
+			return -EIO;
+		}
+		*dst_len = zlen;
+		return 0;
+#ifndef BTRFS_DISABLE_ZSTD
+	case COMPRESS_ZSTD:
+		if (ctx && !ctx->zstd_dctx) {
+			ctx->zstd_dctx = ZSTD_createDCtx();
+			if (!ctx->zstd_dctx)
+				return -ENOMEM;
+		}
+		if (ctx)
+			ret = ZSTD_decompressDCtx(ctx->zstd_dctx, dst, *dst_len,
+						  src, len);
+		else
+			ret = ZSTD_decompress(dst, *dst_len, src, len);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "Error decompressing %s\n",
+				ZSTD_getErrorName(ret));
+			return -EIO;
+		}
+		*dst_len = ret;
+		return 0;
+#endif
+#ifndef BTRFS_DISABLE_LZ4
+	case COMPRESS_LZ4:
+		zret = LZ4_decompress_safe((const char *)src, (char *)dst,
+					   len, *dst_len);
+		if (zret < 0) {
+			fprintf(stderr, "Error decompressing %d\n", zret);
+			return -EIO;
+		}
+		*dst_len = zret;
+		return 0;
+#endif
+	}
+	return check_compress_method(method);
+}
+
+static int index_item_cmp(const void *a, const void *b)
+{
+	const struct meta_index_item *ia = a;
+	const struct meta_index_item *ib = b;
+	u64 abytenr = le64_to_cpu(ia->bytenr);
+	u64 bbytenr = le64_to_cpu(ib->bytenr);
+
+	if (abytenr < bbytenr)
+		return -1;
+	if (abytenr > bbytenr)
+		return 1;
+	return 0;
+}
+
+static int read_cluster(int fd, u64 offset, struct meta_cluster *cluster)
+{
+	int ret;
+
+	ret = pread(fd, cluster, BLOCK_SIZE, offset);
+	if (ret < 0)
+		return -errno;
+	if (ret == 0)
+		return 1;
+	if (ret != BLOCK_SIZE ||
+	    le64_to_cpu(cluster->header.magic) != HEADER_MAGIC ||
+	    le64_to_cpu(cluster->header.bytenr) != offset)
+		return -EIO;
+	return 0;
+}
+
+static int read_index_cluster(int fd, u64 offset, struct meta_cluster *cluster,
+			      struct meta_index_header **ret_header)
+{
+	struct meta_index_header *ih;
+	int ret;
+
+	ret = read_cluster(fd, offset, cluster);
+	if (ret)
+		return ret < 0 ? ret : -EIO;
+
+	ih = (struct meta_index_header *)(cluster->items);
+	if (le32_to_cpu(cluster->header.nritems) != 0 ||
+	    le64_to_cpu(ih->magic) != INDEX_MAGIC ||
+	    le32_to_cpu(ih->nritems) > INDEX_ITEMS_PER_CLUSTER)
+		return -ENOENT;
+
+	*ret_header = ih;
+	return 0;
+}
+
+static int add_image_item(struct metadump_image *image, u64 *max_items,
+			  struct meta_index_item *item)
+{
+	if (image->nr_items == *max_items) {
+		u64 max = max_t(u64, *max_items * 2, INDEX_ITEMS_PER_CLUSTER);
+		struct meta_index_item *items;
+
+		items = realloc(image->items, max * sizeof(*items));
+		if (!items)
+			return -ENOMEM;
+		image->items = items;
+		*max_items = max;
+	}
+	image->items[image->nr_items++] = *item;
+	return 0;
+}
+
+/* load the index written at the end of the image */
+static int load_index(struct metadump_image *image, u64 size,
+		      struct meta_cluster *cluster)
+{
+	struct meta_index_header *ih;
+	u64 offset;
+	u64 start;
+	u64 total;
+	u64 nr = 0;
+	int ret;
+
+	ret = read_index_cluster(image->fd, size - BLOCK_SIZE, cluster, &ih);
+	if (ret)
+		return ret == -EIO ? -ENOENT : ret;
+
+	start = le64_to_cpu(ih->start);
+	total = le64_to_cpu(ih->total);
+	if (start & BLOCK_MASK || start >= size ||
+	    total > (size - start) / BLOCK_SIZE * INDEX_ITEMS_PER_CLUSTER)
+		return -EIO;
+
+	image->items = malloc(max_t(u64, total, 1) * sizeof(*image->items));
+	if (!image->items)
+		return -ENOMEM;
+
+	for (offset = start; offset < size; offset += BLOCK_SIZE) {
+		u32 nritems;
+
+		ret = read_index_cluster(image->fd, offset, cluster, &ih);
+		if (ret)
+			return ret == -ENOENT ? -EIO : ret;
+		nritems = le32_to_cpu(ih->nritems);
+		if (nr + nritems > total)
+			return -EIO;
+		memcpy(image->items + nr, ih + 1,
+		       nritems * sizeof(struct meta_index_item));
+		nr += nritems;
+	}
+	if (nr != total)
+		return -EIO;
+	image->nr_items = nr;
+	return 0;
+}
+
+/*
+ * Build the index of an image written without one by walking all of its
+ * clusters.  Compressed items have to be decompressed to learn their size.
+ */
+static int scan_image(struct metadump_image *image,
+		      struct meta_cluster *cluster)
+{
+	struct meta_index_item entry;
+	u64 max_items = 0;
+	u64 offset = 0;
+	u32 max_size = MAX_PENDING_SIZE * 4;
+	u8 *src = NULL;
+	u8 *dst = NULL;
+	int ret;
+
+	if (image->compress_method != COMPRESS_NONE) {
+		src = malloc(max_size);
+		dst = malloc(max_size);
+		if (!src || !dst) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	while (1) {
+		u32 nritems;
+		u32 i;
+
+		ret = read_cluster(image->fd, offset, cluster);
+		if (ret) {
+			if (ret > 0)
+				ret = 0;
+			break;
+		}
+
+		offset += BLOCK_SIZE;
+		nritems = le32_to_cpu(cluster->header.nritems);
+		if (nritems > ITEMS_PER_CLUSTER) {
+			ret = -EIO;
+			break;
+		}
+		for (i = 0; i < nritems; i++) {
+			struct meta_cluster_item *item = &cluster->items[i];
+			u32 size = le32_to_cpu(item->size);
+			size_t raw_size = size;
+
+			if (image->compress_method != COMPRESS_NONE) {
+				if (size > max_size) {
+					ret = -EIO;
+					goto out;
+				}
+				ret = pread(image->fd, src, size, offset);
+				if (ret != size) {
+					ret = ret < 0 ? -errno : -EIO;
+					goto out;
+				}
+				raw_size = max_size;
+				ret = decompress_item(&image->ctx,
+						      image->compress_method,
+						      dst, &raw_size, src, size);
+				if (ret)
+					goto out;
+			}
+
+			entry.bytenr = item->bytenr;
+			entry.offset = cpu_to_le64(offset);
+			entry.size = item->size;
+			entry.raw_size = cpu_to_le32(raw_size);
+			ret = add_image_item(image, &max_items, &entry);
+			if (ret)
+				goto out;
+			offset += size;
+		}
+		if (offset & BLOCK_MASK)
+			offset += BLOCK_SIZE - (offset & BLOCK_MASK);
+	}
+out:
+	free(src);
+	free(dst);
+	return ret;
+}
+
+/*
+ * Open the metadump image in @fd for reading by bytenr.  The index at the
+ * end of the image is used if there is one, otherwise the image is scanned
+ * if @scan is set.  Returns ERR_PTR(-ENOENT) if @fd is not an image or has
+ * no index and @scan isn't set.  The image reads through its own copy of
+ * @fd, so the caller may close it.
+ */
+struct metadump_image *metadump_image_open(int fd, int scan)
+{
+	struct metadump_image *image;
+	struct meta_cluster *cluster;
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st) < 0)
+		return ERR_PTR(-errno);
+	if (!S_ISREG(st.st_mode) || st.st_size < BLOCK_SIZE ||
+	    st.st_size & BLOCK_MASK)
+		return ERR_PTR(-ENOENT);
+
+	cluster = malloc(BLOCK_SIZE);
+	image = calloc(1, sizeof(*image));
+	if (!cluster || !image) {
+		free(cluster);
+		free(image);
+		return ERR_PTR(-ENOMEM);
+	}
+	image->fd = dup(fd);
+	if (image->fd < 0) {
+		ret = -errno;
+		free(cluster);
+		free(image);
+		return ERR_PTR(ret);
+	}
+	image->cache_max = METADUMP_CACHE_SIZE;
+	INIT_LIST_HEAD(&image->lru);
+	pthread_mutex_init(&image->lock, NULL);
+
+	ret = read_cluster(image->fd, 0, cluster);
+	if (ret) {
+		ret = ret == -EIO || ret > 0 ? -ENOENT : ret;
+		goto fail;
+	}
+	image->compress_method = cluster->header.compress;
+	ret = check_compress_method(image->compress_method);
+	if (ret)
+		goto fail;
+
+	ret = load_index(image, st.st_size, cluster);
+	if (ret == -ENOENT && scan) {
+		free(image->items);
+		image->items = NULL;
+		image->nr_items = 0;
+		ret = scan_image(image, cluster);
+	}
+	if (ret)
+		goto fail;
+
+	qsort(image->items, image->nr_items, sizeof(*image->items),
+	      index_item_cmp);
+	image->cache = calloc(max_t(u64, image->nr_items, 1),
+			      sizeof(*image->cache));
+	if (!image->cache) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	free(cluster);
+	return image;
+
+fail:
+	if (ret != -ENOENT)
+		fprintf(stderr, "Error reading metadump image: %s\n",
+			strerror(-ret));
+	free(cluster);
+	metadump_image_close(image);
+	return ERR_PTR(ret);
+}
+
+void metadump_image_close(struct metadump_image *image)
+{
+	struct metadump_cached *cached;
+
+	if (!image)
+		return;
+	while (!list_empty(&image->lru)) {
+		cached = list_entry(image->lru.next, struct metadump_cached,
+				    lru);
+		list_del(&cached->lru);
+		free(cached);
+	}
+	compress_ctx_free(&image->ctx);
+	pthread_mutex_destroy(&image->lock);
+	free(image->cache);
+	free(image->items);
+	close(image->fd);
+	free(image);
+}
+
+/* index of the first item that starts after @bytenr */
+static u64 find_slot(struct metadump_image *image, u64 bytenr)
+{
+	u64 lo = 0;
+	u64 hi = image->nr_items;
+
+	while (lo < hi) {
+		u64 mid = lo + (hi - lo) / 2;
+
+		if (le64_to_cpu(image->items[mid].bytenr) <= bytenr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* find the item that covers @bytenr */
+struct meta_index_item *metadump_image_find(struct metadump_image *image,
+					    u64 bytenr)
+{
+	struct meta_index_item *item;
+	u64 slot = find_slot(image, bytenr);
+
+	if (!slot)
+		return NULL;
+	item = image->items + slot - 1;
+	if (bytenr >= le64_to_cpu(item->bytenr) + le32_to_cpu(item->raw_size))
+		return NULL;
+	return item;
+}
+
+static void trim_cache(struct metadump_image *image)
+{
+	struct metadump_cached *cached;
+
+	while (image->cache_size > image->cache_max &&
+	       !list_empty(&image->lru)) {
+		cached = list_entry(image->lru.prev, struct metadump_cached,
+				    lru);
+		list_del(&cached->lru);
+		image->cache[cached->nr] = NULL;
+		image->cache_size -= cached->len;
+		free(cached);
+	}
+}
+
+/* return the decompressed buffer of item @nr, caller holds image->lock */
+static struct metadump_cached *get_item(struct metadump_image *image, u64 nr)
+{
+	struct meta_index_item *item = image->items + nr;
+	struct metadump_cached *cached = image->cache[nr];
+	u32 size = le32_to_cpu(item->size);
+	size_t len = le32_to_cpu(item->raw_size);
+	u8 *src;
+	int ret;
+
+	if (cached) {
+		list_move(&cached->lru, &image->lru);
+		image->cache_hits++;
+		return cached;
+	}
+
+	src = malloc(size);
+	cached = malloc(sizeof(*cached) + len);
+	if (!src || !cached) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = pread(image->fd, src, size, le64_to_cpu(item->offset));
+	if (ret != size) {
+		ret = ret < 0 ? -errno : -EIO;
+		goto fail;
+	}
+	ret = decompress_item(&image->ctx, image->compress_method,
+			      cached->data, &len, src, size);
+	if (ret)
+		goto fail;
+	if (len != le32_to_cpu(item->raw_size)) {
+		ret = -EIO;
+		goto fail;
+	}
+	free(src);
+
+	cached->nr = nr;
+	cached->len = len;
+	list_add(&cached->lru, &image->lru);
+	image->cache[nr] = cached;
+	image->cache_size += len;
+	image->cache_misses++;
+	trim_cache(image);
+	return cached;
+
+fail:
+	free(src);
+	free(cached);
+	return ERR_PTR(ret);
+}
+
+static int read_range(struct metadump_image *image, u64 bytenr, u8 *dst,
+		      u64 len, int zero_holes)
+{
+	struct meta_index_item *item;
+	struct metadump_cached *cached;
+	u64 item_start;
+	u64 offset;
+	u64 slot;
+	u64 cur;
+	int ret;
+
+	while (len) {
+		slot = find_slot(image, bytenr);
+		item = slot ? image->items + slot - 1 : NULL;
+		if (!item || bytenr >= le64_to_cpu(item->bytenr) +
+				       le32_to_cpu(item->raw_size)) {
+			if (!zero_holes)
+				return -ENOENT;
+			/* not in the image, restore would leave zeroes */
+			cur = len;
+			if (slot < image->nr_items)
+				cur = min_t(u64, cur,
+				le64_to_cpu(image->items[slot].bytenr) - bytenr);
+			memset(dst, 0, cur);
+			goto next;
+		}
+
+		item_start = le64_to_cpu(item->bytenr);
+		offset = bytenr - item_start;
+		cur = min_t(u64, len, le32_to_cpu(item->raw_size) - offset);
+		if (image->compress_method == COMPRESS_NONE) {
+			ret = pread(image->fd, dst, cur,
+				    le64_to_cpu(item->offset) + offset);
+			if (ret != cur)
+				return ret < 0 ? -errno : -EIO;
+			goto next;
+		}
+
+		cached = get_item(image, slot - 1);
+		if (IS_ERR(cached))
+			return PTR_ERR(cached);
+		memcpy(dst, cached->data + offset, cur);
+next:
+		dst += cur;
+		bytenr += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/*
+ * Read @len bytes at logical @bytenr, as they would be restored.  Returns
+ * -ENOENT if part of the range is not in the image.
+ */
+int metadump_image_read(struct metadump_image *image, u64 bytenr,
+			void *buf, u64 len)
+{
+	int ret;
+
+	pthread_mutex_lock(&image->lock);
+	ret = read_range(image, bytenr, buf, len, 0);
+	pthread_mutex_unlock(&image->lock);
+	return ret;
+}
+
+/* like metadump_image_read(), but ranges not in the image read as zeroes */
+int metadump_image_read_sparse(struct metadump_image *image, u64 bytenr,
+			       void *buf, u64 len)
+{
+	int ret;
+
+	pthread_mutex_lock(&image->lock);
+	ret = read_range(image, bytenr, buf, len, 1);
+	pthread_mutex_unlock(&image->lock);
+	return ret;
+}
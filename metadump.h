@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2008 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_METADUMP_H__
+#define __BTRFS_METADUMP_H__
+
+#include <pthread.h>
+#include "kerncompat.h"
+#include "list.h"
+
+/*
+ * On disk format of btrfs-image dumps.  The image is a chain of clusters,
+ * each one a BLOCK_SIZE header listing its items followed by the item
+ * buffers, padded to BLOCK_SIZE.  header->bytenr is the file offset of the
+ * cluster, item->bytenr the logical address the item is restored to.
+ */
+#define HEADER_MAGIC		0xbd5c25e27295668bULL
+#define MAX_PENDING_SIZE	(256 * 1024)
+#define BLOCK_SIZE		1024
+#define BLOCK_MASK		(BLOCK_SIZE - 1)
+
+#define COMPRESS_NONE		0
+#define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+#define COMPRESS_LZ4		3
+
+struct meta_cluster_item {
+	__le64 bytenr;
+	__le32 size;
+} __attribute__ ((__packed__));
+
+struct meta_cluster_header {
+	__le64 magic;
+	__le64 bytenr;
+	__le32 nritems;
+	u8 compress;
+} __attribute__ ((__packed__));
+
+/* cluster header + index items + buffers */
+struct meta_cluster {
+	struct meta_cluster_header header;
+	struct meta_cluster_item items[];
+} __attribute__ ((__packed__));
+
+#define ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster)) / \
+			   sizeof(struct meta_cluster_item))
+
+/*
+ * The optional block index is written at the end of the image as clusters
+ * without items, so older versions just skip it.  The space after the
+ * cluster header holds a meta_index_header and the index items.  Every
+ * index cluster records where the index starts, so readers find it from
+ * the last block of the file.
+ */
+#define INDEX_MAGIC		0x5844494d55444d42ULL
+
+struct meta_index_header {
+	__le64 magic;
+	/* file offset of the first index cluster */
+	__le64 start;
+	/* items in the whole index */
+	__le64 total;
+	/* items in this cluster */
+	__le32 nritems;
+} __attribute__ ((__packed__));
+
+struct meta_index_item {
+	__le64 bytenr;
+	/* file offset of the item buffer */
+	__le64 offset;
+	/* size of the buffer in the image */
+	__le32 size;
+	/* size of the buffer after decompression */
+	__le32 raw_size;
+} __attribute__ ((__packed__));
+
+#define INDEX_ITEMS_PER_CLUSTER ((BLOCK_SIZE - sizeof(struct meta_cluster) - \
+				  sizeof(struct meta_index_header)) / \
+				 sizeof(struct meta_index_item))
+
+struct compress_codec {
+	const char *name;
+	int method;
+	int default_level;
+	int max_level;
+};
+
+extern const struct compress_codec metadump_codecs[];
+extern const int metadump_nr_codecs;
+
+/* per thread codec state, set up on first use */
+struct compress_ctx {
+	struct ZSTD_CCtx_s *zstd_cctx;
+	struct ZSTD_DCtx_s *zstd_dctx;
+};
+
+const struct compress_codec *find_codec(int method);
+int check_compress_method(int method);
+void compress_ctx_free(struct compress_ctx *ctx);
+size_t compress_bound(int method, size_t size);
+int compress_item(struct compress_ctx *ctx, int method, int level,
+		  u8 *dst, size_t *dst_len, const u8 *src, size_t len);
+int decompress_item(struct compress_ctx *ctx, int method, u8 *dst,
+		    size_t *dst_len, const u8 *src, size_t len);
+
+/* decompressed items of an image are kept around up to this size */
+#define METADUMP_CACHE_SIZE	(64 * 1024 * 1024)
+
+struct metadump_cached {
+	struct list_head lru;
+	u64 nr;
+	u32 len;
+	u8 data[];
+};
+
+/* an image opened for reading by bytenr, see metadump_image_open() */
+struct metadump_image {
+	int fd;
+	int compress_method;
+	/* sorted by bytenr */
+	struct meta_index_item *items;
+	u64 nr_items;
+
+	pthread_mutex_t lock;
+	struct compress_ctx ctx;
+	/* cached decompressed items, by item number and in lru order */
+	struct metadump_cached **cache;
+	struct list_head lru;
+	u64 cache_size;
+	u64 cache_max;
+	u64 cache_hits;
+	u64 cache_misses;
+};
+
+struct metadump_image *metadump_image_open(int fd, int scan);
+void metadump_image_close(struct metadump_image *image);
+struct meta_index_item *metadump_image_find(struct metadump_image *image,
+					    u64 bytenr);
+int metadump_image_read(struct metadump_image *image, u64 bytenr,
+			void *buf, u64 len);
+int metadump_image_read_sparse(struct metadump_image *image, u64 bytenr,
+			       void *buf, u64 len);
+
+#endif
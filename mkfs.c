@@ -35,13 +35,15 @@
 #include <limits.h>
 #include <linux/limits.h>
 #include <blkid/blkid.h>
-#include <ftw.h>
+#include <pthread.h>
+#include <sys/syscall.h>
 #include "ctree.h"
 #include "disk-io.h"
 #include "volumes.h"
 #include "transaction.h"
 #include "utils.h"
 #include "version.h"
+#include "bulk-load.h"
 
 static u64 index_cnt = 2;
 
@@ -50,13 +52,86 @@ static u64 index_cnt = 2;
 
 #define DEFAULT_MKFS_LEAF_SIZE 16384
 
-struct directory_name_entry {
-	char *dir_name;
+/*
+ * The source directory of --rootdir is scanned once by a pool of threads
+ * which read the directories, stat every entry and read its xattrs and
+ * symlink target.  The result sizes the image and is then turned into
+ * the fs tree in breadth first order by the main thread, while the same
+ * threads read the contents of small files ahead of it.
+ */
+#define MKFS_ROOTDIR_THREADS	8
+/* files up to this size are read ahead of the tree builder */
+#define MKFS_PREFETCH_FILE_MAX	(1024 * 1024)
+/* limits of what is read ahead and not consumed yet */
+#define MKFS_PREFETCH_BYTES	(64 * 1024 * 1024)
+#define MKFS_PREFETCH_FILES	1024
+/*
+ * The fs and csum trees are bulk loaded with full leaves, the image is
+ * mostly read before anything is added to it.
+ */
+#define MKFS_BULK_FILL		100
+
+struct rootdir_xattr {
+	char *name;
+	char *value;
+	int value_len;
+};
+
+struct rootdir_dir;
+
+struct rootdir_entry {
+	char *name;
+	struct rootdir_dir *parent;
+	struct stat st;
+	/* errno of lstat(), llistxattr() or getxattr() and readlink() */
+	int stat_err;
+	int xattr_err;
+	int link_err;
+	struct rootdir_xattr *xattrs;
+	int nr_xattrs;
+	char *link;
+	/* the scanned directory for directories */
+	struct rootdir_dir *dir;
+	/* contents read ahead for small files */
+	char *data;
+	int data_ready;
+};
+
+struct rootdir_dir {
 	char *path;
 	ino_t inum;
+	int scan_err;
+	struct rootdir_entry *entries;
+	int nr_entries;
+	u64 inode_size;
 	struct list_head list;
 };
 
+struct rootdir_scan {
+	struct rootdir_dir *top;
+	u64 total_size;
+	/* directories waiting to be scanned and the number being scanned */
+	struct list_head queue;
+	int busy;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct rootdir_prefetch {
+	/* regular files in the order the tree builder consumes them */
+	struct rootdir_entry **files;
+	u64 nr_files;
+	u64 next;
+	u64 consumed;
+	u64 bytes;
+	u32 sectorsize;
+	int stop;
+	int nr_threads;
+	pthread_t threads[MKFS_ROOTDIR_THREADS];
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
 static int make_root_dir(struct btrfs_root *root, int mixed)
 {
 	struct btrfs_trans_handle *trans;
@@ -338,6 +413,7 @@ static char *parse_label(char *input)
 }
 
 static int add_directory_items(struct btrfs_trans_handle *trans,
+			       struct btrfs_bulk_loader *bl,
 			       struct btrfs_root *root, u64 objectid,
 			       ino_t parent_inum, const char *name,
 			       struct stat *st, int *dir_index_cnt)
@@ -360,13 +436,13 @@ static int add_directory_items(struct btrfs_trans_handle *trans,
 	if (S_ISLNK(st->st_mode))
 		filetype = BTRFS_FT_SYMLINK;
 
-	ret = btrfs_insert_dir_item(trans, root, name, name_len,
-				    parent_inum, &location,
-				    filetype, index_cnt);
+	ret = btrfs_bulk_insert_dir_item(trans, bl, root, name, name_len,
+					 parent_inum, &location,
+					 filetype, index_cnt);
 	if (ret)
 		return ret;
-	ret = btrfs_insert_inode_ref(trans, root, name, name_len,
-				     objectid, parent_inum, index_cnt);
+	ret = btrfs_bulk_insert_inode_ref(bl, root, name, name_len,
+					  objectid, parent_inum, index_cnt);
 	*dir_index_cnt = index_cnt;
 	index_cnt++;
 
@@ -449,28 +525,10 @@ static void free_namelist(struct direct **files, int count)
 	free(files);
 }
 
-static u64 calculate_dir_inode_size(char *dirname)
-{
-	int count, i;
-	struct direct **files, *cur_file;
-	u64 dir_inode_size = 0;
-
-	count = scandir(dirname, &files, directory_select, NULL);
-
-	for (i = 0; i < count; i++) {
-		cur_file = files[i];
-		dir_inode_size += strlen(cur_file->d_name);
-	}
-
-	free_namelist(files, count);
-
-	dir_inode_size *= 2;
-	return dir_inode_size;
-}
-
 static int add_inode_items(struct btrfs_trans_handle *trans,
+			   struct btrfs_bulk_loader *bl,
 			   struct btrfs_root *root,
-			   struct stat *st, char *name,
+			   struct stat *st, u64 dir_inode_size,
 			   u64 self_objectid, ino_t parent_inum,
 			   int dir_index_cnt, struct btrfs_inode_item *inode_ret)
 {
@@ -478,109 +536,201 @@ static int add_inode_items(struct btrfs_trans_handle *trans,
 	struct btrfs_key inode_key;
 	struct btrfs_inode_item btrfs_inode;
 	u64 objectid;
-	u64 inode_size = 0;
 
 	fill_inode_item(trans, root, &btrfs_inode, st);
 	objectid = self_objectid;
 
-	if (S_ISDIR(st->st_mode)) {
-		inode_size = calculate_dir_inode_size(name);
-		btrfs_set_stack_inode_size(&btrfs_inode, inode_size);
-	}
+	if (S_ISDIR(st->st_mode))
+		btrfs_set_stack_inode_size(&btrfs_inode, dir_inode_size);
 
 	inode_key.objectid = objectid;
 	inode_key.offset = 0;
 	btrfs_set_key_type(&inode_key, BTRFS_INODE_ITEM_KEY);
 
-	ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
+	ret = btrfs_bulk_insert_inode(bl, root, objectid, &btrfs_inode);
 
 	*inode_ret = btrfs_inode;
 	return ret;
 }
 
 static int add_xattr_item(struct btrfs_trans_handle *trans,
+			  struct btrfs_bulk_loader *bl,
 			  struct btrfs_root *root, u64 objectid,
-			  const char *file_name)
+			  struct rootdir_entry *entry)
 {
-	int ret;
-	int cur_name_len;
-	char xattr_list[XATTR_LIST_MAX];
-	char *cur_name;
-	char cur_value[XATTR_SIZE_MAX];
-	char delimiter = '\0';
-	char *next_location = xattr_list;
+	int ret = 0;
+	int i;
 
-	ret = llistxattr(file_name, xattr_list, XATTR_LIST_MAX);
-	if (ret < 0) {
-		if(errno == ENOTSUP)
-			return 0;
+	if (entry->xattr_err) {
 		fprintf(stderr, "get a list of xattr failed for %s\n",
-			file_name);
-		return ret;
+			entry->name);
+		return -1;
 	}
-	if (ret == 0)
-		return ret;
 
-	cur_name = strtok(xattr_list, &delimiter);
-	while (cur_name != NULL) {
-		cur_name_len = strlen(cur_name);
-		next_location += cur_name_len + 1;
-
-		ret = getxattr(file_name, cur_name, cur_value, XATTR_SIZE_MAX);
-		if (ret < 0) {
-			if(errno == ENOTSUP)
-				return 0;
-			fprintf(stderr, "get a xattr value failed for %s attr %s\n",
-				file_name, cur_name);
-			return ret;
-		}
-
-		ret = btrfs_insert_xattr_item(trans, root, cur_name,
-					      cur_name_len, cur_value,
-					      ret, objectid);
+	for (i = 0; i < entry->nr_xattrs; i++) {
+		ret = btrfs_bulk_insert_xattr_item(trans, bl, root,
+					entry->xattrs[i].name,
+					strlen(entry->xattrs[i].name),
+					entry->xattrs[i].value,
+					entry->xattrs[i].value_len,
+					objectid);
 		if (ret) {
 			fprintf(stderr, "insert a xattr item failed for %s\n",
-				file_name);
+				entry->name);
 		}
-
-		cur_name = strtok(next_location, &delimiter);
 	}
 
 	return ret;
 }
 
 static int add_symbolic_link(struct btrfs_trans_handle *trans,
+			     struct btrfs_bulk_loader *bl,
 			     struct btrfs_root *root,
-			     u64 objectid, const char *path_name)
+			     u64 objectid, struct rootdir_entry *entry)
 {
-	int ret;
-	u64 sectorsize = root->sectorsize;
-	char *buf = malloc(sectorsize);
+	size_t len;
 
-	ret = readlink(path_name, buf, sectorsize);
-	if (ret <= 0) {
-		fprintf(stderr, "readlink failed for %s\n", path_name);
-		goto fail;
+	if (entry->link_err || !entry->link) {
+		fprintf(stderr, "readlink failed for %s\n", entry->name);
+		return -1;
 	}
-	if (ret >= sectorsize) {
-		fprintf(stderr, "symlink too long for %s", path_name);
-		ret = -1;
-		goto fail;
+	len = strlen(entry->link);
+	if (len >= root->sectorsize) {
+		fprintf(stderr, "symlink too long for %s", entry->name);
+		return -1;
 	}
 
-	buf[ret] = '\0'; /* readlink does not do it for us */
-	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-					 buf, ret + 1);
-fail:
-	free(buf);
-	return ret;
+	return btrfs_bulk_insert_inline_extent(trans, bl, root, objectid, 0,
+					       entry->link, len + 1);
 }
 
+/*
+ * Data of --rootdir is written in extents of up to 128MiB, the largest the
+ * kernel creates, and streamed through a buffer of 8MiB.
+ */
+#define MKFS_MAX_EXTENT_SIZE	(128 * 1024 * 1024)
+#define MKFS_DATA_IO_SIZE	(8 * 1024 * 1024)
+
+static int copy_range_disabled = 0;
+
+/*
+ * find_free_extent() BUG()s when no free range is large enough, so cap the
+ * extent size to the largest free range of the block groups it could use.
+ */
+static u64 largest_free_data_extent(struct btrfs_fs_info *info, u64 max_bytes)
+{
+	struct btrfs_block_group_cache *cache;
+	u64 bits = BTRFS_BLOCK_GROUP_DATA |
+		   (info->avail_data_alloc_bits & info->data_alloc_profile);
+	u64 cur = 0;
+	u64 found = 0;
+	u64 bg_end;
+	u64 start;
+	u64 end;
+	u64 last;
+
+	while ((cache = btrfs_lookup_first_block_group(info, cur)) &&
+	       found < max_bytes) {
+		bg_end = cache->key.objectid + cache->key.offset;
+		cur = bg_end;
+		if (cache->ro || (cache->flags & bits) != bits)
+			continue;
+		last = cache->key.objectid;
+		while (last < bg_end &&
+		       !find_first_extent_bit(&info->free_space_cache, last,
+					      &start, &end, EXTENT_DIRTY)) {
+			start = max(start, last);
+			end = min(end + 1, bg_end);
+			if (start >= bg_end)
+				break;
+			found = max(found, end - start);
+			last = end;
+		}
+	}
+	found = min(found, max_bytes);
+	return found - found % info->tree_root->sectorsize;
+}
+
+static int read_file_data(int fd, char *buf, u64 pos, u64 len,
+			  const char *path_name)
+{
+	ssize_t ret;
+	u64 done = 0;
+
+	while (done < len) {
+		ret = pread64(fd, buf + done, len - done, pos + done);
+		if (ret < 0) {
+			fprintf(stderr, "%s read failed\n", path_name);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	memset(buf + done, 0, len - done);
+	return 0;
+}
+
+/*
+ * Write @len bytes read from @fd at @pos to @logical.  When the range maps
+ * to a single stripe the kernel is asked to copy, or reflink, the data
+ * straight from the source file, otherwise and when that is not supported
+ * the data in @buf is written.
+ */
+static int write_file_data(struct btrfs_fs_info *info, int fd, u64 pos,
+			   u64 logical, char *buf, u64 len)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 map_len = len;
+	u64 done = 0;
+	loff_t in_off;
+	loff_t out_off;
+	ssize_t ret = -1;
+
+	if (!copy_range_disabled &&
+	    !btrfs_map_block(&info->mapping_tree, WRITE, logical, &map_len,
+			     &multi, 0, &raid_map)) {
+		if (!raid_map && multi->num_stripes == 1 && map_len >= len) {
+			in_off = pos;
+			out_off = multi->stripes[0].physical;
+			while (done < len) {
+#ifdef __NR_copy_file_range
+				ret = syscall(__NR_copy_file_range, fd, &in_off,
+					      multi->stripes[0].dev->fd,
+					      &out_off, len - done, 0);
+#else
+				ret = -1;
+				errno = ENOSYS;
+#endif
+				if (ret <= 0)
+					break;
+				done += ret;
+			}
+			if (ret < 0 && (errno == EXDEV || errno == EINVAL ||
+					errno == ENOSYS || errno == EOPNOTSUPP ||
+					errno == EBADF))
+				copy_range_disabled = 1;
+		}
+		kfree(raid_map);
+		kfree(multi);
+	}
+	if (done == len)
+		return 0;
+	return write_data_to_disk(info, buf + done, logical + done, len - done,
+				  0);
+}
+
+/*
+ * Add the contents of the file at @path_name, @data holds them zero padded
+ * to the sector size when they were read ahead.
+ */
 static int add_file_items(struct btrfs_trans_handle *trans,
+			  struct btrfs_bulk_loader *bl,
 			  struct btrfs_root *root,
 			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
 			  ino_t parent_inum, struct stat *st,
-			  const char *path_name, int out_fd)
+			  const char *path_name, int out_fd, char *data)
 {
 	int ret = -1;
 	ssize_t ret_read;
@@ -591,17 +741,21 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 	u64 first_block = 0;
 	u64 file_pos = 0;
 	u64 cur_bytes;
+	u64 io_bytes;
 	u64 total_bytes;
-	struct extent_buffer *eb = NULL;
-	int fd;
+	char *buf = NULL;
+	char *chunk;
+	int fd = -1;
 
 	if (st->st_size == 0)
 		return 0;
 
-	fd = open(path_name, O_RDONLY);
-	if (fd == -1) {
-		fprintf(stderr, "%s open failed\n", path_name);
-		return ret;
+	if (!data) {
+		fd = open(path_name, O_RDONLY);
+		if (fd == -1) {
+			fprintf(stderr, "%s open failed\n", path_name);
+			return ret;
+		}
 	}
 
 	blocks = st->st_size / sectorsize;
@@ -609,99 +763,108 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 		blocks += 1;
 
 	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(root)) {
-		char *buffer = malloc(st->st_size);
-		ret_read = pread64(fd, buffer, st->st_size, bytes_read);
-		if (ret_read == -1) {
-			fprintf(stderr, "%s read failed\n", path_name);
-			free(buffer);
-			goto end;
+		char *buffer = data;
+
+		if (!data) {
+			buffer = malloc(st->st_size);
+			ret_read = pread64(fd, buffer, st->st_size, bytes_read);
+			if (ret_read == -1) {
+				fprintf(stderr, "%s read failed\n", path_name);
+				free(buffer);
+				goto end;
+			}
 		}
 
-		ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
-						 buffer, st->st_size);
-		free(buffer);
+		ret = btrfs_bulk_insert_inline_extent(trans, bl, root,
+						      objectid, 0, buffer,
+						      st->st_size);
+		if (!data)
+			free(buffer);
 		goto end;
 	}
 
 	/* round up our st_size to the FS blocksize */
 	total_bytes = (u64)blocks * sectorsize;
 
-	/*
-	 * do our IO in extent buffers so it can work
-	 * against any raid type
-	 */
-	eb = malloc(sizeof(*eb) + sectorsize);
-	if (!eb) {
-		ret = -ENOMEM;
-		goto end;
+	if (!data) {
+		buf = malloc(min_t(u64, total_bytes, MKFS_DATA_IO_SIZE));
+		if (!buf) {
+			ret = -ENOMEM;
+			goto end;
+		}
 	}
-	memset(eb, 0, sizeof(*eb) + sectorsize);
-
-again:
-
-	/*
-	 * keep our extent size at 1MB max, this makes it easier to work inside
-	 * the tiny block groups created during mkfs
-	 */
-	cur_bytes = min(total_bytes, 1024ULL * 1024);
-	ret = btrfs_reserve_extent(trans, root, cur_bytes, 0, 0, (u64)-1,
-				   &key, 1);
-	if (ret)
-		goto end;
-
-	first_block = key.objectid;
-	bytes_read = 0;
-
-	while (bytes_read < cur_bytes) {
 
-		memset(eb->data, 0, sectorsize);
-
-		ret_read = pread64(fd, eb->data, sectorsize, file_pos + bytes_read);
-		if (ret_read == -1) {
-			fprintf(stderr, "%s read failed\n", path_name);
+	while (total_bytes) {
+		cur_bytes = largest_free_data_extent(root->fs_info,
+				min_t(u64, total_bytes, MKFS_MAX_EXTENT_SIZE));
+		if (!cur_bytes) {
+			fprintf(stderr, "no space left for %s\n", path_name);
+			ret = -ENOSPC;
 			goto end;
 		}
-
-		eb->start = first_block + bytes_read;
-		eb->len = sectorsize;
-
-		/*
-		 * we're doing the csum before we record the extent, but
-		 * that's ok
-		 */
-		ret = btrfs_csum_file_block(trans, root->fs_info->csum_root,
-					    first_block + bytes_read + sectorsize,
-					    first_block + bytes_read,
-					    eb->data, sectorsize);
+		ret = btrfs_reserve_extent(trans, root, cur_bytes, 0, 0,
+					   (u64)-1, &key, 1);
 		if (ret)
 			goto end;
 
-		ret = write_and_map_eb(trans, root, eb);
-		if (ret) {
-			fprintf(stderr, "output file write failed\n");
-			goto end;
-		}
+		first_block = key.objectid;
+		for (bytes_read = 0; bytes_read < cur_bytes;
+		     bytes_read += io_bytes) {
+			io_bytes = min_t(u64, cur_bytes - bytes_read,
+					 MKFS_DATA_IO_SIZE);
+			if (data) {
+				chunk = data + file_pos + bytes_read;
+			} else {
+				ret = read_file_data(fd, buf,
+						     file_pos + bytes_read,
+						     io_bytes, path_name);
+				if (ret)
+					goto end;
+				chunk = buf;
+			}
 
-		bytes_read += sectorsize;
-	}
+			/*
+			 * we're doing the csum before we record the extent,
+			 * but that's ok
+			 */
+			ret = btrfs_bulk_csum_file_blocks(bl,
+					root->fs_info->csum_root,
+					first_block + bytes_read, chunk,
+					io_bytes);
+			if (ret)
+				goto end;
+
+			/* the tail past EOF must be written from the buffer */
+			if (!data &&
+			    file_pos + bytes_read + io_bytes <= st->st_size)
+				ret = write_file_data(root->fs_info, fd,
+						      file_pos + bytes_read,
+						      first_block + bytes_read,
+						      chunk, io_bytes);
+			else
+				ret = write_data_to_disk(root->fs_info, chunk,
+						first_block + bytes_read,
+						io_bytes, 0);
+			if (ret) {
+				fprintf(stderr, "output file write failed\n");
+				goto end;
+			}
+		}
 
-	if (bytes_read) {
-		ret = btrfs_record_file_extent(trans, root, objectid, btrfs_inode,
-					       file_pos, first_block, cur_bytes);
+		ret = btrfs_bulk_record_file_extent(trans, bl, root, objectid,
+						    btrfs_inode, file_pos,
+						    first_block, cur_bytes);
 		if (ret)
 			goto end;
 
+		file_pos += cur_bytes;
+		total_bytes -= cur_bytes;
 	}
 
-	file_pos += cur_bytes;
-	total_bytes -= cur_bytes;
-
-	if (total_bytes)
-		goto again;
-
 end:
-	free(eb);
-	close(fd);
+	free(buf);
+	if (fd >= 0)
+		close(fd);
 	return ret;
 }
 
@@ -719,41 +882,417 @@ static char *make_path(char *dir, char *name)
 	return path;
 }
 
+static void read_rootdir_xattrs(const char *path,
+				struct rootdir_entry *entry)
+{
+	char xattr_list[XATTR_LIST_MAX];
+	char cur_value[XATTR_SIZE_MAX];
+	struct rootdir_xattr *xattr;
+	char *cur_name;
+	int ret;
+	int len;
+
+	len = llistxattr(path, xattr_list, XATTR_LIST_MAX);
+	if (len < 0) {
+		if (errno != ENOTSUP)
+			entry->xattr_err = errno;
+		return;
+	}
+
+	for (cur_name = xattr_list; cur_name < xattr_list + len;
+	     cur_name += strlen(cur_name) + 1) {
+		ret = getxattr(path, cur_name, cur_value, XATTR_SIZE_MAX);
+		if (ret < 0) {
+			if (errno != ENOTSUP)
+				entry->xattr_err = errno;
+			return;
+		}
+		xattr = realloc(entry->xattrs,
+				(entry->nr_xattrs + 1) * sizeof(*xattr));
+		if (!xattr) {
+			entry->xattr_err = ENOMEM;
+			return;
+		}
+		entry->xattrs = xattr;
+		xattr += entry->nr_xattrs;
+		xattr->name = strdup(cur_name);
+		xattr->value = malloc(ret ? ret : 1);
+		if (!xattr->name || !xattr->value) {
+			free(xattr->name);
+			free(xattr->value);
+			entry->xattr_err = ENOMEM;
+			return;
+		}
+		memcpy(xattr->value, cur_value, ret);
+		xattr->value_len = ret;
+		entry->nr_xattrs++;
+	}
+}
+
+/*
+ * Read the directory @dir and everything about its entries, new
+ * directories found are added to @subdirs and the size of what was found
+ * to @size.
+ */
+static void scan_rootdir_dir(struct rootdir_dir *dir,
+			     struct list_head *subdirs, u64 *size)
+{
+	struct direct **files;
+	struct rootdir_entry *entry;
+	char link[PATH_MAX];
+	char *path;
+	int count;
+	int ret;
+	int i;
+
+	count = scandir(dir->path, &files, directory_select, NULL);
+	if (count == -1) {
+		dir->scan_err = errno;
+		return;
+	}
+
+	dir->entries = calloc(count, sizeof(*dir->entries));
+	if (!dir->entries) {
+		dir->scan_err = ENOMEM;
+		goto out;
+	}
+	dir->nr_entries = count;
+
+	for (i = 0; i < count; i++) {
+		entry = &dir->entries[i];
+		entry->parent = dir;
+		entry->name = strdup(files[i]->d_name);
+		dir->inode_size += strlen(files[i]->d_name) * 2;
+		path = make_path(dir->path, files[i]->d_name);
+		if (!entry->name || !path) {
+			free(path);
+			entry->stat_err = ENOMEM;
+			continue;
+		}
+
+		if (lstat(path, &entry->st) == -1) {
+			entry->stat_err = errno;
+			free(path);
+			continue;
+		}
+		if (S_ISREG(entry->st.st_mode) || S_ISDIR(entry->st.st_mode))
+			*size += round_up(entry->st.st_size, 4096);
+
+		read_rootdir_xattrs(path, entry);
+
+		if (S_ISLNK(entry->st.st_mode)) {
+			ret = readlink(path, link, sizeof(link) - 1);
+			if (ret <= 0) {
+				entry->link_err = errno;
+			} else {
+				link[ret] = '\0';
+				entry->link = strdup(link);
+			}
+		}
+
+		if (S_ISDIR(entry->st.st_mode)) {
+			entry->dir = calloc(1, sizeof(*entry->dir));
+			if (!entry->dir) {
+				entry->stat_err = ENOMEM;
+				free(path);
+				continue;
+			}
+			entry->dir->path = path;
+			list_add_tail(&entry->dir->list, subdirs);
+		} else {
+			free(path);
+		}
+	}
+out:
+	free_namelist(files, count);
+}
+
+static void *rootdir_scan_worker(void *data)
+{
+	struct rootdir_scan *scan = data;
+	struct rootdir_dir *dir;
+	LIST_HEAD(subdirs);
+	u64 size;
+
+	pthread_mutex_lock(&scan->mutex);
+	while (1) {
+		while (list_empty(&scan->queue) && scan->busy)
+			pthread_cond_wait(&scan->cond, &scan->mutex);
+		if (list_empty(&scan->queue))
+			break;
+		dir = list_entry(scan->queue.next, struct rootdir_dir, list);
+		list_del_init(&dir->list);
+		scan->busy++;
+		pthread_mutex_unlock(&scan->mutex);
+
+		size = 0;
+		scan_rootdir_dir(dir, &subdirs, &size);
+
+		pthread_mutex_lock(&scan->mutex);
+		list_splice_tail_init(&subdirs, &scan->queue);
+		scan->total_size += size;
+		scan->busy--;
+		pthread_cond_broadcast(&scan->cond);
+	}
+	pthread_mutex_unlock(&scan->mutex);
+	return NULL;
+}
+
+static void free_rootdir_dir(struct rootdir_dir *dir)
+{
+	struct rootdir_entry *entry;
+	int i;
+	int j;
+
+	for (i = 0; i < dir->nr_entries; i++) {
+		entry = &dir->entries[i];
+		if (entry->dir)
+			free_rootdir_dir(entry->dir);
+		for (j = 0; j < entry->nr_xattrs; j++) {
+			free(entry->xattrs[j].name);
+			free(entry->xattrs[j].value);
+		}
+		free(entry->xattrs);
+		free(entry->link);
+		free(entry->data);
+		free(entry->name);
+	}
+	free(dir->entries);
+	free(dir->path);
+	free(dir);
+}
+
+static void free_rootdir_scan(struct rootdir_scan *scan)
+{
+	if (scan->top)
+		free_rootdir_dir(scan->top);
+	pthread_mutex_destroy(&scan->mutex);
+	pthread_cond_destroy(&scan->cond);
+	free(scan);
+}
+
+/*
+ * Scan the whole tree under @dir_name with a pool of threads.  Errors on
+ * entries are recorded and reported when the tree is built, in the same
+ * order as if it was walked on a single thread.
+ */
+static struct rootdir_scan *scan_rootdir(const char *dir_name)
+{
+	struct rootdir_scan *scan;
+	pthread_t threads[MKFS_ROOTDIR_THREADS];
+	struct stat st;
+	int nr_threads;
+	int i;
+
+	scan = calloc(1, sizeof(*scan));
+	if (!scan)
+		return NULL;
+	INIT_LIST_HEAD(&scan->queue);
+	pthread_mutex_init(&scan->mutex, NULL);
+	pthread_cond_init(&scan->cond, NULL);
+
+	scan->top = calloc(1, sizeof(*scan->top));
+	if (!scan->top)
+		goto fail;
+	scan->top->path = realpath(dir_name, NULL);
+	if (!scan->top->path || lstat(scan->top->path, &st)) {
+		fprintf(stderr, "unable to lstat the %s\n", dir_name);
+		goto fail;
+	}
+	scan->total_size = round_up(st.st_size, 4096);
+	list_add_tail(&scan->top->list, &scan->queue);
+
+	for (nr_threads = 0; nr_threads < MKFS_ROOTDIR_THREADS; nr_threads++)
+		if (pthread_create(&threads[nr_threads], NULL,
+				   rootdir_scan_worker, scan))
+			break;
+	if (!nr_threads)
+		rootdir_scan_worker(scan);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	return scan;
+fail:
+	free_rootdir_scan(scan);
+	return NULL;
+}
+
+static void *rootdir_prefetch_worker(void *data)
+{
+	struct rootdir_prefetch *pf = data;
+	struct rootdir_entry *entry;
+	char *path;
+	u64 size;
+	int fd;
+
+	pthread_mutex_lock(&pf->mutex);
+	while (!pf->stop && pf->next < pf->nr_files) {
+		entry = pf->files[pf->next];
+		size = 0;
+		if (entry->st.st_size <= MKFS_PREFETCH_FILE_MAX)
+			size = round_up(entry->st.st_size, pf->sectorsize);
+		if (pf->next - pf->consumed >= MKFS_PREFETCH_FILES ||
+		    (pf->bytes && pf->bytes + size > MKFS_PREFETCH_BYTES)) {
+			pthread_cond_wait(&pf->cond, &pf->mutex);
+			continue;
+		}
+		pf->next++;
+		pf->bytes += size;
+		pthread_mutex_unlock(&pf->mutex);
+
+		/* on any error the builder reads the file and reports it */
+		path = size ? make_path(entry->parent->path, entry->name) : NULL;
+		fd = path ? open(path, O_RDONLY) : -1;
+		if (fd >= 0) {
+			entry->data = malloc(size);
+			if (entry->data &&
+			    read_file_data(fd, entry->data, 0, size, path)) {
+				free(entry->data);
+				entry->data = NULL;
+			}
+			close(fd);
+		}
+		free(path);
+
+		pthread_mutex_lock(&pf->mutex);
+		entry->data_ready = 1;
+		pthread_cond_broadcast(&pf->cond);
+	}
+	pthread_mutex_unlock(&pf->mutex);
+	return NULL;
+}
+
+static void add_prefetch_files(struct rootdir_prefetch *pf,
+			       struct rootdir_dir *dir)
+{
+	struct rootdir_entry *entry;
+	int i;
+
+	for (i = 0; i < dir->nr_entries; i++) {
+		entry = &dir->entries[i];
+		if (entry->stat_err || !S_ISREG(entry->st.st_mode) ||
+		    !entry->st.st_size)
+			continue;
+		pf->files[pf->nr_files++] = entry;
+	}
+}
+
+/*
+ * Start reading small files ahead in the breadth first order
+ * traverse_directory() adds them in.
+ */
+static int start_rootdir_prefetch(struct rootdir_prefetch *pf,
+				  struct rootdir_scan *scan, u32 sectorsize)
+{
+	struct rootdir_dir *dir;
+	u64 nr_files = 0;
+	LIST_HEAD(queue);
+	int i;
+
+	memset(pf, 0, sizeof(*pf));
+	pf->sectorsize = sectorsize;
+	pthread_mutex_init(&pf->mutex, NULL);
+	pthread_cond_init(&pf->cond, NULL);
+
+	list_add_tail(&scan->top->list, &queue);
+	while (!list_empty(&queue)) {
+		dir = list_entry(queue.next, struct rootdir_dir, list);
+		list_del_init(&dir->list);
+		nr_files += dir->nr_entries;
+		for (i = 0; i < dir->nr_entries; i++)
+			if (dir->entries[i].dir)
+				list_add_tail(&dir->entries[i].dir->list,
+					      &queue);
+	}
+	pf->files = malloc(max_t(u64, nr_files, 1) * sizeof(*pf->files));
+	if (!pf->files)
+		return -ENOMEM;
+
+	list_add_tail(&scan->top->list, &queue);
+	while (!list_empty(&queue)) {
+		dir = list_entry(queue.next, struct rootdir_dir, list);
+		list_del_init(&dir->list);
+		add_prefetch_files(pf, dir);
+		for (i = 0; i < dir->nr_entries; i++)
+			if (dir->entries[i].dir)
+				list_add_tail(&dir->entries[i].dir->list,
+					      &queue);
+	}
+
+	for (i = 0; i < MKFS_ROOTDIR_THREADS; i++) {
+		if (pthread_create(&pf->threads[i], NULL,
+				   rootdir_prefetch_worker, pf))
+			break;
+		pf->nr_threads++;
+	}
+	return 0;
+}
+
+/* wait for the read ahead of @entry, the next file to add */
+static char *get_prefetched_file(struct rootdir_prefetch *pf,
+				 struct rootdir_entry *entry)
+{
+	if (!pf->nr_threads)
+		return NULL;
+	pthread_mutex_lock(&pf->mutex);
+	while (!entry->data_ready)
+		pthread_cond_wait(&pf->cond, &pf->mutex);
+	pthread_mutex_unlock(&pf->mutex);
+	return entry->data;
+}
+
+static void put_prefetched_file(struct rootdir_prefetch *pf,
+				struct rootdir_entry *entry)
+{
+	free(entry->data);
+	entry->data = NULL;
+	pthread_mutex_lock(&pf->mutex);
+	if (entry->st.st_size <= MKFS_PREFETCH_FILE_MAX)
+		pf->bytes -= round_up(entry->st.st_size, pf->sectorsize);
+	pf->consumed++;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+}
+
+static void stop_rootdir_prefetch(struct rootdir_prefetch *pf)
+{
+	int i;
+
+	pthread_mutex_lock(&pf->mutex);
+	pf->stop = 1;
+	pthread_cond_broadcast(&pf->cond);
+	pthread_mutex_unlock(&pf->mutex);
+	for (i = 0; i < pf->nr_threads; i++)
+		pthread_join(pf->threads[i], NULL);
+	free(pf->files);
+	pthread_mutex_destroy(&pf->mutex);
+	pthread_cond_destroy(&pf->cond);
+}
+
 static int traverse_directory(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, char *dir_name,
-			      struct directory_name_entry *dir_head, int out_fd)
+			      struct btrfs_root *root,
+			      struct rootdir_scan *scan, int out_fd)
 {
 	int ret = 0;
 
 	struct btrfs_inode_item cur_inode;
 	struct btrfs_inode_item *inode_item;
-	int count, i, dir_index_cnt;
-	struct direct **files;
-	struct stat st;
-	struct directory_name_entry *dir_entry, *parent_dir_entry;
-	struct direct *cur_file;
+	int i, dir_index_cnt;
+	struct rootdir_dir *parent_dir;
+	struct rootdir_entry *entry;
+	struct rootdir_prefetch prefetch;
+	struct btrfs_bulk_loader bl;
+	struct cache_tree links;
 	ino_t parent_inum, cur_inum;
 	ino_t highest_inum = 0;
-	char *parent_dir_name;
-	char real_path[PATH_MAX];
+	char *path_name;
+	char *data;
 	struct btrfs_path path;
 	struct extent_buffer *leaf;
 	struct btrfs_key root_dir_key;
-	u64 root_dir_inode_size = 0;
-
-	/* Add list for source directory */
-	dir_entry = malloc(sizeof(struct directory_name_entry));
-	dir_entry->dir_name = dir_name;
-	dir_entry->path = realpath(dir_name, real_path);
-	if (!dir_entry->path) {
-		fprintf(stderr, "get directory real path error\n");
-		ret = -1;
-		goto fail_no_dir;
-	}
+	LIST_HEAD(dir_head);
 
 	parent_inum = highest_inum + BTRFS_FIRST_FREE_OBJECTID;
-	dir_entry->inum = parent_inum;
-	list_add_tail(&dir_entry->list, &dir_head->list);
+	scan->top->inum = parent_inum;
 
 	btrfs_init_path(&path);
 
@@ -763,127 +1302,129 @@ static int traverse_directory(struct btrfs_trans_handle *trans,
 	ret = btrfs_lookup_inode(trans, root, &path, &root_dir_key, 1);
 	if (ret) {
 		fprintf(stderr, "root dir lookup error\n");
-		goto fail_no_dir;
+		return 1;
 	}
 
 	leaf = path.nodes[0];
 	inode_item = btrfs_item_ptr(leaf, path.slots[0],
 				    struct btrfs_inode_item);
 
-	root_dir_inode_size = calculate_dir_inode_size(dir_name);
-	btrfs_set_inode_size(leaf, inode_item, root_dir_inode_size);
+	btrfs_set_inode_size(leaf, inode_item, scan->top->inode_size);
 	btrfs_mark_buffer_dirty(leaf);
 
 	btrfs_release_path(&path);
 
+	ret = start_rootdir_prefetch(&prefetch, scan, root->sectorsize);
+	if (ret) {
+		fprintf(stderr, "unable to start reading files\n");
+		return 1;
+	}
+	btrfs_bulk_init(&bl, MKFS_BULK_FILL);
+	cache_tree_init(&links);
+
+	list_add_tail(&scan->top->list, &dir_head);
 	do {
-		parent_dir_entry = list_entry(dir_head->list.next,
-					      struct directory_name_entry,
-					      list);
-		list_del(&parent_dir_entry->list);
-
-		parent_inum = parent_dir_entry->inum;
-		parent_dir_name = parent_dir_entry->dir_name;
-		if (chdir(parent_dir_entry->path)) {
-			fprintf(stderr, "chdir error for %s\n",
-				parent_dir_name);
-			ret = -1;
-			goto fail_no_files;
-		}
+		parent_dir = list_entry(dir_head.next, struct rootdir_dir,
+					list);
+		list_del_init(&parent_dir->list);
 
-		count = scandir(parent_dir_entry->path, &files,
-				directory_select, NULL);
-		if (count == -1)
-		{
+		parent_inum = parent_dir->inum;
+		if (parent_dir->scan_err) {
 			fprintf(stderr, "scandir for %s failed: %s\n",
-				parent_dir_name, strerror (errno));
+				parent_dir->path, strerror(parent_dir->scan_err));
 			ret = -1;
-			goto fail;
+			goto out;
 		}
 
-		for (i = 0; i < count; i++) {
-			cur_file = files[i];
+		for (i = 0; i < parent_dir->nr_entries; i++) {
+			entry = &parent_dir->entries[i];
 
-			if (lstat(cur_file->d_name, &st) == -1) {
+			if (entry->stat_err) {
 				fprintf(stderr, "lstat failed for file %s\n",
-					cur_file->d_name);
+					entry->name);
 				ret = -1;
-				goto fail;
+				goto out;
 			}
 
-			cur_inum = st.st_ino;
-			ret = add_directory_items(trans, root,
+			cur_inum = entry->st.st_ino;
+			ret = add_directory_items(trans, &bl, root,
 						  cur_inum, parent_inum,
-						  cur_file->d_name,
-						  &st, &dir_index_cnt);
+						  entry->name,
+						  &entry->st, &dir_index_cnt);
 			if (ret) {
 				fprintf(stderr, "add_directory_items failed\n");
-				goto fail;
+				goto out;
 			}
 
-			ret = add_inode_items(trans, root, &st,
-					      cur_file->d_name, cur_inum,
-					      parent_inum, dir_index_cnt,
-					      &cur_inode);
-			if (ret == -EEXIST) {
-				BUG_ON(st.st_nlink <= 1);
+			/* only the first link adds the inode */
+			if (!S_ISDIR(entry->st.st_mode) &&
+			    entry->st.st_nlink > 1 &&
+			    add_cache_extent(&links, cur_inum, 1) == -EEXIST) {
+				if (S_ISREG(entry->st.st_mode) &&
+				    entry->st.st_size) {
+					get_prefetched_file(&prefetch, entry);
+					put_prefetched_file(&prefetch, entry);
+				}
 				continue;
 			}
+
+			ret = add_inode_items(trans, &bl, root, &entry->st,
+					      entry->dir ?
+					      entry->dir->inode_size : 0,
+					      cur_inum, parent_inum,
+					      dir_index_cnt, &cur_inode);
 			if (ret) {
 				fprintf(stderr, "add_inode_items failed\n");
-				goto fail;
+				goto out;
 			}
 
-			ret = add_xattr_item(trans, root,
-					     cur_inum, cur_file->d_name);
+			ret = add_xattr_item(trans, &bl, root, cur_inum, entry);
 			if (ret) {
 				fprintf(stderr, "add_xattr_item failed\n");
-				if(ret != -ENOTSUP)
-					goto fail;
+				goto out;
 			}
 
-			if (S_ISDIR(st.st_mode)) {
-				dir_entry = malloc(sizeof(struct directory_name_entry));
-				dir_entry->dir_name = cur_file->d_name;
-				dir_entry->path = make_path(parent_dir_entry->path,
-							    cur_file->d_name);
-				dir_entry->inum = cur_inum;
-				list_add_tail(&dir_entry->list,	&dir_head->list);
-			} else if (S_ISREG(st.st_mode)) {
-				ret = add_file_items(trans, root, &cur_inode,
-						     cur_inum, parent_inum, &st,
-						     cur_file->d_name, out_fd);
+			if (S_ISDIR(entry->st.st_mode)) {
+				entry->dir->inum = cur_inum;
+				list_add_tail(&entry->dir->list, &dir_head);
+			} else if (S_ISREG(entry->st.st_mode) &&
+				   entry->st.st_size) {
+				path_name = make_path(parent_dir->path,
+						      entry->name);
+				data = get_prefetched_file(&prefetch, entry);
+				ret = path_name ? add_file_items(trans, &bl, root,
+						&cur_inode, cur_inum,
+						parent_inum, &entry->st,
+						path_name, out_fd, data) :
+						-ENOMEM;
+				put_prefetched_file(&prefetch, entry);
+				free(path_name);
 				if (ret) {
 					fprintf(stderr, "add_file_items failed\n");
-					goto fail;
+					goto out;
 				}
-			} else if (S_ISLNK(st.st_mode)) {
-				ret = add_symbolic_link(trans, root,
-						        cur_inum, cur_file->d_name);
+			} else if (S_ISLNK(entry->st.st_mode)) {
+				ret = add_symbolic_link(trans, &bl, root,
+							cur_inum, entry);
 				if (ret) {
 					fprintf(stderr, "add_symbolic_link failed\n");
-					goto fail;
+					goto out;
 				}
 			}
 		}
 
-		free_namelist(files, count);
-		free(parent_dir_entry);
-
 		index_cnt = 2;
 
-	} while (!list_empty(&dir_head->list));
+	} while (!list_empty(&dir_head));
 
+	ret = btrfs_bulk_commit(trans, &bl);
+	if (ret)
+		fprintf(stderr, "unable to build the fs tree: %d\n", ret);
 out:
+	stop_rootdir_prefetch(&prefetch);
+	btrfs_bulk_release(&bl);
+	free_extent_cache_tree(&links);
 	return !!ret;
-fail:
-	free_namelist(files, count);
-fail_no_files:
-	free(parent_dir_entry);
-	goto out;
-fail_no_dir:
-	free(dir_entry);
-	goto out;
 }
 
 static int open_target(char *output_name)
@@ -934,27 +1475,14 @@ static int create_chunks(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
-static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
+static int make_image(struct rootdir_scan *scan, struct btrfs_root *root,
+		      int out_fd)
 {
 	int ret;
 	struct btrfs_trans_handle *trans;
 
-	struct stat root_st;
-
-	struct directory_name_entry dir_head;
-
-	struct directory_name_entry *dir_entry = NULL;
-
-	ret = lstat(source_dir, &root_st);
-	if (ret) {
-		fprintf(stderr, "unable to lstat the %s\n", source_dir);
-		goto out;
-	}
-
-	INIT_LIST_HEAD(&dir_head.list);
-
 	trans = btrfs_start_transaction(root, 1);
-	ret = traverse_directory(trans, root, source_dir, &dir_head, out_fd);
+	ret = traverse_directory(trans, root, scan, out_fd);
 	if (ret) {
 		fprintf(stderr, "unable to traverse_directory\n");
 		goto fail;
@@ -964,13 +1492,6 @@ static int make_image(char *source_dir, struct btrfs_root *root, int out_fd)
 	printf("Making image is completed.\n");
 	return 0;
 fail:
-	while (!list_empty(&dir_head.list)) {
-		dir_entry = list_entry(dir_head.list.next,
-				       struct directory_name_entry, list);
-		list_del(&dir_entry->list);
-		free(dir_entry);
-	}
-out:
 	fprintf(stderr, "Making image is aborted.\n");
 	return -1;
 }
@@ -983,22 +1504,11 @@ out:
  *
  * The rounding up to 4096 is questionable.  Previous code used du -B 4096.
  */
-static u64 global_total_size;
-static int ftw_add_entry_size(const char *fpath, const struct stat *st,
-			      int type)
-{
-	if (type == FTW_F || type == FTW_D)
-		global_total_size += round_up(st->st_size, 4096);
-
-	return 0;
-}
-
-static u64 size_sourcedir(char *dir_name, u64 sectorsize,
+static u64 size_sourcedir(struct rootdir_scan *scan, u64 sectorsize,
 			  u64 *num_of_meta_chunks_ret, u64 *size_of_data_ret)
 {
-	u64 dir_size = 0;
+	u64 dir_size = scan->total_size;
 	u64 total_size = 0;
-	int ret;
 	u64 default_chunk_size = 8 * 1024 * 1024;	/* 8MB */
 	u64 allocated_meta_size = 8 * 1024 * 1024;	/* 8MB */
 	u64 allocated_total_size = 20 * 1024 * 1024;	/* 20MB */
@@ -1007,15 +1517,6 @@ static u64 size_sourcedir(char *dir_name, u64 sectorsize,
 	u64 num_of_allocated_meta_chunks =
 			allocated_meta_size / default_chunk_size;
 
-	global_total_size = 0;
-	ret = ftw(dir_name, ftw_add_entry_size, 10);
-	dir_size = global_total_size;
-	if (ret < 0) {
-		fprintf(stderr, "ftw subdir walk of '%s' failed: %s\n",
-			dir_name, strerror(errno));
-		exit(1);
-	}
-
 	num_of_data_chunks = (dir_size + default_chunk_size - 1) /
 		default_chunk_size;
 
@@ -1036,25 +1537,20 @@ static u64 size_sourcedir(char *dir_name, u64 sectorsize,
 	return total_size;
 }
 
-static int zero_output_file(int out_fd, u64 size, u32 sectorsize)
+static int zero_output_file(int out_fd, char *file, u64 size)
 {
-	int len = sectorsize;
-	int loop_num = size / sectorsize;
-	u64 location = 0;
-	char *buf = malloc(len);
-	int ret = 0, i;
-	ssize_t written;
-
-	if (!buf)
-		return -ENOMEM;
-	memset(buf, 0, len);
-	for (i = 0; i < loop_num; i++) {
-		written = pwrite64(out_fd, buf, len, location);
-		if (written != len)
-			ret = -EIO;
-		location += sectorsize;
-	}
-	free(buf);
+	struct stat st;
+	int method;
+	int ret;
+
+	if (fstat(out_fd, &st) < 0)
+		return -errno;
+	if (S_ISREG(st.st_mode) && ftruncate(out_fd, size) < 0)
+		return -errno;
+	ret = btrfs_zero_range(out_fd, 0, size, &method);
+	if (!ret)
+		printf("Zeroed %s (%s) by %s\n", file, pretty_size(size),
+		       btrfs_zero_method_name(method));
 	return ret;
 }
 
@@ -1252,6 +1748,7 @@ int main(int ac, char **av)
 	u64 num_of_meta_chunks = 0;
 	u64 size_of_data = 0;
 	u64 source_dir_size = 0;
+	struct rootdir_scan *scan = NULL;
 	int dev_cnt = 0;
 	int saved_optind;
 	char estr[100];
@@ -1525,11 +2022,14 @@ int main(int ac, char **av)
 		}
 
 		first_file = file;
-		source_dir_size = size_sourcedir(source_dir, sectorsize,
+		scan = scan_rootdir(source_dir);
+		if (!scan)
+			exit(1);
+		source_dir_size = size_sourcedir(scan, sectorsize,
 					     &num_of_meta_chunks, &size_of_data);
 		if(block_count < source_dir_size)
 			block_count = source_dir_size;
-		ret = zero_output_file(fd, block_count, sectorsize);
+		ret = zero_output_file(fd, file, block_count);
 		if (ret) {
 			fprintf(stderr, "unable to zero the output file\n");
 			exit(1);
@@ -1656,8 +2156,9 @@ raid_groups:
 		BUG_ON(ret);
 		btrfs_commit_transaction(trans, root);
 
-		ret = make_image(source_dir, root, fd);
+		ret = make_image(scan, root, fd);
 		BUG_ON(ret);
+		free_rootdir_scan(scan);
 	}
 
 	ret = close_ctree(root);
@@ -18,6 +18,8 @@
  * This file was postprocessed using unroll.pl and then ported to userspace
  */
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "kerncompat.h"
 #include "ctree.h"
@@ -71,11 +73,18 @@ static inline __attribute_const__ unative_t MASK(unative_t v)
 }
 
 
-void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+/*
+ * Generate P and Q over [@start, @bytes) of the stripes, the remaining
+ * bytes after the last whole vector of the SIMD versions end up here.
+ */
+static void raid6_int_gen_syndrome(int disks, size_t start, size_t bytes,
+				   void **ptrs)
 {
 	uint8_t **dptr = (uint8_t **)ptrs;
 	uint8_t *p, *q;
-	int d, z, z0;
+	uint8_t bd, bq, bp;
+	size_t d;
+	int z, z0;
 
 	unative_t wd0, wq0, wp0, w10, w20;
 
@@ -83,7 +92,7 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 	p = dptr[z0+1];		/* XOR parity */
 	q = dptr[z0+2];		/* RS syndrome */
 
-	for ( d = 0 ; d < bytes ; d += NSIZE*1 ) {
+	for ( d = start ; d + NSIZE <= bytes ; d += NSIZE*1 ) {
 		wq0 = wp0 = *(unative_t *)&dptr[z0][d+0*NSIZE];
 		for ( z = z0-1 ; z >= 0 ; z-- ) {
 			wd0 = *(unative_t *)&dptr[z][d+0*NSIZE];
@@ -97,5 +106,349 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 		*(unative_t *)&p[d+NSIZE*0] = wp0;
 		*(unative_t *)&q[d+NSIZE*0] = wq0;
 	}
+
+	/* what is left of a length that isn't a multiple of NSIZE */
+	for ( ; d < bytes ; d++ ) {
+		bq = bp = dptr[z0][d];
+		for ( z = z0-1 ; z >= 0 ; z-- ) {
+			bd = dptr[z][d];
+			bp ^= bd;
+			bq = (bq << 1) ^ ((bq & 0x80) ? 0x1d : 0);
+			bq ^= bd;
+		}
+		p[d] = bp;
+		q[d] = bq;
+	}
+}
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+
+/*
+ * The same computation as the integer version on 16, 32 or 64 bytes at a
+ * time, two vectors per iteration to keep both the load and the ALU ports
+ * busy.  Multiplying Q by {02} is a byte wise add to itself, reduced by
+ * {1d} in the bytes whose top bit was set.
+ */
+__attribute__((target("sse2")))
+static void raid6_sse2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	uint8_t **dptr = (uint8_t **)ptrs;
+	uint8_t *p, *q;
+	int z, z0;
+	size_t d;
+	const __m128i x1d = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i wd0, wq0, wp0, wd1, wq1, wp1;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		wq0 = wp0 = _mm_loadu_si128((__m128i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm_loadu_si128((__m128i *)&dptr[z0][d + 16]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm_loadu_si128((__m128i *)&dptr[z][d]);
+			wd1 = _mm_loadu_si128((__m128i *)&dptr[z][d + 16]);
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0),
+				_mm_and_si128(_mm_cmpgt_epi8(zero, wq0), x1d));
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1),
+				_mm_and_si128(_mm_cmpgt_epi8(zero, wq1), x1d));
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)&p[d], wp0);
+		_mm_storeu_si128((__m128i *)&p[d + 16], wp1);
+		_mm_storeu_si128((__m128i *)&q[d], wq0);
+		_mm_storeu_si128((__m128i *)&q[d + 16], wq1);
+	}
+	raid6_int_gen_syndrome(disks, d, bytes, ptrs);
+}
+
+__attribute__((target("avx2")))
+static void raid6_avx2_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	uint8_t **dptr = (uint8_t **)ptrs;
+	uint8_t *p, *q;
+	int z, z0;
+	size_t d;
+	const __m256i x1d = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i wd0, wq0, wp0, wd1, wq1, wp1;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d + 64 <= bytes; d += 64) {
+		wq0 = wp0 = _mm256_loadu_si256((__m256i *)&dptr[z0][d]);
+		wq1 = wp1 = _mm256_loadu_si256((__m256i *)&dptr[z0][d + 32]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm256_loadu_si256((__m256i *)&dptr[z][d]);
+			wd1 = _mm256_loadu_si256((__m256i *)&dptr[z][d + 32]);
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0),
+				_mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0),
+						 x1d));
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1),
+				_mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1),
+						 x1d));
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)&p[d], wp0);
+		_mm256_storeu_si256((__m256i *)&p[d + 32], wp1);
+		_mm256_storeu_si256((__m256i *)&q[d], wq0);
+		_mm256_storeu_si256((__m256i *)&q[d + 32], wq1);
+	}
+	raid6_int_gen_syndrome(disks, d, bytes, ptrs);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void raid6_avx512_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	uint8_t **dptr = (uint8_t **)ptrs;
+	uint8_t *p, *q;
+	int z, z0;
+	size_t d;
+	const __m512i x1d = _mm512_set1_epi8(0x1d);
+	__m512i wd0, wq0, wp0, wd1, wq1, wp1;
+
+	z0 = disks - 3;
+	p = dptr[z0 + 1];
+	q = dptr[z0 + 2];
+
+	for (d = 0; d + 128 <= bytes; d += 128) {
+		wq0 = wp0 = _mm512_loadu_si512(&dptr[z0][d]);
+		wq1 = wp1 = _mm512_loadu_si512(&dptr[z0][d + 64]);
+		for (z = z0 - 1; z >= 0; z--) {
+			wd0 = _mm512_loadu_si512(&dptr[z][d]);
+			wd1 = _mm512_loadu_si512(&dptr[z][d + 64]);
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			wq0 = _mm512_xor_si512(_mm512_add_epi8(wq0, wq0),
+				_mm512_maskz_mov_epi8(
+					_mm512_movepi8_mask(wq0), x1d));
+			wq1 = _mm512_xor_si512(_mm512_add_epi8(wq1, wq1),
+				_mm512_maskz_mov_epi8(
+					_mm512_movepi8_mask(wq1), x1d));
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+		}
+		_mm512_storeu_si512(&p[d], wp0);
+		_mm512_storeu_si512(&p[d + 64], wp1);
+		_mm512_storeu_si512(&q[d], wq0);
+		_mm512_storeu_si512(&q[d + 64], wq1);
+	}
+	raid6_int_gen_syndrome(disks, d, bytes, ptrs);
+}
+
+#endif /* __x86_64__ */
+
+static void raid6_int1_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	raid6_int_gen_syndrome(disks, 0, bytes, ptrs);
 }
 
+static void (*raid6_gen_syndrome_function)(int disks, size_t bytes,
+					   void **ptrs) = raid6_int1_gen_syndrome;
+
+/*
+ * Generate P and Q for @disks - 2 data stripes of @bytes each, @ptrs holds
+ * the data stripes followed by P and Q.
+ */
+void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	raid6_gen_syndrome_function(disks, bytes, ptrs);
+}
+
+/*
+ * Generate the RAID5 parity of @disks - 1 data stripes into the last one.
+ */
+void raid5_gen_parity(int disks, size_t bytes, void **ptrs)
+{
+	uint8_t **dptr = (uint8_t **)ptrs;
+	uint8_t *p = dptr[disks - 1];
+	size_t d;
+	int z;
+
+	memcpy(p, dptr[0], bytes);
+	for (z = 1; z < disks - 1; z++) {
+		for (d = 0; d + NSIZE <= bytes; d += NSIZE)
+			*(unative_t *)&p[d] ^= *(unative_t *)&dptr[z][d];
+		for (; d < bytes; d++)
+			p[d] ^= dptr[z][d];
+	}
+}
+
+/*
+ * GF(2^8) with the RAID6 polynomial x^8 + x^4 + x^3 + x^2 + 1, raid6_gfexp
+ * holds the powers of {02} twice so that adding two logs needs no modulo.
+ */
+static uint8_t raid6_gfexp[512];
+static uint8_t raid6_gflog[256];
+
+static inline uint8_t raid6_gfmul(uint8_t a, uint8_t b)
+{
+	if (!a || !b)
+		return 0;
+	return raid6_gfexp[raid6_gflog[a] + raid6_gflog[b]];
+}
+
+static inline uint8_t raid6_gfinv(uint8_t a)
+{
+	return raid6_gfexp[255 - raid6_gflog[a]];
+}
+
+static void raid6_gfmul_table(uint8_t *table, uint8_t coef)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+		table[i] = raid6_gfmul(i, coef);
+}
+
+/*
+ * Recover the two data stripes @faila < @failb from the rest of the data
+ * and P and Q.  The failed stripes are used as scratch space for the
+ * syndrome of the surviving ones.
+ */
+int raid6_recov_2data(int disks, size_t bytes, int faila, int failb,
+		      void **ptrs)
+{
+	uint8_t *p, *q, *dp, *dq;
+	uint8_t px, qx, db;
+	uint8_t pbmul[256];
+	uint8_t qmul[256];
+	void *zero;
+
+	zero = calloc(1, bytes);
+	if (!zero)
+		return -ENOMEM;
+
+	p = (uint8_t *)ptrs[disks - 2];
+	q = (uint8_t *)ptrs[disks - 1];
+
+	dp = (uint8_t *)ptrs[faila];
+	ptrs[faila] = zero;
+	ptrs[disks - 2] = dp;
+	dq = (uint8_t *)ptrs[failb];
+	ptrs[failb] = zero;
+	ptrs[disks - 1] = dq;
+
+	raid6_gen_syndrome(disks, bytes, ptrs);
+
+	ptrs[faila] = dp;
+	ptrs[failb] = dq;
+	ptrs[disks - 2] = p;
+	ptrs[disks - 1] = q;
+	free(zero);
+
+	raid6_gfmul_table(pbmul, raid6_gfinv(raid6_gfexp[failb - faila] ^ 1));
+	raid6_gfmul_table(qmul, raid6_gfinv(raid6_gfexp[faila] ^
+					    raid6_gfexp[failb]));
+
+	while (bytes--) {
+		px = *p ^ *dp;
+		qx = qmul[*q ^ *dq];
+		*dq++ = db = pbmul[px] ^ qx;
+		*dp++ = db ^ px;
+		p++;
+		q++;
+	}
+	return 0;
+}
+
+/*
+ * Recover the data stripe @faila and P from the rest of the data and Q.
+ */
+int raid6_recov_datap(int disks, size_t bytes, int faila, void **ptrs)
+{
+	uint8_t *p, *q, *dq;
+	uint8_t qmul[256];
+	void *zero;
+
+	zero = calloc(1, bytes);
+	if (!zero)
+		return -ENOMEM;
+
+	p = (uint8_t *)ptrs[disks - 2];
+	q = (uint8_t *)ptrs[disks - 1];
+
+	dq = (uint8_t *)ptrs[faila];
+	ptrs[faila] = zero;
+	ptrs[disks - 1] = dq;
+
+	raid6_gen_syndrome(disks, bytes, ptrs);
+
+	ptrs[faila] = dq;
+	ptrs[disks - 1] = q;
+	free(zero);
+
+	raid6_gfmul_table(qmul, raid6_gfinv(raid6_gfexp[faila]));
+
+	while (bytes--) {
+		*p++ ^= *dq = qmul[*q ^ *dq];
+		q++;
+		dq++;
+	}
+	return 0;
+}
+
+/*
+ * Recover the stripe @faila of @disks stripes xored together, which is any
+ * data stripe or P of RAID5, or of RAID6 with Q left out.
+ */
+void raid5_recov(int disks, size_t bytes, int faila, void **ptrs)
+{
+	uint8_t **dptr = (uint8_t **)ptrs;
+	uint8_t *dest = dptr[faila];
+	size_t d;
+	int first = 1;
+	int z;
+
+	for (z = 0; z < disks; z++) {
+		if (z == faila)
+			continue;
+		if (first) {
+			memcpy(dest, dptr[z], bytes);
+			first = 0;
+			continue;
+		}
+		for (d = 0; d + NSIZE <= bytes; d += NSIZE)
+			*(unative_t *)&dest[d] ^= *(unative_t *)&dptr[z][d];
+		for (; d < bytes; d++)
+			dest[d] ^= dptr[z][d];
+	}
+}
+
+__attribute__((constructor))
+static void raid6_init(void)
+{
+	uint8_t v = 1;
+	int i;
+
+	for (i = 0; i < 255; i++) {
+		raid6_gfexp[i] = v;
+		raid6_gfexp[i + 255] = v;
+		raid6_gflog[v] = i;
+		v = (v << 1) ^ ((v & 0x80) ? 0x1d : 0);
+	}
+	raid6_gfexp[510] = raid6_gfexp[0];
+	raid6_gfexp[511] = raid6_gfexp[1];
+
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw"))
+		raid6_gen_syndrome_function = raid6_avx512_gen_syndrome;
+	else if (__builtin_cpu_supports("avx2"))
+		raid6_gen_syndrome_function = raid6_avx2_gen_syndrome;
+	else
+		raid6_gen_syndrome_function = raid6_sse2_gen_syndrome;
+#endif
+}
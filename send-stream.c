@@ -18,14 +18,56 @@
 
 #include <uuid/uuid.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "send.h"
 #include "send-stream.h"
 #include "crc32c.h"
 
-struct btrfs_send_stream {
+/*
+ * The stream is read by a helper thread into a ring buffer, so the next
+ * commands are already there while the current one is applied.  Commands
+ * are decoded in place and the attribute pointers handed to the callbacks
+ * point into the ring.  A command that wraps around the end of the ring is
+ * made contiguous by copying its beginning to the slack area behind it.
+ *
+ * A reader opened with btrfs_send_reader_open() stays with the fd for all
+ * the streams on it, what is read beyond the END of one stream is the
+ * start of the next.  btrfs_read_and_process_send_stream() reads a single
+ * stream and leaves the fd right behind its END.
+ */
+#define SEND_STREAM_RING_SIZE	(4 * 1024 * 1024)
+#define SEND_STREAM_READ_SIZE	(1024 * 1024)
+
+struct btrfs_send_reader {
 	int fd;
-	char read_buf[BTRFS_SEND_BUF_SIZE];
+
+	/* SEND_STREAM_RING_SIZE bytes plus room for one wrapped command */
+	char *buf;
+	/* stream offsets of the first unconsumed and the first unread byte */
+	u64 head;
+	u64 tail;
+	/* the size of the command in use, consumed by the next stream_get() */
+	u32 cmd_size;
+	/*
+	 * Only a single stream is read.  The next command header the reader
+	 * looks at and where END stops it, a pipe is never read beyond a
+	 * command as it can't be seeked back.
+	 */
+	int one_stream;
+	u64 scan;
+	u64 end;
+	int seekable;
+	int error;
+	int stop;
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t data_cond;
+	pthread_cond_t space_cond;
+};
+
+struct btrfs_send_stream {
+	struct btrfs_send_reader *r;
 
 	int cmd;
 	struct btrfs_cmd_header *cmd_hdr;
@@ -36,52 +78,236 @@ struct btrfs_send_stream {
 	void *user;
 };
 
-static int read_buf(struct btrfs_send_stream *s, void *buf, int len)
+static void stream_copy_out(struct btrfs_send_reader *r, u64 pos,
+			    void *dst, u64 len)
 {
-	int ret;
-	int pos = 0;
+	u64 off = pos % SEND_STREAM_RING_SIZE;
+	u64 first = min(len, SEND_STREAM_RING_SIZE - off);
 
-	while (pos < len) {
-		ret = read(s->fd, (char*)buf + pos, len - pos);
-		if (ret < 0) {
-			ret = -errno;
-			fprintf(stderr, "ERROR: read from stream failed. %s\n",
-					strerror(-ret));
-			goto out;
+	memcpy(dst, r->buf + off, first);
+	memcpy((char *)dst + first, r->buf, len - first);
+}
+
+/*
+ * Walk the command headers that have been read, so that the reader stops
+ * at the END command instead of reading into whatever follows the stream.
+ */
+static void stream_scan(struct btrfs_send_reader *r)
+{
+	struct btrfs_cmd_header hdr;
+
+	while (!r->end && r->tail >= r->scan + sizeof(hdr)) {
+		stream_copy_out(r, r->scan, &hdr, sizeof(hdr));
+		r->scan += sizeof(hdr) + le32_to_cpu(hdr.len);
+		if (le16_to_cpu(hdr.cmd) == BTRFS_SEND_C_END)
+			r->end = r->scan;
+	}
+}
+
+/*
+ * The end of the next command header, or of the payload behind the header
+ * that was scanned last.  Reads of a single stream that can't be seeked
+ * back are cut there, so nothing after the END command is taken from the
+ * fd.
+ */
+static u64 stream_boundary(struct btrfs_send_reader *r)
+{
+	if (r->tail < r->scan)
+		return r->scan;
+	return r->scan + sizeof(struct btrfs_cmd_header);
+}
+
+static void *stream_reader(void *arg)
+{
+	struct btrfs_send_reader *r = arg;
+	u64 off;
+	u64 len;
+	ssize_t ret;
+
+	/* only a blocking read may be cancelled, never a wait on the lock */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	pthread_mutex_lock(&r->lock);
+	while (!r->stop && !(r->end && r->tail >= r->end)) {
+		len = SEND_STREAM_RING_SIZE - (r->tail - r->head);
+		if (!len) {
+			pthread_cond_wait(&r->space_cond, &r->lock);
+			continue;
 		}
-		if (ret == 0) {
-			ret = 1;
-			goto out;
+		off = r->tail % SEND_STREAM_RING_SIZE;
+		len = min(len, SEND_STREAM_RING_SIZE - off);
+		len = min_t(u64, len, SEND_STREAM_READ_SIZE);
+		if (r->one_stream && !r->seekable)
+			len = min(len, stream_boundary(r) - r->tail);
+		pthread_mutex_unlock(&r->lock);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = read(r->fd, r->buf + off, len);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		pthread_mutex_lock(&r->lock);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			r->error = -errno;
+			break;
 		}
-		pos += ret;
+		if (ret == 0)
+			break;
+		r->tail += ret;
+		if (r->one_stream)
+			stream_scan(r);
+		pthread_cond_signal(&r->data_cond);
 	}
+	r->stop = 1;
+	pthread_cond_signal(&r->data_cond);
+	pthread_mutex_unlock(&r->lock);
 
-	ret = 0;
+	return NULL;
+}
 
-out:
-	return ret;
+static int reader_init(struct btrfs_send_reader *r, int fd, int one_stream)
+{
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->buf = malloc(SEND_STREAM_RING_SIZE + BTRFS_SEND_BUF_SIZE);
+	if (!r->buf) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->data_cond, NULL);
+	pthread_cond_init(&r->space_cond, NULL);
+
+	r->one_stream = one_stream;
+	r->scan = sizeof(struct btrfs_stream_header);
+	r->seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+
+	ret = pthread_create(&r->reader, NULL, stream_reader, r);
+	if (ret) {
+		fprintf(stderr, "ERROR: failed to start stream reader: %s\n",
+			strerror(ret));
+		pthread_cond_destroy(&r->space_cond);
+		pthread_cond_destroy(&r->data_cond);
+		pthread_mutex_destroy(&r->lock);
+		free(r->buf);
+		return -ret;
+	}
+	return 0;
+}
+
+/*
+ * Stop the reader and seek back over what was read beyond the last
+ * command.  A single stream that can't be seeked was only read up to a
+ * command boundary.
+ */
+static void reader_release(struct btrfs_send_reader *r)
+{
+	u64 left;
+
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	r->head += r->cmd_size;
+	r->cmd_size = 0;
+	pthread_cond_signal(&r->space_cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_cancel(r->reader);
+	pthread_join(r->reader, NULL);
+
+	left = r->tail - r->head;
+	if (left && r->seekable)
+		lseek(r->fd, -(off_t)left, SEEK_CUR);
+
+	pthread_cond_destroy(&r->space_cond);
+	pthread_cond_destroy(&r->data_cond);
+	pthread_mutex_destroy(&r->lock);
+	free(r->buf);
+}
+
+struct btrfs_send_reader *btrfs_send_reader_open(int fd)
+{
+	struct btrfs_send_reader *r;
+
+	r = malloc(sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "ERROR: not enough memory\n");
+		return NULL;
+	}
+	if (reader_init(r, fd, 0)) {
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+void btrfs_send_reader_close(struct btrfs_send_reader *r)
+{
+	if (!r)
+		return;
+	reader_release(r);
+	free(r);
+}
+
+/*
+ * Makes the next len bytes of the stream contiguous in the buffer, after
+ * consuming the previous command.  Returns 1 if the stream ends before.
+ */
+static int stream_get(struct btrfs_send_reader *r, u32 len, void **ptr)
+{
+	u64 off;
+	int ret = 0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->cmd_size) {
+		r->head += r->cmd_size;
+		r->cmd_size = 0;
+		pthread_cond_signal(&r->space_cond);
+	}
+	while (r->tail - r->head < len && !r->stop)
+		pthread_cond_wait(&r->data_cond, &r->lock);
+	if (r->tail - r->head < len) {
+		ret = r->error;
+		if (ret)
+			fprintf(stderr, "ERROR: read from stream failed. %s\n",
+					strerror(-ret));
+		else
+			ret = 1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	if (ret)
+		return ret;
+
+	off = r->head % SEND_STREAM_RING_SIZE;
+	if (off + len > SEND_STREAM_RING_SIZE)
+		memcpy(r->buf + SEND_STREAM_RING_SIZE, r->buf,
+		       off + len - SEND_STREAM_RING_SIZE);
+	*ptr = r->buf + off;
+	return 0;
 }
 
 /*
- * Reads a single command from kernel space and decodes the TLV's into
- * s->cmd_attrs
+ * Reads a single command from the stream and decodes the TLV's into
+ * s->cmd_attrs, which point into the stream buffer until the next command
+ * is read.
  */
 static int read_cmd(struct btrfs_send_stream *s)
 {
 	int ret;
 	int cmd;
-	int cmd_len;
+	u32 cmd_len;
 	int tlv_type;
 	int tlv_len;
 	char *data;
-	int pos;
+	u32 pos;
 	struct btrfs_tlv_header *tlv_hdr;
 	u32 crc;
 	u32 crc2;
 
 	memset(s->cmd_attrs, 0, sizeof(s->cmd_attrs));
 
-	ret = read_buf(s, s->read_buf, sizeof(*s->cmd_hdr));
+	ret = stream_get(s->r, sizeof(*s->cmd_hdr), (void **)&s->cmd_hdr);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -90,12 +316,16 @@ static int read_cmd(struct btrfs_send_stream *s)
 		goto out;
 	}
 
-	s->cmd_hdr = (struct btrfs_cmd_header *)s->read_buf;
 	cmd = le16_to_cpu(s->cmd_hdr->cmd);
 	cmd_len = le32_to_cpu(s->cmd_hdr->len);
+	if (cmd_len > BTRFS_SEND_BUF_SIZE - sizeof(*s->cmd_hdr)) {
+		ret = -EINVAL;
+		fprintf(stderr, "ERROR: invalid command length %u.\n", cmd_len);
+		goto out;
+	}
 
-	data = s->read_buf + sizeof(*s->cmd_hdr);
-	ret = read_buf(s, data, cmd_len);
+	ret = stream_get(s->r, sizeof(*s->cmd_hdr) + cmd_len,
+			 (void **)&s->cmd_hdr);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -103,11 +333,13 @@ static int read_cmd(struct btrfs_send_stream *s)
 		fprintf(stderr, "ERROR: unexpected EOF in stream.\n");
 		goto out;
 	}
+	s->r->cmd_size = sizeof(*s->cmd_hdr) + cmd_len;
+	data = (char *)(s->cmd_hdr + 1);
 
 	crc = le32_to_cpu(s->cmd_hdr->crc);
 	s->cmd_hdr->crc = 0;
 
-	crc2 = crc32c(0, (unsigned char*)s->read_buf,
+	crc2 = crc32c(0, (unsigned char*)s->cmd_hdr,
 			sizeof(*s->cmd_hdr) + cmd_len);
 
 	if (crc != crc2) {
@@ -123,7 +355,8 @@ static int read_cmd(struct btrfs_send_stream *s)
 		tlv_len = le16_to_cpu(tlv_hdr->tlv_len);
 
 		if (tlv_type <= 0 || tlv_type > BTRFS_SEND_A_MAX ||
-		    tlv_len < 0 || tlv_len > BTRFS_SEND_BUF_SIZE) {
+		    tlv_len < 0 || tlv_len > BTRFS_SEND_BUF_SIZE ||
+		    pos + sizeof(*tlv_hdr) + tlv_len > cmd_len) {
 			fprintf(stderr, "ERROR: invalid tlv in cmd. "
 					"tlv_type = %d, tlv_len = %d\n",
 					tlv_type, tlv_len);
@@ -440,36 +673,38 @@ out:
  * callbacks in btrfs_send_ops structure returns an error. If greater than
  * zero, stop after max_errors errors happened.
  */
-int btrfs_read_and_process_send_stream(int fd,
+int btrfs_read_and_process_send_reader(struct btrfs_send_reader *r,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors)
 {
 	int ret;
 	struct btrfs_send_stream s;
-	struct btrfs_stream_header hdr;
+	struct btrfs_stream_header *hdr;
 	u64 errors = 0;
 	int last_err = 0;
 
-	s.fd = fd;
+	memset(&s, 0, sizeof(s));
+	s.r = r;
 	s.ops = ops;
 	s.user = user;
 
-	ret = read_buf(&s, &hdr, sizeof(hdr));
+	ret = stream_get(r, sizeof(*hdr), (void **)&hdr);
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = 1;
 		goto out;
 	}
+	r->cmd_size = sizeof(*hdr);
 
-	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
+	if (strcmp(hdr->magic, BTRFS_SEND_STREAM_MAGIC)) {
 		ret = -EINVAL;
 		fprintf(stderr, "ERROR: Unexpected header\n");
 		goto out;
 	}
 
-	s.version = le32_to_cpu(hdr.version);
+	s.version = le32_to_cpu(hdr->version);
 	if (s.version > BTRFS_SEND_STREAM_VERSION) {
 		ret = -EINVAL;
 		fprintf(stderr, "ERROR: Stream version %d not supported. "
@@ -492,8 +727,31 @@ int btrfs_read_and_process_send_stream(int fd,
 	}
 
 out:
+	/* the next stream starts behind the last command */
+	pthread_mutex_lock(&r->lock);
+	r->head += r->cmd_size;
+	r->cmd_size = 0;
+	pthread_cond_signal(&r->space_cond);
+	pthread_mutex_unlock(&r->lock);
 	if (last_err && !ret)
 		ret = last_err;
 
 	return ret;
 }
+
+int btrfs_read_and_process_send_stream(int fd,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors)
+{
+	struct btrfs_send_reader r;
+	int ret;
+
+	ret = reader_init(&r, fd, 1);
+	if (ret < 0)
+		return ret;
+	ret = btrfs_read_and_process_send_reader(&r, ops, user,
+						 honor_end_cmd, max_errors);
+	reader_release(&r);
+	return ret;
+}
@@ -67,6 +67,20 @@ int btrfs_read_and_process_send_stream(int fd,
 				       int honor_end_cmd,
 				       u64 max_errors);
 
+/*
+ * A reader for all the streams on @fd, one after the other.  It reads
+ * ahead of the stream being processed, a pipe is left somewhere after the
+ * last stream processed.
+ */
+struct btrfs_send_reader;
+
+struct btrfs_send_reader *btrfs_send_reader_open(int fd);
+void btrfs_send_reader_close(struct btrfs_send_reader *r);
+int btrfs_read_and_process_send_reader(struct btrfs_send_reader *r,
+				       struct btrfs_send_ops *ops, void *user,
+				       int honor_end_cmd,
+				       u64 max_errors);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,326 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Checks the instruction set specific crc32c and RAID6 syndrome versions
+ * against plain byte wise ones, on random buffers of odd lengths and
+ * alignments, and the RAID5/6 recovery on top of each syndrome version.
+ * The sources are included so that every version the cpu supports is run,
+ * not only the one picked at startup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.c"
+#include "raid6.c"
+
+#define TEST_BUF_SIZE	(64 * 1024)
+#define TEST_ROUNDS	2000
+#define TEST_RAID_ROUNDS	250
+#define TEST_MAX_DISKS	16
+#define TEST_STRIPE_LEN	(16 * 1024)
+/* bytes behind each stripe that must not be written */
+#define TEST_GUARD	64
+#define TEST_GUARD_BYTE	0xa5
+
+static int errors;
+
+static u32 crc32c_ref(u32 crc, unsigned char const *data, size_t length)
+{
+	while (length--)
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/* mostly short lengths, where the tails and the unrolled rounds meet */
+static size_t random_length(size_t max)
+{
+	switch (rand() % 4) {
+	case 0:
+		return rand() % 64;
+	case 1:
+		return rand() % 4096;
+	case 2:
+		return max - rand() % 64;
+	default:
+		return rand() % max;
+	}
+}
+
+static void test_crc32c(const char *name,
+			u32 (*fn)(u32 crc, unsigned char const *data,
+				  size_t length),
+			unsigned char *buf)
+{
+	size_t off;
+	size_t len;
+	u32 seed;
+	u32 want;
+	u32 got;
+	int i;
+
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		off = rand() % 64;
+		len = random_length(TEST_BUF_SIZE - off);
+		seed = rand() % 2 ? ~0U : (u32)rand();
+		want = crc32c_ref(seed, buf + off, len);
+		got = fn(seed, buf + off, len);
+		if (got != want) {
+			fprintf(stderr,
+	"%s: crc of %zu bytes at offset %zu is %08x, expected %08x\n",
+				name, len, off, got, want);
+			errors++;
+			return;
+		}
+	}
+	printf("crc32c %s ok\n", name);
+}
+
+static void test_crc32c_sectors(const char *name,
+				void (*fn)(u32 seed, unsigned char const *data,
+					   size_t sectorsize, unsigned int nr,
+					   u32 *crcs),
+				unsigned char *buf)
+{
+	static const size_t sizes[] = { 4096, 512, 4100, 61, 8, 1 };
+	u32 crcs[64];
+	size_t sectorsize;
+	size_t off;
+	u32 seed;
+	unsigned int nr;
+	unsigned int j;
+	int i;
+
+	for (i = 0; i < TEST_ROUNDS; i++) {
+		sectorsize = sizes[i % ARRAY_SIZE(sizes)];
+		off = rand() % 64;
+		nr = rand() % min_t(size_t, ARRAY_SIZE(crcs),
+				    (TEST_BUF_SIZE - off) / sectorsize + 1);
+		seed = rand() % 2 ? ~0U : (u32)rand();
+		fn(seed, buf + off, sectorsize, nr, crcs);
+		for (j = 0; j < nr; j++) {
+			if (crcs[j] == crc32c_ref(seed,
+					buf + off + j * sectorsize,
+					sectorsize))
+				continue;
+			fprintf(stderr,
+	"%s: crc of sector %u of %u, %zu bytes at offset %zu is wrong\n",
+				name, j, nr, sectorsize, off);
+			errors++;
+			return;
+		}
+	}
+	printf("crc32c sectors %s ok\n", name);
+}
+
+static void raid6_ref_gen_syndrome(int disks, size_t bytes, uint8_t **ptrs)
+{
+	uint8_t *p = ptrs[disks - 2];
+	uint8_t *q = ptrs[disks - 1];
+	size_t d;
+	int z;
+
+	for (d = 0; d < bytes; d++) {
+		p[d] = 0;
+		q[d] = 0;
+		for (z = 0; z < disks - 2; z++) {
+			p[d] ^= ptrs[z][d];
+			q[d] ^= raid6_gfmul(ptrs[z][d], raid6_gfexp[z]);
+		}
+	}
+}
+
+struct raid_test {
+	int disks;
+	size_t bytes;
+	/* the stripes as generated by the reference and under test */
+	uint8_t *want[TEST_MAX_DISKS];
+	uint8_t *got[TEST_MAX_DISKS];
+};
+
+/* each stripe under test starts at a random offset of its slot in @mem */
+static void raid_test_setup(struct raid_test *t, uint8_t *mem)
+{
+	size_t stride = TEST_STRIPE_LEN + TEST_GUARD + 64;
+	size_t i;
+	int z;
+
+	t->disks = 4 + rand() % (TEST_MAX_DISKS - 3);
+	t->bytes = random_length(TEST_STRIPE_LEN);
+	for (z = 0; z < t->disks; z++) {
+		t->want[z] = mem + z * stride;
+		t->got[z] = mem + (TEST_MAX_DISKS + z) * stride + rand() % 64;
+		memset(t->got[z] + t->bytes, TEST_GUARD_BYTE, TEST_GUARD);
+		if (z >= t->disks - 2)
+			continue;
+		for (i = 0; i < t->bytes; i++)
+			t->want[z][i] = rand();
+		memcpy(t->got[z], t->want[z], t->bytes);
+	}
+	raid6_ref_gen_syndrome(t->disks, t->bytes, t->want);
+}
+
+static int raid_test_check(const char *name, const char *what,
+			   struct raid_test *t)
+{
+	int z;
+	int i;
+
+	for (z = 0; z < t->disks; z++) {
+		if (memcmp(t->got[z], t->want[z], t->bytes)) {
+			fprintf(stderr,
+		"%s: %s, stripe %d of %d differs, %zu bytes per stripe\n",
+				name, what, z, t->disks, t->bytes);
+			errors++;
+			return 1;
+		}
+		for (i = 0; i < TEST_GUARD; i++) {
+			if (t->got[z][t->bytes + i] == TEST_GUARD_BYTE)
+				continue;
+			fprintf(stderr,
+		"%s: %s, stripe %d of %d written beyond %zu bytes\n",
+				name, what, z, t->disks, t->bytes);
+			errors++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void test_raid6(const char *name,
+		       void (*fn)(int disks, size_t bytes, void **ptrs),
+		       uint8_t *mem)
+{
+	struct raid_test t;
+	int faila;
+	int failb;
+	int tmp;
+	int i;
+
+	raid6_gen_syndrome_function = fn;
+	for (i = 0; i < TEST_RAID_ROUNDS; i++) {
+		raid_test_setup(&t, mem);
+		raid6_gen_syndrome(t.disks, t.bytes, (void **)t.got);
+		if (raid_test_check(name, "syndrome", &t))
+			return;
+
+		faila = rand() % (t.disks - 2);
+		do {
+			failb = rand() % (t.disks - 2);
+		} while (failb == faila);
+		if (faila > failb) {
+			tmp = faila;
+			faila = failb;
+			failb = tmp;
+		}
+		memset(t.got[faila], 0, t.bytes);
+		memset(t.got[failb], 0, t.bytes);
+		if (raid6_recov_2data(t.disks, t.bytes, faila, failb,
+				      (void **)t.got) ||
+		    raid_test_check(name, "two data stripes recovered", &t))
+			return;
+
+		memset(t.got[faila], 0, t.bytes);
+		memset(t.got[t.disks - 2], 0, t.bytes);
+		if (raid6_recov_datap(t.disks, t.bytes, faila,
+				      (void **)t.got) ||
+		    raid_test_check(name, "data and P recovered", &t))
+			return;
+
+		/* P is the xor of the data, any one of them can be rebuilt */
+		faila = rand() % (t.disks - 1);
+		memset(t.got[faila], 0, t.bytes);
+		raid5_recov(t.disks - 1, t.bytes, faila, (void **)t.got);
+		if (raid_test_check(name, "raid5 stripe recovered", &t))
+			return;
+
+		memset(t.got[t.disks - 2], 0, t.bytes);
+		raid5_gen_parity(t.disks - 1, t.bytes, (void **)t.got);
+		if (raid_test_check(name, "raid5 parity", &t))
+			return;
+	}
+	printf("raid6 %s ok\n", name);
+}
+
+static void test_raid6_all(uint8_t *mem)
+{
+	void (*selected)(int disks, size_t bytes, void **ptrs);
+
+	selected = raid6_gen_syndrome_function;
+	test_raid6("int", raid6_int1_gen_syndrome, mem);
+#ifdef __x86_64__
+	test_raid6("sse2", raid6_sse2_gen_syndrome, mem);
+	if (__builtin_cpu_supports("avx2"))
+		test_raid6("avx2", raid6_avx2_gen_syndrome, mem);
+	if (__builtin_cpu_supports("avx512bw"))
+		test_raid6("avx512", raid6_avx512_gen_syndrome, mem);
+#endif
+	raid6_gen_syndrome_function = selected;
+}
+
+static void test_crc32c_all(unsigned char *buf)
+{
+	test_crc32c("generic", __crc32c_le, buf);
+	test_crc32c_sectors("generic", crc32c_le_sectors_generic, buf);
+#ifdef __x86_64__
+	if (crc32c_intel_available) {
+		test_crc32c("sse4.2", crc32c_intel, buf);
+		test_crc32c_sectors("sse4.2", crc32c_intel_sectors, buf);
+	}
+	if (crc32c_intel_available && crc32c_pclmul_available)
+		test_crc32c("pclmul", crc32c_intel_3way, buf);
+#elif defined(__aarch64__) && !defined(__AARCH64EB__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		test_crc32c("arm64", crc32c_arm64, buf);
+#endif
+	test_crc32c("selected", crc32c_le, buf);
+	test_crc32c_sectors("selected", crc32c_le_sectors, buf);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char *buf;
+	uint8_t *mem;
+	unsigned int seed;
+	int i;
+
+	seed = argc > 1 ? atoi(argv[1]) : 1;
+	srand(seed);
+	printf("seed %u\n", seed);
+
+	buf = malloc(TEST_BUF_SIZE);
+	mem = malloc(2 * TEST_MAX_DISKS *
+		     (TEST_STRIPE_LEN + TEST_GUARD + 64));
+	if (!buf || !mem) {
+		fprintf(stderr, "not enough memory\n");
+		return 1;
+	}
+	for (i = 0; i < TEST_BUF_SIZE; i++)
+		buf[i] = rand();
+
+	test_crc32c_all(buf);
+	test_raid6_all(mem);
+
+	free(mem);
+	free(buf);
+	if (errors) {
+		fprintf(stderr, "%d tests failed\n", errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Round trip btrfs-image dumps with a block index through restore and through
+# opening the dump directly, for every compression the binary supports.
+
+source $top/tests/common
+
+check_prereq mkfs.btrfs
+check_prereq btrfs-debug-tree
+
+IMAGE=$(pwd)/test.img
+DUMP=$(pwd)/test.dump
+
+cleanup()
+{
+	rm -f $IMAGE $IMAGE.restored $DUMP $DUMP.tree $IMAGE.tree
+}
+trap cleanup EXIT
+
+# generation and transid change when restore fixes up the chunk tree
+dump_tree()
+{
+	$top/btrfs-debug-tree $1 2>&1 | grep -v "generation\|transid"
+}
+
+# the last block of an indexed image is an index cluster
+check_index()
+{
+	magic=$(tail -c 1024 $DUMP | dd bs=1 skip=21 count=8 2>/dev/null)
+	[ "$magic" = "BMDUMIDX" ] || _fail "no block index in $DUMP"
+}
+
+test_roundtrip()
+{
+	echo "     [TEST]    image round trip $*" >> $RESULT
+	rm -f $DUMP $IMAGE.restored
+	run_check $top/btrfs-image "$@" $IMAGE $DUMP
+	[ "$1" = "-i" ] && check_index
+
+	run_check $top/btrfs-image -r $DUMP $IMAGE.restored
+	run_check $top/btrfs check $IMAGE.restored
+	run_check $top/btrfs check $DUMP
+
+	dump_tree $DUMP > $DUMP.tree
+	dump_tree $IMAGE.restored > $IMAGE.tree
+	cmp -s $DUMP.tree $IMAGE.tree || \
+		_fail "dump and restored image differ: $*"
+}
+
+rm -f $IMAGE
+truncate -s 1G $IMAGE
+run_check $top/mkfs.btrfs -f -n 4096 -r $top/Documentation $IMAGE
+
+test_roundtrip
+test_roundtrip -i
+for algo in zlib zstd lz4; do
+	# left out of the build with DISABLE_ZSTD or DISABLE_LZ4
+	$top/btrfs-image -c $algo 2>&1 | grep -q "Invalid compression" && \
+		continue
+	test_roundtrip -i -c $algo
+	test_roundtrip -i -c $algo:1 -t 4
+	test_roundtrip -c $algo
+done
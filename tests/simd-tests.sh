@@ -0,0 +1,17 @@
+#!/bin/bash
+#
+# compare the instruction set specific checksum and raid versions against
+# the portable ones
+#
+
+unset top
+script_dir=$(dirname $(realpath $0))
+top=$(realpath $script_dir/../)
+RESULT="$top/tests/simd-tests-results.txt"
+
+source $top/tests/common
+
+rm -f $RESULT
+
+check_prereq simd-test
+run_check $top/simd-test $RANDOM
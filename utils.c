@@ -35,6 +35,7 @@
 #include <limits.h>
 #include <blkid/blkid.h>
 #include <sys/vfs.h>
+#include <linux/falloc.h>
 
 #include "kerncompat.h"
 #include "radix-tree.h"
@@ -49,6 +50,18 @@
 #ifndef BLKDISCARD
 #define BLKDISCARD	_IO(0x12,119)
 #endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES	_IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT	_IO(0x12,127)
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE	0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE	0x10
+#endif
 
 static int btrfs_scan_done = 0;
 
@@ -570,22 +583,98 @@ u64 btrfs_device_size(int fd, struct stat *st)
 	return 0;
 }
 
-static int zero_blocks(int fd, off_t start, size_t len)
+static const char *zero_method_names[] = {
+	[BTRFS_ZERO_NONE]	= "nothing",
+	[BTRFS_ZERO_ZERO_RANGE]	= "fallocate zero range",
+	[BTRFS_ZERO_PUNCH_HOLE]	= "fallocate punch hole",
+	[BTRFS_ZERO_ZEROOUT]	= "BLKZEROOUT",
+	[BTRFS_ZERO_DISCARD]	= "BLKDISCARD",
+	[BTRFS_ZERO_WRITE]	= "writing zeroes",
+};
+
+const char *btrfs_zero_method_name(int method)
 {
-	char *buf = malloc(len);
-	int ret = 0;
+	if (method < 0 || method >= ARRAY_SIZE(zero_method_names))
+		return "unknown";
+	return zero_method_names[method];
+}
+
+#define ZERO_WRITE_SIZE (4 * 1024 * 1024)
+
+static int zero_by_writing(int fd, u64 start, u64 len)
+{
+	void *buf;
 	ssize_t written;
+	int ret = 0;
 
-	if (!buf)
-		return -ENOMEM;
-	memset(buf, 0, len);
-	written = pwrite(fd, buf, len, start);
-	if (written != len)
-		ret = -EIO;
+	ret = posix_memalign(&buf, 4096, min_t(u64, len, ZERO_WRITE_SIZE));
+	if (ret)
+		return -ret;
+	memset(buf, 0, min_t(u64, len, ZERO_WRITE_SIZE));
+	while (len > 0) {
+		written = pwrite(fd, buf, min_t(u64, len, ZERO_WRITE_SIZE),
+				 start);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0) {
+			ret = written < 0 ? -errno : -EIO;
+			break;
+		}
+		start += written;
+		len -= written;
+	}
 	free(buf);
 	return ret;
 }
 
+/*
+ * Zero the given range of a file or block device without changing its
+ * size.  The cheapest way the kernel offers is tried first and writing
+ * zeroes is the last resort, the way that was used is returned in @method
+ * if it's not NULL.
+ */
+int btrfs_zero_range(int fd, u64 start, u64 len, int *method)
+{
+	struct stat st;
+	int zeroes = 0;
+	int how = BTRFS_ZERO_NONE;
+	int ret = 0;
+
+	if (len == 0)
+		goto out;
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	if (S_ISREG(st.st_mode)) {
+		how = BTRFS_ZERO_ZERO_RANGE;
+		if (!fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+			       start, len))
+			goto out;
+		how = BTRFS_ZERO_PUNCH_HOLE;
+		if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       start, len))
+			goto out;
+	} else if (S_ISBLK(st.st_mode)) {
+		u64 range[2] = { start, len };
+
+		how = BTRFS_ZERO_ZEROOUT;
+		if (!ioctl(fd, BLKZEROOUT, &range))
+			goto out;
+		/* only if discarded blocks are guaranteed to read as zeroes */
+		how = BTRFS_ZERO_DISCARD;
+		if (!ioctl(fd, BLKDISCARDZEROES, &zeroes) && zeroes &&
+		    !ioctl(fd, BLKDISCARD, &range))
+			goto out;
+	}
+
+	how = BTRFS_ZERO_WRITE;
+	ret = zero_by_writing(fd, start, len);
+out:
+	if (method)
+		*method = how;
+	return ret;
+}
+
 #define ZERO_DEV_BYTES (2 * 1024 * 1024)
 
 /* don't write outside the device by clamping the region to the device size */
@@ -602,7 +691,7 @@ static int zero_dev_clamped(int fd, off_t start, ssize_t len, u64 dev_size)
 	start = min_t(u64, start, dev_size);
 	end = min_t(u64, end, dev_size);
 
-	return zero_blocks(fd, start, end - start);
+	return btrfs_zero_range(fd, start, end - start, NULL);
 }
 
 int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
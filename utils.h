@@ -84,6 +84,17 @@ int make_btrfs(int fd, const char *device, const char *label,
 	       u32 leafsize, u32 sectorsize, u32 stripesize, u64 features);
 int btrfs_make_root_dir(struct btrfs_trans_handle *trans,
 			struct btrfs_root *root, u64 objectid);
+enum btrfs_zero_method {
+	BTRFS_ZERO_NONE,
+	BTRFS_ZERO_ZERO_RANGE,
+	BTRFS_ZERO_PUNCH_HOLE,
+	BTRFS_ZERO_ZEROOUT,
+	BTRFS_ZERO_DISCARD,
+	BTRFS_ZERO_WRITE,
+};
+
+int btrfs_zero_range(int fd, u64 start, u64 len, int *method);
+const char *btrfs_zero_method_name(int method);
 int btrfs_prepare_device(int fd, char *file, int zero_end, u64 *block_count_ret,
 			 u64 max_block_count, int *mixed, int discard);
 int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
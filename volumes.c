@@ -270,6 +270,18 @@ error:
 	return ret;
 }
 
+/*
+ * Register a btrfs-image dump as the only device of its filesystem.  @sb is
+ * the super block stored in the image, all reads go to the image and not
+ * through the chunk mapping.
+ */
+int btrfs_scan_one_metadump(const char *path, struct btrfs_super_block *sb,
+			    struct btrfs_fs_devices **fs_devices_ret)
+{
+	return device_list_add(path, sb, btrfs_stack_device_id(&sb->dev_item),
+			       fs_devices_ret);
+}
+
 /*
  * this uses a pretty simple search, the expectation is that it is
  * called very infrequently and that a given device has a small number
@@ -1935,7 +1947,6 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 {
 	struct extent_buffer **ebs, *p_eb = NULL, *q_eb = NULL;
 	int i;
-	int j;
 	int ret;
 	int alloc_size = eb->len;
 
@@ -1985,14 +1996,19 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 		raid6_gen_syndrome(multi->num_stripes, stripe_len, pointers);
 		kfree(pointers);
 	} else {
+		void **pointers;
+
+		pointers = kmalloc(sizeof(*pointers) * multi->num_stripes,
+				   GFP_NOFS);
+		BUG_ON(!pointers);
+
 		ebs[multi->num_stripes - 1] = p_eb;
-		memcpy(p_eb->data, ebs[0]->data, stripe_len);
-		for (j = 1; j < multi->num_stripes - 1; j++) {
-			for (i = 0; i < stripe_len; i += sizeof(unsigned long)) {
-				*(unsigned long *)(p_eb->data + i) ^=
-					*(unsigned long *)(ebs[j]->data + i);
-			}
-		}
+
+		for (i = 0; i < multi->num_stripes; i++)
+			pointers[i] = ebs[i]->data;
+
+		raid5_gen_parity(multi->num_stripes, stripe_len, pointers);
+		kfree(pointers);
 	}
 
 	for (i = 0; i < multi->num_stripes; i++) {
@@ -2006,3 +2022,148 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 
 	return 0;
 }
+
+/*
+ * Mirror 1 of a RAID5/6 chunk is the data stripe itself, mirror 2 is the
+ * data rebuilt from the other data stripes and P, and mirror 3 from the
+ * other data stripes and Q.
+ */
+int btrfs_is_raid56_rebuild(struct btrfs_mapping_tree *map_tree, u64 logical,
+			    int mirror)
+{
+	struct cache_extent *ce;
+	struct map_lookup *map;
+
+	if (mirror <= 1)
+		return 0;
+	ce = search_cache_extent(&map_tree->cache_tree, logical);
+	if (!ce || ce->start > logical)
+		return 0;
+	map = container_of(ce, struct map_lookup, ce);
+	return !!(map->type & (BTRFS_BLOCK_GROUP_RAID5 |
+			       BTRFS_BLOCK_GROUP_RAID6));
+}
+
+static int read_raid56_stripe(struct btrfs_multi_bio *multi, int i,
+			      void *buf, u64 offset, u64 len)
+{
+	struct btrfs_device *device = multi->stripes[i].dev;
+	ssize_t ret;
+
+	if (device->fd <= 0)
+		return -EIO;
+	device->total_ios++;
+	ret = pread64(device->fd, buf, len, multi->stripes[i].physical + offset);
+	if (ret != len)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Rebuild up to @len bytes at @logical of a RAID5/6 chunk for @mirror > 1
+ * from the other stripes of the full stripe, see btrfs_is_raid56_rebuild().
+ * Stripes that can't be read are rebuilt as well as long as there is enough
+ * parity left.  @len is trimmed to the end of the data stripe.
+ */
+int read_raid56_rebuild(struct btrfs_fs_info *info, void *buf, u64 logical,
+			u64 *len, int mirror)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 stripe_len = 0;
+	u64 offset;
+	void **pointers = NULL;
+	char *data = NULL;
+	int *failed = NULL;
+	int num_stripes;
+	int nr_parity;
+	int nr_data;
+	int nr_failed = 0;
+	int target = -1;
+	int other = -1;
+	int i;
+	int ret;
+
+	ret = btrfs_map_block(&info->mapping_tree, READ, logical, &stripe_len,
+			      &multi, 2, &raid_map);
+	if (ret)
+		return -EIO;
+	if (!raid_map) {
+		kfree(multi);
+		return -EIO;
+	}
+
+	num_stripes = multi->num_stripes;
+	nr_parity = raid_map[num_stripes - 1] == BTRFS_RAID6_Q_STRIPE ? 2 : 1;
+	nr_data = num_stripes - nr_parity;
+	for (i = 0; i < nr_data; i++) {
+		if (logical >= raid_map[i] &&
+		    logical < raid_map[i] + stripe_len) {
+			target = i;
+			break;
+		}
+	}
+	ret = -EIO;
+	if (target < 0)
+		goto out;
+	offset = logical - raid_map[target];
+	*len = min(*len, stripe_len - offset);
+
+	ret = -ENOMEM;
+	pointers = kmalloc(sizeof(*pointers) * num_stripes, GFP_NOFS);
+	failed = kzalloc(sizeof(*failed) * num_stripes, GFP_NOFS);
+	data = malloc(*len * num_stripes);
+	if (!pointers || !failed || !data)
+		goto out;
+	for (i = 0; i < num_stripes; i++)
+		pointers[i] = data + i * *len;
+
+	failed[target] = 1;
+	nr_failed = 1;
+	if (mirror > 2 && nr_parity == 2) {
+		failed[nr_data] = 1;
+		nr_failed++;
+	}
+
+	/* Q is only needed when P alone can't rebuild the data */
+	for (i = 0; i < nr_data + 1; i++) {
+		if (failed[i])
+			continue;
+		if (read_raid56_stripe(multi, i, pointers[i], offset, *len)) {
+			failed[i] = 1;
+			nr_failed++;
+		}
+	}
+	if (nr_parity == 2 && nr_failed > 1 &&
+	    read_raid56_stripe(multi, nr_data + 1, pointers[nr_data + 1],
+			       offset, *len)) {
+		failed[nr_data + 1] = 1;
+		nr_failed++;
+	}
+
+	ret = -EIO;
+	if (nr_failed > nr_parity)
+		goto out;
+
+	for (i = 0; i < num_stripes; i++)
+		if (failed[i] && i != target && i < nr_data + 1)
+			other = i;
+
+	ret = 0;
+	if (other < 0)
+		raid5_recov(nr_data + 1, *len, target, pointers);
+	else if (other == nr_data)
+		ret = raid6_recov_datap(num_stripes, *len, target, pointers);
+	else
+		ret = raid6_recov_2data(num_stripes, *len, min(target, other),
+					max(target, other), pointers);
+	if (!ret)
+		memcpy(buf, pointers[target], *len);
+out:
+	free(data);
+	kfree(failed);
+	kfree(pointers);
+	kfree(raid_map);
+	kfree(multi);
+	return ret;
+}
@@ -182,6 +182,8 @@ int btrfs_update_device(struct btrfs_trans_handle *trans,
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, int super_recover);
+int btrfs_scan_one_metadump(const char *path, struct btrfs_super_block *sb,
+			    struct btrfs_fs_devices **fs_devices_ret);
 int btrfs_num_copies(struct btrfs_mapping_tree *map_tree, u64 logical, u64 len);
 struct list_head *btrfs_scanned_uuids(void);
 int btrfs_add_system_chunk(struct btrfs_trans_handle *trans,
@@ -197,4 +199,8 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			     struct extent_buffer *eb,
 			     struct btrfs_multi_bio *multi,
 			     u64 stripe_len, u64 *raid_map);
+int btrfs_is_raid56_rebuild(struct btrfs_mapping_tree *map_tree, u64 logical,
+			    int mirror);
+int read_raid56_rebuild(struct btrfs_fs_info *info, void *buf, u64 logical,
+			u64 *len, int mirror);
 #endif